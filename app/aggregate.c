@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "aggregate.h"
+
+#define AGG_IDLE_TIMEOUT 2000   /*ms，所有节点都没有帧时的等待上限*/
+
+static __u64 AggNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 AggTimestamp(const struct v4l2_buffer *buf)
+{
+    return buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+}
+
+static int AggQueue(AggCam *cam, struct v4l2_buffer *buf)
+{
+    if(ioctl(cam->fd, VIDIOC_QBUF, buf) == -1){
+        printf("%s: QBUF error:%s\n", cam->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int AggOpenCam(AggCam *cam, const char *name, __u32 fourcc, __u32 width, __u32 height, __u32 buffers)
+{
+    struct v4l2_format fmt;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    __u32 i;
+
+    cam->name = name;
+    cam->fd = open(name, O_RDWR | O_NONBLOCK);
+    if(cam->fd == -1){
+        printf("Error opening video interface %s : %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.width       = width;
+    fmt.fmt.pix.height      = height;
+    fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+    if(ioctl(cam->fd, VIDIOC_S_FMT, &fmt) == -1 || ioctl(cam->fd, VIDIOC_G_FMT, &fmt) == -1){
+        printf("%s: unable to set format:%s\n", name, strerror(errno));
+        return -1;
+    }
+    cam->pix = fmt.fmt.pix;
+
+    memset(&req, 0, sizeof(req));
+    req.count  = buffers > AGG_MAX_BUFS ? AGG_MAX_BUFS : buffers;
+    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if(ioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1){
+        printf("%s: request for buffers error:%s\n", name, strerror(errno));
+        return -1;
+    }
+    if(req.count > AGG_MAX_BUFS){
+        req.count = AGG_MAX_BUFS;
+    }
+
+    for(i=0; i<req.count; i++){
+        memset(&buf, 0, sizeof(buf));
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index  = i;
+        if(ioctl(cam->fd, VIDIOC_QUERYBUF, &buf) == -1){
+            printf("%s: query buffer error:%s\n", name, strerror(errno));
+            return -1;
+        }
+        cam->start[i] = mmap(NULL, buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, cam->fd, buf.m.offset);
+        if(cam->start[i] == MAP_FAILED){
+            printf("%s: buffer map error:%s\n", name, strerror(errno));
+            return -1;
+        }
+        cam->length[i] = buf.length;
+        cam->count++;
+        if(AggQueue(cam, &buf) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int AggOpen(Aggregator *agg, const char * const *devs, int n, __u32 fourcc, __u32 width, __u32 height,
+            __u32 buffers, AggKey key, int wait_ms)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int i;
+
+    memset(agg, 0, sizeof(*agg));
+    for(i=0; i<AGG_MAX_CAMS; i++){
+        agg->cam[i].fd = -1;
+    }
+    if(n < 1 || n > AGG_MAX_CAMS){
+        printf("aggregate 1 to %d devices\n", AGG_MAX_CAMS);
+        return -1;
+    }
+    agg->n = n;
+    agg->key = key;
+    agg->wait_ms = wait_ms;
+
+    agg->ts_skew = malloc(sizeof(LatHist));
+    agg->arrival_skew = malloc(sizeof(LatHist));
+    if(!agg->ts_skew || !agg->arrival_skew){
+        printf("Unable to alloc skew histograms\n");
+        goto err;
+    }
+    LatHistInit(agg->ts_skew, "bundle timestamp skew");
+    LatHistInit(agg->arrival_skew, "bundle arrival skew");
+
+    for(i=0; i<n; i++){
+        if(AggOpenCam(&agg->cam[i], devs[i], fourcc, width, height, buffers) != 0){
+            goto err;
+        }
+    }
+    //各节点尽量同时开始
+    for(i=0; i<n; i++){
+        if(ioctl(agg->cam[i].fd, VIDIOC_STREAMON, &type) == -1){
+            printf("%s: STREAMON error:%s\n", devs[i], strerror(errno));
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    AggClose(agg);
+    return -1;
+}
+
+//取出节点上已完成的帧，没有返回0
+static int AggDequeue(AggCam *cam, AggKey key)
+{
+    memset(&cam->head, 0, sizeof(cam->head));
+    cam->head.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->head.memory = V4L2_MEMORY_MMAP;
+    if(ioctl(cam->fd, VIDIOC_DQBUF, &cam->head) == -1){
+        if(errno == EAGAIN){
+            return 0;
+        }
+        printf("%s: DQBUF error:%s\n", cam->name, strerror(errno));
+        return -1;
+    }
+    cam->arrival = AggNow();
+    cam->key = key == AGG_KEY_SEQUENCE ? cam->head.sequence : AggTimestamp(&cam->head);
+    cam->held = 1;
+    cam->frames++;
+    return 1;
+}
+
+static void AggEmit(Aggregator *agg, AggBundle *bundle, __u64 key)
+{
+    AggCam *cam;
+    __u64 ts_min = ~0ULL, ts_max = 0, arr_min = ~0ULL, arr_max = 0;
+    int i;
+
+    memset(bundle, 0, sizeof(*bundle));
+    bundle->key = key;
+    for(i=0; i<agg->n; i++){
+        cam = &agg->cam[i];
+        if(!cam->held || cam->key != key){
+            cam->missing++;
+            continue;
+        }
+        bundle->mask |= 1U << i;
+        bundle->buf[i] = cam->head;
+        bundle->data[i] = cam->start[cam->head.index];
+        bundle->timestamp[i] = AggTimestamp(&cam->head);
+        cam->held = 0;
+
+        ts_min  = bundle->timestamp[i] < ts_min ? bundle->timestamp[i] : ts_min;
+        ts_max  = bundle->timestamp[i] > ts_max ? bundle->timestamp[i] : ts_max;
+        arr_min = cam->arrival < arr_min ? cam->arrival : arr_min;
+        arr_max = cam->arrival > arr_max ? cam->arrival : arr_max;
+    }
+    bundle->ts_skew = ts_max - ts_min;
+    bundle->arrival_skew = arr_max - arr_min;
+
+    agg->bundles++;
+    if(bundle->mask != (1U << agg->n) - 1){
+        agg->incomplete++;
+    }
+    //只有一帧时偏差没有意义
+    if(bundle->mask & (bundle->mask - 1)){
+        LatHistRecord(agg->ts_skew, bundle->ts_skew);
+        LatHistRecord(agg->arrival_skew, bundle->arrival_skew);
+    }
+    agg->next_key = key + 1;
+    agg->started = 1;
+}
+
+//等待下一个bundle，缺帧的节点对应位不在mask中
+int AggNext(Aggregator *agg, AggBundle *bundle)
+{
+    struct pollfd pfd[AGG_MAX_CAMS];
+    int map[AGG_MAX_CAMS];
+    AggCam *cam;
+    __u64 target, first, now, deadline;
+    int i, npfd, held, timeout, retval;
+
+    for(;;){
+        //比已发出的bundle还旧的帧直接还给驱动
+        target = ~0ULL;
+        held = 0;
+        for(i=0; i<agg->n; i++){
+            cam = &agg->cam[i];
+            if(cam->held && agg->started && cam->key < agg->next_key){
+                cam->held = 0;
+                agg->stale++;
+                if(AggQueue(cam, &cam->head) != 0){
+                    return -1;
+                }
+            }
+            if(cam->held){
+                held++;
+                target = cam->key < target ? cam->key : target;
+            }
+        }
+
+        //节点持有更新的帧说明它没有target这一帧，全部节点都有帧就不必再等
+        if(held == agg->n){
+            AggEmit(agg, bundle, target);
+            return 0;
+        }
+
+        now = AggNow();
+        timeout = AGG_IDLE_TIMEOUT;
+        if(held){
+            first = ~0ULL;
+            for(i=0; i<agg->n; i++){
+                cam = &agg->cam[i];
+                if(cam->held && cam->key == target && cam->arrival < first){
+                    first = cam->arrival;
+                }
+            }
+            deadline = first + agg->wait_ms * 1000000ULL;
+            if(now >= deadline){
+                AggEmit(agg, bundle, target);
+                return 0;
+            }
+            timeout = (deadline - now + 999999) / 1000000;
+        }
+
+        npfd = 0;
+        for(i=0; i<agg->n; i++){
+            if(!agg->cam[i].held){
+                pfd[npfd].fd = agg->cam[i].fd;
+                pfd[npfd].events = POLLIN;
+                pfd[npfd].revents = 0;
+                map[npfd++] = i;
+            }
+        }
+        retval = poll(pfd, npfd, timeout);
+        if(retval < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            printf("poll error:%s\n", strerror(errno));
+            return -1;
+        }
+        if(retval == 0 && !held){
+            printf("poll error:timeout\n");
+            return -1;
+        }
+        for(i=0; i<npfd; i++){
+            if((pfd[i].revents & (POLLIN | POLLERR)) && AggDequeue(&agg->cam[map[i]], agg->key) < 0){
+                return -1;
+            }
+        }
+    }
+}
+
+//bundle中的帧还给驱动
+int AggRelease(Aggregator *agg, AggBundle *bundle)
+{
+    int i, retval = 0;
+
+    for(i=0; i<agg->n; i++){
+        if((bundle->mask & (1U << i)) && AggQueue(&agg->cam[i], &bundle->buf[i]) != 0){
+            retval = -1;
+        }
+    }
+    bundle->mask = 0;
+    return retval;
+}
+
+void AggReport(const Aggregator *agg)
+{
+    int i;
+
+    printf("bundles: %llu, complete %llu, incomplete %llu, stale frames %llu\n",
+           (unsigned long long)agg->bundles, (unsigned long long)(agg->bundles - agg->incomplete),
+           (unsigned long long)agg->incomplete, (unsigned long long)agg->stale);
+    for(i=0; i<agg->n; i++){
+        printf("  %s: %llu frames, missing from %llu bundles\n", agg->cam[i].name,
+               (unsigned long long)agg->cam[i].frames, (unsigned long long)agg->cam[i].missing);
+    }
+    LatHistPrint(agg->ts_skew);
+    LatHistPrint(agg->arrival_skew);
+}
+
+void AggClose(Aggregator *agg)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    AggCam *cam;
+    __u32 j;
+    int i;
+
+    for(i=0; i<AGG_MAX_CAMS; i++){
+        cam = &agg->cam[i];
+        if(cam->fd == -1){
+            continue;
+        }
+        ioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+        for(j=0; j<cam->count; j++){
+            munmap(cam->start[j], cam->length[j]);
+        }
+        close(cam->fd);
+        cam->fd = -1;
+        cam->count = 0;
+    }
+    free(agg->ts_skew);
+    free(agg->arrival_skew);
+    agg->ts_skew = NULL;
+    agg->arrival_skew = NULL;
+}
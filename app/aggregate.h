@@ -0,0 +1,72 @@
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <linux/videodev2.h>
+#include "rt.h"
+
+/*
+多路采集聚合
+从多个采集节点取帧，按sequence(驱动group=同一时钟组)或时间戳(同一帧时钟但不同组)把同一时刻的帧组成一个bundle；
+某个节点持有更新的帧即说明它缺了这一帧，bundle立即发出，否则从第一帧到达起最多等待wait_ms，
+超时发出不完整的bundle；统计时间戳偏差和到达时间偏差
+*/
+
+#define AGG_MAX_CAMS 8
+#define AGG_MAX_BUFS 16
+
+typedef enum
+{
+    AGG_KEY_SEQUENCE = 0,
+    AGG_KEY_TIMESTAMP,
+} AggKey;
+
+typedef struct
+{
+    int fd;
+    const char *name;
+    void *start[AGG_MAX_BUFS];
+    __u32 length[AGG_MAX_BUFS];
+    __u32 count;
+    struct v4l2_pix_format pix;
+    int held;                   /*head是已出队、还没发出的帧*/
+    struct v4l2_buffer head;
+    __u64 key;
+    __u64 arrival;              /*head出队时刻，CLOCK_MONOTONIC纳秒*/
+    __u64 frames;
+    __u64 missing;              /*没赶上的bundle数*/
+} AggCam;
+
+typedef struct
+{
+    __u64 key;
+    __u32 mask;                 /*有帧的节点*/
+    struct v4l2_buffer buf[AGG_MAX_CAMS];
+    void *data[AGG_MAX_CAMS];
+    __u64 timestamp[AGG_MAX_CAMS];
+    __u64 ts_skew;
+    __u64 arrival_skew;
+} AggBundle;
+
+typedef struct
+{
+    AggCam cam[AGG_MAX_CAMS];
+    int n;
+    AggKey key;
+    int wait_ms;
+    int started;                /*next_key有效*/
+    __u64 next_key;             /*更早的帧所属bundle已发出*/
+    __u64 bundles;
+    __u64 incomplete;
+    __u64 stale;                /*bundle发出后才到的帧*/
+    LatHist *ts_skew;
+    LatHist *arrival_skew;
+} Aggregator;
+
+int AggOpen(Aggregator *agg, const char * const *devs, int n, __u32 fourcc, __u32 width, __u32 height,
+            __u32 buffers, AggKey key, int wait_ms);
+int AggNext(Aggregator *agg, AggBundle *bundle);
+int AggRelease(Aggregator *agg, AggBundle *bundle);
+void AggReport(const Aggregator *agg);
+void AggClose(Aggregator *agg);
+
+#endif    /* _AGGREGATE_H_ */
@@ -0,0 +1,744 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <linux/videodev2.h>
+#include "bitmap.h"
+#include "convert.h"
+#include "debayer.h"
+#include "rt.h"
+#include "shmring.h"
+#include "pipeout.h"
+#include "crc32c.h"
+
+/*
+app模块性能测试
+用法: bench.elf qoi [width height threads iterations]
+      bench.elf conv [width height threads iterations]
+      bench.elf debayer [width height threads iterations]
+      bench.elf ring [width height frames fps]
+      bench.elf pipe [frames buffers]
+      bench.elf crc [width height iterations]
+*/
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//与驱动BGR32输出相同的三段纯色图案
+static void fill_bands(__u8 *pData, __u32 width, __u32 height)
+{
+    __u32 size = width * height * 4;
+    __u32 step = size / 3;
+    __u32 i;
+
+    for(i=0; i<size; i+=4){
+        pData[i]   = i < step ? 0xff : 0x00;
+        pData[i+1] = i >= step && i < step*2 ? 0xff : 0x00;
+        pData[i+2] = i >= step*2 ? 0xff : 0x00;
+        pData[i+3] = 0xff;
+    }
+}
+
+//水平渐变加少量噪声，近似自然图像
+static void fill_gradient(__u8 *pData, __u32 width, __u32 height)
+{
+    __u32 x, y;
+    unsigned int seed = 1;
+    __u8 *p = pData;
+
+    for(y=0; y<height; y++){
+        for(x=0; x<width; x++){
+            seed = seed * 1103515245 + 12345;
+            p[0] = (x * 255 / width) + ((seed >> 16) & 3);
+            p[1] = (y * 255 / height);
+            p[2] = ((x + y) & 0xff);
+            p[3] = 0xff;
+            p += 4;
+        }
+    }
+}
+
+static int bench_qoi(int argc, char *argv[])
+{
+    __u32 width   = argc > 0 ? strtoul(argv[0], NULL, 0) : 800;
+    __u32 height  = argc > 1 ? strtoul(argv[1], NULL, 0) : 480;
+    int threads   = argc > 2 ? atoi(argv[2]) : 1;
+    int iteration = argc > 3 ? atoi(argv[3]) : 100;
+    const char *pattern[] = {"bands", "gradient"};
+    __u64 raw = (__u64)width * height * 4;
+    __u64 out_size = QOI_MAX_SIZE(width, height, 32);
+    __u8 *pData, *out;
+    double t;
+    long len = 0;
+    int i, k;
+
+    pData = malloc(raw);
+    out = malloc(out_size);
+    if(!pData || !out){
+        printf("out of memory!\n");
+        return -1;
+    }
+
+    printf("qoi %dx%d threads=%d iterations=%d\n", width, height, threads, iteration);
+    for(k=0; k<2; k++){
+        if(k == 0){
+            fill_bands(pData, width, height);
+        } else {
+            fill_gradient(pData, width, height);
+        }
+        QoiEncode(pData, 32, width, height, out, out_size, threads, NULL);
+
+        t = now_sec();
+        for(i=0; i<iteration; i++){
+            len = QoiEncode(pData, 32, width, height, out, out_size, threads, NULL);
+        }
+        t = now_sec() - t;
+
+        printf("  %-9s %9.1f MB/s  %8.3f ms/frame  %9ld bytes  ratio %.1f:1\n", pattern[k],
+                raw * iteration / t / 1e6, t * 1e3 / iteration, len, (double)raw / len);
+    }
+
+    free(out);
+    free(pData);
+    return 0;
+}
+
+static const char *fourcc_name(__u32 fourcc)
+{
+    static char name[8][5];
+    static int n;
+    char *p = name[n++ & 7];
+
+    p[0] = fourcc & 0xff;
+    p[1] = (fourcc >> 8) & 0xff;
+    p[2] = (fourcc >> 16) & 0xff;
+    p[3] = (fourcc >> 24) & 0xff;
+    p[4] = 0;
+    return p;
+}
+
+/*
+对全部格式组合，先以单线程标量结果为参考，校验SSE4.1、AVX2及多线程输出逐字节一致，
+再测试各实现的吞吐(Mpix/s)；有不一致时返回非0
+*/
+static int bench_conv(int argc, char *argv[])
+{
+    static const __u32 fourcc[] = {
+        V4L2_PIX_FMT_RGB32, V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420,
+    };
+    const int nfmt = sizeof(fourcc) / sizeof(fourcc[0]);
+    __u32 width   = argc > 0 ? strtoul(argv[0], NULL, 0) : 1920;
+    __u32 height  = argc > 1 ? strtoul(argv[1], NULL, 0) : 1080;
+    int threads   = argc > 2 ? atoi(argv[2]) : 1;
+    int iteration = argc > 3 ? atoi(argv[3]) : 20;
+    __u32 max_size = width * height * 4;
+    ConvImage src, ref, dst;
+    __u8 *src_buf, *ref_buf, *dst_buf;
+    unsigned int seed = 1;
+    int mismatch = 0, tested = 0;
+    int i, j, m, level, it;
+    __u32 size;
+    double t;
+
+    src_buf = malloc(max_size);
+    ref_buf = malloc(max_size);
+    dst_buf = malloc(max_size);
+    if(!src_buf || !ref_buf || !dst_buf){
+        printf("out of memory!\n");
+        return -1;
+    }
+
+    printf("conv %dx%d threads=%d iterations=%d\n", width, height, threads, iteration);
+    for(i=0; i<nfmt; i++){
+        if(fourcc[i] == V4L2_PIX_FMT_RGB32 || fourcc[i] == V4L2_PIX_FMT_BGR32){
+            fill_gradient(src_buf, width, height);
+        } else {
+            for(size=0; size<max_size; size++){
+                seed = seed * 1103515245 + 12345;
+                src_buf[size] = seed >> 16;
+            }
+        }
+        if(ConvImageInit(&src, fourcc[i], width, height, src_buf) != 0){
+            printf("  %s: unsupported size\n", fourcc_name(fourcc[i]));
+            continue;
+        }
+
+        for(j=0; j<nfmt; j++){
+            if(i == j){
+                continue;
+            }
+            if(ConvImageInit(&ref, fourcc[j], width, height, ref_buf) != 0 ||
+               ConvImageInit(&dst, fourcc[j], width, height, dst_buf) != 0){
+                printf("  %s->%s: unsupported size\n", fourcc_name(fourcc[i]), fourcc_name(fourcc[j]));
+                continue;
+            }
+            size = ConvImageSize(fourcc[j], width, height);
+            tested++;
+
+            for(m=CONV_BT601; m<=CONV_BT709; m++){
+                printf("  %s->%s %s", fourcc_name(fourcc[i]), fourcc_name(fourcc[j]), m == CONV_BT601 ? "bt601" : "bt709");
+
+                ConvSetLevel(CONV_SCALAR);
+                memset(ref_buf, 0, max_size);
+                Convert(&src, &ref, m, 1, NULL);
+
+                for(level=CONV_SCALAR; level<=CONV_AVX2; level++){
+                    if((int)ConvSetLevel(level) < 0){
+                        continue;
+                    }
+                    memset(dst_buf, 0x5a, max_size);
+                    Convert(&src, &dst, m, threads, NULL);
+                    if(memcmp(ref_buf, dst_buf, size) != 0){
+                        printf("  %s MISMATCH", ConvLevelName(level));
+                        mismatch++;
+                        continue;
+                    }
+
+                    t = now_sec();
+                    for(it=0; it<iteration; it++){
+                        Convert(&src, &dst, m, threads, NULL);
+                    }
+                    t = now_sec() - t;
+                    printf("  %s %7.1f", ConvLevelName(level), (double)width * height * iteration / t / 1e6);
+                }
+                printf(" Mpix/s\n");
+            }
+        }
+    }
+    ConvSetLevel(CONV_AUTO);
+
+    if(!tested){
+        printf("conv: unsupported size %dx%d\n", width, height);
+    } else {
+        printf("%s\n", mismatch ? "conv: FAILED" : "conv: all SIMD outputs match scalar");
+    }
+    free(dst_buf);
+    free(ref_buf);
+    free(src_buf);
+    return mismatch || !tested ? -1 : 0;
+}
+
+//fill_gradient图像经RGGB滤色得到的拜耳帧，10位格式低2位为噪声
+static void fill_mosaic(__u8 *pData, __u32 fourcc, __u32 width, __u32 height, __u8 *rgb)
+{
+    static const int channel[2][2] = { { 2, 1 }, { 1, 0 } };    /*BGR32中R、G、B的字节下标*/
+    unsigned int seed = 1;
+    __u32 x, y;
+    int v;
+
+    fill_gradient(rgb, width, height);
+    for(y=0; y<height; y++){
+        for(x=0; x<width; x++){
+            seed = seed * 1103515245 + 12345;
+            v = rgb[(y * width + x) * 4 + channel[y & 1][x & 1]];
+            v = (v << 2) | ((seed >> 16) & 3);
+            switch(fourcc){
+            case V4L2_PIX_FMT_SRGGB8:
+                pData[y * width + x] = v >> 2;
+                break;
+            case V4L2_PIX_FMT_SRGGB10:
+                pData[(y * width + x) * 2]     = v & 0xff;
+                pData[(y * width + x) * 2 + 1] = v >> 8;
+                break;
+            default:
+                pData[y * width * 5 / 4 + x / 4 * 5 + (x & 3)] = v >> 2;
+                if((x & 3) == 0){
+                    pData[y * width * 5 / 4 + x / 4 * 5 + 4] = 0;
+                }
+                pData[y * width * 5 / 4 + x / 4 * 5 + 4] |= (v & 3) << (2 * (x & 3));
+                break;
+            }
+        }
+    }
+}
+
+/*
+拜耳格式去马赛克，校验方式同conv：单线程标量结果为参考，
+SSE4.1、AVX2及多线程输出须逐字节一致
+*/
+static int bench_debayer(int argc, char *argv[])
+{
+    static const __u32 fourcc[] = { V4L2_PIX_FMT_SRGGB8, V4L2_PIX_FMT_SRGGB10, V4L2_PIX_FMT_SRGGB10P };
+    static const __u32 out_fourcc[] = { V4L2_PIX_FMT_BGR32, V4L2_PIX_FMT_RGB32 };
+    static const char *method_name[] = { "bilinear", "edge" };
+    __u32 width   = argc > 0 ? strtoul(argv[0], NULL, 0) : 1920;
+    __u32 height  = argc > 1 ? strtoul(argv[1], NULL, 0) : 1080;
+    int threads   = argc > 2 ? atoi(argv[2]) : 1;
+    int iteration = argc > 3 ? atoi(argv[3]) : 20;
+    __u32 max_size = width * height * 4;
+    ConvImage src, ref, dst;
+    __u8 *src_buf, *ref_buf, *dst_buf;
+    int mismatch = 0;
+    int i, j, m, level, it;
+    double t;
+
+    src_buf = malloc(max_size);
+    ref_buf = malloc(max_size);
+    dst_buf = malloc(max_size);
+    if(!src_buf || !ref_buf || !dst_buf){
+        printf("out of memory!\n");
+        return -1;
+    }
+
+    printf("debayer %dx%d threads=%d iterations=%d\n", width, height, threads, iteration);
+    for(i=0; i<3; i++){
+        fill_mosaic(src_buf, fourcc[i], width, height, dst_buf);
+        if(ConvImageInit(&src, fourcc[i], width, height, src_buf) != 0){
+            printf("  %s: unsupported size\n", fourcc_name(fourcc[i]));
+            continue;
+        }
+        for(j=0; j<2; j++){
+            ConvImageInit(&ref, out_fourcc[j], width, height, ref_buf);
+            ConvImageInit(&dst, out_fourcc[j], width, height, dst_buf);
+
+            for(m=DEBAYER_BILINEAR; m<=DEBAYER_EDGE; m++){
+                printf("  %s->%s %-8s", fourcc_name(fourcc[i]), fourcc_name(out_fourcc[j]), method_name[m]);
+
+                DebayerSetLevel(CONV_SCALAR);
+                memset(ref_buf, 0, max_size);
+                Debayer(&src, &ref, m, 1, NULL);
+
+                for(level=CONV_SCALAR; level<=CONV_AVX2; level++){
+                    if((int)DebayerSetLevel(level) < 0){
+                        continue;
+                    }
+                    memset(dst_buf, 0x5a, max_size);
+                    Debayer(&src, &dst, m, threads, NULL);
+                    if(memcmp(ref_buf, dst_buf, max_size) != 0){
+                        printf("  %s MISMATCH", ConvLevelName(level));
+                        mismatch++;
+                        continue;
+                    }
+
+                    t = now_sec();
+                    for(it=0; it<iteration; it++){
+                        Debayer(&src, &dst, m, threads, NULL);
+                    }
+                    t = now_sec() - t;
+                    printf("  %s %7.1f", ConvLevelName(level), (double)width * height * iteration / t / 1e6);
+                }
+                printf(" Mpix/s\n");
+            }
+        }
+    }
+    DebayerSetLevel(CONV_AUTO);
+
+    printf("%s\n", mismatch ? "debayer: FAILED" : "debayer: all SIMD outputs match scalar");
+    free(dst_buf);
+    free(ref_buf);
+    free(src_buf);
+    return mismatch ? -1 : 0;
+}
+
+#define RING_BENCH_SLOTS 8
+
+//订阅者结果，经管道交给父进程
+typedef struct
+{
+    LatHist lat;
+    __u64 frames;
+    __u64 skipped;
+    __u64 torn;       /*读完后RingValid失败*/
+    __u64 corrupt;    /*RingValid通过但内容与帧号不符，seqlock出错*/
+} RingReader;
+
+//结果比管道容量大，分多次读完
+static int read_full(int fd, void *data, size_t size)
+{
+    ssize_t n;
+    size_t done = 0;
+
+    while(done < size){
+        n = read(fd, (char *)data + done, size - done);
+        if(n <= 0){
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+//子进程：读到最后一帧或1s没有新帧为止，每帧按cache line扫一遍
+static void ring_reader(const char *path, __u32 frames, int ready_fd, int result_fd)
+{
+    RingReader *res;
+    RingSub sub;
+    RingFrame frame;
+    volatile __u8 sink = 0;
+    __u64 stamp;
+    __u32 i;
+    char c = 'r';
+
+    res = calloc(1, sizeof(*res));
+    if(!res || RingAttach(&sub, path) != 0){
+        exit(1);
+    }
+    LatHistInit(&res->lat, "publish to read");
+    if(write(ready_fd, &c, 1) != 1){
+        exit(1);
+    }
+
+    while(RingNext(&sub, &frame, 1000) == 1){
+        LatHistRecord(&res->lat, RingNow() - frame.publish_ns);
+        for(i=0; i<sub.hdr->frame_size; i+=64){
+            sink += frame.data[i];
+        }
+        memcpy(&stamp, frame.data, sizeof(stamp));
+        res->frames++;
+        res->skipped += frame.skipped;
+        if(!RingValid(&sub, &frame)){
+            res->torn++;
+        } else if(stamp != frame.frame_no){
+            res->corrupt++;
+        }
+        if(frame.frame_no + 1 >= frames){
+            break;
+        }
+    }
+    RingDetach(&sub);
+
+    if(write(result_fd, res, sizeof(*res)) != sizeof(*res)){
+        exit(1);
+    }
+    exit(0);
+}
+
+static int bench_ring(int argc, char *argv[])
+{
+    static const int readers[] = {1, 4, 16};
+    __u32 width  = argc > 0 ? strtoul(argv[0], NULL, 0) : 1920;
+    __u32 height = argc > 1 ? strtoul(argv[1], NULL, 0) : 1080;
+    __u32 frames = argc > 2 ? strtoul(argv[2], NULL, 0) : 300;
+    __u32 fps    = argc > 3 ? strtoul(argv[3], NULL, 0) : 200;
+    __u32 size = width * height * 4;
+    LatHist *publish, *total;
+    RingReader *res;
+    RingPub pub;
+    char path[64];
+    int ready[2], result[16][2];
+    pid_t pid[16];
+    __u64 start, t, stamp, frames_read, skipped, torn, corrupt;
+    struct timespec ts;
+    __u8 *pData;
+    char c;
+    int n, i, k, failed = 0;
+    __u32 f;
+
+    pData = malloc(size);
+    publish = malloc(sizeof(*publish));
+    total = malloc(sizeof(*total));
+    res = malloc(sizeof(*res));
+    if(!pData || !publish || !total || !res || fps == 0){
+        printf("out of memory!\n");
+        return -1;
+    }
+    fill_gradient(pData, width, height);
+    snprintf(path, sizeof(path), "/tmp/vvbench.%d.sock", getpid());
+
+    printf("ring %ux%u BGR32, %u frames at %u fps, %d slots:\n", width, height, frames, fps, RING_BENCH_SLOTS);
+    printf("%8s %12s %12s %12s %12s %12s %10s %8s %8s\n", "readers", "publish p50", "publish p99",
+           "read p50", "read p99", "read max", "frames", "skipped", "torn");
+    for(k=0; k<(int)(sizeof(readers)/sizeof(readers[0])); k++){
+        n = readers[k];
+        if(RingCreate(&pub, path, RING_BENCH_SLOTS, width, height, V4L2_PIX_FMT_BGR32, width * 4, size) != 0 ||
+           pipe(ready) != 0){
+            return -1;
+        }
+        //子进程exit时不再重复输出缓冲中的内容
+        fflush(stdout);
+        for(i=0; i<n; i++){
+            if(pipe(result[i]) != 0){
+                return -1;
+            }
+            pid[i] = fork();
+            if(pid[i] == 0){
+                ring_reader(path, frames, ready[1], result[i][1]);
+            }
+            close(result[i][1]);
+        }
+        close(ready[1]);
+        //全部订阅者连上后才开始发布
+        for(i=0; i<n; i++){
+            if(read(ready[0], &c, 1) != 1){
+                printf("ring: reader failed to attach\n");
+                failed = 1;
+                break;
+            }
+        }
+        close(ready[0]);
+
+        LatHistInit(publish, "publish");
+        start = RingNow();
+        for(f=0; f<frames && !failed; f++){
+            //按fps定时发布，每帧开头写入帧号供订阅者核对
+            t = start + (__u64)f * 1000000000ULL / fps;
+            ts.tv_sec  = t / 1000000000ULL;
+            ts.tv_nsec = t % 1000000000ULL;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            stamp = f;
+            memcpy(pData, &stamp, sizeof(stamp));
+            t = RingNow();
+            RingPublish(&pub, pData, f, t);
+            LatHistRecord(publish, RingNow() - t);
+        }
+
+        LatHistInit(total, "read");
+        frames_read = skipped = torn = corrupt = 0;
+        for(i=0; i<n; i++){
+            if(read_full(result[i][0], res, sizeof(*res)) == 0){
+                LatHistMerge(total, &res->lat);
+                frames_read += res->frames;
+                skipped += res->skipped;
+                torn += res->torn;
+                corrupt += res->corrupt;
+            } else {
+                failed = 1;
+            }
+            close(result[i][0]);
+            waitpid(pid[i], NULL, 0);
+        }
+        RingDestroy(&pub);
+
+        printf("%8d %9.1f us %9.1f us %9.1f us %9.1f us %9.1f us %10llu %8llu %8llu\n", n,
+               LatHistValue(publish, 50) / 1e3, LatHistValue(publish, 99) / 1e3,
+               LatHistValue(total, 50) / 1e3, LatHistValue(total, 99) / 1e3, LatHistValue(total, 100) / 1e3,
+               (unsigned long long)frames_read, (unsigned long long)skipped, (unsigned long long)torn);
+        if(corrupt){
+            printf("ring: %llu frames changed under a valid seqlock\n", (unsigned long long)corrupt);
+            failed = 1;
+        }
+        if(failed){
+            break;
+        }
+    }
+
+    free(res);
+    free(total);
+    free(publish);
+    free(pData);
+    return failed ? -1 : 0;
+}
+
+//子进程：像编码器一样把每帧读进自己的缓冲区，核对首尾的帧号，返回出错帧数是否为0
+static void pipe_reader(int fd, __u32 size, __u32 frames)
+{
+    __u8 *frame = malloc(size);
+    __u64 head, tail;
+    __u32 f, bad = 0;
+
+    if(!frame){
+        exit(2);
+    }
+    for(f=0; f<frames; f++){
+        if(read_full(fd, frame, size) != 0){
+            exit(2);
+        }
+        memcpy(&head, frame, sizeof(head));
+        memcpy(&tail, frame + size - sizeof(tail), sizeof(tail));
+        if(head != f || tail != f){
+            bad++;
+        }
+    }
+    exit(bad ? 1 : 0);
+}
+
+//一种写法的吞吐量：buffers个共享映射的帧缓冲轮流写出，缓冲区被读端取走后才改写
+static int pipe_run(__u32 width, __u32 height, __u32 frames, __u32 nbuf, int use_write)
+{
+    __u32 size = width * height * 4;
+    size_t stride = (size + 4095) & ~4095UL;
+    __u32 free_idx[PIPE_MAX_PENDING], nfree, f;
+    PipeOut po;
+    __u8 *map, *pData;
+    __u64 stamp;
+    struct timespec c0, c1;
+    double start, t;
+    int fds[2], status, index, failed = 0;
+    pid_t pid;
+
+    //与驱动缓冲区一样是共享映射
+    map = mmap(NULL, stride * nbuf, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        printf("out of memory!\n");
+        return -1;
+    }
+    for(nfree=0; nfree<nbuf; nfree++){
+        fill_gradient(map + stride * nfree, width, height);
+        free_idx[nfree] = nbuf - 1 - nfree;
+    }
+    if(pipe(fds) != 0){
+        munmap(map, stride * nbuf);
+        return -1;
+    }
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0){
+        close(fds[1]);
+        pipe_reader(fds[0], size, frames);
+    }
+    close(fds[0]);
+    if(pid == -1 || PipeOutOpen(&po, fds[1], use_write, size) != 0){
+        close(fds[1]);
+        munmap(map, stride * nbuf);
+        return -1;
+    }
+
+    start = now_sec();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+    for(f=0; f<frames; f++){
+        //所有缓冲区都在管道里时等读端取走最早的一个，相当于驱动没有可填的缓冲区
+        if(nfree == 0){
+            index = PipeOutReap(&po, 1);
+            if(index < 0){
+                failed = 1;
+                break;
+            }
+            free_idx[nfree++] = index;
+        }
+        index = free_idx[--nfree];
+        pData = map + stride * index;
+        stamp = f;
+        memcpy(pData, &stamp, sizeof(stamp));
+        memcpy(pData + size - sizeof(stamp), &stamp, sizeof(stamp));
+        if(PipeOutWrite(&po, pData, size, index) != 0){
+            failed = 1;
+            break;
+        }
+        while((index = PipeOutReap(&po, 0)) >= 0){
+            free_idx[nfree++] = index;
+        }
+    }
+    PipeOutClose(&po);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+    waitpid(pid, &status, 0);
+    t = now_sec() - start;
+
+    printf("  %-8s %4ux%-4u %8.1f MB/s %7.1f fps  writer cpu %7.3f ms/frame%s\n",
+           po.splice ? "vmsplice" : "write", width, height, (double)size * f / t / 1e6, f / t,
+           ((c1.tv_sec - c0.tv_sec) * 1e3 + (c1.tv_nsec - c0.tv_nsec) / 1e6) / (f ? f : 1),
+           WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "" : "  READER SAW OVERWRITTEN FRAMES");
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        failed = 1;
+    }
+    munmap(map, stride * nbuf);
+    return failed ? -1 : 0;
+}
+
+static int bench_pipe(int argc, char *argv[])
+{
+    static const struct { __u32 width, height; } res[] = { { 1920, 1080 }, { 3840, 2160 } };
+    __u32 frames = argc > 0 ? strtoul(argv[0], NULL, 0) : 300;
+    __u32 nbuf   = argc > 1 ? strtoul(argv[1], NULL, 0) : 4;
+    int i, failed = 0;
+
+    if(nbuf < 1 || nbuf > PIPE_MAX_PENDING){
+        printf("buffers must be 1-%d\n", PIPE_MAX_PENDING);
+        return -1;
+    }
+    printf("pipe BGR32, %u frames from %u buffers to a reading child:\n", frames, nbuf);
+    for(i=0; i<(int)(sizeof(res)/sizeof(res[0])); i++){
+        if(pipe_run(res[i].width, res[i].height, frames, nbuf, 1) != 0 ||
+           pipe_run(res[i].width, res[i].height, frames, nbuf, 0) != 0){
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+//校验实现之间及与标准值一致，再测每帧的校验速度
+static int bench_crc(int argc, char *argv[])
+{
+    static const Crc32cLevel level[] = { CRC32C_SCALAR, CRC32C_SSE42 };
+    __u32 width   = argc > 0 ? strtoul(argv[0], NULL, 0) : 3840;
+    __u32 height  = argc > 1 ? strtoul(argv[1], NULL, 0) : 2160;
+    int iteration = argc > 2 ? atoi(argv[2]) : 100;
+    size_t size = (size_t)width * height * 4;
+    __u32 ref[64], crc = 0;
+    __u8 *pData;
+    double t;
+    int i, k, mismatch = 0;
+
+    pData = malloc(size + 64);
+    if(!pData){
+        printf("out of memory!\n");
+        return -1;
+    }
+    fill_gradient(pData, width, height);
+    for(i=0; i<64; i++){
+        pData[size + i] = i * 37;
+    }
+
+    printf("crc32c %ux%u BGR32 (%.1f MB), %d iterations:\n", width, height, size / 1e6, iteration);
+    for(k=0; k<(int)(sizeof(level)/sizeof(level[0])); k++){
+        if(Crc32cSetLevel(level[k]) != level[k]){
+            printf("  %-6s unsupported\n", Crc32cLevelName(level[k]));
+            continue;
+        }
+        //标准测试值，以及各种起始对齐和长度(含3路交错的分块边界)
+        if(Crc32cFrame(0, "123456789", 9) != 0xe3069283){
+            mismatch = 1;
+        }
+        for(i=0; i<64; i++){
+            crc = Crc32cFrame(i, pData + i, size - i * 4099);
+            if(k == 0){
+                ref[i] = crc;
+            } else if(crc != ref[i]){
+                mismatch = 1;
+            }
+        }
+
+        t = now_sec();
+        for(i=0; i<iteration; i++){
+            crc ^= Crc32cFrame(i, pData, size);
+        }
+        t = now_sec() - t;
+        printf("  %-6s %8.2f GB/s %8.1f fps%s\n", Crc32cLevelName(level[k]), (double)size * iteration / t / 1e9,
+               iteration / t, mismatch ? "  MISMATCH" : "");
+    }
+    //防止循环被优化掉
+    if(crc == 0x5a5a5a5a){
+        printf("\n");
+    }
+    Crc32cSetLevel(CRC32C_AUTO);
+    free(pData);
+    return mismatch ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc >= 2 && strcmp(argv[1], "qoi") == 0){
+        return bench_qoi(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "conv") == 0){
+        return bench_conv(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "debayer") == 0){
+        return bench_debayer(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "ring") == 0){
+        return bench_ring(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "pipe") == 0){
+        return bench_pipe(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "crc") == 0){
+        return bench_crc(argc - 2, argv + 2);
+    }
+
+    printf("usage: %s qoi [width height threads iterations]\n", argv[0]);
+    printf("       %s conv [width height threads iterations]\n", argv[0]);
+    printf("       %s debayer [width height threads iterations]\n", argv[0]);
+    printf("       %s ring [width height frames fps]\n", argv[0]);
+    printf("       %s pipe [frames buffers]\n", argv[0]);
+    printf("       %s crc [width height iterations]\n", argv[0]);
+    return -1;
+}
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "bitmap.h"
+#include "probe.h"
 
 //显示位图文件头信息
 void showBitMapFileHead(BitMapFileHeader *pBmpHead){
@@ -73,6 +80,7 @@ int GenBmpFile(__u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, cons
     printf("file_size=%d\n", file_size);
 
 
+    VV_PROBE2(encode_start, width, height);
     bmp_data = (__u8*)malloc(file_size);
     if(!bmp_data){
         printf("Unable to malloc buff:%s", strerror(errno));
@@ -122,107 +130,462 @@ int GenBmpFile(__u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, cons
         pbmp += bmp_byte_per_line;
     }
 
+    VV_PROBE1(encode_done, file_size);
+
+    VV_PROBE1(fwrite_start, file_size);
     retval = fwrite(bmp_data,file_size,1,pf);
+    VV_PROBE2(fwrite_done, file_size, retval);
     free(bmp_data);
     fclose(pf);
 
     return 0;
 }
 
-__u8* GetBmpData(__u8 *bitCountPerPix, __u32 *width, __u32 *height, const char* filename)
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MAX_SLICE 64
+
+//像素按内存中B,G,R,A排列读成 b | g<<8 | r<<16 | a<<24
+#define QOI_B(px) ((px) & 0xff)
+#define QOI_G(px) (((px) >> 8) & 0xff)
+#define QOI_R(px) (((px) >> 16) & 0xff)
+#define QOI_A(px) ((px) >> 24)
+#define QOI_HASH(px) ((QOI_R(px) * 3 + QOI_G(px) * 5 + QOI_B(px) * 7 + QOI_A(px) * 11) & 63)
+
+typedef struct
+{
+    const __u8 *src;
+    __u8 byte_per_pix;
+    __u32 npix;
+    int first;
+    __u8 *out;
+    long len;
+} QoiSlice;
+
+static inline __u32 QoiLoad(const __u8 *src, __u8 byte_per_pix)
+{
+    __u32 px;
+
+    if(byte_per_pix == 4){
+        memcpy(&px, src, 4);
+        return px;
+    }
+    return src[0] | (src[1] << 8) | (src[2] << 16) | 0xff000000;
+}
+
+static long QoiEncodeSlice(const __u8 *src, __u8 byte_per_pix, __u32 npix, int first, __u8 *out)
+{
+    __u32 index[64];
+    __u64 valid;
+    __u32 px, px_prev;
+    __u32 run = 0;
+    __u32 i = 0;
+    long p = 0;
+    int h;
+    signed char vr, vg, vb, vg_r, vg_b;
+
+    memset(index, 0, sizeof(index));
+    if(first){
+        //解码器初始状态：索引全0，前一像素为不透明黑
+        valid = ~0ULL;
+        px_prev = 0xff000000;
+    } else {
+        //非首分片：第一个像素显式给出，之后只使用本分片写入过的索引项
+        px = QoiLoad(src, byte_per_pix);
+        out[p++] = QOI_OP_RGBA;
+        out[p++] = QOI_R(px);
+        out[p++] = QOI_G(px);
+        out[p++] = QOI_B(px);
+        out[p++] = QOI_A(px);
+        h = QOI_HASH(px);
+        index[h] = px;
+        valid = 1ULL << h;
+        px_prev = px;
+        i = 1;
+    }
+
+    for(; i<npix; i++){
+        px = QoiLoad(src + (size_t)i * byte_per_pix, byte_per_pix);
+        if(px == px_prev){
+            if(++run == 62){
+                out[p++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if(run){
+            out[p++] = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        h = QOI_HASH(px);
+        if(((valid >> h) & 1) && index[h] == px){
+            out[p++] = QOI_OP_INDEX | h;
+        } else {
+            index[h] = px;
+            valid |= 1ULL << h;
+            if(QOI_A(px) == QOI_A(px_prev)){
+                vr = QOI_R(px) - QOI_R(px_prev);
+                vg = QOI_G(px) - QOI_G(px_prev);
+                vb = QOI_B(px) - QOI_B(px_prev);
+                vg_r = vr - vg;
+                vg_b = vb - vg;
+                if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2){
+                    out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8){
+                    out[p++] = QOI_OP_LUMA | (vg + 32);
+                    out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    out[p++] = QOI_OP_RGB;
+                    out[p++] = QOI_R(px);
+                    out[p++] = QOI_G(px);
+                    out[p++] = QOI_B(px);
+                }
+            } else {
+                out[p++] = QOI_OP_RGBA;
+                out[p++] = QOI_R(px);
+                out[p++] = QOI_G(px);
+                out[p++] = QOI_B(px);
+                out[p++] = QOI_A(px);
+            }
+        }
+        px_prev = px;
+    }
+    if(run){
+        out[p++] = QOI_OP_RUN | (run - 1);
+    }
+    return p;
+}
+
+static void *QoiSliceThread(void *arg)
+{
+    QoiSlice *slice = (QoiSlice *)arg;
+
+    slice->len = QoiEncodeSlice(slice->src, slice->byte_per_pix, slice->npix, slice->first, slice->out);
+    return NULL;
+}
+
+//编码到out，out_size至少为QOI_MAX_SIZE，返回码流长度，失败返回-1
+long QoiEncode(const __u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, __u8 *out, __u64 out_size, int threads, const pthread_attr_t *attr)
+{
+    QoiSlice slice[QOI_MAX_SLICE];
+    pthread_t tid[QOI_MAX_SLICE];
+    __u8 byte_per_pix = bitCountPerPix >> 3;
+    __u32 rows, y;
+    __u64 slice_max;
+    long p;
+    int i, n;
+
+    if((byte_per_pix != 3 && byte_per_pix != 4) || width == 0 || height == 0){
+        return -1;
+    }
+    if(out_size < QOI_MAX_SIZE(width, height, bitCountPerPix)){
+        return -1;
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    if(threads > QOI_MAX_SLICE){
+        threads = QOI_MAX_SLICE;
+    }
+    if((__u32)threads > height){
+        threads = height;
+    }
+
+    out[0] = 'q';
+    out[1] = 'o';
+    out[2] = 'i';
+    out[3] = 'f';
+    out[4] = width >> 24;
+    out[5] = width >> 16;
+    out[6] = width >> 8;
+    out[7] = width;
+    out[8] = height >> 24;
+    out[9] = height >> 16;
+    out[10] = height >> 8;
+    out[11] = height;
+    out[12] = byte_per_pix;
+    out[13] = 0;  /*sRGB with linear alpha*/
+    p = QOI_HEADER_SIZE;
+
+    //每个分片先写到各自最坏情况大小的区域，编码完成后再依次前移拼接
+    rows = (height + threads - 1) / threads;
+    n = 0;
+    for(y=0; y<height; y+=rows){
+        slice[n].src          = pData + (size_t)y * width * byte_per_pix;
+        slice[n].byte_per_pix = byte_per_pix;
+        slice[n].npix         = (y + rows > height ? height - y : rows) * width;
+        slice[n].first        = (n == 0);
+        slice_max             = (__u64)slice[n].npix * (byte_per_pix + 1) + 5;
+        slice[n].out          = out + p;
+        p += slice_max;
+        n++;
+    }
+
+    if(n == 1){
+        QoiSliceThread(&slice[0]);
+    } else {
+        for(i=0; i<n; i++){
+            if(pthread_create(&tid[i], attr, QoiSliceThread, &slice[i]) != 0){
+                QoiSliceThread(&slice[i]);
+                tid[i] = 0;
+            }
+        }
+        for(i=0; i<n; i++){
+            if(tid[i]){
+                pthread_join(tid[i], NULL);
+            }
+        }
+    }
+
+    p = QOI_HEADER_SIZE + slice[0].len;
+    for(i=1; i<n; i++){
+        memmove(out + p, slice[i].out, slice[i].len);
+        p += slice[i].len;
+    }
+
+    memset(out + p, 0, QOI_PADDING_SIZE - 1);
+    p += QOI_PADDING_SIZE - 1;
+    out[p++] = 0x01;
+    return p;
+}
+
+int GenQoiFile(__u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, const char *filename, int threads, const pthread_attr_t *attr)
 {
-    int retval;
     FILE *pf;
-    BitMapFileHeader mFileHead;
-    BitMapInfoHeader mInfoHead;
-    //RgbQuad rgb;
+    __u8 *out;
+    __u64 out_size;
+    long len;
+    size_t written;
+    int retval = 0;
 
-    __u32 bmp_byte_per_line;
-    __u32 buf_byte_per_line;
-    __u8 *pdata, *pbuf;
-    __u8 *line_buf;
-    __u8 byte_per_pix;
-    int x,y;
+    out_size = QOI_MAX_SIZE(width, height, bitCountPerPix);
+    out = (__u8*)malloc(out_size);
+    if(!out){
+        printf("Unable to malloc buff:%s\n", strerror(errno));
+        return -1;
+    }
 
-    pf = fopen(filename, "rb");  
+    VV_PROBE2(encode_start, width, height);
+    len = QoiEncode(pData, bitCountPerPix, width, height, out, out_size, threads, attr);
+    VV_PROBE1(encode_done, len);
+    if(len < 0){
+        printf("qoi encode %dx%d %d bpp failed\n", width, height, bitCountPerPix);
+        free(out);
+        return -1;
+    }
+
+    pf = fopen(filename, "w");
     if(NULL == pf){
         printf("fopen \'%s\' failed : %s\n", filename, strerror(errno));
-        return NULL;  
+        free(out);
+        return -1;
     }
-    
-    retval = fseek(pf, 0, SEEK_SET);
-    if(retval == (-1)){
-        printf("fseek fail : %s\n", strerror(errno));
-        fclose(pf);
-        return NULL;
+    VV_PROBE1(fwrite_start, len);
+    written = fwrite(out, len, 1, pf);
+    VV_PROBE2(fwrite_done, len, written);
+    if(written != 1){
+        printf("fwrite \'%s\' failed : %s\n", filename, strerror(errno));
+        retval = -1;
     }
+    fclose(pf);
+    free(out);
+    return retval;
+}
 
-    retval = fread(&mFileHead, sizeof(BitMapFileHeader), 1, pf);
-    if(retval!=1){
-        printf("read BitMapFileHeader error:%s\n", strerror(errno));
-        fclose(pf);
-        return NULL;
-    }
-    retval = fread(&mInfoHead, sizeof(BitMapInfoHeader), 1, pf);
-    if(retval != 1){
-        printf("read BitMapFileHeader error:%s\n", strerror(errno));
-        fclose(pf);
+__u8* GetBmpData(__u8 *bitCountPerPix, __u32 *width, __u32 *height, const char* filename)
+{
+    int retval;
+    BmpView view;
+    __u32 buf_byte_per_line;
+    __u8 *pdata, *pbuf, *prow;
+    __u8 byte_per_pix;
+    __u32 x,y,i;
+
+    retval = BmpMapFile(&view, filename);
+    if(retval != 0){
         return NULL;
     }
-    showBitMapFileHead(&mFileHead);
-    showBmpInforHead(&mInfoHead);
+    showBitMapFileHead((BitMapFileHeader *)view.map);
+    showBmpInforHead((BitMapInfoHeader *)(view.map + sizeof(BitMapFileHeader)));
 
     if(bitCountPerPix){
-        *bitCountPerPix = mInfoHead.biBitCount;
+        *bitCountPerPix = view.bitCountPerPix;
     }
     if(width){
-        *width = mInfoHead.biWidth;
+        *width = view.width;
     }
     if(height){
-        *height = mInfoHead.biHeight;
+        *height = view.height;
     }
 
-    retval = fseek(pf, mFileHead.bfOffBits, SEEK_SET);
-    if(retval == (-1)){
-        printf("fseek to %d fail : %s\n", mFileHead.bfOffBits, strerror(errno));
-        fclose(pf);
+    byte_per_pix = view.bitCountPerPix >> 3;
+    buf_byte_per_line = view.width * byte_per_pix;
+    printf("bmp_byte_per_line=%d\n", view.stride);
+    printf("buf_byte_per_line=%d\n", buf_byte_per_line);
+
+    pdata = (__u8*)malloc((size_t)buf_byte_per_line * view.height);
+    if(!pdata){
+        printf("Unable to malloc buff:%s\n", strerror(errno));
+        BmpUnmapFile(&view);
         return NULL;
     }
 
-    bmp_byte_per_line = ((mInfoHead.biWidth * mInfoHead.biBitCount + 31) >> 5) << 2;
-    line_buf = (__u8*)malloc(bmp_byte_per_line);
-    printf("bmp_byte_per_line=%d\n", bmp_byte_per_line);
+    //输出从上到下排列，像素内字节顺序颠倒(BGRA->ARGB)
+    pbuf = pdata;
+    for(y=0; y<view.height; y++){
+        prow = BmpViewRow(&view, y);
+        for(x=0; x<view.width; x++){
+            for(i=0; i<byte_per_pix; i++){
+                pbuf[x*byte_per_pix+i] = prow[x*byte_per_pix+byte_per_pix-1-i];
+            }
+        }
+        pbuf += buf_byte_per_line;
+    }
 
-    byte_per_pix = mInfoHead.biBitCount >> 3;
-    pdata = (__u8*)malloc(mInfoHead.biWidth * mInfoHead.biHeight * byte_per_pix);
-    
-    buf_byte_per_line = mInfoHead.biWidth * byte_per_pix;
-    printf("buf_byte_per_line=%d\n", buf_byte_per_line);
+    BmpUnmapFile(&view);
+    return pdata;
+}
 
-    if(!pdata || !line_buf){
-        if(pdata){
-            free(pdata);
-        }
-        if(line_buf){
-            free(line_buf);
-        }
-        fclose(pf);
-        return NULL;
+//映射并校验BMP文件，成功返回0，view中的像素指针指向文件映射
+int BmpMapFile(BmpView *view, const char *filename)
+{
+    int fd;
+    struct stat st;
+    const BitMapFileHeader *pFileHead;
+    const BitMapInfoHeader *pInfoHead;
+    __u8 *map;
+    __u64 stride, data_end;
+    int biHeight;
+
+    memset(view, 0, sizeof(*view));
+
+    fd = open(filename, O_RDONLY);
+    if(fd == -1){
+        printf("open \'%s\' failed : %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if(fstat(fd, &st) == -1){
+        printf("fstat \'%s\' failed : %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if(st.st_size < (off_t)(sizeof(BitMapFileHeader) + sizeof(BitMapInfoHeader)) || st.st_size > 0xFFFFFFFFLL){
+        printf("\'%s\': invalid file size %lld\n", filename, (long long)st.st_size);
+        close(fd);
+        return -1;
     }
 
-    pbuf = &pdata[(mInfoHead.biHeight-1)*buf_byte_per_line];
-    for(y=0; y<mInfoHead.biHeight; y++){
-        fread(line_buf, bmp_byte_per_line, 1, pf);
-        //memcpy(pbuf,line_buf,buf_byte_per_line);
-        for(x=0; x<mInfoHead.biWidth; x++){
-            pbuf[x*byte_per_pix+0] = line_buf[x*byte_per_pix+3];
-            pbuf[x*byte_per_pix+1] = line_buf[x*byte_per_pix+2];
-            pbuf[x*byte_per_pix+2] = line_buf[x*byte_per_pix+1];
-            pbuf[x*byte_per_pix+3] = line_buf[x*byte_per_pix+0];
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        printf("mmap \'%s\' failed : %s\n", filename, strerror(errno));
+        return -1;
+    }
+    //madvise每次只接受一个advice，两个都只是提示，失败不影响读取
+    (void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+    (void)madvise(map, st.st_size, MADV_WILLNEED);
+
+    pFileHead = (const BitMapFileHeader *)map;
+    pInfoHead = (const BitMapInfoHeader *)(map + sizeof(BitMapFileHeader));
+    biHeight = (int)pInfoHead->biHeight;
+
+    if(pFileHead->bfType[0] != 'B' || pFileHead->bfType[1] != 'M'){
+        printf("\'%s\': bad signature\n", filename);
+        goto invalid;
+    }
+    if(pInfoHead->biSize < sizeof(BitMapInfoHeader) || pInfoHead->biPlanes != 1){
+        printf("\'%s\': unsupported info header size=%d planes=%d\n", filename, pInfoHead->biSize, pInfoHead->biPlanes);
+        goto invalid;
+    }
+    if(pInfoHead->biBitCount != 24 && pInfoHead->biBitCount != 32){
+        printf("\'%s\': unsupported bit_count %d\n", filename, pInfoHead->biBitCount);
+        goto invalid;
+    }
+    //BI_RGB，32位允许BI_BITFIELDS(按默认BGRA掩码处理)
+    if(pInfoHead->biCompression != 0 && !(pInfoHead->biCompression == 3 && pInfoHead->biBitCount == 32)){
+        printf("\'%s\': unsupported compression %d\n", filename, pInfoHead->biCompression);
+        goto invalid;
+    }
+    if((int)pInfoHead->biWidth <= 0 || biHeight == 0 || biHeight == (int)0x80000000){
+        printf("\'%s\': invalid size %dx%d\n", filename, (int)pInfoHead->biWidth, biHeight);
+        goto invalid;
+    }
+
+    //行长和图像大小都用64位算，放不进32位的文件直接拒绝，避免回绕后越界检查失效
+    stride = (((__u64)pInfoHead->biWidth * pInfoHead->biBitCount + 31) >> 5) << 2;
+    if(stride > 0xFFFFFFFFULL){
+        printf("\'%s\': row of %llu bytes too large\n", filename, (unsigned long long)stride);
+        goto invalid;
+    }
+    data_end = (__u64)pFileHead->bfOffBits + stride * (__u64)(biHeight < 0 ? -(__s64)biHeight : biHeight);
+    if(pFileHead->bfOffBits < sizeof(BitMapFileHeader) + pInfoHead->biSize || data_end > (__u64)st.st_size){
+        printf("\'%s\': invalid data offset %d, need %llu bytes, file has %lld\n", filename,
+                pFileHead->bfOffBits, (unsigned long long)data_end, (long long)st.st_size);
+        goto invalid;
+    }
+
+    view->map            = map;
+    view->map_size       = st.st_size;
+    view->width          = pInfoHead->biWidth;
+    view->height         = biHeight < 0 ? -biHeight : biHeight;
+    view->top_down       = biHeight < 0;
+    view->bitCountPerPix = pInfoHead->biBitCount;
+    view->stride         = stride;
+    view->pixels = map + pFileHead->bfOffBits;
+    return 0;
+
+invalid:
+    munmap(map, st.st_size);
+    return -1;
+}
+
+void BmpUnmapFile(BmpView *view)
+{
+    if(view->map){
+        munmap(view->map, view->map_size);
+    }
+    memset(view, 0, sizeof(*view));
+}
+
+//返回从上往下第y行在文件中的地址
+__u8* BmpViewRow(const BmpView *view, __u32 y)
+{
+    if(!view->top_down){
+        y = view->height - 1 - y;
+    }
+    return view->pixels + (size_t)y * view->stride;
+}
+
+//按设备RGB32排列(byte0:a byte1:r byte2:g byte3:b)从上到下拷贝到pData，24位时a填0
+int BmpViewCopy(const BmpView *view, __u8 *pData, __u32 bytesPerLine)
+{
+    __u32 x,y;
+    __u8 *prow;
+    __u32 *pdst;
+    __u32 pix;
+
+    if(bytesPerLine < view->width * 4){
+        return -1;
+    }
+
+    for(y=0; y<view->height; y++){
+        prow = BmpViewRow(view, y);
+        pdst = (__u32 *)(pData + (size_t)y * bytesPerLine);
+        if(view->bitCountPerPix == 32){
+            for(x=0; x<view->width; x++){
+                memcpy(&pix, prow + x*4, 4);
+                pdst[x] = __builtin_bswap32(pix);
+            }
+        } else {
+            for(x=0; x<view->width; x++){
+                pdst[x] = ((__u32)prow[x*3+2] << 8) | ((__u32)prow[x*3+1] << 16) | ((__u32)prow[x*3+0] << 24);
+            }
         }
-        pbuf -= buf_byte_per_line;
     }
-    free(line_buf);
-    fclose(pf);
-    return pdata;
+    return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef _BMP_H_
 #define _BMP_H_
 
+#include <pthread.h>
+
 /*
 BMP文件由文件头、位图信息头、颜色信息和图形数据四部分组成
 BMP文件头数据结构含有BMP文件的类型、文件大小和位图起始位置等信息
@@ -10,6 +12,7 @@ BMP位图信息头数据用于说明位图的尺寸等信息
 typedef unsigned char  __u8;
 typedef unsigned short __u16;
 typedef unsigned int   __u32;
+typedef unsigned long long __u64;
 
 //文件头结构体
 typedef struct  /* bmfh 14byte */ 
@@ -49,7 +52,38 @@ typedef struct
 } __attribute__((packed)) RgbQuad;
 
 
+//文件映射视图：像素直接指向mmap的文件内容，不做拷贝
+typedef struct
+{
+    __u8 *map;             /*mmap得到的整个文件*/
+    __u32 map_size;        /*文件大小*/
+    __u8 *pixels;          /*像素数据起始地址，即map + bfOffBits*/
+    __u32 width;           /*宽度，以象素为单位*/
+    __u32 height;          /*高度的绝对值*/
+    __u8 bitCountPerPix;   /*24或32*/
+    __u32 stride;          /*文件中每行字节数，已按4字节对齐*/
+    int top_down;          /*biHeight为负数时为1，行顺序从上到下*/
+} BmpView;
+
+/*
+QOI无损压缩(https://qoiformat.org)，输入与GenBmpFile相同(每像素B,G,R[,A]，从上到下)
+多线程时按行分片并行编码，每个分片以QOI_OP_RGBA开头且只引用本分片写入的颜色索引，
+拼接后仍是标准QOI码流
+分片线程以attr创建，NULL为默认属性；需要绑核或实时优先级的调用者传入RtWorkerAttr()
+*/
+#define QOI_HEADER_SIZE  14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_SIZE(width, height, bitCountPerPix) \
+    (QOI_HEADER_SIZE + QOI_PADDING_SIZE + (__u64)(width) * (height) * (((bitCountPerPix) >> 3) + 1) + 64 * 5)
+
 int GenBmpFile(__u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, const char *filename);
+long QoiEncode(const __u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, __u8 *out, __u64 out_size, int threads, const pthread_attr_t *attr);
+int GenQoiFile(__u8 *pData, __u8 bitCountPerPix, __u32 width, __u32 height, const char *filename, int threads, const pthread_attr_t *attr);
 __u8* GetBmpData(__u8 *bitCountPerPix, __u32 *width, __u32 *height, const char* filename);
 
+int BmpMapFile(BmpView *view, const char *filename);
+void BmpUnmapFile(BmpView *view);
+__u8* BmpViewRow(const BmpView *view, __u32 y);
+int BmpViewCopy(const BmpView *view, __u8 *pData, __u32 bytesPerLine);
+
 #endif    /* _BMP_H_ */
@@ -0,0 +1,893 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <linux/videodev2.h>
+#include "convert.h"
+#include "debayer.h"
+
+#define CONV_MAX_THREADS 64
+
+//定点系数：Y/U/V正变换为Q8，色度按2x2像素和计算再右移10位；逆变换为Q8
+typedef struct
+{
+    int yr, yg, yb;
+    int ur, ug, ub;
+    int vr, vg, vb;
+    int cy, rv, gu, gv, bu;
+    int as, rs, gs, bs;    /*RGB像素(小端u32)中各分量的位移*/
+} ConvCoef;
+
+static const int coef_601[14] = {66, 129, 25, -38, -74, 112, 112, -94, -18, 298, 409, -100, -208, 516};
+static const int coef_709[14] = {47, 157, 16, -26, -87, 112, 112, -102, -10, 298, 459, -55, -136, 541};
+
+typedef struct
+{
+    void (*rgb2yuv)(const __u8 *s0, const __u8 *s1, __u8 *y0, __u8 *y1, __u8 *u, __u8 *v, int w, const ConvCoef *k);
+    void (*yuv2rgb)(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w, const ConvCoef *k);
+    void (*swap32)(const __u8 *s, __u8 *d, int w);
+    void (*pack_uv)(const __u8 *u, const __u8 *v, __u8 *uv, int n);
+    void (*unpack_uv)(const __u8 *uv, __u8 *u, __u8 *v, int n);
+    void (*pack_yuyv)(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w);
+    void (*unpack_yuyv)(const __u8 *s, __u8 *y, __u8 *u, __u8 *v, int w);
+    void (*avg)(const __u8 *a, const __u8 *b, __u8 *d, int n);
+} ConvKernels;
+
+static inline __u8 clamp255(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/*==================== 标量参考实现 ====================*/
+
+//s0/s1为上下两行RGB，y1为NULL时不输出第二行亮度；4:2:2时调用方传s1=s0
+static void rgb2yuv_c(const __u8 *s0, const __u8 *s1, __u8 *y0, __u8 *y1, __u8 *u, __u8 *v, int w, const ConvCoef *k)
+{
+    const __u32 *p0 = (const __u32 *)s0;
+    const __u32 *p1 = (const __u32 *)s1;
+    int x, i, r, g, b, rs, gs, bs;
+    __u32 px;
+
+    for(x=0; x<w; x+=2){
+        rs = gs = bs = 0;
+        for(i=0; i<4; i++){
+            px = (i < 2 ? p0 : p1)[x + (i & 1)];
+            r = (px >> k->rs) & 0xff;
+            g = (px >> k->gs) & 0xff;
+            b = (px >> k->bs) & 0xff;
+            rs += r;
+            gs += g;
+            bs += b;
+            if(i < 2 && y0){
+                y0[x + i] = ((k->yr * r + k->yg * g + k->yb * b + 128) >> 8) + 16;
+            } else if(i >= 2 && y1){
+                y1[x + i - 2] = ((k->yr * r + k->yg * g + k->yb * b + 128) >> 8) + 16;
+            }
+        }
+        u[x >> 1] = ((k->ur * rs + k->ug * gs + k->ub * bs + 512) >> 10) + 128;
+        v[x >> 1] = ((k->vr * rs + k->vg * gs + k->vb * bs + 512) >> 10) + 128;
+    }
+}
+
+static void yuv2rgb_c(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w, const ConvCoef *k)
+{
+    __u32 *p = (__u32 *)d;
+    int x, c, du, dv;
+
+    for(x=0; x<w; x++){
+        c  = k->cy * (y[x] - 16) + 128;
+        du = u[x >> 1] - 128;
+        dv = v[x >> 1] - 128;
+        p[x] = ((__u32)clamp255((c + k->rv * dv) >> 8) << k->rs) |
+               ((__u32)clamp255((c + k->gu * du + k->gv * dv) >> 8) << k->gs) |
+               ((__u32)clamp255((c + k->bu * du) >> 8) << k->bs) |
+               (0xffu << k->as);
+    }
+}
+
+static void swap32_c(const __u8 *s, __u8 *d, int w)
+{
+    const __u32 *ps = (const __u32 *)s;
+    __u32 *pd = (__u32 *)d;
+    int x;
+
+    for(x=0; x<w; x++){
+        pd[x] = __builtin_bswap32(ps[x]);
+    }
+}
+
+static void pack_uv_c(const __u8 *u, const __u8 *v, __u8 *uv, int n)
+{
+    int i;
+
+    for(i=0; i<n; i++){
+        uv[2*i]   = u[i];
+        uv[2*i+1] = v[i];
+    }
+}
+
+static void unpack_uv_c(const __u8 *uv, __u8 *u, __u8 *v, int n)
+{
+    int i;
+
+    for(i=0; i<n; i++){
+        u[i] = uv[2*i];
+        v[i] = uv[2*i+1];
+    }
+}
+
+static void pack_yuyv_c(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w)
+{
+    int x;
+
+    for(x=0; x<w; x+=2){
+        d[2*x]   = y[x];
+        d[2*x+1] = u[x >> 1];
+        d[2*x+2] = y[x+1];
+        d[2*x+3] = v[x >> 1];
+    }
+}
+
+static void unpack_yuyv_c(const __u8 *s, __u8 *y, __u8 *u, __u8 *v, int w)
+{
+    int x;
+
+    for(x=0; x<w; x+=2){
+        y[x]      = s[2*x];
+        u[x >> 1] = s[2*x+1];
+        y[x+1]    = s[2*x+2];
+        v[x >> 1] = s[2*x+3];
+    }
+}
+
+static void avg_c(const __u8 *a, const __u8 *b, __u8 *d, int n)
+{
+    int i;
+
+    for(i=0; i<n; i++){
+        d[i] = (a[i] + b[i] + 1) >> 1;
+    }
+}
+
+static const ConvKernels kernels_c = {
+    rgb2yuv_c, yuv2rgb_c, swap32_c, pack_uv_c, unpack_uv_c, pack_yuyv_c, unpack_yuyv_c, avg_c,
+};
+
+/*==================== SSE4.1 ====================*/
+
+#define SSE4 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE4 static inline __m128i luma_sse4(__m128i r, __m128i g, __m128i b, const ConvCoef *k)
+{
+    __m128i t = _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(k->yr)), _mm_mullo_epi32(g, _mm_set1_epi32(k->yg)));
+    t = _mm_add_epi32(t, _mm_add_epi32(_mm_mullo_epi32(b, _mm_set1_epi32(k->yb)), _mm_set1_epi32(128)));
+    return _mm_add_epi32(_mm_srai_epi32(t, 8), _mm_set1_epi32(16));
+}
+
+SSE4 static inline __m128i chroma_sse4(__m128i r, __m128i g, __m128i b, int kr, int kg, int kb)
+{
+    __m128i t = _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(kr)), _mm_mullo_epi32(g, _mm_set1_epi32(kg)));
+    t = _mm_add_epi32(t, _mm_add_epi32(_mm_mullo_epi32(b, _mm_set1_epi32(kb)), _mm_set1_epi32(512)));
+    return _mm_add_epi32(_mm_srai_epi32(t, 10), _mm_set1_epi32(128));
+}
+
+SSE4 static void rgb2yuv_sse4(const __u8 *s0, const __u8 *s1, __u8 *y0, __u8 *y1, __u8 *u, __u8 *v, int w, const ConvCoef *k)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i rs = _mm_cvtsi32_si128(k->rs);
+    const __m128i gs = _mm_cvtsi32_si128(k->gs);
+    const __m128i bs = _mm_cvtsi32_si128(k->bs);
+    __m128i a0, b0, a1, b1, ra0, ga0, ba0, rb0, gb0, bb0, ra1, ga1, ba1, rb1, gb1, bb1;
+    __m128i rsum, gsum, bsum, cu, cv, t;
+    int x;
+
+    for(x=0; x+8<=w; x+=8){
+        a0 = _mm_loadu_si128((const __m128i *)(s0 + x*4));
+        b0 = _mm_loadu_si128((const __m128i *)(s0 + x*4 + 16));
+        a1 = _mm_loadu_si128((const __m128i *)(s1 + x*4));
+        b1 = _mm_loadu_si128((const __m128i *)(s1 + x*4 + 16));
+
+        ra0 = _mm_and_si128(_mm_srl_epi32(a0, rs), mask);
+        ga0 = _mm_and_si128(_mm_srl_epi32(a0, gs), mask);
+        ba0 = _mm_and_si128(_mm_srl_epi32(a0, bs), mask);
+        rb0 = _mm_and_si128(_mm_srl_epi32(b0, rs), mask);
+        gb0 = _mm_and_si128(_mm_srl_epi32(b0, gs), mask);
+        bb0 = _mm_and_si128(_mm_srl_epi32(b0, bs), mask);
+        ra1 = _mm_and_si128(_mm_srl_epi32(a1, rs), mask);
+        ga1 = _mm_and_si128(_mm_srl_epi32(a1, gs), mask);
+        ba1 = _mm_and_si128(_mm_srl_epi32(a1, bs), mask);
+        rb1 = _mm_and_si128(_mm_srl_epi32(b1, rs), mask);
+        gb1 = _mm_and_si128(_mm_srl_epi32(b1, gs), mask);
+        bb1 = _mm_and_si128(_mm_srl_epi32(b1, bs), mask);
+
+        if(y0){
+            t = _mm_packus_epi32(luma_sse4(ra0, ga0, ba0, k), luma_sse4(rb0, gb0, bb0, k));
+            _mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(t, t));
+        }
+        if(y1){
+            t = _mm_packus_epi32(luma_sse4(ra1, ga1, ba1, k), luma_sse4(rb1, gb1, bb1, k));
+            _mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(t, t));
+        }
+
+        //相邻两列水平相加得到2x2块之和
+        rsum = _mm_hadd_epi32(_mm_add_epi32(ra0, ra1), _mm_add_epi32(rb0, rb1));
+        gsum = _mm_hadd_epi32(_mm_add_epi32(ga0, ga1), _mm_add_epi32(gb0, gb1));
+        bsum = _mm_hadd_epi32(_mm_add_epi32(ba0, ba1), _mm_add_epi32(bb0, bb1));
+        cu = chroma_sse4(rsum, gsum, bsum, k->ur, k->ug, k->ub);
+        cv = chroma_sse4(rsum, gsum, bsum, k->vr, k->vg, k->vb);
+        t = _mm_packus_epi32(cu, cv);
+        t = _mm_packus_epi16(t, t);
+        *(__u32 *)(u + (x >> 1)) = _mm_cvtsi128_si32(t);
+        *(__u32 *)(v + (x >> 1)) = _mm_extract_epi32(t, 1);
+    }
+    if(x < w){
+        rgb2yuv_c(s0 + x*4, s1 + x*4, y0 ? y0 + x : NULL, y1 ? y1 + x : NULL, u + (x >> 1), v + (x >> 1), w - x, k);
+    }
+}
+
+SSE4 static void yuv2rgb_sse4(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w, const ConvCoef *k)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi32(255);
+    const __m128i alpha = _mm_set1_epi32(0xffu << k->as);
+    const __m128i rs = _mm_cvtsi32_si128(k->rs);
+    const __m128i gs = _mm_cvtsi32_si128(k->gs);
+    const __m128i bs = _mm_cvtsi32_si128(k->bs);
+    __m128i yy, uu, vv, c, r, g, b;
+    __u32 t;
+    int x;
+
+    for(x=0; x+4<=w; x+=4){
+        memcpy(&t, y + x, 4);
+        yy = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(t));
+        t = *(const __u16 *)(u + (x >> 1));
+        uu = _mm_cvtsi32_si128(t);
+        uu = _mm_cvtepu8_epi32(_mm_unpacklo_epi8(uu, uu));
+        t = *(const __u16 *)(v + (x >> 1));
+        vv = _mm_cvtsi32_si128(t);
+        vv = _mm_cvtepu8_epi32(_mm_unpacklo_epi8(vv, vv));
+
+        c  = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(yy, _mm_set1_epi32(16)), _mm_set1_epi32(k->cy)), _mm_set1_epi32(128));
+        uu = _mm_sub_epi32(uu, _mm_set1_epi32(128));
+        vv = _mm_sub_epi32(vv, _mm_set1_epi32(128));
+
+        r = _mm_srai_epi32(_mm_add_epi32(c, _mm_mullo_epi32(vv, _mm_set1_epi32(k->rv))), 8);
+        g = _mm_srai_epi32(_mm_add_epi32(c, _mm_add_epi32(_mm_mullo_epi32(uu, _mm_set1_epi32(k->gu)),
+                                                           _mm_mullo_epi32(vv, _mm_set1_epi32(k->gv)))), 8);
+        b = _mm_srai_epi32(_mm_add_epi32(c, _mm_mullo_epi32(uu, _mm_set1_epi32(k->bu))), 8);
+        r = _mm_min_epi32(_mm_max_epi32(r, zero), max);
+        g = _mm_min_epi32(_mm_max_epi32(g, zero), max);
+        b = _mm_min_epi32(_mm_max_epi32(b, zero), max);
+
+        r = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, rs), _mm_sll_epi32(g, gs)), _mm_or_si128(_mm_sll_epi32(b, bs), alpha));
+        _mm_storeu_si128((__m128i *)(d + x*4), r);
+    }
+    if(x < w){
+        yuv2rgb_c(y + x, u + (x >> 1), v + (x >> 1), d + x*4, w - x, k);
+    }
+}
+
+SSE4 static void swap32_sse4(const __u8 *s, __u8 *d, int w)
+{
+    const __m128i shuf = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int x;
+
+    for(x=0; x+4<=w; x+=4){
+        _mm_storeu_si128((__m128i *)(d + x*4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + x*4)), shuf));
+    }
+    swap32_c(s + x*4, d + x*4, w - x);
+}
+
+SSE4 static void pack_uv_sse4(const __u8 *u, const __u8 *v, __u8 *uv, int n)
+{
+    __m128i a, b;
+    int i;
+
+    for(i=0; i+16<=n; i+=16){
+        a = _mm_loadu_si128((const __m128i *)(u + i));
+        b = _mm_loadu_si128((const __m128i *)(v + i));
+        _mm_storeu_si128((__m128i *)(uv + 2*i), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(uv + 2*i + 16), _mm_unpackhi_epi8(a, b));
+    }
+    pack_uv_c(u + i, v + i, uv + 2*i, n - i);
+}
+
+SSE4 static void unpack_uv_sse4(const __u8 *uv, __u8 *u, __u8 *v, int n)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    __m128i a, b;
+    int i;
+
+    for(i=0; i+16<=n; i+=16){
+        a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(uv + 2*i)), shuf);
+        b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(uv + 2*i + 16)), shuf);
+        _mm_storeu_si128((__m128i *)(u + i), _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_unpackhi_epi64(a, b));
+    }
+    unpack_uv_c(uv + 2*i, u + i, v + i, n - i);
+}
+
+SSE4 static void pack_yuyv_sse4(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w)
+{
+    __m128i yy, uv;
+    int x;
+
+    for(x=0; x+16<=w; x+=16){
+        yy = _mm_loadu_si128((const __m128i *)(y + x));
+        uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + (x >> 1))), _mm_loadl_epi64((const __m128i *)(v + (x >> 1))));
+        _mm_storeu_si128((__m128i *)(d + 2*x), _mm_unpacklo_epi8(yy, uv));
+        _mm_storeu_si128((__m128i *)(d + 2*x + 16), _mm_unpackhi_epi8(yy, uv));
+    }
+    pack_yuyv_c(y + x, u + (x >> 1), v + (x >> 1), d + 2*x, w - x);
+}
+
+SSE4 static void unpack_yuyv_sse4(const __u8 *s, __u8 *y, __u8 *u, __u8 *v, int w)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15);
+    __m128i a, b;
+    int x;
+
+    for(x=0; x+16<=w; x+=16){
+        //每16字节: 低8字节为Y，之后4字节U、4字节V
+        a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + 2*x)), shuf);
+        b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + 2*x + 16)), shuf);
+        _mm_storeu_si128((__m128i *)(y + x), _mm_unpacklo_epi64(a, b));
+        a = _mm_unpackhi_epi32(a, b);  /*u0 u1 v0 v1(各4字节)*/
+        _mm_storel_epi64((__m128i *)(u + (x >> 1)), a);
+        _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_unpackhi_epi64(a, a));
+    }
+    unpack_yuyv_c(s + 2*x, y + x, u + (x >> 1), v + (x >> 1), w - x);
+}
+
+SSE4 static void avg_sse4(const __u8 *a, const __u8 *b, __u8 *d, int n)
+{
+    int i;
+
+    for(i=0; i+16<=n; i+=16){
+        _mm_storeu_si128((__m128i *)(d + i), _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                          _mm_loadu_si128((const __m128i *)(b + i))));
+    }
+    avg_c(a + i, b + i, d + i, n - i);
+}
+
+static const ConvKernels kernels_sse4 = {
+    rgb2yuv_sse4, yuv2rgb_sse4, swap32_sse4, pack_uv_sse4, unpack_uv_sse4, pack_yuyv_sse4, unpack_yuyv_sse4, avg_sse4,
+};
+
+/*==================== AVX2 ====================*/
+
+AVX2 static inline __m256i luma_avx2(__m256i r, __m256i g, __m256i b, const ConvCoef *k)
+{
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(k->yr)), _mm256_mullo_epi32(g, _mm256_set1_epi32(k->yg)));
+    t = _mm256_add_epi32(t, _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(k->yb)), _mm256_set1_epi32(128)));
+    return _mm256_add_epi32(_mm256_srai_epi32(t, 8), _mm256_set1_epi32(16));
+}
+
+AVX2 static inline __m256i chroma_avx2(__m256i r, __m256i g, __m256i b, int kr, int kg, int kb)
+{
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(kr)), _mm256_mullo_epi32(g, _mm256_set1_epi32(kg)));
+    t = _mm256_add_epi32(t, _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(kb)), _mm256_set1_epi32(512)));
+    return _mm256_add_epi32(_mm256_srai_epi32(t, 10), _mm256_set1_epi32(128));
+}
+
+//两组8个32位数压成16个按顺序排列的字节
+AVX2 static inline __m128i pack16_avx2(__m256i a, __m256i b)
+{
+    __m256i t = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+}
+
+AVX2 static void rgb2yuv_avx2(const __u8 *s0, const __u8 *s1, __u8 *y0, __u8 *y1, __u8 *u, __u8 *v, int w, const ConvCoef *k)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m128i rs = _mm_cvtsi32_si128(k->rs);
+    const __m128i gs = _mm_cvtsi32_si128(k->gs);
+    const __m128i bs = _mm_cvtsi32_si128(k->bs);
+    __m256i a0, b0, a1, b1, ra0, ga0, ba0, rb0, gb0, bb0, ra1, ga1, ba1, rb1, gb1, bb1;
+    __m256i rsum, gsum, bsum, cu, cv;
+    __m128i t;
+    int x;
+
+    for(x=0; x+16<=w; x+=16){
+        a0 = _mm256_loadu_si256((const __m256i *)(s0 + x*4));
+        b0 = _mm256_loadu_si256((const __m256i *)(s0 + x*4 + 32));
+        a1 = _mm256_loadu_si256((const __m256i *)(s1 + x*4));
+        b1 = _mm256_loadu_si256((const __m256i *)(s1 + x*4 + 32));
+
+        ra0 = _mm256_and_si256(_mm256_srl_epi32(a0, rs), mask);
+        ga0 = _mm256_and_si256(_mm256_srl_epi32(a0, gs), mask);
+        ba0 = _mm256_and_si256(_mm256_srl_epi32(a0, bs), mask);
+        rb0 = _mm256_and_si256(_mm256_srl_epi32(b0, rs), mask);
+        gb0 = _mm256_and_si256(_mm256_srl_epi32(b0, gs), mask);
+        bb0 = _mm256_and_si256(_mm256_srl_epi32(b0, bs), mask);
+        ra1 = _mm256_and_si256(_mm256_srl_epi32(a1, rs), mask);
+        ga1 = _mm256_and_si256(_mm256_srl_epi32(a1, gs), mask);
+        ba1 = _mm256_and_si256(_mm256_srl_epi32(a1, bs), mask);
+        rb1 = _mm256_and_si256(_mm256_srl_epi32(b1, rs), mask);
+        gb1 = _mm256_and_si256(_mm256_srl_epi32(b1, gs), mask);
+        bb1 = _mm256_and_si256(_mm256_srl_epi32(b1, bs), mask);
+
+        if(y0){
+            _mm_storeu_si128((__m128i *)(y0 + x), pack16_avx2(luma_avx2(ra0, ga0, ba0, k), luma_avx2(rb0, gb0, bb0, k)));
+        }
+        if(y1){
+            _mm_storeu_si128((__m128i *)(y1 + x), pack16_avx2(luma_avx2(ra1, ga1, ba1, k), luma_avx2(rb1, gb1, bb1, k)));
+        }
+
+        //hadd在每个128位通道内进行，结果顺序为c0 c1 c4 c5 | c2 c3 c6 c7
+        rsum = _mm256_hadd_epi32(_mm256_add_epi32(ra0, ra1), _mm256_add_epi32(rb0, rb1));
+        gsum = _mm256_hadd_epi32(_mm256_add_epi32(ga0, ga1), _mm256_add_epi32(gb0, gb1));
+        bsum = _mm256_hadd_epi32(_mm256_add_epi32(ba0, ba1), _mm256_add_epi32(bb0, bb1));
+        cu = _mm256_permute4x64_epi64(chroma_avx2(rsum, gsum, bsum, k->ur, k->ug, k->ub), 0xd8);
+        cv = _mm256_permute4x64_epi64(chroma_avx2(rsum, gsum, bsum, k->vr, k->vg, k->vb), 0xd8);
+        t = pack16_avx2(cu, cv);
+        _mm_storel_epi64((__m128i *)(u + (x >> 1)), t);
+        _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_unpackhi_epi64(t, t));
+    }
+    if(x < w){
+        rgb2yuv_sse4(s0 + x*4, s1 + x*4, y0 ? y0 + x : NULL, y1 ? y1 + x : NULL, u + (x >> 1), v + (x >> 1), w - x, k);
+    }
+}
+
+AVX2 static void yuv2rgb_avx2(const __u8 *y, const __u8 *u, const __u8 *v, __u8 *d, int w, const ConvCoef *k)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i alpha = _mm256_set1_epi32(0xffu << k->as);
+    const __m128i rs = _mm_cvtsi32_si128(k->rs);
+    const __m128i gs = _mm_cvtsi32_si128(k->gs);
+    const __m128i bs = _mm_cvtsi32_si128(k->bs);
+    __m256i yy, uu, vv, c, r, g, b;
+    __m128i t;
+    __u32 t32;
+    int x;
+
+    for(x=0; x+8<=w; x+=8){
+        yy = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(y + x)));
+        memcpy(&t32, u + (x >> 1), 4);
+        t  = _mm_cvtsi32_si128(t32);
+        uu = _mm256_cvtepu8_epi32(_mm_unpacklo_epi8(t, t));
+        memcpy(&t32, v + (x >> 1), 4);
+        t  = _mm_cvtsi32_si128(t32);
+        vv = _mm256_cvtepu8_epi32(_mm_unpacklo_epi8(t, t));
+
+        c  = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(yy, _mm256_set1_epi32(16)), _mm256_set1_epi32(k->cy)),
+                              _mm256_set1_epi32(128));
+        uu = _mm256_sub_epi32(uu, _mm256_set1_epi32(128));
+        vv = _mm256_sub_epi32(vv, _mm256_set1_epi32(128));
+
+        r = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_mullo_epi32(vv, _mm256_set1_epi32(k->rv))), 8);
+        g = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_add_epi32(_mm256_mullo_epi32(uu, _mm256_set1_epi32(k->gu)),
+                                                                    _mm256_mullo_epi32(vv, _mm256_set1_epi32(k->gv)))), 8);
+        b = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_mullo_epi32(uu, _mm256_set1_epi32(k->bu))), 8);
+        r = _mm256_min_epi32(_mm256_max_epi32(r, zero), max);
+        g = _mm256_min_epi32(_mm256_max_epi32(g, zero), max);
+        b = _mm256_min_epi32(_mm256_max_epi32(b, zero), max);
+
+        r = _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(r, rs), _mm256_sll_epi32(g, gs)),
+                            _mm256_or_si256(_mm256_sll_epi32(b, bs), alpha));
+        _mm256_storeu_si256((__m256i *)(d + x*4), r);
+    }
+    if(x < w){
+        yuv2rgb_sse4(y + x, u + (x >> 1), v + (x >> 1), d + x*4, w - x, k);
+    }
+}
+
+AVX2 static void swap32_avx2(const __u8 *s, __u8 *d, int w)
+{
+    const __m256i shuf = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int x;
+
+    for(x=0; x+8<=w; x+=8){
+        _mm256_storeu_si256((__m256i *)(d + x*4), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(s + x*4)), shuf));
+    }
+    swap32_c(s + x*4, d + x*4, w - x);
+}
+
+AVX2 static void avg_avx2(const __u8 *a, const __u8 *b, __u8 *d, int n)
+{
+    int i;
+
+    for(i=0; i+32<=n; i+=32){
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                _mm256_loadu_si256((const __m256i *)(b + i))));
+    }
+    avg_sse4(a + i, b + i, d + i, n - i);
+}
+
+//纯重排的打包/解包受内存带宽限制，AVX2下沿用SSE4.1实现
+static const ConvKernels kernels_avx2 = {
+    rgb2yuv_avx2, yuv2rgb_avx2, swap32_avx2, pack_uv_sse4, unpack_uv_sse4, pack_yuyv_sse4, unpack_yuyv_sse4, avg_avx2,
+};
+
+/*==================== 调度 ====================*/
+
+static const ConvKernels *kernels;
+static ConvLevel conv_level = CONV_AUTO;
+
+static const ConvKernels *ConvKernelsFor(ConvLevel level)
+{
+    if(level == CONV_AUTO){
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")){
+            level = CONV_AVX2;
+        } else if(__builtin_cpu_supports("sse4.1")){
+            level = CONV_SSE4;
+        } else {
+            level = CONV_SCALAR;
+        }
+    }
+    conv_level = level;
+    switch(level){
+    case CONV_AVX2:
+        return &kernels_avx2;
+    case CONV_SSE4:
+        return &kernels_sse4;
+    default:
+        return &kernels_c;
+    }
+}
+
+//选择实现，返回实际使用的级别；CPU不支持时返回-1且不修改
+ConvLevel ConvSetLevel(ConvLevel level)
+{
+    __builtin_cpu_init();
+    if((level == CONV_AVX2 && !__builtin_cpu_supports("avx2")) ||
+       (level == CONV_SSE4 && !__builtin_cpu_supports("sse4.1"))){
+        return (ConvLevel)-1;
+    }
+    kernels = ConvKernelsFor(level);
+    return conv_level;
+}
+
+const char *ConvLevelName(ConvLevel level)
+{
+    switch(level){
+    case CONV_SCALAR:
+        return "scalar";
+    case CONV_SSE4:
+        return "sse4.1";
+    case CONV_AVX2:
+        return "avx2";
+    default:
+        return "auto";
+    }
+}
+
+__u32 ConvFourcc(const char *name)
+{
+    if(strcmp(name, "RGB32") == 0 || strcmp(name, "RGB4") == 0){
+        return V4L2_PIX_FMT_RGB32;
+    }
+    if(strcmp(name, "BGR32") == 0 || strcmp(name, "BGR4") == 0){
+        return V4L2_PIX_FMT_BGR32;
+    }
+    if(strcmp(name, "YUYV") == 0){
+        return V4L2_PIX_FMT_YUYV;
+    }
+    if(strcmp(name, "NV12") == 0){
+        return V4L2_PIX_FMT_NV12;
+    }
+    if(strcmp(name, "I420") == 0 || strcmp(name, "YU12") == 0){
+        return V4L2_PIX_FMT_YUV420;
+    }
+    if(strcmp(name, "SRGGB8") == 0 || strcmp(name, "RGGB") == 0){
+        return V4L2_PIX_FMT_SRGGB8;
+    }
+    if(strcmp(name, "SRGGB10") == 0 || strcmp(name, "RG10") == 0){
+        return V4L2_PIX_FMT_SRGGB10;
+    }
+    if(strcmp(name, "SRGGB10P") == 0 || strcmp(name, "pRAA") == 0){
+        return V4L2_PIX_FMT_SRGGB10P;
+    }
+    return 0;
+}
+
+__u32 ConvImageSize(__u32 fourcc, __u32 width, __u32 height)
+{
+    switch(fourcc){
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+        return width * height * 4;
+    case V4L2_PIX_FMT_YUYV:
+        return width * height * 2;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        return width * height + 2 * (width / 2) * ((height + 1) / 2);
+    case V4L2_PIX_FMT_SRGGB8:
+        return width * height;
+    case V4L2_PIX_FMT_SRGGB10:
+        return width * height * 2;
+    case V4L2_PIX_FMT_SRGGB10P:
+        return width * 5 / 4 * height;
+    default:
+        return 0;
+    }
+}
+
+//按V4L2单缓冲区的连续布局填写各平面，宽度须为偶数；拜耳格式高度至少2，RAW10宽度须为4的倍数
+int ConvImageInit(ConvImage *img, __u32 fourcc, __u32 width, __u32 height, __u8 *data)
+{
+    memset(img, 0, sizeof(*img));
+    if(ConvImageSize(fourcc, width, height) == 0 || (width & 1) || width == 0 || height == 0){
+        return -1;
+    }
+    if(DebayerIsBayer(fourcc) && (height < 2 || (fourcc == V4L2_PIX_FMT_SRGGB10P && (width & 3)))){
+        return -1;
+    }
+
+    img->fourcc = fourcc;
+    img->width  = width;
+    img->height = height;
+    img->plane[0] = data;
+    switch(fourcc){
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+        img->stride[0] = width * 4;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        img->stride[0] = width * 2;
+        break;
+    case V4L2_PIX_FMT_NV12:
+        img->stride[0] = width;
+        img->plane[1]  = data + width * height;
+        img->stride[1] = width;
+        break;
+    case V4L2_PIX_FMT_YUV420:
+        img->stride[0] = width;
+        img->plane[1]  = data + width * height;
+        img->stride[1] = width / 2;
+        img->plane[2]  = img->plane[1] + (width / 2) * ((height + 1) / 2);
+        img->stride[2] = width / 2;
+        break;
+    default:
+        img->stride[0] = ConvImageSize(fourcc, width, 1);
+        break;
+    }
+    return 0;
+}
+
+static int ConvIsRgb(__u32 fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_RGB32 || fourcc == V4L2_PIX_FMT_BGR32;
+}
+
+static int ConvIs420(__u32 fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_NV12 || fourcc == V4L2_PIX_FMT_YUV420;
+}
+
+static void ConvCoefInit(ConvCoef *k, ConvMatrix matrix, __u32 rgb_fourcc)
+{
+    const int *c = matrix == CONV_BT709 ? coef_709 : coef_601;
+
+    k->yr = c[0];  k->yg = c[1];  k->yb = c[2];
+    k->ur = c[3];  k->ug = c[4];  k->ub = c[5];
+    k->vr = c[6];  k->vg = c[7];  k->vb = c[8];
+    k->cy = c[9];  k->rv = c[10]; k->gu = c[11]; k->gv = c[12]; k->bu = c[13];
+    if(rgb_fourcc == V4L2_PIX_FMT_RGB32){
+        /*byte0:a byte1:r byte2:g byte3:b*/
+        k->as = 0;  k->rs = 8;  k->gs = 16; k->bs = 24;
+    } else {
+        /*byte0:b byte1:g byte2:r byte3:a*/
+        k->bs = 0;  k->gs = 8;  k->rs = 16; k->as = 24;
+    }
+}
+
+typedef struct
+{
+    const ConvImage *src;
+    ConvImage *dst;
+    const ConvCoef *k;
+    __u32 y_start, y_end;    /*偶数行开始的行区间*/
+    __u8 *tmp;
+} ConvBand;
+
+#define ROW(img, p, y) ((img)->plane[p] + (size_t)(y) * (img)->stride[p])
+
+//取第y行的Y和色度；4:2:0源的色度行按y/2共享
+static void ConvLoadYuv(const ConvKernels *kn, const ConvImage *img, __u32 y, __u8 **py, __u8 **pu, __u8 **pv, __u8 *ty, __u8 *tu, __u8 *tv)
+{
+    __u32 w = img->width;
+
+    switch(img->fourcc){
+    case V4L2_PIX_FMT_YUYV:
+        kn->unpack_yuyv(ROW(img, 0, y), ty, tu, tv, w);
+        *py = ty;
+        *pu = tu;
+        *pv = tv;
+        break;
+    case V4L2_PIX_FMT_NV12:
+        kn->unpack_uv(ROW(img, 1, y >> 1), tu, tv, w / 2);
+        *py = ROW(img, 0, y);
+        *pu = tu;
+        *pv = tv;
+        break;
+    default:
+        *py = ROW(img, 0, y);
+        *pu = ROW(img, 1, y >> 1);
+        *pv = ROW(img, 2, y >> 1);
+        break;
+    }
+}
+
+//写一对行的YUV，u/v为已按目标采样的色度；4:2:2目标时u1/v1为第二行色度
+static void ConvStoreYuv(const ConvKernels *kn, ConvImage *img, __u32 y, int rows,
+                         const __u8 *y0, const __u8 *y1, const __u8 *u0, const __u8 *v0, const __u8 *u1, const __u8 *v1)
+{
+    __u32 w = img->width;
+
+    switch(img->fourcc){
+    case V4L2_PIX_FMT_YUYV:
+        kn->pack_yuyv(y0, u0, v0, ROW(img, 0, y), w);
+        if(rows > 1){
+            kn->pack_yuyv(y1, u1, v1, ROW(img, 0, y + 1), w);
+        }
+        return;
+    case V4L2_PIX_FMT_NV12:
+        kn->pack_uv(u0, v0, ROW(img, 1, y >> 1), w / 2);
+        break;
+    default:
+        if(u0 != ROW(img, 1, y >> 1)){
+            memcpy(ROW(img, 1, y >> 1), u0, w / 2);
+            memcpy(ROW(img, 2, y >> 1), v0, w / 2);
+        }
+        break;
+    }
+    if(y0 != ROW(img, 0, y)){
+        memcpy(ROW(img, 0, y), y0, w);
+    }
+    if(rows > 1 && y1 != ROW(img, 0, y + 1)){
+        memcpy(ROW(img, 0, y + 1), y1, w);
+    }
+}
+
+static void *ConvBandThread(void *arg)
+{
+    ConvBand *band = (ConvBand *)arg;
+    const ConvKernels *kn = kernels;
+    const ConvImage *src = band->src;
+    ConvImage *dst = band->dst;
+    __u32 w = src->width;
+    __u8 *ty0 = band->tmp, *ty1 = ty0 + w, *tu0 = ty1 + w, *tv0 = tu0 + w / 2, *tu1 = tv0 + w / 2, *tv1 = tu1 + w / 2;
+    __u8 *tu2 = tv1 + w / 2, *tv2 = tu2 + w / 2;
+    __u8 *y0, *y1, *u0, *v0, *u1, *v1;
+    const __u8 *s0, *s1;
+    __u32 y;
+    int rows;
+
+    for(y=band->y_start; y<band->y_end; y+=2){
+        rows = y + 1 < src->height ? 2 : 1;
+
+        if(ConvIsRgb(src->fourcc) && ConvIsRgb(dst->fourcc)){
+            if(src->fourcc == dst->fourcc){
+                memcpy(ROW(dst, 0, y), ROW(src, 0, y), w * 4);
+                if(rows > 1){
+                    memcpy(ROW(dst, 0, y + 1), ROW(src, 0, y + 1), w * 4);
+                }
+            } else {
+                kn->swap32(ROW(src, 0, y), ROW(dst, 0, y), w);
+                if(rows > 1){
+                    kn->swap32(ROW(src, 0, y + 1), ROW(dst, 0, y + 1), w);
+                }
+            }
+        } else if(ConvIsRgb(src->fourcc)){
+            s0 = ROW(src, 0, y);
+            s1 = rows > 1 ? ROW(src, 0, y + 1) : s0;
+            if(dst->fourcc == V4L2_PIX_FMT_YUYV){
+                //4:2:2逐行计算，s1=s0时2x2和恰为两像素和的2倍
+                kn->rgb2yuv(s0, s0, ty0, NULL, tu0, tv0, w, band->k);
+                if(rows > 1){
+                    kn->rgb2yuv(s1, s1, ty1, NULL, tu1, tv1, w, band->k);
+                }
+                ConvStoreYuv(kn, dst, y, rows, ty0, ty1, tu0, tv0, tu1, tv1);
+            } else if(dst->fourcc == V4L2_PIX_FMT_YUV420){
+                kn->rgb2yuv(s0, s1, ROW(dst, 0, y), rows > 1 ? ROW(dst, 0, y + 1) : NULL,
+                            ROW(dst, 1, y >> 1), ROW(dst, 2, y >> 1), w, band->k);
+            } else {
+                kn->rgb2yuv(s0, s1, ROW(dst, 0, y), rows > 1 ? ROW(dst, 0, y + 1) : NULL, tu0, tv0, w, band->k);
+                kn->pack_uv(tu0, tv0, ROW(dst, 1, y >> 1), w / 2);
+            }
+        } else {
+            ConvLoadYuv(kn, src, y, &y0, &u0, &v0, ty0, tu0, tv0);
+            if(rows > 1){
+                ConvLoadYuv(kn, src, y + 1, &y1, &u1, &v1, ty1, tu1, tv1);
+            } else {
+                y1 = y0;
+                u1 = u0;
+                v1 = v0;
+            }
+
+            if(ConvIsRgb(dst->fourcc)){
+                kn->yuv2rgb(y0, u0, v0, ROW(dst, 0, y), w, band->k);
+                if(rows > 1){
+                    kn->yuv2rgb(y1, u1, v1, ROW(dst, 0, y + 1), w, band->k);
+                }
+            } else if(ConvIs420(dst->fourcc) && !ConvIs420(src->fourcc)){
+                //4:2:2到4:2:0，上下两行色度取平均
+                kn->avg(u0, u1, tu2, w / 2);
+                kn->avg(v0, v1, tv2, w / 2);
+                ConvStoreYuv(kn, dst, y, rows, y0, y1, tu2, tv2, tu2, tv2);
+            } else {
+                ConvStoreYuv(kn, dst, y, rows, y0, y1, u0, v0, u1, v1);
+            }
+        }
+    }
+    return NULL;
+}
+
+//src与dst尺寸须相同，threads>1时按行带并行
+int Convert(const ConvImage *src, ConvImage *dst, ConvMatrix matrix, int threads, const pthread_attr_t *attr)
+{
+    ConvBand band[CONV_MAX_THREADS];
+    pthread_t tid[CONV_MAX_THREADS];
+    ConvCoef k;
+    __u32 rows, y;
+    __u8 *tmp;
+    int i, n;
+
+    if(src->width != dst->width || src->height != dst->height || !src->plane[0] || !dst->plane[0]){
+        return -1;
+    }
+    if(DebayerIsBayer(src->fourcc)){
+        //拜耳源只能输出RGB，去马赛克用双线性
+        return Debayer(src, dst, DEBAYER_BILINEAR, threads, attr);
+    }
+    if(DebayerIsBayer(dst->fourcc)){
+        return -1;
+    }
+    if(!kernels){
+        kernels = ConvKernelsFor(conv_level);
+    }
+
+    ConvCoefInit(&k, matrix, ConvIsRgb(src->fourcc) ? src->fourcc : dst->fourcc);
+
+    if(threads < 1){
+        threads = 1;
+    }
+    if(threads > CONV_MAX_THREADS){
+        threads = CONV_MAX_THREADS;
+    }
+    rows = ((src->height + threads - 1) / threads + 1) & ~1;
+
+    tmp = malloc((size_t)threads * src->width * 5);
+    if(!tmp){
+        printf("Unable to malloc convert buffer:%s\n", strerror(errno));
+        return -1;
+    }
+
+    n = 0;
+    for(y=0; y<src->height; y+=rows){
+        band[n].src     = src;
+        band[n].dst     = dst;
+        band[n].k       = &k;
+        band[n].y_start = y;
+        band[n].y_end   = y + rows > src->height ? src->height : y + rows;
+        band[n].tmp     = tmp + (size_t)n * src->width * 5;
+        n++;
+    }
+
+    if(n == 1){
+        ConvBandThread(&band[0]);
+    } else {
+        for(i=0; i<n; i++){
+            if(pthread_create(&tid[i], attr, ConvBandThread, &band[i]) != 0){
+                ConvBandThread(&band[i]);
+                tid[i] = 0;
+            }
+        }
+        for(i=0; i<n; i++){
+            if(tid[i]){
+                pthread_join(tid[i], NULL);
+            }
+        }
+    }
+
+    free(tmp);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include "bitmap.h"
+
+/*
+像素格式转换
+支持V4L2_PIX_FMT_RGB32、BGR32、YUYV、NV12、YUV420(I420)之间任意互转，
+YUV为有限范围(16-235)的BT.601或BT.709，4:2:0色度取2x2均值，YUV转RGB色度最近邻上采样
+每条路径都有标量参考实现以及SSE4.1和AVX2实现，SIMD结果与标量逐字节一致
+SRGGB8/SRGGB10/SRGGB10P只能作为源，经debayer.c双线性去马赛克输出RGB32/BGR32
+*/
+
+typedef enum
+{
+    CONV_BT601 = 0,
+    CONV_BT709,
+} ConvMatrix;
+
+typedef enum
+{
+    CONV_SCALAR = 0,
+    CONV_SSE4,
+    CONV_AVX2,
+    CONV_AUTO,
+} ConvLevel;
+
+//一帧图像，plane/stride按格式使用1到3个平面
+typedef struct
+{
+    __u32 fourcc;
+    __u32 width;
+    __u32 height;
+    __u8 *plane[3];
+    __u32 stride[3];
+} ConvImage;
+
+__u32 ConvImageSize(__u32 fourcc, __u32 width, __u32 height);
+int ConvImageInit(ConvImage *img, __u32 fourcc, __u32 width, __u32 height, __u8 *data);
+//threads>1时按行分带并行，工作线程以attr创建，NULL为默认属性
+int Convert(const ConvImage *src, ConvImage *dst, ConvMatrix matrix, int threads, const pthread_attr_t *attr);
+
+ConvLevel ConvSetLevel(ConvLevel level);
+const char *ConvLevelName(ConvLevel level);
+__u32 ConvFourcc(const char *name);
+
+#endif    /* _CONVERT_H_ */
@@ -0,0 +1,164 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78   /*反射后的Castagnoli多项式*/
+#define CRC32C_LANE 8192         /*3路交错时每路的字节数*/
+
+static __u32 crc_table[8][256];
+static __u32 lane_shift[4][256];     /*crc之后再接CRC32C_LANE个0字节*/
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static __u32 (*crc_update)(__u32 crc, const __u8 *p, size_t len);
+static Crc32cLevel crc_level = CRC32C_AUTO;
+
+/*==================== 查表 ====================*/
+
+static __u32 Crc32cScalar(__u32 crc, const __u8 *p, size_t len)
+{
+    __u64 v;
+
+    while(len && ((uintptr_t)p & 7)){
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    //小端，低32位先与crc异或
+    for(; len >= 8; p += 8, len -= 8){
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^
+              crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+              crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+              crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+    }
+    while(len--){
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+//crc之后接CRC32C_LANE个0字节后的值，对crc是线性的
+static inline __u32 Crc32cShift(__u32 crc)
+{
+    return lane_shift[0][crc & 0xff] ^ lane_shift[1][(crc >> 8) & 0xff] ^
+           lane_shift[2][(crc >> 16) & 0xff] ^ lane_shift[3][crc >> 24];
+}
+
+/*==================== SSE4.2 ====================*/
+
+#define SSE42 __attribute__((target("sse4.2")))
+
+//crc32指令延迟3周期、每周期可发一条，三路无依赖的链才能跑满
+SSE42 static __u32 Crc32cSse42(__u32 crc, const __u8 *p, size_t len)
+{
+    __u64 c0 = crc, c1, c2, v0, v1, v2;
+    size_t i;
+
+    while(len && ((uintptr_t)p & 7)){
+        c0 = _mm_crc32_u8(c0, *p++);
+        len--;
+    }
+    for(; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE){
+        c1 = c2 = 0;
+        for(i = 0; i < CRC32C_LANE; i += 8){
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        //crc(c, A|B|C) = shift(shift(crc(c,A)) ^ crc(0,B)) ^ crc(0,C)
+        c0 = Crc32cShift(Crc32cShift(c0) ^ c1) ^ c2;
+    }
+    for(; len >= 8; p += 8, len -= 8){
+        memcpy(&v0, p, 8);
+        c0 = _mm_crc32_u64(c0, v0);
+    }
+    while(len--){
+        c0 = _mm_crc32_u8(c0, *p++);
+    }
+    return c0;
+}
+
+/*==================== 调度 ====================*/
+
+static void Crc32cInit(void)
+{
+    static const __u8 zero[CRC32C_LANE];
+    __u32 bit[32], c;
+    int i, k, n;
+
+    for(n = 0; n < 256; n++){
+        c = n;
+        for(k = 0; k < 8; k++){
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        }
+        crc_table[0][n] = c;
+    }
+    for(n = 0; n < 256; n++){
+        for(k = 1; k < 8; k++){
+            crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^ crc_table[0][crc_table[k - 1][n] & 0xff];
+        }
+    }
+    //每一位单独移位，再按字节组合
+    for(i = 0; i < 32; i++){
+        bit[i] = Crc32cScalar(1U << i, zero, CRC32C_LANE);
+    }
+    for(k = 0; k < 4; k++){
+        for(n = 0; n < 256; n++){
+            for(c = 0, i = 0; i < 8; i++){
+                if(n & (1 << i)){
+                    c ^= bit[k * 8 + i];
+                }
+            }
+            lane_shift[k][n] = c;
+        }
+    }
+
+    __builtin_cpu_init();
+    if(crc_level == CRC32C_AUTO){
+        crc_level = __builtin_cpu_supports("sse4.2") ? CRC32C_SSE42 : CRC32C_SCALAR;
+    }
+    crc_update = crc_level == CRC32C_SSE42 ? Crc32cSse42 : Crc32cScalar;
+}
+
+__u32 Crc32c(__u32 crc, const void *data, size_t len)
+{
+    pthread_once(&crc_once, Crc32cInit);
+    return crc_update(crc, data, len);
+}
+
+//驱动给帧的校验值：以~sequence为初值，sequence为0时即标准CRC32C
+__u32 Crc32cFrame(__u32 sequence, const void *data, size_t len)
+{
+    return ~Crc32c(~sequence, data, len);
+}
+
+//选择实现，返回实际使用的级别；CPU不支持时返回-1且不修改
+Crc32cLevel Crc32cSetLevel(Crc32cLevel level)
+{
+    pthread_once(&crc_once, Crc32cInit);
+    if(level == CRC32C_AUTO){
+        level = __builtin_cpu_supports("sse4.2") ? CRC32C_SSE42 : CRC32C_SCALAR;
+    }
+    if(level == CRC32C_SSE42 && !__builtin_cpu_supports("sse4.2")){
+        return (Crc32cLevel)-1;
+    }
+    crc_level = level;
+    crc_update = level == CRC32C_SSE42 ? Crc32cSse42 : Crc32cScalar;
+    return crc_level;
+}
+
+const char *Crc32cLevelName(Crc32cLevel level)
+{
+    switch(level){
+    case CRC32C_SCALAR:
+        return "scalar";
+    case CRC32C_SSE42:
+        return "sse4.2";
+    default:
+        return "auto";
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+CRC32C(Castagnoli)
+Crc32c与内核crc32c()相同，只做更新，不做首尾取反；标准CRC32C为~Crc32c(~0, data, len)
+驱动V4L2_CID_VIRTUAL_VIDEO_CHECKSUM打开时给每帧的校验值即Crc32cFrame(sequence, ...)
+SSE4.2实现3路交错计算后按字节数移位合并，单核可达内存带宽；不支持时用slicing-by-8查表
+*/
+
+typedef enum
+{
+    CRC32C_SCALAR = 0,
+    CRC32C_SSE42,
+    CRC32C_AUTO,
+} Crc32cLevel;
+
+__u32 Crc32c(__u32 crc, const void *data, size_t len);
+__u32 Crc32cFrame(__u32 sequence, const void *data, size_t len);
+
+Crc32cLevel Crc32cSetLevel(Crc32cLevel level);
+const char *Crc32cLevelName(Crc32cLevel level);
+
+#endif    /* _CRC32C_H_ */
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <linux/videodev2.h>
+#include "debayer.h"
+
+#define DEBAYER_MAX_THREADS 64
+#define DEBAYER_PAD         32    /*行缓冲前后留白，放镜像像素*/
+
+typedef struct
+{
+    void (*unpack16)(const __u8 *s, __u8 *d, int w);
+    void (*unpack10p)(const __u8 *s, __u8 *d, int w);
+    //up/cur/dn为上中下三行8位样本，下标-1和w可读；odd为奇数行(GBGB)，rgb为输出RGB32
+    void (*row)(const __u8 *up, const __u8 *cur, const __u8 *dn, __u8 *d, int w, int odd, int edge, int rgb);
+} DebayerKernels;
+
+/*==================== 标量参考实现 ====================*/
+
+static inline int avg2(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+//10位样本取高8位，超出10位的值饱和到255
+static void unpack16_c(const __u8 *s, __u8 *d, int w)
+{
+    int x, v;
+
+    for(x=0; x<w; x++){
+        v = (s[2*x] | (s[2*x+1] << 8)) >> 2;
+        d[x] = v > 255 ? 255 : v;
+    }
+}
+
+//每5字节: 4个像素的高8位，然后是4个像素的低2位
+static void unpack10p_c(const __u8 *s, __u8 *d, int w)
+{
+    int x;
+
+    for(x=0; x<w; x++){
+        d[x] = s[x / 4 * 5 + (x & 3)];
+    }
+}
+
+static void row_c(const __u8 *up, const __u8 *cur, const __u8 *dn, __u8 *d, int w, int odd, int edge, int rgb)
+{
+    int x, h, v, cross, diag, dh, dv, r, g, b;
+
+    for(x=0; x<w; x++){
+        h = avg2(cur[x-1], cur[x+1]);
+        v = avg2(up[x], dn[x]);
+        cross = avg2(h, v);
+        if(edge){
+            dh = abs(cur[x-1] - cur[x+1]);
+            dv = abs(up[x] - dn[x]);
+            cross = dh < dv ? h : (dv < dh ? v : cross);
+        }
+        diag = avg2(avg2(up[x-1], up[x+1]), avg2(dn[x-1], dn[x+1]));
+
+        if(!odd){
+            if(!(x & 1)){    /*R*/
+                r = cur[x];  g = cross;  b = diag;
+            } else {         /*G，左右为R*/
+                r = h;       g = cur[x]; b = v;
+            }
+        } else {
+            if(!(x & 1)){    /*G，左右为B*/
+                r = v;       g = cur[x]; b = h;
+            } else {         /*B*/
+                r = diag;    g = cross;  b = cur[x];
+            }
+        }
+
+        if(rgb){
+            d[0] = 0xff; d[1] = r; d[2] = g; d[3] = b;
+        } else {
+            d[0] = b; d[1] = g; d[2] = r; d[3] = 0xff;
+        }
+        d += 4;
+    }
+}
+
+static const DebayerKernels kernels_c = {
+    unpack16_c, unpack10p_c, row_c,
+};
+
+/*==================== SSE4.1 ====================*/
+
+#define SSE4 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE4 static void unpack16_sse4(const __u8 *s, __u8 *d, int w)
+{
+    __m128i a, b;
+    int x;
+
+    for(x=0; x+16<=w; x+=16){
+        a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(s + 2*x)), 2);
+        b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(s + 2*x + 16)), 2);
+        _mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16(a, b));
+    }
+    unpack16_c(s + 2*x, d + x, w - x);
+}
+
+//每次读16字节取3组共12个像素，写16字节，多写的4字节由下一次覆盖
+SSE4 static void unpack10p_sse4(const __u8 *s, __u8 *d, int w)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, -1, -1, -1, -1);
+    int x;
+
+    for(x=0; x+16<=w; x+=12){
+        _mm_storeu_si128((__m128i *)(d + x), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + x / 4 * 5)), shuf));
+    }
+    unpack10p_c(s + x / 4 * 5, d + x, w - x);
+}
+
+SSE4 static void row_sse4(const __u8 *up, const __u8 *cur, const __u8 *dn, __u8 *d, int w, int odd, int edge, int rgb)
+{
+    const __m128i odd_x = _mm_set1_epi16((short)0xff00);
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    __m128i s, l, r, u, dd, h, v, cross, diag, dh, dv, mn, eq, R, G, B, c0, c1, c2, c3, lo, hi;
+    int x;
+
+    for(x=0; x+16<=w; x+=16){
+        s  = _mm_loadu_si128((const __m128i *)(cur + x));
+        l  = _mm_loadu_si128((const __m128i *)(cur + x - 1));
+        r  = _mm_loadu_si128((const __m128i *)(cur + x + 1));
+        u  = _mm_loadu_si128((const __m128i *)(up + x));
+        dd = _mm_loadu_si128((const __m128i *)(dn + x));
+
+        h = _mm_avg_epu8(l, r);
+        v = _mm_avg_epu8(u, dd);
+        cross = _mm_avg_epu8(h, v);
+        if(edge){
+            dh = _mm_or_si128(_mm_subs_epu8(l, r), _mm_subs_epu8(r, l));
+            dv = _mm_or_si128(_mm_subs_epu8(u, dd), _mm_subs_epu8(dd, u));
+            mn = _mm_min_epu8(dh, dv);
+            eq = _mm_cmpeq_epi8(dh, dv);
+            cross = _mm_blendv_epi8(cross, h, _mm_andnot_si128(eq, _mm_cmpeq_epi8(mn, dh)));
+            cross = _mm_blendv_epi8(cross, v, _mm_andnot_si128(eq, _mm_cmpeq_epi8(mn, dv)));
+        }
+        diag = _mm_avg_epu8(_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up + x - 1)),
+                                         _mm_loadu_si128((const __m128i *)(up + x + 1))),
+                            _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(dn + x - 1)),
+                                         _mm_loadu_si128((const __m128i *)(dn + x + 1))));
+
+        if(!odd){
+            R = _mm_blendv_epi8(s, h, odd_x);
+            G = _mm_blendv_epi8(cross, s, odd_x);
+            B = _mm_blendv_epi8(diag, v, odd_x);
+        } else {
+            R = _mm_blendv_epi8(v, diag, odd_x);
+            G = _mm_blendv_epi8(s, cross, odd_x);
+            B = _mm_blendv_epi8(h, s, odd_x);
+        }
+
+        if(rgb){
+            c0 = alpha; c1 = R; c2 = G; c3 = B;
+        } else {
+            c0 = B; c1 = G; c2 = R; c3 = alpha;
+        }
+        lo = _mm_unpacklo_epi8(c0, c1);
+        hi = _mm_unpacklo_epi8(c2, c3);
+        _mm_storeu_si128((__m128i *)(d + 4*x),      _mm_unpacklo_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(d + 4*x + 16), _mm_unpackhi_epi16(lo, hi));
+        lo = _mm_unpackhi_epi8(c0, c1);
+        hi = _mm_unpackhi_epi8(c2, c3);
+        _mm_storeu_si128((__m128i *)(d + 4*x + 32), _mm_unpacklo_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(d + 4*x + 48), _mm_unpackhi_epi16(lo, hi));
+    }
+    row_c(up + x, cur + x, dn + x, d + 4*x, w - x, odd, edge, rgb);
+}
+
+static const DebayerKernels kernels_sse4 = {
+    unpack16_sse4, unpack10p_sse4, row_sse4,
+};
+
+/*==================== AVX2 ====================*/
+
+AVX2 static void unpack16_avx2(const __u8 *s, __u8 *d, int w)
+{
+    __m256i a, b;
+    int x;
+
+    for(x=0; x+32<=w; x+=32){
+        a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(s + 2*x)), 2);
+        b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(s + 2*x + 32)), 2);
+        //packus按128位通道交错，重排回顺序
+        _mm256_storeu_si256((__m256i *)(d + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    unpack16_sse4(s + 2*x, d + x, w - x);
+}
+
+AVX2 static void row_avx2(const __u8 *up, const __u8 *cur, const __u8 *dn, __u8 *d, int w, int odd, int edge, int rgb)
+{
+    const __m256i odd_x = _mm256_set1_epi16((short)0xff00);
+    const __m256i alpha = _mm256_set1_epi8((char)0xff);
+    __m256i s, l, r, u, dd, h, v, cross, diag, dh, dv, mn, eq, R, G, B, c0, c1, c2, c3, lo, hi, q0, q1, q2, q3;
+    int x;
+
+    for(x=0; x+32<=w; x+=32){
+        s  = _mm256_loadu_si256((const __m256i *)(cur + x));
+        l  = _mm256_loadu_si256((const __m256i *)(cur + x - 1));
+        r  = _mm256_loadu_si256((const __m256i *)(cur + x + 1));
+        u  = _mm256_loadu_si256((const __m256i *)(up + x));
+        dd = _mm256_loadu_si256((const __m256i *)(dn + x));
+
+        h = _mm256_avg_epu8(l, r);
+        v = _mm256_avg_epu8(u, dd);
+        cross = _mm256_avg_epu8(h, v);
+        if(edge){
+            dh = _mm256_or_si256(_mm256_subs_epu8(l, r), _mm256_subs_epu8(r, l));
+            dv = _mm256_or_si256(_mm256_subs_epu8(u, dd), _mm256_subs_epu8(dd, u));
+            mn = _mm256_min_epu8(dh, dv);
+            eq = _mm256_cmpeq_epi8(dh, dv);
+            cross = _mm256_blendv_epi8(cross, h, _mm256_andnot_si256(eq, _mm256_cmpeq_epi8(mn, dh)));
+            cross = _mm256_blendv_epi8(cross, v, _mm256_andnot_si256(eq, _mm256_cmpeq_epi8(mn, dv)));
+        }
+        diag = _mm256_avg_epu8(_mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(up + x - 1)),
+                                               _mm256_loadu_si256((const __m256i *)(up + x + 1))),
+                               _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(dn + x - 1)),
+                                               _mm256_loadu_si256((const __m256i *)(dn + x + 1))));
+
+        if(!odd){
+            R = _mm256_blendv_epi8(s, h, odd_x);
+            G = _mm256_blendv_epi8(cross, s, odd_x);
+            B = _mm256_blendv_epi8(diag, v, odd_x);
+        } else {
+            R = _mm256_blendv_epi8(v, diag, odd_x);
+            G = _mm256_blendv_epi8(s, cross, odd_x);
+            B = _mm256_blendv_epi8(h, s, odd_x);
+        }
+
+        if(rgb){
+            c0 = alpha; c1 = R; c2 = G; c3 = B;
+        } else {
+            c0 = B; c1 = G; c2 = R; c3 = alpha;
+        }
+        //通道内交错后q0..q3依次为像素0-3/16-19、4-7/20-23、8-11/24-27、12-15/28-31
+        lo = _mm256_unpacklo_epi8(c0, c1);
+        hi = _mm256_unpacklo_epi8(c2, c3);
+        q0 = _mm256_unpacklo_epi16(lo, hi);
+        q1 = _mm256_unpackhi_epi16(lo, hi);
+        lo = _mm256_unpackhi_epi8(c0, c1);
+        hi = _mm256_unpackhi_epi8(c2, c3);
+        q2 = _mm256_unpacklo_epi16(lo, hi);
+        q3 = _mm256_unpackhi_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *)(d + 4*x),      _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256((__m256i *)(d + 4*x + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256((__m256i *)(d + 4*x + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256((__m256i *)(d + 4*x + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+    row_sse4(up + x, cur + x, dn + x, d + 4*x, w - x, odd, edge, rgb);
+}
+
+//RAW10解包为字节重排，AVX2下沿用SSE4.1实现
+static const DebayerKernels kernels_avx2 = {
+    unpack16_avx2, unpack10p_sse4, row_avx2,
+};
+
+/*==================== 调度 ====================*/
+
+static const DebayerKernels *kernels;
+static ConvLevel debayer_level = CONV_AUTO;
+
+static const DebayerKernels *DebayerKernelsFor(ConvLevel level)
+{
+    if(level == CONV_AUTO){
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")){
+            level = CONV_AVX2;
+        } else if(__builtin_cpu_supports("sse4.1")){
+            level = CONV_SSE4;
+        } else {
+            level = CONV_SCALAR;
+        }
+    }
+    debayer_level = level;
+    switch(level){
+    case CONV_AVX2:
+        return &kernels_avx2;
+    case CONV_SSE4:
+        return &kernels_sse4;
+    default:
+        return &kernels_c;
+    }
+}
+
+//选择实现，返回实际使用的级别；CPU不支持时返回-1且不修改
+ConvLevel DebayerSetLevel(ConvLevel level)
+{
+    __builtin_cpu_init();
+    if((level == CONV_AVX2 && !__builtin_cpu_supports("avx2")) ||
+       (level == CONV_SSE4 && !__builtin_cpu_supports("sse4.1"))){
+        return (ConvLevel)-1;
+    }
+    kernels = DebayerKernelsFor(level);
+    return debayer_level;
+}
+
+DebayerMethod DebayerMethodByName(const char *name)
+{
+    if(strcmp(name, "bilinear") == 0){
+        return DEBAYER_BILINEAR;
+    }
+    if(strcmp(name, "edge") == 0){
+        return DEBAYER_EDGE;
+    }
+    return (DebayerMethod)-1;
+}
+
+int DebayerIsBayer(__u32 fourcc)
+{
+    return fourcc == V4L2_PIX_FMT_SRGGB8 || fourcc == V4L2_PIX_FMT_SRGGB10 || fourcc == V4L2_PIX_FMT_SRGGB10P;
+}
+
+typedef struct
+{
+    const ConvImage *src;
+    ConvImage *dst;
+    int edge;
+    __u32 y_start, y_end;
+    __u8 *tmp;               /*3个带留白的行缓冲*/
+} DebayerBand;
+
+#define ROW(img, y) ((img)->plane[0] + (size_t)(y) * (img)->stride[0])
+
+/*
+取第y行的8位样本，越界行按边缘镜像(-1取1，height取height-2)，
+镜像不改变行列奇偶，即不改变颜色；3个缓冲按y%3轮换，已解包的行不重复解包
+*/
+static const __u8 *DebayerLoadRow(const DebayerKernels *kn, const DebayerBand *band, __u32 *loaded, int y)
+{
+    const ConvImage *src = band->src;
+    int w = src->width, h = src->height;
+    __u8 *row;
+
+    if(y < 0){
+        y = -y;
+    } else if(y >= h){
+        y = 2 * (h - 1) - y;
+    }
+
+    row = band->tmp + (size_t)(y % 3) * (w + 2 * DEBAYER_PAD) + DEBAYER_PAD;
+    if(loaded[y % 3] == (__u32)y){
+        return row;
+    }
+    switch(src->fourcc){
+    case V4L2_PIX_FMT_SRGGB10:
+        kn->unpack16(ROW(src, y), row, w);
+        break;
+    case V4L2_PIX_FMT_SRGGB10P:
+        kn->unpack10p(ROW(src, y), row, w);
+        break;
+    default:
+        memcpy(row, ROW(src, y), w);
+        break;
+    }
+    row[-1] = row[1];
+    row[w]  = row[w - 2];
+    loaded[y % 3] = y;
+    return row;
+}
+
+static void *DebayerBandThread(void *arg)
+{
+    DebayerBand *band = (DebayerBand *)arg;
+    const DebayerKernels *kn = kernels;
+    ConvImage *dst = band->dst;
+    __u32 loaded[3] = { ~0U, ~0U, ~0U };
+    const __u8 *up, *cur, *dn;
+    __u32 y;
+
+    for(y=band->y_start; y<band->y_end; y++){
+        up  = DebayerLoadRow(kn, band, loaded, (int)y - 1);
+        cur = DebayerLoadRow(kn, band, loaded, y);
+        dn  = DebayerLoadRow(kn, band, loaded, y + 1);
+        kn->row(up, cur, dn, ROW(dst, y), dst->width, y & 1, band->edge, dst->fourcc == V4L2_PIX_FMT_RGB32);
+    }
+    return NULL;
+}
+
+//src为拜耳格式，dst为RGB32/BGR32且尺寸相同，threads>1时按行带并行
+int Debayer(const ConvImage *src, ConvImage *dst, DebayerMethod method, int threads, const pthread_attr_t *attr)
+{
+    DebayerBand band[DEBAYER_MAX_THREADS];
+    pthread_t tid[DEBAYER_MAX_THREADS];
+    size_t row_size = src->width + 2 * DEBAYER_PAD;
+    __u32 rows, y;
+    __u8 *tmp;
+    int i, n;
+
+    if(!DebayerIsBayer(src->fourcc) || (dst->fourcc != V4L2_PIX_FMT_RGB32 && dst->fourcc != V4L2_PIX_FMT_BGR32) ||
+       src->width != dst->width || src->height != dst->height || !src->plane[0] || !dst->plane[0]){
+        return -1;
+    }
+    if(!kernels){
+        kernels = DebayerKernelsFor(debayer_level);
+    }
+
+    if(threads < 1){
+        threads = 1;
+    }
+    if(threads > DEBAYER_MAX_THREADS){
+        threads = DEBAYER_MAX_THREADS;
+    }
+    rows = (src->height + threads - 1) / threads;
+
+    tmp = malloc((size_t)threads * 3 * row_size);
+    if(!tmp){
+        printf("Unable to malloc debayer buffer:%s\n", strerror(errno));
+        return -1;
+    }
+
+    n = 0;
+    for(y=0; y<src->height; y+=rows){
+        band[n].src     = src;
+        band[n].dst     = dst;
+        band[n].edge    = method == DEBAYER_EDGE;
+        band[n].y_start = y;
+        band[n].y_end   = y + rows > src->height ? src->height : y + rows;
+        band[n].tmp     = tmp + (size_t)n * 3 * row_size;
+        n++;
+    }
+
+    if(n == 1){
+        DebayerBandThread(&band[0]);
+    } else {
+        for(i=0; i<n; i++){
+            if(pthread_create(&tid[i], attr, DebayerBandThread, &band[i]) != 0){
+                DebayerBandThread(&band[i]);
+                tid[i] = 0;
+            }
+        }
+        for(i=0; i<n; i++){
+            if(tid[i]){
+                pthread_join(tid[i], NULL);
+            }
+        }
+    }
+
+    free(tmp);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _DEBAYER_H_
+#define _DEBAYER_H_
+
+#include "convert.h"
+
+/*
+RGGB拜耳阵列去马赛克
+输入V4L2_PIX_FMT_SRGGB8、SRGGB10(16位小端，低10位有效)、SRGGB10P(MIPI RAW10，4像素5字节)，
+输出RGB32或BGR32，可直接交给GenBmpFile；10位样本取高8位后插值
+DEBAYER_BILINEAR: 双线性，缺失分量取同色邻点的均值
+DEBAYER_EDGE:     R/B位置的G沿梯度较小的方向(水平或垂直)插值，其余同双线性，减少边缘的拉链效应
+两两均值按(a+b+1)>>1逐级计算，标量、SSE4.1和AVX2实现结果逐字节一致
+*/
+
+typedef enum
+{
+    DEBAYER_BILINEAR = 0,
+    DEBAYER_EDGE,
+} DebayerMethod;
+
+int DebayerIsBayer(__u32 fourcc);
+int Debayer(const ConvImage *src, ConvImage *dst, DebayerMethod method, int threads, const pthread_attr_t *attr);
+
+ConvLevel DebayerSetLevel(ConvLevel level);
+DebayerMethod DebayerMethodByName(const char *name);
+
+#endif    /* _DEBAYER_H_ */
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "bitmap.h"
+#include "record.h"
+#include "convert.h"
+
+/*
+从录制容器中取出帧保存为BMP
+用法: extract.elf <prefix>              列出索引
+      extract.elf <prefix> <seq> [out]  按sequence取出一帧
+      extract.elf <prefix> all [dir]    取出全部帧
+YUV录制按BT.601转换为BGR32后保存
+*/
+
+static int ExtractOne(const RecReader *rd, __u8 *pData, __u8 *pRgb, __u32 index, const char *filename)
+{
+    ConvImage src, dst;
+
+    if(RecReadFrame(rd, index, pData) != 0){
+        return -1;
+    }
+    if(pRgb){
+        ConvImageInit(&src, rd->hdr.pixelformat, rd->hdr.width, rd->hdr.height, pData);
+        ConvImageInit(&dst, V4L2_PIX_FMT_BGR32, rd->hdr.width, rd->hdr.height, pRgb);
+        Convert(&src, &dst, CONV_BT601, 1, NULL);
+        pData = pRgb;
+    }
+    return GenBmpFile(pData, 32, rd->hdr.width, rd->hdr.height, filename);
+}
+
+int main(int argc, char *argv[])
+{
+    RecReader rd;
+    __u8 *pData;
+    __u8 *pRgb = NULL;
+    char name[300];
+    int index;
+    __u32 i;
+    int retval = 0;
+
+    if(argc < 2){
+        printf("usage: %s <prefix> [seq|all] [output]\n", argv[0]);
+        return -1;
+    }
+
+    if(RecLoad(&rd, argv[1]) != 0){
+        return -2;
+    }
+    printf("%dx%d %c%c%c%c bytesperline=%d frames=%d\n", rd.hdr.width, rd.hdr.height,
+            (rd.hdr.pixelformat >> 0) & 0xFF, (rd.hdr.pixelformat >> 8) & 0xFF,
+            (rd.hdr.pixelformat >> 16) & 0xFF, (rd.hdr.pixelformat >> 24) & 0xFF,
+            rd.hdr.bytesperline, rd.count);
+
+    if(argc == 2){
+        for(i=0; i<rd.count; i++){
+            printf("%6d seq=%-8d seg=%-4d offset=%-12llu ts=%llu\n", i, rd.entries[i].sequence, rd.entries[i].segment,
+                    (unsigned long long)rd.entries[i].offset, (unsigned long long)rd.entries[i].timestamp);
+        }
+        RecUnload(&rd);
+        return 0;
+    }
+
+    if(ConvImageSize(rd.hdr.pixelformat, rd.hdr.width, rd.hdr.height) == 0){
+        printf("recordings of this format can not be saved as bmp\n");
+        RecUnload(&rd);
+        return -3;
+    }
+
+    pData = malloc(rd.hdr.frame_size);
+    if(rd.hdr.pixelformat != V4L2_PIX_FMT_RGB32 && rd.hdr.pixelformat != V4L2_PIX_FMT_BGR32){
+        pRgb = malloc(rd.hdr.width * rd.hdr.height * 4);
+    }
+    if(!pData || (!pRgb && rd.hdr.pixelformat != V4L2_PIX_FMT_RGB32 && rd.hdr.pixelformat != V4L2_PIX_FMT_BGR32)){
+        printf("out of memory!\n");
+        RecUnload(&rd);
+        return -4;
+    }
+
+    if(strcmp(argv[2], "all") == 0){
+        for(i=0; i<rd.count && retval == 0; i++){
+            snprintf(name, sizeof(name), "%s/image%d.bmp", argc > 3 ? argv[3] : ".", rd.entries[i].sequence);
+            retval = ExtractOne(&rd, pData, pRgb, i, name);
+        }
+    } else {
+        index = RecFind(&rd, strtoul(argv[2], NULL, 0));
+        if(index < 0){
+            printf("sequence %s not found\n", argv[2]);
+            retval = -5;
+        } else {
+            snprintf(name, sizeof(name), "%s", argc > 3 ? argv[3] : "image.bmp");
+            retval = ExtractOne(&rd, pData, pRgb, index, name);
+        }
+    }
+
+    free(pRgb);
+    free(pData);
+    RecUnload(&rd);
+    return retval;
+}
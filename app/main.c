@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -9,8 +10,19 @@
 #include <sys/ioctl.h>
 #include <linux/videodev2.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
 #include <time.h>
 #include "bitmap.h"
+#include "record.h"
+#include "convert.h"
+#include "debayer.h"
+#include "rt.h"
+#include "shmring.h"
+#include "pipeout.h"
+#include "crc32c.h"
+#include "probe.h"
+#include "virtual_video.h"
 
 #define FILE_VIDEO  "/dev/video0"
 #define IMAGE_WIDTH  800
@@ -30,9 +42,228 @@ struct v4l2_buffer buf;
 struct buffer *buffers;
 int frame_num = 4;
 
-int main(int argc, char argv[])
+//分片模式统计：每帧第一个分片事件先于整帧出队的时间
+//按缓冲区序号记录，应用落后于驱动时后面几帧的分片事件不会覆盖待出队的帧
+typedef struct
 {
+    __u32 sequence[VIDEO_MAX_FRAME];
+    double first[VIDEO_MAX_FRAME];
+    double lead;
+    unsigned int frames;
+} SliceStat;
+
+//校验模式：驱动随每个完成的缓冲区发一个校验事件，按缓冲区序号记下最近一次的结果
+typedef struct
+{
+    __u32 sequence;
+    __u32 crc;
+    int valid;
+} FrameSum;
+
+static FrameSum frame_sum[VIDEO_MAX_FRAME];
+
+#define HUGE_ALIGN   (2UL << 20)
+#define PAGE_ALIGN(x) (((x) + 4095UL) & ~4095UL)
+
+//缓冲区的I/O方式，read时没有v4l2_buffer，只用一个缓冲区
+typedef enum
+{
+    IO_MMAP = 0,
+    IO_USERPTR,
+    IO_READ,
+} IoMode;
+
+static const char *io_name[] = { "mmap", "userptr", "read" };
+
+static __u64 MonotonicNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//把缓冲区重新入队
+static int QueueBuffer(IoMode io, __u32 index)
+{
+    struct v4l2_buffer qbuf;
+
+    memset(&qbuf, 0, sizeof(qbuf));
+    qbuf.index = index;
+    qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    qbuf.memory = io == IO_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    if(io == IO_USERPTR){
+        qbuf.m.userptr = (unsigned long)buffers[index].start;
+        qbuf.length    = buffers[index].length;
+    }
+    return ioctl(fd, VIDIOC_QBUF, &qbuf);
+}
+
+//本线程占用的CPU时间，不含阻塞等待
+static __u64 ThreadCpuNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double MonotonicSec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//记下校验事件，其他事件不处理
+static void TakeEvent(const struct v4l2_event *ev)
+{
+    const struct virtual_video_checksum_event *sum = (const struct virtual_video_checksum_event *)ev->u.data;
+
+    if(ev->type == V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM && sum->index < VIDEO_MAX_FRAME){
+        frame_sum[sum->index].sequence = sum->sequence;
+        frame_sum[sum->index].crc      = sum->crc;
+        frame_sum[sum->index].valid    = 1;
+    }
+}
+
+//取出已到达的全部事件，没有事件时DQEVENT会阻塞，先用poll确认
+static void DrainEvents(void)
+{
+    struct pollfd pfd;
+    struct v4l2_event ev;
+
+    pfd.fd = fd;
+    pfd.events = POLLPRI;
+    if(poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI)){
+        return;
+    }
+    do {
+        memset(&ev, 0, sizeof(ev));
+        if(ioctl(fd, VIDIOC_DQEVENT, &ev) == -1){
+            break;
+        }
+        TakeEvent(&ev);
+    } while(ev.pending);
+}
+
+//等待一帧可出队，期间取出分片事件，记下每帧第一个分片的时间
+static int WaitSlices(SliceStat *st)
+{
+    struct pollfd pfd;
+    struct v4l2_event ev;
+    struct virtual_video_slice_event *slice = (struct virtual_video_slice_event *)ev.u.data;
     int retval;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLPRI;
+    for(;;){
+        retval = poll(&pfd, 1, 2000);
+        if(retval <= 0){
+            printf("poll error:%s\n", retval == 0 ? "timeout" : strerror(errno));
+            return -1;
+        }
+        if(pfd.revents & POLLPRI){
+            do {
+                memset(&ev, 0, sizeof(ev));
+                if(ioctl(fd, VIDIOC_DQEVENT, &ev) == -1){
+                    break;
+                }
+                if(ev.type == V4L2_EVENT_VIRTUAL_VIDEO_SLICE && slice->index < VIDEO_MAX_FRAME &&
+                   slice->sequence != st->sequence[slice->index]){
+                    //此时前lines_ready行已可处理
+                    st->sequence[slice->index] = slice->sequence;
+                    st->first[slice->index] = ev.timestamp.tv_sec + ev.timestamp.tv_nsec * 1e-9;
+                }
+                TakeEvent(&ev);
+            } while(ev.pending);
+        }
+        if(pfd.revents & (POLLIN | POLLERR)){
+            return 0;
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-d device] [-i mmap|userptr|read] [-f fourcc [-b bilinear|edge]] [-g WxH] [-n frames] [-q] [-j threads] [-S] [-o] [-R cpus [-w cpus] [-p prio]] [-P socket [-k slots]] [-O file|- [-W]] [-V] [-r prefix [-s segment_MiB] [-c fourcc [-m 601|709]]]\n", prog);
+    printf("  -d device   capture node (default " FILE_VIDEO "), driver streams=N adds more\n");
+    printf("  -i io       mmap (default) driver buffers, userptr our own page aligned buffers filled in place,\n");
+    printf("              or read() copying every frame; the capture cost per frame is printed at the end\n");
+    printf("  -f fourcc   capture format BGR32 (default), RGB32, SRGGB8, SRGGB10 or SRGGB10P\n");
+    printf("  -b method   demosaic of bayer frames before saving, bilinear (default) or edge\n");
+    printf("  -g WxH      frame size (default %dx%d)\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+    printf("  -n frames   number of frames to capture (default %d)\n", FRAME_NUM);
+    printf("  -q          save ./img/*.qoi (lossless compressed) instead of bmp\n");
+    printf("  -j threads  qoi encoder / pixel conversion threads\n");
+    printf("  -r prefix   record frames to <prefix>.NNNN.raw/<prefix>.idx instead of ./img/*.bmp\n");
+    printf("  -s MiB      record segment size (default %llu)\n", REC_DEF_SEG_SIZE >> 20);
+    printf("  -c fourcc   convert recorded frames to RGB32|BGR32|YUYV|NV12|I420, bayer frames only to RGB32|BGR32\n");
+    printf("  -m matrix   YUV matrix for -c, 601 (default) or 709\n");
+    printf("  -o          burn device/sequence/time/fps overlay into the frames\n");
+    printf("  -S          follow slice events (driver slices=N), report how early the first rows were ready\n");
+    printf("  -R cpus     realtime: pin the capture thread to cpus (e.g. 2 or 2,4-5), mlockall, prefault the buffers\n");
+    printf("              and print latency histograms, frame timestamp to DQBUF wakeup and wakeup to processing done\n");
+    printf("  -w cpus     pin -j worker threads to cpus (default the -R cpus)\n");
+    printf("  -p prio     SCHED_FIFO priority 1-99 for the capture and worker threads\n");
+    printf("  -P socket   publish frames to a shared memory ring for subscribe.elf readers instead of ./img/*.bmp\n");
+    printf("  -k slots    ring slots (default %d)\n", RING_DEF_SLOTS);
+    printf("  -O file     write raw frames to a pipe, FIFO or file instead of ./img/*.bmp, - for stdout (messages go to stderr);\n");
+    printf("              on a pipe the buffer pages are vmspliced and a buffer is requeued once the reader has taken them\n");
+    printf("  -W          plain write() for -O, for comparison\n");
+    printf("  -V          turn on the driver frame checksum and verify every frame, count mismatched, stale and dropped\n");
+    printf("              frames; without -r/-P/-O nothing is saved, mmap and userptr only\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int retval;
+    int opt;
+    int exit_code = 0;
+    unsigned int frames = FRAME_NUM;
+    unsigned int count;
+    const char *rec_prefix = NULL;
+    unsigned long long seg_size = 0;
+    int qoi = 0;
+    int threads = 1;
+    __u32 conv_fourcc = 0;
+    ConvMatrix conv_matrix = CONV_BT601;
+    ConvImage conv_src, conv_dst;
+    __u8 *conv_buf = NULL;
+    __u32 pixelformat = V4L2_PIX_FMT_BGR32;
+    DebayerMethod method = DEBAYER_BILINEAR;
+    ConvImage bayer_src, bayer_dst;
+    __u8 *rgb_buf = NULL;
+    const void *frame;
+    Recorder rec;
+    int slice_mode = 0;
+    int overlay = 0;
+    const char *dev_name = FILE_VIDEO;
+    unsigned int width = IMAGE_WIDTH, height = IMAGE_HEIGHT;
+    struct v4l2_control ctrl;
+    SliceStat slice_stat = { .frames = 0 };
+    struct v4l2_event_subscription sub;
+    const char *rt_cpus = NULL, *worker_cpus = NULL;
+    int rt_prio = 0;
+    cpu_set_t cpus;
+    LatHist *wake_hist = NULL, *proc_hist = NULL;
+    __u64 wake;
+    const char *ring_path = NULL;
+    __u32 ring_slots = RING_DEF_SLOTS;
+    RingPub ring;
+    IoMode io = IO_MMAP;
+    const char *pipe_target = NULL;
+    int pipe_write = 0, out_fd = -1;
+    unsigned int queued = 0;
+    int index;
+    PipeOut pipe_out;
+    double pipe_start = 0;
+    __u64 io_ns = 0, cpu_start;
+    int verify = 0;
+    __u32 crc, last_seq = 0;
+    unsigned int crc_bad = 0, crc_stale = 0, crc_dropped = 0, crc_missing = 0;
+    __u64 verify_ns = 0, verify_bytes = 0, verify_start;
     
     struct v4l2_capability cap;
     
@@ -47,12 +278,165 @@ int main(int argc, char argv[])
 
     char name[22];
 
+    while((opt = getopt(argc, argv, "d:i:f:b:g:n:qj:r:s:c:m:SoR:w:p:P:k:O:WVh")) != -1){
+        switch(opt){
+        case 'd':
+            dev_name = optarg;
+            break;
+        case 'i':
+            for(io = IO_MMAP; io <= IO_READ && strcmp(optarg, io_name[io]) != 0; io++);
+            if(io > IO_READ){
+                printf("unknown io mode %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            pixelformat = ConvFourcc(optarg);
+            if(pixelformat != V4L2_PIX_FMT_RGB32 && pixelformat != V4L2_PIX_FMT_BGR32 && !DebayerIsBayer(pixelformat)){
+                printf("unsupported capture format %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'b':
+            method = DebayerMethodByName(optarg);
+            if((int)method < 0){
+                printf("unknown demosaic method %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'g':
+            if(sscanf(optarg, "%ux%u", &width, &height) != 2){
+                printf("bad frame size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            qoi = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            rec_prefix = optarg;
+            break;
+        case 's':
+            seg_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'c':
+            conv_fourcc = ConvFourcc(optarg);
+            if(!conv_fourcc){
+                printf("unsupported fourcc %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            conv_matrix = atoi(optarg) == 709 ? CONV_BT709 : CONV_BT601;
+            break;
+        case 'S':
+            slice_mode = 1;
+            break;
+        case 'o':
+            overlay = 1;
+            break;
+        case 'R':
+            rt_cpus = optarg;
+            break;
+        case 'w':
+            worker_cpus = optarg;
+            break;
+        case 'p':
+            rt_prio = atoi(optarg);
+            if(rt_prio < 1 || rt_prio > 99){
+                printf("bad SCHED_FIFO priority %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'P':
+            ring_path = optarg;
+            break;
+        case 'k':
+            ring_slots = strtoul(optarg, NULL, 0);
+            break;
+        case 'O':
+            pipe_target = optarg;
+            break;
+        case 'W':
+            pipe_write = 1;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    //read()不带帧号和校验值
+    if(verify && io == IO_READ){
+        printf("-V needs -i mmap or -i userptr\n");
+        return -1;
+    }
+
+    //帧写到stdout时，其余输出都改到stderr
+    if(pipe_target){
+        if(strcmp(pipe_target, "-") == 0){
+            out_fd = dup(STDOUT_FILENO);
+            if(out_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1){
+                printf("Unable to redirect stdout:%s\n", strerror(errno));
+                return -1;
+            }
+            setvbuf(stdout, NULL, _IOLBF, 0);
+        } else {
+            out_fd = open(pipe_target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(out_fd == -1){
+                printf("Error opening %s : %s\n", pipe_target, strerror(errno));
+                return -1;
+            }
+        }
+        //读端退出时以EPIPE结束，不被SIGPIPE杀掉
+        signal(SIGPIPE, SIG_IGN);
+    }
+
     printf("Hello Elmo.\n");
 
+    //实时模式：绑核、SCHED_FIFO、锁定内存，工作线程随后按RtWorkerAttr创建
+    if(rt_cpus){
+        if(RtParseCpus(rt_cpus, &cpus) != 0 || RtPinSelf(&cpus) != 0){
+            return -1;
+        }
+        if(worker_cpus && RtParseCpus(worker_cpus, &cpus) != 0){
+            return -1;
+        }
+        if(rt_prio && RtSetFifo(rt_prio) != 0){
+            printf("running without SCHED_FIFO\n");
+            rt_prio = 0;
+        }
+        if(RtSetWorkers(&cpus, rt_prio) != 0){
+            return -1;
+        }
+        if(RtLockMemory() != 0){
+            printf("running with pageable memory, raise RLIMIT_MEMLOCK (ulimit -l) or run as root\n");
+        }
+        wake_hist = malloc(sizeof(*wake_hist));
+        proc_hist = malloc(sizeof(*proc_hist));
+        if(!wake_hist || !proc_hist){
+            printf("Unable to alloc latency histograms\n");
+            return -1;
+        }
+        LatHistInit(wake_hist, "timestamp to DQBUF wakeup latency");
+        LatHistInit(proc_hist, "DQBUF wakeup to processing done latency");
+    } else if(worker_cpus || rt_prio){
+        printf("-w and -p require -R\n");
+    }
+
     //打开设备
-    fd = open(FILE_VIDEO, O_RDWR);
+    fd = open(dev_name, O_RDWR);
     if(fd == -1){
-        printf("Error opening video interface " FILE_VIDEO " : %s\n", strerror(errno));
+        printf("Error opening video interface %s : %s\n", dev_name, strerror(errno));
         return -1;
     }
 
@@ -60,7 +444,7 @@ int main(int argc, char argv[])
     memset(&cap, 0, sizeof(cap));
     retval = ioctl(fd, VIDIOC_QUERYCAP, &cap);
     if(retval == -1) {
-        printf("unable to query device "FILE_VIDEO" : %s.\n", strerror(errno));
+        printf("unable to query device %s : %s.\n", dev_name, strerror(errno));
         close(fd);
         return -2;
     } 
@@ -70,19 +454,19 @@ int main(int argc, char argv[])
     printf("version:\t%d\n",  cap.version);
     printf("capabilities:\t%x\n", cap.capabilities);
     if ((cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == V4L2_CAP_VIDEO_CAPTURE){
-        printf("Device %s: supports capture.\n",FILE_VIDEO);
+        printf("Device %s: supports capture.\n",dev_name);
     }
     if ((cap.capabilities & V4L2_CAP_STREAMING) == V4L2_CAP_STREAMING){
-        printf("Device %s: supports streaming.\n",FILE_VIDEO);
+        printf("Device %s: supports streaming.\n",dev_name);
     }
     if(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT){
-        printf("Device %s: support output\n", FILE_VIDEO);
+        printf("Device %s: support output\n", dev_name);
     }
     if(cap.capabilities & V4L2_CAP_VIDEO_OVERLAY){
-        printf("Device %s: support overlay\n", FILE_VIDEO);
+        printf("Device %s: support overlay\n", dev_name);
     }
     if(cap.capabilities & V4L2_CAP_READWRITE){
-        printf("Device %s: support read write\n", FILE_VIDEO);
+        printf("Device %s: support read write\n", dev_name);
     }
 
     //显示所有支持帧格式
@@ -111,9 +495,9 @@ int main(int argc, char argv[])
     memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     //fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB32;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR32;
-    fmt.fmt.pix.width  = IMAGE_WIDTH;
-    fmt.fmt.pix.height = IMAGE_HEIGHT;
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.width  = width;
+    fmt.fmt.pix.height = height;
     fmt.fmt.pix.field  = V4L2_FIELD_INTERLACED;
     retval = ioctl(fd, VIDIOC_S_FMT, &fmt);
     if(retval == -1){
@@ -140,6 +524,71 @@ int main(int argc, char argv[])
     printf("pix.width:\t\t%d\n",fmt.fmt.pix.width);
     printf("pix.field:\t\t%d\n",fmt.fmt.pix.field);
 
+    if(conv_fourcc && !rec_prefix){
+        printf("-c requires -r\n");
+        conv_fourcc = 0;
+    }
+    if(conv_fourcc && DebayerIsBayer(fmt.fmt.pix.pixelformat) &&
+       conv_fourcc != V4L2_PIX_FMT_RGB32 && conv_fourcc != V4L2_PIX_FMT_BGR32){
+        printf("bayer frames can only be converted to RGB32 or BGR32\n");
+        close(fd);
+        return -14;
+    }
+    if(!rec_prefix && !ring_path && DebayerIsBayer(fmt.fmt.pix.pixelformat)){
+        //bmp/qoi保存BGR32
+        rgb_buf = malloc(fmt.fmt.pix.width * fmt.fmt.pix.height * 4);
+        if(!rgb_buf || ConvImageInit(&bayer_dst, V4L2_PIX_FMT_BGR32, fmt.fmt.pix.width, fmt.fmt.pix.height, rgb_buf) != 0){
+            printf("Unable to set up demosaic\n");
+            close(fd);
+            return -14;
+        }
+    }
+    if(conv_fourcc){
+        //转换输出也直接以O_DIRECT写入，需页对齐
+        if(posix_memalign((void **)&conv_buf, 4096, ConvImageSize(conv_fourcc, fmt.fmt.pix.width, fmt.fmt.pix.height)) != 0 ||
+           ConvImageInit(&conv_dst, conv_fourcc, fmt.fmt.pix.width, fmt.fmt.pix.height, conv_buf) != 0){
+            printf("Unable to set up pixel conversion\n");
+            close(fd);
+            return -14;
+        }
+    }
+
+    if(rec_prefix){
+        if(conv_fourcc){
+            retval = RecOpen(&rec, rec_prefix, fmt.fmt.pix.width, fmt.fmt.pix.height, conv_fourcc, conv_dst.stride[0],
+                             ConvImageSize(conv_fourcc, fmt.fmt.pix.width, fmt.fmt.pix.height), seg_size);
+        } else {
+            retval = RecOpen(&rec, rec_prefix, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.pixelformat,
+                             fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage, seg_size);
+        }
+        if(retval != 0){
+            close(fd);
+            return -14;
+        }
+    }
+
+    //发布原始帧，订阅者按头部的格式自行处理
+    if(ring_path && RingCreate(&ring, ring_path, ring_slots, fmt.fmt.pix.width, fmt.fmt.pix.height,
+                               fmt.fmt.pix.pixelformat, fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage) != 0){
+        if(rec_prefix){
+            RecClose(&rec);
+        }
+        close(fd);
+        return -14;
+    }
+
+    //原始帧依次写出，没有文件头，格式见上面的打印
+    if(pipe_target && PipeOutOpen(&pipe_out, out_fd, pipe_write, fmt.fmt.pix.sizeimage) != 0){
+        if(ring_path){
+            RingDestroy(&ring);
+        }
+        if(rec_prefix){
+            RecClose(&rec);
+        }
+        close(fd);
+        return -14;
+    }
+
 #if 0    
     //设置帧速率
     memset(&stream_para, 0, sizeof(struct v4l2_streamparm));
@@ -163,11 +612,36 @@ int main(int argc, char argv[])
     printf("denominator:%d\n", stream_para.parm.capture.timeperframe.denominator);
 #endif    
 
+    //read()不需要申请帧缓冲，每次读出一整帧
+    if(io == IO_READ){
+        if(!(cap.capabilities & V4L2_CAP_READWRITE)){
+            printf("Device %s: no read() support\n", dev_name);
+            close(fd);
+            return -7;
+        }
+        if(slice_mode){
+            printf("-S requires mmap or userptr, slice events disabled\n");
+            slice_mode = 0;
+        }
+        frame_num = 1;
+        buffers = malloc(sizeof(*buffers));
+        if(!buffers || posix_memalign(&buffers[0].start, 4096, fmt.fmt.pix.sizeimage) != 0){
+            printf ("out of memory!\n");
+            close(fd);
+            return -8;
+        }
+        buffers[0].length = fmt.fmt.pix.sizeimage;
+        if(rt_cpus){
+            RtPrefault(buffers[0].start, buffers[0].length);
+        }
+        goto buffers_ready;
+    }
+
     //申请帧缓冲
     memset(&req, 0, sizeof(req));
     req.count  = FRAME_NUM;
     req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = io == IO_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
     retval = ioctl(fd, VIDIOC_REQBUFS, &req);    /*请求系统分配缓冲区*/
     if(retval == -1){
         printf("request for buffers error:%s\n", strerror(errno));
@@ -184,8 +658,26 @@ int main(int argc, char argv[])
         close(fd);
         return -8;
     }
+    // userptr：驱动直接写入我们的缓冲区，长度至少为页对齐的sizeimage；实时模式下在绑核后预取，页面分配在本地节点
+    for (n_buffers = 0; io == IO_USERPTR && n_buffers < frame_num; n_buffers++) {
+        buffers[n_buffers].length = PAGE_ALIGN(fmt.fmt.pix.sizeimage);
+        if(posix_memalign(&buffers[n_buffers].start, buffers[n_buffers].length >= HUGE_ALIGN ? HUGE_ALIGN : 4096,
+                          buffers[n_buffers].length) != 0){
+            printf("out of memory!\n");
+            while(n_buffers--){
+                free(buffers[n_buffers].start);
+            }
+            free(buffers);
+            close(fd);
+            return -8;
+        }
+        if(rt_cpus){
+            RtPrefault(buffers[n_buffers].start, buffers[n_buffers].length);
+        }
+    }
+
     // 进行内存映射
-    for (n_buffers = 0; n_buffers < frame_num; n_buffers++) {
+    for (n_buffers = 0; io == IO_MMAP && n_buffers < frame_num; n_buffers++) {
         printf("query buffer %d\n", n_buffers);
         memset(&buf, 0, sizeof(buf));
         buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -199,22 +691,21 @@ int main(int argc, char argv[])
             return -9;
         }
         buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL,buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
         if (buffers[n_buffers].start == MAP_FAILED){
             printf("buffer map error:%s\n", strerror(errno));
             free(buffers);
             close(fd);
             return -10;
         }
+        if(rt_cpus){
+            RtPrefault(buffers[n_buffers].start, buf.length);
+        }
     }
 
     //入队
     for (n_buffers = 0; n_buffers < frame_num; n_buffers++){
-        memset(&buf, 0, sizeof(buf));
-        buf.index = n_buffers;
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        retval = ioctl(fd, VIDIOC_QBUF, &buf);
+        retval = QueueBuffer(io, n_buffers);
         if(retval == -1){
             printf("QBUF error:%s\n", strerror(errno));
             free(buffers);
@@ -222,11 +713,54 @@ int main(int argc, char argv[])
             return -10;
         }
     }
+    queued = frame_num;
+
+
+buffers_ready:
+    if(overlay){
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.id    = V4L2_CID_VIRTUAL_VIDEO_OVERLAY;
+        ctrl.value = 1;
+        if(ioctl(fd, VIDIOC_S_CTRL, &ctrl) == -1){
+            printf("enable overlay error:%s\n", strerror(errno));
+        }
+    }
 
+    //驱动在帧完成时算校验值，在该帧出队之前以事件送达
+    if(verify){
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM;
+        if(ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1){
+            printf("SUBSCRIBE_EVENT error:%s\n", strerror(errno));
+            free(buffers);
+            close(fd);
+            return -11;
+        }
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.id    = V4L2_CID_VIRTUAL_VIDEO_CHECKSUM;
+        ctrl.value = 1;
+        if(ioctl(fd, VIDIOC_S_CTRL, &ctrl) == -1){
+            printf("enable checksum error:%s\n", strerror(errno));
+            free(buffers);
+            close(fd);
+            return -11;
+        }
+    }
 
-    //开启采集
+    if(slice_mode){
+        //序号全1表示该缓冲区还没收到分片事件
+        memset(slice_stat.sequence, 0xff, sizeof(slice_stat.sequence));
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_VIRTUAL_VIDEO_SLICE;
+        if(ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1){
+            printf("SUBSCRIBE_EVENT error:%s, slice events disabled\n", strerror(errno));
+            slice_mode = 0;
+        }
+    }
+
+    //开启采集，read()在第一次读时由驱动开始
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    retval = ioctl(fd, VIDIOC_STREAMON, &type);
+    retval = io == IO_READ ? 0 : ioctl(fd, VIDIOC_STREAMON, &type);
     if(retval==-1){
         printf("STREAMON error:%s\n", strerror(errno));
         free(buffers);
@@ -234,45 +768,235 @@ int main(int argc, char argv[])
         return -11;
     }
 
-    for(n_buffers = 0; n_buffers < FRAME_NUM; n_buffers++){
+    for(count = 0; count < frames; count++){
+        VV_PROBE1(dqbuf_start, count);
+        if(slice_mode && WaitSlices(&slice_stat) != 0){
+            exit_code = -12;
+            break;
+        }
+
         //出队
         memset(&buf, 0, sizeof(buf));
-        buf.index = n_buffers;
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        retval = ioctl(fd, VIDIOC_DQBUF, &buf);
+        buf.memory = io == IO_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+        cpu_start = ThreadCpuNs();
+        if(io == IO_READ){
+            //read()没有帧号和时间戳
+            retval = read(fd, buffers[0].start, buffers[0].length);
+            if(retval >= 0 && retval != buffers[0].length){
+                printf("short read %d of %u bytes\n", retval, buffers[0].length);
+                retval = -1;
+                errno = EIO;
+            }
+            buf.sequence  = count;
+            buf.bytesused = buffers[0].length;
+        } else {
+            retval = ioctl(fd, VIDIOC_DQBUF, &buf);
+        }
         if (retval == -1) {
-            printf("DQBUF error:%s\n", strerror(errno));
+            printf("%s error:%s\n", io == IO_READ ? "read" : "DQBUF", strerror(errno));
             free(buffers);
             close(fd);
             return -12;
         }
+        io_ns += ThreadCpuNs() - cpu_start;
+        if(io != IO_READ){
+            queued--;
+        }
+        wake = MonotonicNs();
+        VV_PROBE3(dqbuf_done, buf.index, buf.sequence, buf.bytesused);
+        if(wake_hist && io != IO_READ){
+            //驱动时间戳同为CLOCK_MONOTONIC
+            LatHistRecord(wake_hist, wake - (buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL));
+        }
+        if(slice_mode && buf.index < VIDEO_MAX_FRAME && buf.sequence == slice_stat.sequence[buf.index]){
+            slice_stat.lead += MonotonicSec() - slice_stat.first[buf.index];
+            slice_stat.frames++;
+        }
 
-        memset(name, 0, 22);
-        sprintf(name,"./img/image%d.bmp",n_buffers);
-        GenBmpFile(buffers[n_buffers].start, 32, IMAGE_WIDTH, IMAGE_HEIGHT, name);
+        //在交给其他环节之前校验，之后的改动不算驱动的错
+        if(verify){
+            verify_start = MonotonicNs();
+            crc = Crc32cFrame(buf.sequence, buffers[buf.index].start, buf.bytesused);
+            verify_ns += MonotonicNs() - verify_start;
+            verify_bytes += buf.bytesused;
+            DrainEvents();
+            if(buf.index >= VIDEO_MAX_FRAME || !frame_sum[buf.index].valid || frame_sum[buf.index].sequence != buf.sequence){
+                //事件队列溢出时最早的事件被丢弃
+                crc_missing++;
+            } else if(crc != frame_sum[buf.index].crc){
+                if(crc_bad < 10){
+                    printf("verify: frame %u (buffer %u) crc %08x, driver %08x\n", buf.sequence, buf.index, crc, frame_sum[buf.index].crc);
+                }
+                crc_bad++;
+            }
+            if(count && buf.sequence <= last_seq){
+                crc_stale++;
+            } else if(count && buf.sequence > last_seq + 1){
+                crc_dropped += buf.sequence - last_seq - 1;
+            }
+            if(!count || buf.sequence > last_seq){
+                last_seq = buf.sequence;
+            }
+        }
+
+        if(ring_path){
+            VV_PROBE2(publish_start, buf.index, buf.sequence);
+            RingPublish(&ring, buffers[buf.index].start, buf.sequence,
+                        buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL);
+            VV_PROBE3(publish_done, buf.index, buf.sequence, fmt.fmt.pix.sizeimage);
+        }
+
+        if(pipe_target){
+            if(count == 0){
+                pipe_start = MonotonicSec();
+            }
+            if(PipeOutWrite(&pipe_out, buffers[buf.index].start, buf.bytesused, buf.index) != 0){
+                if(errno == EPIPE){
+                    printf("pipe: reader closed\n");
+                } else {
+                    exit_code = -17;
+                }
+                break;
+            }
+        }
+
+        if(rec_prefix){
+            frame = buffers[buf.index].start;
+            if(conv_fourcc){
+                VV_PROBE2(convert_start, buf.index, buf.sequence);
+                ConvImageInit(&conv_src, fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height, buffers[buf.index].start);
+                if(DebayerIsBayer(conv_src.fourcc)){
+                    Debayer(&conv_src, &conv_dst, method, threads, RtWorkerAttr());
+                } else {
+                    Convert(&conv_src, &conv_dst, conv_matrix, threads, RtWorkerAttr());
+                }
+                frame = conv_buf;
+                VV_PROBE3(convert_done, buf.index, buf.sequence, rec.hdr.frame_size);
+            }
+            retval = RecWrite(&rec, frame, buf.sequence,
+                              buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL);
+            if(retval != 0){
+                exit_code = -15;
+                break;
+            }
+        } else if(!ring_path && !pipe_target && !verify){
+            frame = buffers[buf.index].start;
+            if(rgb_buf){
+                VV_PROBE2(convert_start, buf.index, buf.sequence);
+                ConvImageInit(&bayer_src, fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height, buffers[buf.index].start);
+                Debayer(&bayer_src, &bayer_dst, method, threads, RtWorkerAttr());
+                frame = rgb_buf;
+                VV_PROBE3(convert_done, buf.index, buf.sequence, fmt.fmt.pix.width * fmt.fmt.pix.height * 4);
+            }
+            memset(name, 0, 22);
+            if(qoi){
+                sprintf(name,"./img/image%d.qoi",count);
+                GenQoiFile((__u8 *)frame, 32, fmt.fmt.pix.width, fmt.fmt.pix.height, name, threads, RtWorkerAttr());
+            } else {
+                sprintf(name,"./img/image%d.bmp",count);
+                GenBmpFile((__u8 *)frame, 32, fmt.fmt.pix.width, fmt.fmt.pix.height, name);
+            }
+        }
+
+        if(proc_hist){
+            LatHistRecord(proc_hist, MonotonicNs() - wake);
+        }
+
+        //写入管道的缓冲区等读端取走页面后才入队，驱动手里一个都没有时等待
+        if(pipe_target){
+            while((index = PipeOutReap(&pipe_out, queued == 0)) >= 0 && io != IO_READ){
+                if(QueueBuffer(io, index) == -1){
+                    printf("QBUF error:%s\n", strerror(errno));
+                    free(buffers);
+                    close(fd);
+                    return -13;
+                }
+                queued++;
+            }
+            continue;
+        }
 
         //入队循环
+        if(io == IO_READ){
+            continue;
+        }
+        VV_PROBE2(qbuf_start, buf.index, buf.sequence);
+        cpu_start = ThreadCpuNs();
         retval = ioctl(fd, VIDIOC_QBUF, &buf); 
+        io_ns += ThreadCpuNs() - cpu_start;
         if (retval == -1) {
             printf("QBUF error:%s\n", strerror(errno));
             free(buffers);
             close(fd);
             return -13;
         }
+        VV_PROBE2(qbuf_done, buf.index, buf.sequence);
+        queued++;
+    }
+
+    //等读端取走剩下的帧
+    if(pipe_target){
+        PipeOutClose(&pipe_out);
+        if(pipe_out.frames){
+            printf("pipe: %llu frames, %.1f MB/s with %s\n", (unsigned long long)pipe_out.frames,
+                   pipe_out.written / 1e6 / (MonotonicSec() - pipe_start), pipe_out.splice ? "vmsplice" : "write");
+        }
     }
 
     //关闭流
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ioctl(fd, VIDIOC_STREAMOFF, &type);
+    if(io != IO_READ){
+        ioctl(fd, VIDIOC_STREAMOFF, &type);
+    }
+
+    //不含等待帧的时间，read()包含拷贝
+    if(count){
+        printf("io %s: %.2f us cpu per frame in %s\n", io_name[io], io_ns / 1e3 / count,
+               io == IO_READ ? "read()" : "DQBUF+QBUF");
+    }
+
+    //只计算校验的时间，不含等待
+    if(verify && count){
+        printf("verify: %u frames, %u mismatched, %u stale, %u dropped, %u without checksum, %.2f GB/s with %s\n",
+               count, crc_bad, crc_stale, crc_dropped, crc_missing, verify_bytes / (double)verify_ns, Crc32cLevelName(Crc32cSetLevel(CRC32C_AUTO)));
+        if(crc_bad || crc_stale || crc_missing){
+            exit_code = -18;
+        }
+    }
+
+    if(slice_stat.frames){
+        printf("slices: first rows ready %.3f ms before the whole frame (%u frames)\n",
+                slice_stat.lead * 1e3 / slice_stat.frames, slice_stat.frames);
+    }
+
+    if(wake_hist){
+        LatHistPrint(wake_hist);
+        LatHistPrint(proc_hist);
+    }
+    free(wake_hist);
+    free(proc_hist);
+
+    if(ring_path){
+        RingDestroy(&ring);
+    }
+    if(rec_prefix && RecClose(&rec) != 0){
+        exit_code = -16;
+    }
+    free(conv_buf);
+    free(rgb_buf);
 
     //关闭内存映射
     for(n_buffers=0;n_buffers<frame_num;n_buffers++) {
-        munmap(buffers[n_buffers].start, buffers[n_buffers].length);
+        if(io == IO_MMAP){
+            munmap(buffers[n_buffers].start, buffers[n_buffers].length);
+        } else {
+            free(buffers[n_buffers].start);
+        }
     }
     
     free(buffers);
     close(fd);
-    return 0;
+    return exit_code;
 }
 
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aggregate.h"
+#include "convert.h"
+
+#define MULTICAM_FRAMES 100
+#define MULTICAM_BUFS   4
+#define MULTICAM_WAIT   10    /*ms*/
+
+static void usage(const char *prog)
+{
+    printf("usage: %s -d device -d device [...] [-f fourcc] [-g WxH] [-n bundles] [-b buffers] [-w wait_ms] [-t] [-v]\n", prog);
+    printf("  -d device   capture node, up to %d, e.g. the nodes of one clock group (driver group=N)\n", AGG_MAX_CAMS);
+    printf("  -f fourcc   capture format (default BGR32)\n");
+    printf("  -g WxH      frame size (default 800x480)\n");
+    printf("  -n bundles  number of bundles (default %d)\n", MULTICAM_FRAMES);
+    printf("  -b buffers  buffers per device (default %d)\n", MULTICAM_BUFS);
+    printf("  -w ms       longest wait for the rest of a bundle after its first frame (default %d)\n", MULTICAM_WAIT);
+    printf("  -t          match frames by timestamp instead of sequence (shared clock without group=)\n");
+    printf("  -v          print every bundle\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *devs[AGG_MAX_CAMS];
+    int ndev = 0;
+    __u32 fourcc = V4L2_PIX_FMT_BGR32;
+    __u32 width = 800, height = 480;
+    unsigned int bundles = MULTICAM_FRAMES, count;
+    __u32 buffers = MULTICAM_BUFS;
+    int wait_ms = MULTICAM_WAIT;
+    AggKey key = AGG_KEY_SEQUENCE;
+    int verbose = 0;
+    int exit_code = 0;
+    Aggregator agg;
+    AggBundle bundle;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "d:f:g:n:b:w:tvh")) != -1){
+        switch(opt){
+        case 'd':
+            if(ndev == AGG_MAX_CAMS){
+                printf("at most %d devices\n", AGG_MAX_CAMS);
+                return -1;
+            }
+            devs[ndev++] = optarg;
+            break;
+        case 'f':
+            fourcc = ConvFourcc(optarg);
+            if(!fourcc){
+                printf("unsupported fourcc %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'g':
+            if(sscanf(optarg, "%ux%u", &width, &height) != 2){
+                printf("bad frame size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            bundles = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            buffers = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            wait_ms = atoi(optarg);
+            break;
+        case 't':
+            key = AGG_KEY_TIMESTAMP;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(ndev == 0){
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(AggOpen(&agg, devs, ndev, fourcc, width, height, buffers, key, wait_ms) != 0){
+        return -1;
+    }
+
+    for(count = 0; count < bundles; count++){
+        if(AggNext(&agg, &bundle) != 0){
+            exit_code = -2;
+            break;
+        }
+        if(verbose){
+            printf("bundle %llu:", (unsigned long long)bundle.key);
+            for(i=0; i<ndev; i++){
+                if(bundle.mask & (1U << i)){
+                    printf(" %u", bundle.buf[i].sequence);
+                } else {
+                    printf(" -");
+                }
+            }
+            printf("  ts skew %.3f ms, arrival skew %.3f ms\n", bundle.ts_skew / 1e6, bundle.arrival_skew / 1e6);
+        }
+        if(AggRelease(&agg, &bundle) != 0){
+            exit_code = -3;
+            break;
+        }
+    }
+
+    AggReport(&agg);
+    AggClose(&agg);
+    return exit_code;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "pipeout.h"
+
+#define PIPE_MIN_SIZE (64 * 1024)
+
+//管道容量按页计，尽量放下一整帧以减少唤醒次数，超过pipe-max-size时逐次减半
+static void PipeOutGrow(int fd, __u32 frame_size)
+{
+    int size;
+
+    for(size = frame_size; size >= PIPE_MIN_SIZE; size /= 2){
+        if(fcntl(fd, F_SETPIPE_SZ, size) != -1){
+            return;
+        }
+    }
+}
+
+int PipeOutOpen(PipeOut *po, int fd, int use_write, __u32 frame_size)
+{
+    struct stat st;
+
+    memset(po, 0, sizeof(*po));
+    po->fd = fd;
+    if(fstat(fd, &st) == -1){
+        printf("pipe: fstat error:%s\n", strerror(errno));
+        return -1;
+    }
+    if(S_ISFIFO(st.st_mode)){
+        PipeOutGrow(fd, frame_size);
+        po->splice = !use_write;
+    }
+    return 0;
+}
+
+static int PipeOutCopy(PipeOut *po, const __u8 *data, size_t size)
+{
+    ssize_t n;
+
+    while(size > 0){
+        n = write(po->fd, data, size);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EPIPE){
+                printf("pipe: write error:%s\n", strerror(errno));
+            }
+            return -1;
+        }
+        data += n;
+        size -= n;
+        po->written += n;
+    }
+    return 0;
+}
+
+//写出一帧，index在PipeOutReap返回之前不能重新入队
+int PipeOutWrite(PipeOut *po, const void *data, size_t size, __u32 index)
+{
+    const __u8 *p = data;
+    struct iovec iov;
+    __u64 end = 0;
+    ssize_t n;
+
+    if(po->len == PIPE_MAX_PENDING){
+        printf("pipe: more than %d buffers pending\n", PIPE_MAX_PENDING);
+        errno = EBUSY;
+        return -1;
+    }
+
+    while(po->splice && size > 0){
+        iov.iov_base = (void *)p;
+        iov.iov_len  = size;
+        n = vmsplice(po->fd, &iov, 1, 0);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EPIPE){
+                return -1;
+            }
+            //如驱动hugepages=1的VM_PFNMAP映射无法引用页面，余下部分改用write
+            printf("pipe: vmsplice error:%s, using write\n", strerror(errno));
+            po->splice = 0;
+            break;
+        }
+        p += n;
+        size -= n;
+        po->written += n;
+        end = po->written;
+    }
+    if(PipeOutCopy(po, p, size) != 0){
+        return -1;
+    }
+
+    po->index[(po->head + po->len) % PIPE_MAX_PENDING] = index;
+    po->end[(po->head + po->len) % PIPE_MAX_PENDING] = end;
+    po->len++;
+    po->frames++;
+    return 0;
+}
+
+//最早写出的缓冲区已被消费者取走时返回其index，否则返回-1；wait时等到取走为止
+int PipeOutReap(PipeOut *po, int wait)
+{
+    struct pollfd pfd;
+    struct timespec ts = { 0, 100 * 1000 };
+    __u32 index;
+    int unread;
+
+    while(po->len){
+        if(po->end[po->head] == 0){
+            break;
+        }
+        if(ioctl(po->fd, FIONREAD, &unread) == -1){
+            printf("pipe: FIONREAD error:%s\n", strerror(errno));
+            return -1;
+        }
+        if(po->written - unread >= po->end[po->head]){
+            break;
+        }
+        if(!wait){
+            return -1;
+        }
+        //管道里还剩的字节减少时没有事件可等，只能短暂休眠；读端关闭时POLLERR，页面不会再被读
+        pfd.fd = po->fd;
+        pfd.events = 0;
+        if(ppoll(&pfd, 1, &ts, NULL) == 1 && (pfd.revents & POLLERR)){
+            break;
+        }
+    }
+    if(po->len == 0){
+        return -1;
+    }
+    index = po->index[po->head];
+    po->head = (po->head + 1) % PIPE_MAX_PENDING;
+    po->len--;
+    return index;
+}
+
+//等消费者取走全部帧再关闭，之后才能释放或改写缓冲区
+void PipeOutClose(PipeOut *po)
+{
+    while(PipeOutReap(po, 1) >= 0);
+    close(po->fd);
+    po->fd = -1;
+}
@@ -0,0 +1,32 @@
+#ifndef _PIPEOUT_H_
+#define _PIPEOUT_H_
+
+#include <linux/types.h>
+
+/*
+原始帧输出到管道(stdout或FIFO)，供外部编码器读取
+管道上用vmsplice只把mmap缓冲区的页面引用放入管道，不拷贝；消费者读走之前页面仍被引用，
+因此缓冲区要等PipeOutReap确认(已写入字节数 - FIONREAD >= 该帧末尾)后才能重新入队
+消费者用splice/tee把页面转到别处时，页面离开本管道即视为取走
+不是管道、vmsplice失败或指定use_write时用write，缓冲区立即可重用
+*/
+
+#define PIPE_MAX_PENDING 32   /*VIDEO_MAX_FRAME*/
+
+typedef struct
+{
+    int fd;
+    int splice;           /*1:vmsplice，0:write*/
+    __u64 written;        /*已送入管道的字节数*/
+    __u32 index[PIPE_MAX_PENDING];   /*等待消费者取走的缓冲区，先进先出*/
+    __u64 end[PIPE_MAX_PENDING];     /*该帧末尾对应的written，0表示已拷贝*/
+    __u32 head, len;
+    __u64 frames;
+} PipeOut;
+
+int PipeOutOpen(PipeOut *po, int fd, int use_write, __u32 frame_size);
+int PipeOutWrite(PipeOut *po, const void *data, size_t size, __u32 index);
+int PipeOutReap(PipeOut *po, int wait);
+void PipeOutClose(PipeOut *po);
+
+#endif    /* _PIPEOUT_H_ */
@@ -0,0 +1,87 @@
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/*
+USDT静态探针
+VV_PROBEn(name, args...)在代码中放一条nop，并在.note.stapsdt段记下provider "vv"、探针名和参数所在的寄存器/栈位置，
+perf/bpftrace按usdt:out/test.elf:vv:name挂上后才会把nop换成断点；没有挂载时只多一条nop，参数都是已算好的值
+有sys/sdt.h时直接用它，否则按同样的格式自己生成note；参数须为整数，最多4个
+参数只放在寄存器或立即数中(约束nr)，全局变量作参数时sdt.h默认生成的buf(%rip)形式libbpf无法解析
+*/
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define VV_HAVE_SDT_H
+#endif
+#endif
+
+#if defined(VV_HAVE_SDT_H)
+
+#define STAP_SDT_ARG_CONSTRAINT nr
+#include <sys/sdt.h>
+
+#define VV_PROBE0(name)             DTRACE_PROBE(vv, name)
+#define VV_PROBE1(name, a)          DTRACE_PROBE1(vv, name, a)
+#define VV_PROBE2(name, a, b)       DTRACE_PROBE2(vv, name, a, b)
+#define VV_PROBE3(name, a, b, c)    DTRACE_PROBE3(vv, name, a, b, c)
+#define VV_PROBE4(name, a, b, c, d) DTRACE_PROBE4(vv, name, a, b, c, d)
+
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#include <limits.h>
+
+//参数描述为"[-]字节数@位置"，有符号数字节数取负
+//按类型选择判断有无符号，(__typeof__(x))-1 < 0对无符号类型在-Wextra下会报-Wtype-limits
+#define VV_SDT_SIGNED(x) _Generic((x), char: CHAR_MIN < 0, signed char: 1, short: 1, int: 1, long: 1, long long: 1, default: 0)
+#define VV_SDT_SIZE(x)   (VV_SDT_SIGNED(x) ? -(int)sizeof(x) : (int)sizeof(x))
+#define VV_SDT_FMT(n)    "%c[vv_s" #n "]@%[vv_a" #n "]"
+#define VV_SDT_ARG(n, x) [vv_s##n] "n" (VV_SDT_SIZE(x)), [vv_a##n] "nr" (x)
+
+//note内容：探针地址、.stapsdt.base地址(用于prelink后修正)、信号量地址(不用)、provider、探针名、参数描述
+#define VV_SDT(name, fmt, ...)                                                     \
+    __asm__ __volatile__(                                                          \
+        "990: nop\n"                                                               \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+        ".balign 4\n"                                                              \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+        "991: .asciz \"stapsdt\"\n"                                                \
+        "992: .balign 4\n"                                                         \
+        "993: .8byte 990b\n"                                                       \
+        ".8byte _.stapsdt.base\n"                                                  \
+        ".8byte 0\n"                                                               \
+        ".asciz \"vv\"\n"                                                          \
+        ".asciz \"" #name "\"\n"                                                   \
+        ".asciz \"" fmt "\"\n"                                                     \
+        "994: .balign 4\n"                                                         \
+        ".popsection\n"                                                            \
+        ".ifndef _.stapsdt.base\n"                                                 \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+        ".weak _.stapsdt.base\n"                                                   \
+        ".hidden _.stapsdt.base\n"                                                 \
+        "_.stapsdt.base: .space 1\n"                                               \
+        ".size _.stapsdt.base, 1\n"                                                \
+        ".popsection\n"                                                            \
+        ".endif\n"                                                                 \
+        :: __VA_ARGS__)
+
+#define VV_PROBE0(name)             VV_SDT(name, "")
+#define VV_PROBE1(name, a)          VV_SDT(name, VV_SDT_FMT(1), VV_SDT_ARG(1, a))
+#define VV_PROBE2(name, a, b)       VV_SDT(name, VV_SDT_FMT(1) " " VV_SDT_FMT(2), \
+                                           VV_SDT_ARG(1, a), VV_SDT_ARG(2, b))
+#define VV_PROBE3(name, a, b, c)    VV_SDT(name, VV_SDT_FMT(1) " " VV_SDT_FMT(2) " " VV_SDT_FMT(3), \
+                                           VV_SDT_ARG(1, a), VV_SDT_ARG(2, b), VV_SDT_ARG(3, c))
+#define VV_PROBE4(name, a, b, c, d) VV_SDT(name, VV_SDT_FMT(1) " " VV_SDT_FMT(2) " " VV_SDT_FMT(3) " " VV_SDT_FMT(4), \
+                                           VV_SDT_ARG(1, a), VV_SDT_ARG(2, b), VV_SDT_ARG(3, c), VV_SDT_ARG(4, d))
+
+#else
+
+//其他平台不生成探针
+#define VV_PROBE0(name)             do { } while(0)
+#define VV_PROBE1(name, a)          do { (void)(a); } while(0)
+#define VV_PROBE2(name, a, b)       do { (void)(a); (void)(b); } while(0)
+#define VV_PROBE3(name, a, b, c)    do { (void)(a); (void)(b); (void)(c); } while(0)
+#define VV_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while(0)
+
+#endif
+
+#endif    /* _PROBE_H_ */
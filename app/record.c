@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "record.h"
+#include "probe.h"
+
+#define REC_IDX_BATCH 256
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static void RecSegName(char *name, size_t len, const char *prefix, __u32 seg_no)
+{
+    snprintf(name, len, "%s.%04u.raw", prefix, seg_no);
+}
+
+//打开并预分配一个新的分段文件
+static int RecOpenSegment(Recorder *rec)
+{
+    char name[300];
+    int retval;
+
+    RecSegName(name, sizeof(name), rec->prefix, rec->seg_no);
+
+    rec->direct = 1;
+    rec->seg_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if(rec->seg_fd == -1 && errno == EINVAL){
+        //tmpfs等文件系统不支持O_DIRECT
+        printf("O_DIRECT not supported for \'%s\', using buffered io\n", name);
+        rec->direct = 0;
+        rec->seg_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if(rec->seg_fd == -1){
+        printf("open \'%s\' failed : %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    retval = fallocate(rec->seg_fd, 0, 0, rec->hdr.seg_size);
+    if(retval == -1){
+        printf("fallocate \'%s\' %llu bytes failed : %s\n", name,
+                (unsigned long long)rec->hdr.seg_size, strerror(errno));
+        if(errno == ENOSPC){
+            close(rec->seg_fd);
+            rec->seg_fd = -1;
+            return -1;
+        }
+    }
+
+    rec->seg_off = 0;
+    return 0;
+}
+
+//关闭当前分段，截掉未使用的预分配空间
+static void RecCloseSegment(Recorder *rec)
+{
+    if(rec->seg_fd == -1){
+        return;
+    }
+    if(ftruncate(rec->seg_fd, rec->seg_off) == -1){
+        printf("ftruncate segment %u failed : %s\n", rec->seg_no, strerror(errno));
+    }
+    close(rec->seg_fd);
+    rec->seg_fd = -1;
+}
+
+static int RecFlushIndex(Recorder *rec)
+{
+    size_t len = rec->idx_pending * sizeof(RecIndexEntry);
+    ssize_t retval;
+
+    if(len == 0){
+        return 0;
+    }
+    retval = write(rec->idx_fd, rec->idx_buf, len);
+    if(retval != (ssize_t)len){
+        printf("write index failed : %s\n", retval < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    rec->idx_pending = 0;
+    return 0;
+}
+
+int RecOpen(Recorder *rec, const char *prefix, __u32 width, __u32 height,
+            __u32 pixelformat, __u32 bytesperline, __u32 frame_size, __u64 seg_size)
+{
+    char name[300];
+    RecHeader hdr;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->seg_fd = -1;
+    rec->idx_fd = -1;
+    snprintf(rec->prefix, sizeof(rec->prefix), "%s", prefix);
+
+    rec->hdr.magic        = REC_MAGIC;
+    rec->hdr.version      = REC_VERSION;
+    rec->hdr.width        = width;
+    rec->hdr.height       = height;
+    rec->hdr.pixelformat  = pixelformat;
+    rec->hdr.bytesperline = bytesperline;
+    rec->hdr.frame_size   = frame_size;
+    rec->hdr.slot_size    = ALIGN_UP(rec->hdr.frame_size, REC_ALIGN);
+    if(seg_size == 0){
+        seg_size = REC_DEF_SEG_SIZE;
+    }
+    if(seg_size < rec->hdr.slot_size){
+        seg_size = rec->hdr.slot_size;
+    }
+    rec->hdr.seg_size = seg_size / rec->hdr.slot_size * rec->hdr.slot_size;
+
+    if(posix_memalign((void **)&rec->bounce, REC_ALIGN, rec->hdr.slot_size) != 0){
+        printf("Unable to alloc bounce buffer\n");
+        return -1;
+    }
+    memset(rec->bounce, 0, rec->hdr.slot_size);
+
+    rec->idx_buf = malloc(REC_IDX_BATCH * sizeof(RecIndexEntry));
+    if(!rec->idx_buf){
+        printf("Unable to alloc index buffer\n");
+        goto err;
+    }
+
+    snprintf(name, sizeof(name), "%s.idx", prefix);
+    rec->idx_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(rec->idx_fd == -1){
+        printf("open \'%s\' failed : %s\n", name, strerror(errno));
+        goto err;
+    }
+    //gcc 12把上面的字段赋值合并成向量存储后对rec->hdr误报-Wstringop-overread，经局部副本写出
+    hdr = rec->hdr;
+    if(write(rec->idx_fd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+        printf("write \'%s\' header failed : %s\n", name, strerror(errno));
+        goto err;
+    }
+
+    if(RecOpenSegment(rec) != 0){
+        goto err;
+    }
+
+    printf("record:%s frame_size=%d slot_size=%d seg_size=%llu direct=%d\n", prefix,
+            rec->hdr.frame_size, rec->hdr.slot_size, (unsigned long long)rec->hdr.seg_size, rec->direct);
+    return 0;
+
+err:
+    if(rec->idx_fd != -1){
+        close(rec->idx_fd);
+    }
+    free(rec->idx_buf);
+    free(rec->bounce);
+    rec->idx_buf = NULL;
+    rec->bounce = NULL;
+    return -1;
+}
+
+//追加一帧，data为frame_size字节的帧数据，页对齐时除尾部外不做拷贝
+int RecWrite(Recorder *rec, const void *data, __u32 sequence, __u64 timestamp)
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+    __u32 head, tail;
+    ssize_t retval;
+    RecIndexEntry *entry;
+
+    if(rec->seg_off + rec->hdr.slot_size > rec->hdr.seg_size){
+        RecCloseSegment(rec);
+        rec->seg_no++;
+        if(RecOpenSegment(rec) != 0){
+            return -1;
+        }
+    }
+
+    head = rec->hdr.frame_size & ~(REC_ALIGN - 1);
+    if(rec->copy_all || ((uintptr_t)data & (REC_ALIGN - 1)) != 0){
+        head = 0;
+    }
+    tail = rec->hdr.frame_size - head;
+
+    if(head){
+        iov[iovcnt].iov_base = (void *)data;
+        iov[iovcnt].iov_len  = head;
+        iovcnt++;
+    }
+    if(tail){
+        memcpy(rec->bounce, (const __u8 *)data + head, tail);
+        iov[iovcnt].iov_base = rec->bounce;
+        iov[iovcnt].iov_len  = rec->hdr.slot_size - head;
+        iovcnt++;
+    }
+
+    VV_PROBE2(rec_write_start, sequence, rec->hdr.slot_size);
+    retval = pwritev(rec->seg_fd, iov, iovcnt, rec->seg_off);
+    VV_PROBE2(rec_write_done, sequence, retval);
+    if(retval == -1 && head && (errno == EFAULT || errno == EINVAL)){
+        //映射的缓冲区不支持直接io，改为全部经bounce写入
+        printf("direct write from buffer failed (%s), copying frames\n", strerror(errno));
+        rec->copy_all = 1;
+        return RecWrite(rec, data, sequence, timestamp);
+    }
+    if(retval != (ssize_t)rec->hdr.slot_size){
+        printf("write segment %u at %llu failed : %s\n", rec->seg_no,
+                (unsigned long long)rec->seg_off, retval < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+
+    entry = &rec->idx_buf[rec->idx_pending++];
+    entry->sequence  = sequence;
+    entry->segment   = rec->seg_no;
+    entry->timestamp = timestamp;
+    entry->offset    = rec->seg_off;
+    if(rec->idx_pending == REC_IDX_BATCH && RecFlushIndex(rec) != 0){
+        return -1;
+    }
+
+    rec->seg_off += rec->hdr.slot_size;
+    rec->frames++;
+    return 0;
+}
+
+int RecClose(Recorder *rec)
+{
+    int retval;
+
+    retval = RecFlushIndex(rec);
+    RecCloseSegment(rec);
+    if(rec->idx_fd != -1){
+        close(rec->idx_fd);
+        rec->idx_fd = -1;
+    }
+    free(rec->idx_buf);
+    free(rec->bounce);
+    rec->idx_buf = NULL;
+    rec->bounce = NULL;
+
+    printf("record:%s %d frames in %d segments\n", rec->prefix, rec->frames, rec->seg_no + 1);
+    return retval;
+}
+
+//读取索引文件
+int RecLoad(RecReader *rd, const char *prefix)
+{
+    char name[300];
+    FILE *pf;
+    struct stat st;
+    size_t count;
+
+    memset(rd, 0, sizeof(*rd));
+    snprintf(rd->prefix, sizeof(rd->prefix), "%s", prefix);
+    snprintf(name, sizeof(name), "%s.idx", prefix);
+
+    pf = fopen(name, "rb");
+    if(NULL == pf){
+        printf("fopen \'%s\' failed : %s\n", name, strerror(errno));
+        return -1;
+    }
+    if(fread(&rd->hdr, sizeof(rd->hdr), 1, pf) != 1 || rd->hdr.magic != REC_MAGIC || rd->hdr.version != REC_VERSION){
+        printf("\'%s\': not a record index\n", name);
+        fclose(pf);
+        return -1;
+    }
+    if(fstat(fileno(pf), &st) == -1){
+        printf("fstat \'%s\' failed : %s\n", name, strerror(errno));
+        fclose(pf);
+        return -1;
+    }
+
+    count = (st.st_size - sizeof(rd->hdr)) / sizeof(RecIndexEntry);
+    rd->entries = malloc(count * sizeof(RecIndexEntry) + 1);
+    if(!rd->entries){
+        printf("Unable to malloc index:%s\n", strerror(errno));
+        fclose(pf);
+        return -1;
+    }
+    rd->count = fread(rd->entries, sizeof(RecIndexEntry), count, pf);
+    fclose(pf);
+    return 0;
+}
+
+//按sequence查找索引项，返回下标，找不到返回-1
+int RecFind(const RecReader *rd, __u32 sequence)
+{
+    __u32 i;
+
+    for(i=0; i<rd->count; i++){
+        if(rd->entries[i].sequence == sequence){
+            return i;
+        }
+    }
+    return -1;
+}
+
+//读出第index帧，pData至少frame_size字节
+int RecReadFrame(const RecReader *rd, __u32 index, __u8 *pData)
+{
+    char name[300];
+    const RecIndexEntry *entry;
+    int fd;
+    ssize_t retval;
+
+    if(index >= rd->count){
+        return -1;
+    }
+    entry = &rd->entries[index];
+
+    RecSegName(name, sizeof(name), rd->prefix, entry->segment);
+    fd = open(name, O_RDONLY);
+    if(fd == -1){
+        printf("open \'%s\' failed : %s\n", name, strerror(errno));
+        return -1;
+    }
+    retval = pread(fd, pData, rd->hdr.frame_size, entry->offset);
+    close(fd);
+    if(retval != (ssize_t)rd->hdr.frame_size){
+        printf("read frame %d from \'%s\' failed : %s\n", index, name, retval < 0 ? strerror(errno) : "short read");
+        return -1;
+    }
+    return 0;
+}
+
+void RecUnload(RecReader *rd)
+{
+    free(rd->entries);
+    memset(rd, 0, sizeof(*rd));
+}
@@ -0,0 +1,75 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include "bitmap.h"
+
+/*
+连续录制容器
+帧数据顺序追加到预分配的分段文件 <prefix>.NNNN.raw 中，每帧占用按4KB对齐的槽位，
+以O_DIRECT方式写入；<prefix>.idx 为索引文件，由RecHeader和若干RecIndexEntry组成
+*/
+
+#define REC_MAGIC        0x49525656   /*'VVRI'*/
+#define REC_VERSION      1
+#define REC_ALIGN        4096
+#define REC_DEF_SEG_SIZE (1024ULL * 1024 * 1024)
+
+//索引文件头 64byte
+typedef struct
+{
+    __u32 magic;
+    __u32 version;
+    __u32 width;
+    __u32 height;
+    __u32 pixelformat;    /*V4L2 fourcc*/
+    __u32 bytesperline;
+    __u32 frame_size;     /*每帧有效字节数*/
+    __u32 slot_size;      /*每帧在分段文件中占用的字节数，REC_ALIGN的整数倍*/
+    __u64 seg_size;       /*分段文件大小*/
+    __u8  reserved[24];
+} __attribute__((packed)) RecHeader;
+
+//索引项 24byte
+typedef struct
+{
+    __u32 sequence;       /*v4l2_buffer.sequence*/
+    __u32 segment;        /*分段文件编号*/
+    __u64 timestamp;      /*纳秒*/
+    __u64 offset;         /*帧在分段文件中的偏移*/
+} __attribute__((packed)) RecIndexEntry;
+
+typedef struct
+{
+    char prefix[256];
+    RecHeader hdr;
+    int seg_fd;
+    __u32 seg_no;
+    __u64 seg_off;
+    int direct;           /*分段文件是否以O_DIRECT打开*/
+    int idx_fd;
+    RecIndexEntry *idx_buf;
+    __u32 idx_pending;
+    __u8 *bounce;         /*对齐的中转缓冲，大小为slot_size*/
+    int copy_all;         /*源缓冲区不能直接用于O_DIRECT时整帧经bounce写入*/
+    __u32 frames;
+} Recorder;
+
+typedef struct
+{
+    RecHeader hdr;
+    RecIndexEntry *entries;
+    __u32 count;
+    char prefix[256];
+} RecReader;
+
+int RecOpen(Recorder *rec, const char *prefix, __u32 width, __u32 height,
+            __u32 pixelformat, __u32 bytesperline, __u32 frame_size, __u64 seg_size);
+int RecWrite(Recorder *rec, const void *data, __u32 sequence, __u64 timestamp);
+int RecClose(Recorder *rec);
+
+int RecLoad(RecReader *rd, const char *prefix);
+int RecFind(const RecReader *rd, __u32 sequence);
+int RecReadFrame(const RecReader *rd, __u32 index, __u8 *pData);
+void RecUnload(RecReader *rd);
+
+#endif    /* _RECORD_H_ */
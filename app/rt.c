@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+#define RT_STACK_PREFAULT (256 * 1024)
+
+static pthread_attr_t worker_attr;
+static int worker_attr_set = 0;
+
+//解析"2,4-7"形式的CPU列表
+int RtParseCpus(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    char *end;
+    unsigned long first, last;
+
+    CPU_ZERO(set);
+    while(*p){
+        first = strtoul(p, &end, 10);
+        if(end == p){
+            break;
+        }
+        last = first;
+        if(*end == '-'){
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if(end == p){
+                break;
+            }
+        }
+        if(first > last || last >= CPU_SETSIZE){
+            break;
+        }
+        for(; first <= last; first++){
+            CPU_SET(first, set);
+        }
+        p = end;
+        if(*p == ','){
+            p++;
+        } else if(*p){
+            break;
+        }
+    }
+    if(*p || CPU_COUNT(set) == 0){
+        printf("bad cpu list \'%s\'\n", list);
+        return -1;
+    }
+    return 0;
+}
+
+int RtPinSelf(const cpu_set_t *set)
+{
+    int retval;
+
+    retval = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+    if(retval != 0){
+        printf("pin capture thread failed : %s\n", strerror(retval));
+        return -1;
+    }
+    return 0;
+}
+
+int RtSetFifo(int prio)
+{
+    struct sched_param param;
+    int retval;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = prio;
+    retval = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if(retval != 0){
+        printf("SCHED_FIFO %d failed : %s\n", prio, strerror(retval));
+        return -1;
+    }
+    return 0;
+}
+
+//此后转换/编码创建的工作线程绑定到set，prio>0时使用SCHED_FIFO
+int RtSetWorkers(const cpu_set_t *set, int prio)
+{
+    struct sched_param param;
+
+    if(worker_attr_set){
+        pthread_attr_destroy(&worker_attr);
+        worker_attr_set = 0;
+    }
+    if(pthread_attr_init(&worker_attr) != 0){
+        return -1;
+    }
+    worker_attr_set = 1;
+
+    if(set && pthread_attr_setaffinity_np(&worker_attr, sizeof(*set), set) != 0){
+        printf("worker cpu affinity not supported\n");
+        return -1;
+    }
+    if(prio > 0){
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = prio;
+        if(pthread_attr_setinheritsched(&worker_attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+           pthread_attr_setschedpolicy(&worker_attr, SCHED_FIFO) != 0 ||
+           pthread_attr_setschedparam(&worker_attr, &param) != 0){
+            printf("worker SCHED_FIFO %d not supported\n", prio);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//工作线程属性，未设置时为NULL(默认属性)
+pthread_attr_t *RtWorkerAttr(void)
+{
+    return worker_attr_set ? &worker_attr : NULL;
+}
+
+//锁定当前及以后的全部映射，并预先访问一段栈
+int RtLockMemory(void)
+{
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    size_t i;
+
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1){
+        printf("mlockall failed : %s\n", strerror(errno));
+        return -1;
+    }
+    for(i=0; i<sizeof(stack); i+=4096){
+        stack[i] = 0;
+    }
+    return 0;
+}
+
+//逐页读一次，建立映射，mlockall不一定会填充设备映射
+void RtPrefault(void *start, size_t length)
+{
+    const volatile unsigned char *p = start;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for(i=0; i<length; i+=page){
+        (void)p[i];
+    }
+}
+
+static inline unsigned int LatIndex(__u64 ns)
+{
+    unsigned int shift;
+
+    if(ns < (2ULL << LAT_SUB_BITS)){
+        return ns;
+    }
+    if(ns >= (2ULL << (LAT_SUB_BITS + LAT_MAX_SHIFT))){
+        ns = (2ULL << (LAT_SUB_BITS + LAT_MAX_SHIFT)) - 1;
+    }
+    shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift << LAT_SUB_BITS) + (ns >> shift);
+}
+
+//下标对应区间的最大值
+static __u64 LatValue(unsigned int index)
+{
+    unsigned int shift;
+
+    if(index < (2U << LAT_SUB_BITS)){
+        return index;
+    }
+    shift = (index >> LAT_SUB_BITS) - 1;
+    return ((__u64)(index - (shift << LAT_SUB_BITS)) << shift) + (1ULL << shift) - 1;
+}
+
+void LatHistInit(LatHist *h, const char *name)
+{
+    memset(h, 0, sizeof(*h));
+    h->name = name;
+    h->min = ~0ULL;
+}
+
+void LatHistRecord(LatHist *h, __u64 ns)
+{
+    h->counts[LatIndex(ns)]++;
+    h->total++;
+    h->sum += ns;
+    h->sum_sq += (double)ns * ns;
+    if(ns < h->min){
+        h->min = ns;
+    }
+    if(ns > h->max){
+        h->max = ns;
+    }
+}
+
+//把src的样本并入dst，例如多个进程各自统计后汇总
+void LatHistMerge(LatHist *dst, const LatHist *src)
+{
+    unsigned int i;
+
+    for(i=0; i<sizeof(src->counts)/sizeof(src->counts[0]); i++){
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    dst->sum_sq += src->sum_sq;
+    dst->min = src->min < dst->min ? src->min : dst->min;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+//百分位p(0-100)处的值，纳秒，没有样本返回0
+__u64 LatHistValue(const LatHist *h, double p)
+{
+    __u64 target, cum = 0, value;
+    unsigned int idx = 0;
+
+    if(h->total == 0){
+        return 0;
+    }
+    if(p >= 100){
+        return h->max;
+    }
+    target = (__u64)ceil(p / 100 * h->total);
+    if(target == 0){
+        target = 1;
+    }
+    while(cum < target){
+        cum += h->counts[idx++];
+    }
+    value = LatValue(idx - 1);
+    return value < h->min ? h->min : (value > h->max ? h->max : value);
+}
+
+//按HdrHistogram的百分位分布格式输出，单位微秒
+void LatHistPrint(const LatHist *h)
+{
+    static const double percentiles[] = {0, 50, 75, 90, 99, 99.9, 99.99, 99.999, 100};
+    double mean, stddev, p;
+    __u64 target, cum, value;
+    unsigned int i, idx;
+
+    printf("%s (us)\n", h->name);
+    if(h->total == 0){
+        printf("#[no samples]\n");
+        return;
+    }
+    printf("%12s %14s %10s %16s\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    cum = 0;
+    idx = 0;
+    for(i=0; i<sizeof(percentiles)/sizeof(percentiles[0]); i++){
+        p = percentiles[i];
+        target = (__u64)ceil(p / 100 * h->total);
+        if(target == 0){
+            target = 1;
+        }
+        while(cum < target){
+            cum += h->counts[idx++];
+        }
+        if(p < 100){
+            value = LatValue(idx - 1);
+            value = value < h->min ? h->min : (value > h->max ? h->max : value);
+            printf("%12.3f %14.6f %10llu %16.2f\n", value / 1e3, p / 100,
+                   (unsigned long long)cum, 1 / (1 - p / 100));
+        } else {
+            printf("%12.3f %14.6f %10llu %16s\n", h->max / 1e3, 1.0, (unsigned long long)cum, "inf");
+        }
+    }
+
+    mean = h->sum / h->total;
+    stddev = h->sum_sq / h->total - mean * mean;
+    stddev = stddev > 0 ? sqrt(stddev) : 0;
+    printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e3, stddev / 1e3);
+    printf("#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1e3, (unsigned long long)h->total);
+    printf("#[Min     = %12.3f]\n", h->min / 1e3);
+}
@@ -0,0 +1,44 @@
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <linux/types.h>
+
+/*
+实时采集支持
+采集线程和转换/编码工作线程绑定到指定CPU，可选SCHED_FIFO；mlockall锁定内存并预先访问映射的缓冲区，
+避免采集过程中缺页；LatHist为HdrHistogram式的对数线性直方图，记录纳秒延迟，相对误差约0.1%
+cpu_set_t需要_GNU_SOURCE，包含本文件的源文件须在最前面定义
+*/
+
+int RtParseCpus(const char *list, cpu_set_t *set);
+int RtPinSelf(const cpu_set_t *set);
+int RtSetFifo(int prio);
+int RtSetWorkers(const cpu_set_t *set, int prio);
+pthread_attr_t *RtWorkerAttr(void);
+int RtLockMemory(void);
+void RtPrefault(void *start, size_t length);
+
+//第0组2048个1ns的桶，之后每组1024个桶、桶宽翻倍，超过2^41纳秒(约36分钟)的值计入最后一个桶
+#define LAT_SUB_BITS   10
+#define LAT_MAX_SHIFT  30
+
+typedef struct
+{
+    const char *name;
+    __u64 counts[(LAT_MAX_SHIFT + 2) << LAT_SUB_BITS];
+    __u64 total;
+    __u64 min;
+    __u64 max;
+    double sum;
+    double sum_sq;
+} LatHist;
+
+void LatHistInit(LatHist *h, const char *name);
+void LatHistRecord(LatHist *h, __u64 ns);
+void LatHistMerge(LatHist *dst, const LatHist *src);
+__u64 LatHistValue(const LatHist *h, double p);
+void LatHistPrint(const LatHist *h);
+
+#endif    /* _RT_H_ */
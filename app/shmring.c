@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shmring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define RING_PAGE 4096
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+//读到正在写的槽位时先pause自旋这么多次，之后每次让出CPU，发布者被抢占时不空转占满一个核
+#define RING_SPIN_LIMIT 64
+
+__u64 RingNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void RingRelax(int *spins)
+{
+    if(++*spins > RING_SPIN_LIMIT){
+        sched_yield();
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void RingWake(_Atomic __u32 *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int RingWait(const _Atomic __u32 *addr, __u32 val, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    //映射是只读的，只能用共享(非PRIVATE)futex
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+//每个连上来的订阅者收到memfd后断开
+static void *RingAcceptThread(void *arg)
+{
+    RingPub *pub = arg;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte = 'r';
+    int conn;
+
+    while(pub->running){
+        conn = accept4(pub->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(conn == -1){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            break;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        memset(cbuf, 0, sizeof(cbuf));
+        iov.iov_base = &byte;
+        iov.iov_len  = 1;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pub->memfd, sizeof(int));
+        if(sendmsg(conn, &msg, MSG_NOSIGNAL) == -1){
+            printf("ring: send memfd failed : %s\n", strerror(errno));
+        }
+        close(conn);
+    }
+    return NULL;
+}
+
+int RingCreate(RingPub *pub, const char *path, __u32 slots, __u32 width, __u32 height,
+               __u32 pixelformat, __u32 bytesperline, __u32 frame_size)
+{
+    struct sockaddr_un addr;
+    size_t meta;
+    __u32 stride;
+
+    memset(pub, 0, sizeof(*pub));
+    pub->memfd = -1;
+    pub->listen_fd = -1;
+    if(slots < 2 || slots > RING_MAX_SLOTS){
+        printf("ring slots must be 2 to %d\n", RING_MAX_SLOTS);
+        return -1;
+    }
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        printf("ring socket path too long \'%s\'\n", path);
+        return -1;
+    }
+
+    stride = ALIGN_UP(frame_size, RING_PAGE);
+    meta = ALIGN_UP(sizeof(RingHeader) + slots * sizeof(RingSlot), RING_PAGE);
+    pub->map_size = meta + (size_t)slots * stride;
+
+    pub->memfd = memfd_create("vvring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(pub->memfd == -1 || ftruncate(pub->memfd, pub->map_size) == -1){
+        printf("ring memfd failed : %s\n", strerror(errno));
+        goto err;
+    }
+    pub->map = mmap(NULL, pub->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, pub->memfd, 0);
+    if(pub->map == MAP_FAILED){
+        pub->map = NULL;
+        printf("ring mmap failed : %s\n", strerror(errno));
+        goto err;
+    }
+    //订阅者拿到同一个fd也只能只读映射，F_SEAL_FUTURE_WRITE需要5.1以上内核
+    if(fcntl(pub->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) == -1 &&
+       fcntl(pub->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1){
+        printf("ring seal failed : %s\n", strerror(errno));
+    }
+
+    pub->hdr  = (RingHeader *)pub->map;
+    pub->slot = (RingSlot *)(pub->map + sizeof(RingHeader));
+    pub->hdr->magic        = RING_MAGIC;
+    pub->hdr->version      = RING_VERSION;
+    pub->hdr->slots        = slots;
+    pub->hdr->frame_size   = frame_size;
+    pub->hdr->slot_stride  = stride;
+    pub->hdr->data_offset  = meta;
+    pub->hdr->width        = width;
+    pub->hdr->height       = height;
+    pub->hdr->pixelformat  = pixelformat;
+    pub->hdr->bytesperline = bytesperline;
+    pub->hdr->pid          = getpid();
+
+    pub->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(pub->listen_fd == -1){
+        printf("ring socket failed : %s\n", strerror(errno));
+        goto err;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(bind(pub->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(pub->listen_fd, 16) == -1){
+        printf("ring bind \'%s\' failed : %s\n", path, strerror(errno));
+        goto err;
+    }
+    strcpy(pub->path, path);
+
+    pub->running = 1;
+    if(pthread_create(&pub->acceptor, NULL, RingAcceptThread, pub) != 0){
+        printf("ring acceptor thread failed\n");
+        pub->running = 0;
+        goto err;
+    }
+
+    printf("ring:%s %u slots of %u bytes\n", path, slots, stride);
+    return 0;
+
+err:
+    RingDestroy(pub);
+    return -1;
+}
+
+//拷入下一个槽位，写入期间seq为奇数
+int RingPublish(RingPub *pub, const void *data, __u32 sequence, __u64 timestamp)
+{
+    RingHeader *hdr = pub->hdr;
+    __u64 frame_no = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    __u32 index = frame_no % hdr->slots;
+    RingSlot *slot = &pub->slot[index];
+    __u32 seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(pub->map + hdr->data_offset + (size_t)index * hdr->slot_stride, data, hdr->frame_size);
+    slot->sequence   = sequence;
+    slot->frame_no   = frame_no;
+    slot->timestamp  = timestamp;
+    slot->publish_ns = RingNow();
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&hdr->head, frame_no + 1, memory_order_release);
+    atomic_fetch_add_explicit(&hdr->futex, 1, memory_order_release);
+    RingWake(&hdr->futex);
+    return 0;
+}
+
+void RingDestroy(RingPub *pub)
+{
+    if(pub->running){
+        pub->running = 0;
+        //唤醒阻塞在accept中的线程
+        shutdown(pub->listen_fd, SHUT_RDWR);
+        pthread_join(pub->acceptor, NULL);
+    }
+    if(pub->listen_fd != -1){
+        close(pub->listen_fd);
+        pub->listen_fd = -1;
+    }
+    if(pub->path[0]){
+        unlink(pub->path);
+        pub->path[0] = 0;
+    }
+    if(pub->map){
+        munmap(pub->map, pub->map_size);
+        pub->map = NULL;
+    }
+    if(pub->memfd != -1){
+        close(pub->memfd);
+        pub->memfd = -1;
+    }
+}
+
+static int RingRecvFd(int sock)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len  = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0){
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int RingAttach(RingSub *sub, const char *path)
+{
+    struct sockaddr_un addr;
+    RingHeader hdr;
+    int sock, fd;
+
+    memset(sub, 0, sizeof(*sub));
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        printf("ring socket path too long \'%s\'\n", path);
+        return -1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1){
+        printf("ring socket failed : %s\n", strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        printf("ring connect \'%s\' failed : %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    fd = RingRecvFd(sock);
+    close(sock);
+    if(fd == -1){
+        printf("ring receive memfd failed : %s\n", strerror(errno));
+        return -1;
+    }
+
+    if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != RING_MAGIC || hdr.version != RING_VERSION){
+        printf("\'%s\': not a frame ring\n", path);
+        close(fd);
+        return -1;
+    }
+    sub->map_size = hdr.data_offset + (size_t)hdr.slots * hdr.slot_stride;
+    sub->map = mmap(NULL, sub->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(sub->map == MAP_FAILED){
+        sub->map = NULL;
+        printf("ring mmap failed : %s\n", strerror(errno));
+        return -1;
+    }
+    sub->hdr  = (const RingHeader *)sub->map;
+    sub->slot = (const RingSlot *)(sub->map + sizeof(RingHeader));
+    //只读之后发布的帧
+    sub->last = atomic_load_explicit(&sub->hdr->head, memory_order_acquire);
+    return 0;
+}
+
+//取比上次更新的最新一帧，返回1；timeout_ms内没有新帧返回0，<0一直等
+int RingNext(RingSub *sub, RingFrame *frame, int timeout_ms)
+{
+    const RingHeader *hdr = sub->hdr;
+    const RingSlot *slot;
+    __u64 head, deadline = 0, now;
+    __u32 futex, seq, index;
+    int wait_ms, spins = 0;
+
+    if(timeout_ms > 0){
+        deadline = RingNow() + timeout_ms * 1000000ULL;
+    }
+    for(;;){
+        futex = atomic_load_explicit(&hdr->futex, memory_order_acquire);
+        head  = atomic_load_explicit(&hdr->head, memory_order_acquire);
+        if(head != sub->last){
+            index = (head - 1) % hdr->slots;
+            slot  = &sub->slot[index];
+            seq   = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            //正在写，或者已经被更新的帧覆盖
+            if((seq & 1) || slot->frame_no != head - 1){
+                RingRelax(&spins);
+                continue;
+            }
+            frame->data       = sub->map + hdr->data_offset + (size_t)index * hdr->slot_stride;
+            frame->sequence   = slot->sequence;
+            frame->frame_no   = slot->frame_no;
+            frame->timestamp  = slot->timestamp;
+            frame->publish_ns = slot->publish_ns;
+            frame->index      = index;
+            frame->skipped    = head - 1 - sub->last;
+            atomic_thread_fence(memory_order_acquire);
+            frame->token = seq;
+            if(atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq){
+                RingRelax(&spins);
+                continue;
+            }
+            sub->last = head;
+            return 1;
+        }
+
+        wait_ms = -1;
+        if(timeout_ms == 0){
+            return 0;
+        }
+        if(timeout_ms > 0){
+            now = RingNow();
+            if(now >= deadline){
+                return 0;
+            }
+            wait_ms = (deadline - now + 999999) / 1000000;
+        }
+        if(RingWait(&hdr->futex, futex, wait_ms) == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT){
+            printf("ring futex wait failed : %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+//帧数据处理完后调用，返回0表示处理期间槽位已被改写
+int RingValid(const RingSub *sub, const RingFrame *frame)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&sub->slot[frame->index].seq, memory_order_relaxed) == frame->token;
+}
+
+void RingDetach(RingSub *sub)
+{
+    if(sub->map){
+        munmap((void *)sub->map, sub->map_size);
+    }
+    memset(sub, 0, sizeof(*sub));
+}
@@ -0,0 +1,92 @@
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/types.h>
+
+/*
+共享内存帧环
+发布者把出队的帧拷进memfd中的若干槽位，每个槽位有seqlock头(写入期间seq为奇数)；
+订阅者经unix socket(SCM_RIGHTS)拿到memfd后只读映射，直接读最新一帧，有新帧时不做系统调用，
+没有新帧时在头部的futex上等待；帧在订阅者处理期间可能被覆盖，处理完用RingValid确认
+*/
+
+#define RING_MAGIC     0x52565656   /*'VVVR'*/
+#define RING_VERSION   1
+#define RING_MAX_SLOTS 64
+#define RING_DEF_SLOTS 8
+
+typedef struct
+{
+    __u32 magic;
+    __u32 version;
+    __u32 slots;
+    __u32 frame_size;
+    __u32 slot_stride;    /*页对齐*/
+    __u32 data_offset;    /*第0个槽位的数据*/
+    __u32 width;
+    __u32 height;
+    __u32 pixelformat;
+    __u32 bytesperline;
+    __u32 pid;            /*发布者*/
+    _Atomic __u64 head __attribute__((aligned(64)));   /*已发布的帧数，最新一帧在槽位(head-1)%slots*/
+    _Atomic __u32 futex;  /*每发布一帧加1*/
+} __attribute__((aligned(64))) RingHeader;
+
+typedef struct
+{
+    _Atomic __u32 seq;    /*奇数表示正在写*/
+    __u32 sequence;       /*v4l2_buffer.sequence*/
+    __u64 frame_no;       /*第几次发布*/
+    __u64 timestamp;      /*采集时间戳，纳秒*/
+    __u64 publish_ns;     /*发布完成的CLOCK_MONOTONIC时刻*/
+} __attribute__((aligned(64))) RingSlot;
+
+typedef struct
+{
+    int memfd;
+    int listen_fd;
+    char path[108];
+    __u8 *map;
+    size_t map_size;
+    RingHeader *hdr;
+    RingSlot *slot;
+    pthread_t acceptor;
+    int running;
+} RingPub;
+
+typedef struct
+{
+    const __u8 *map;
+    size_t map_size;
+    const RingHeader *hdr;
+    const RingSlot *slot;
+    __u64 last;           /*已读到的head*/
+} RingSub;
+
+typedef struct
+{
+    const __u8 *data;     /*映射中的帧，不拷贝*/
+    __u32 sequence;
+    __u64 frame_no;
+    __u64 timestamp;
+    __u64 publish_ns;
+    __u32 index;
+    __u32 token;          /*读取时的seq*/
+    __u64 skipped;        /*与上一次读到的帧之间错过的帧数*/
+} RingFrame;
+
+int RingCreate(RingPub *pub, const char *path, __u32 slots, __u32 width, __u32 height,
+               __u32 pixelformat, __u32 bytesperline, __u32 frame_size);
+int RingPublish(RingPub *pub, const void *data, __u32 sequence, __u64 timestamp);
+void RingDestroy(RingPub *pub);
+
+int RingAttach(RingSub *sub, const char *path);
+int RingNext(RingSub *sub, RingFrame *frame, int timeout_ms);
+int RingValid(const RingSub *sub, const RingFrame *frame);
+void RingDetach(RingSub *sub);
+
+__u64 RingNow(void);
+
+#endif    /* _SHMRING_H_ */
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rt.h"
+#include "shmring.h"
+
+#define SUBSCRIBE_FRAMES 100
+
+static void usage(const char *prog)
+{
+    printf("usage: %s -P socket [-n frames] [-v]\n", prog);
+    printf("  -P socket   ring published by test.elf -P\n");
+    printf("  -n frames   number of frames to read (default %d)\n", SUBSCRIBE_FRAMES);
+    printf("  -v          print every frame\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    unsigned int frames = SUBSCRIBE_FRAMES, count;
+    int verbose = 0;
+    int exit_code = 0;
+    RingSub sub;
+    RingFrame frame;
+    LatHist *pub_hist, *cap_hist;
+    __u64 now, start = 0, skipped = 0, torn = 0;
+    int opt, retval;
+
+    while((opt = getopt(argc, argv, "P:n:vh")) != -1){
+        switch(opt){
+        case 'P':
+            path = optarg;
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(!path){
+        usage(argv[0]);
+        return -1;
+    }
+
+    pub_hist = malloc(sizeof(*pub_hist));
+    cap_hist = malloc(sizeof(*cap_hist));
+    if(!pub_hist || !cap_hist){
+        printf("Unable to alloc latency histograms\n");
+        return -1;
+    }
+    LatHistInit(pub_hist, "publish to read latency");
+    LatHistInit(cap_hist, "frame timestamp to read latency");
+
+    if(RingAttach(&sub, path) != 0){
+        return -1;
+    }
+    printf("ring:%s %ux%u %c%c%c%c, %u slots, publisher pid %u\n", path, sub.hdr->width, sub.hdr->height,
+           sub.hdr->pixelformat & 0xff, (sub.hdr->pixelformat >> 8) & 0xff,
+           (sub.hdr->pixelformat >> 16) & 0xff, (sub.hdr->pixelformat >> 24) & 0xff,
+           sub.hdr->slots, sub.hdr->pid);
+
+    for(count = 0; count < frames; count++){
+        retval = RingNext(&sub, &frame, 2000);
+        if(retval <= 0){
+            if(retval == 0){
+                printf("ring: no frame for 2s\n");
+            }
+            exit_code = -2;
+            break;
+        }
+        now = RingNow();
+        if(count == 0){
+            start = now;
+        } else {
+            //第一帧可能是连上之前发布的
+            skipped += frame.skipped;
+        }
+        LatHistRecord(pub_hist, now - frame.publish_ns);
+        //驱动时间戳同为CLOCK_MONOTONIC
+        LatHistRecord(cap_hist, now - frame.timestamp);
+
+        //frame.data在这里直接使用，不拷贝
+
+        if(!RingValid(&sub, &frame)){
+            torn++;
+        }
+        if(verbose){
+            printf("frame %llu sequence %u slot %u%s\n", (unsigned long long)frame.frame_no, frame.sequence,
+                   frame.index, frame.skipped ? " (skipped some)" : "");
+        }
+    }
+
+    if(count > 1){
+        printf("%u frames, %.2f fps, skipped %llu, overwritten while reading %llu\n", count,
+               (count - 1) / ((RingNow() - start) / 1e9), (unsigned long long)skipped, (unsigned long long)torn);
+    }
+    LatHistPrint(pub_hist);
+    LatHistPrint(cap_hist);
+    RingDetach(&sub);
+    free(pub_hist);
+    free(cap_hist);
+    return exit_code;
+}
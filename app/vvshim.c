@@ -0,0 +1,1139 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <linux/videodev2.h>
+#include "virtual_video.h"
+#include "crc32c.h"
+
+/*
+virtual_video驱动的用户态替身，以LD_PRELOAD方式接管对设备节点的open/close/ioctl/mmap，
+无需加载内核模块和root权限即可运行和测试app：
+    $ LD_PRELOAD=out/libvvshim.so out/test.elf
+实现与驱动相同的ioctl：QUERYCAP、ENUM/G/S/TRY_FMT、REQBUFS、QUERYBUF、QBUF、DQBUF、STREAMON/OFF，
+G/S_CTRL(仅V4L2_CID_VIRTUAL_VIDEO_CHECKSUM)、SUBSCRIBE/UNSUBSCRIBE_EVENT、DQEVENT(分片和校验事件)以及read()，生成与驱动相同的图案。
+返回给应用的fd是eventfd，已完成的帧数即其计数，poll/select可直接使用POLLIN；有待取事件时的POLLPRI由接管的poll()报告；
+MMAP缓冲区放在memfd中，应用对fd的mmap被转为对memfd的mmap；USERPTR缓冲区直接写入应用给出的地址
+环境变量:
+    VV_SHIM_DEV     接管的设备节点，逗号分隔，最多4个，默认/dev/video0
+    VV_SHIM_FPS     帧率，默认30，0表示不限速
+    VV_SHIM_GROUP   非0时所有节点同属一个时钟组(驱动的group=)，在同一时刻出帧，时间戳和sequence相同
+    VV_SHIM_DEBUG   非0时打印ioctl
+    VV_SHIM_SLICES  N>1时每帧分N片生成(驱动的slices=)，帧周期均分到各分片，每片之后发分片事件
+    VV_SHIM_CORRUPT N>0时在校验值算好之后改坏sequence为N的倍数的帧的第一个字节，用于检验-V
+*/
+
+#define SHIM_MIN_BUF   4
+#define SHIM_MAX_BUF   32
+#define SHIM_VID_LIMIT 16   /* Video memory limit, in Mb */
+#define SHIM_MAX_DEVS  4
+#define SHIM_MAX_EVENTS 32  /* per device, the oldest is dropped like v4l2_event_queue */
+#define SHIM_MAX_POLL  64   /* poll() with more fds than this reports no POLLPRI */
+
+/* bit of a private event type in shim_dev.events */
+#define SHIM_EVENT_BIT(type) (1U << ((type) - V4L2_EVENT_PRIVATE_START))
+
+enum {
+    BUF_DEQUEUED = 0,
+    BUF_QUEUED,
+    BUF_DONE,
+};
+
+struct shim_fmt {
+    const char *name;
+    __u32 fourcc;
+    int depth;           /* 10 is 4 pixels in 5 bytes */
+    int bayer;
+};
+
+static const struct shim_fmt format[] = {
+    { "ARGB8888, 32 bpp",              V4L2_PIX_FMT_RGB32,    32, 0 },
+    { "32 bpp RGB, be",                V4L2_PIX_FMT_BGR32,    32, 0 },
+    { "8-bit Bayer RGRG/GBGB",         V4L2_PIX_FMT_SRGGB8,   8,  1 },
+    { "10-bit Bayer RGRG/GBGB",        V4L2_PIX_FMT_SRGGB10,  16, 1 },
+    { "10-bit Bayer RGRG/GBGB Packed", V4L2_PIX_FMT_SRGGB10P, 10, 1 },
+};
+
+struct shim_buffer {
+    __u32 state;
+    __u32 sequence;
+    struct timeval timestamp;
+    unsigned long userptr;   /* V4L2_MEMORY_USERPTR */
+    __u32 length;
+};
+
+struct shim_dev {
+    int fd;              /* eventfd returned to the application */
+    int memfd;           /* backing store of all buffers */
+    int nonblock;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+
+    const struct shim_fmt *fmt;
+    __u32 width, height;
+    __u32 field;
+    __u32 size;          /* bytes per frame */
+    __u32 buf_stride;    /* PAGE_ALIGN(size), offset step between buffers */
+
+    struct shim_buffer buf[SHIM_MAX_BUF];
+    __u32 count;
+    __u32 memory;        /* V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR */
+    __u8 *map;           /* producer view of memfd */
+    __u32 queued[SHIM_MAX_BUF], q_head, q_len;   /* FIFO of queued buffer indices */
+    __u32 done[SHIM_MAX_BUF], d_head, d_len;     /* FIFO of filled buffer indices */
+
+    int streaming;
+    int reading;         /* streaming through read(), like videobuf_read_stream */
+    int read_index;      /* buffer being copied out, -1 if none */
+    __u32 read_off;
+    pthread_t producer;
+    __u32 sequence;
+    unsigned int fps;
+    int checksum;        /* V4L2_CID_VIRTUAL_VIDEO_CHECKSUM, kept across opens like a control */
+
+    __u32 events;                        /* subscribed types, SHIM_EVENT_BIT */
+    struct v4l2_event evq[SHIM_MAX_EVENTS];
+    __u32 e_head, e_len, e_seq;
+    int ev_fd;                           /* eventfd counting queued events, poll() maps it to POLLPRI */
+};
+
+static struct shim_dev shims[SHIM_MAX_DEVS] = {
+    [0 ... SHIM_MAX_DEVS - 1] = { .fd = -1, .memfd = -1, .ev_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .done_cond = PTHREAD_COND_INITIALIZER },
+};
+static int shim_debug;
+static int shim_group;
+static unsigned int shim_corrupt;
+static unsigned int shim_slices;
+static struct timespec shim_epoch;  /* tick 0 of the clock group */
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static void *(*real_mmap64)(void *, size_t, int, int, int, off64_t);
+
+static void shim_resolve(void)
+{
+    if(real_ioctl){
+        return;
+    }
+    real_open   = dlsym(RTLD_NEXT, "open");
+    real_open64 = dlsym(RTLD_NEXT, "open64");
+    real_close  = dlsym(RTLD_NEXT, "close");
+    real_read   = dlsym(RTLD_NEXT, "read");
+    real_ioctl  = dlsym(RTLD_NEXT, "ioctl");
+    real_poll   = dlsym(RTLD_NEXT, "poll");
+    real_mmap   = dlsym(RTLD_NEXT, "mmap");
+    real_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+    shim_debug  = getenv("VV_SHIM_DEBUG") ? atoi(getenv("VV_SHIM_DEBUG")) : 0;
+    shim_group  = getenv("VV_SHIM_GROUP") ? atoi(getenv("VV_SHIM_GROUP")) : 0;
+    shim_corrupt = getenv("VV_SHIM_CORRUPT") ? strtoul(getenv("VV_SHIM_CORRUPT"), NULL, 0) : 0;
+    shim_slices  = getenv("VV_SHIM_SLICES") ? strtoul(getenv("VV_SHIM_SLICES"), NULL, 0) : 0;
+    clock_gettime(CLOCK_MONOTONIC, &shim_epoch);
+}
+
+/* position of path in VV_SHIM_DEV, -1 if it is not a shim node */
+static int shim_is_dev(const char *path)
+{
+    const char *list = getenv("VV_SHIM_DEV");
+    const char *p;
+    size_t len;
+    int i;
+
+    if(!path){
+        return -1;
+    }
+    if(!list){
+        return strcmp(path, "/dev/video0") == 0 ? 0 : -1;
+    }
+    len = strlen(path);
+    for(i = 0, p = list; i < SHIM_MAX_DEVS && *p; i++){
+        if(strncmp(p, path, len) == 0 && (p[len] == ',' || p[len] == '\0')){
+            return i;
+        }
+        p = strchrnul(p, ',');
+        if(*p == ','){
+            p++;
+        }
+    }
+    return -1;
+}
+
+static struct shim_dev *shim_by_fd(int fd)
+{
+    int i;
+
+    for(i = 0; fd != -1 && i < SHIM_MAX_DEVS; i++){
+        if(shims[i].fd == fd){
+            return &shims[i];
+        }
+    }
+    return NULL;
+}
+
+static const struct shim_fmt *shim_format_by_fourcc(__u32 fourcc)
+{
+    unsigned int i;
+
+    for(i = 0; i < sizeof(format) / sizeof(format[0]); i++){
+        if(format[i].fourcc == fourcc){
+            return &format[i];
+        }
+    }
+    return NULL;
+}
+
+/* whole 2x2 filter cells, whole 4 pixel groups when packed */
+static void shim_align(const struct shim_fmt *fmt, __u32 *width, __u32 *height)
+{
+    __u32 align = fmt->depth == 10 ? 4 : 2;
+
+    if(!fmt->bayer){
+        return;
+    }
+    *width  = *width / align * align;
+    *height = *height / 2 * 2;
+    if(*width < align){
+        *width = align;
+    }
+    if(*height < 2){
+        *height = 2;
+    }
+}
+
+/* the driver's bayer_band_byte: byte i of a row of band b (0 blue, 1 green, 2 red) behind an RGGB filter */
+static __u8 shim_bayer_byte(int depth, __u32 b, __u32 y, __u32 i)
+{
+    __u32 x = depth == 16 ? i / 2 : i, k;
+    __u32 colour = (y & 1) ? ((x & 1) ? 0 : 1) : ((x & 1) ? 1 : 2);
+    __u8 lo = 0;
+
+    if(depth == 10 && i == 4){
+        for(k = 0; k < 4; k++){
+            colour = (y & 1) ? ((k & 1) ? 0 : 1) : ((k & 1) ? 1 : 2);
+            if(colour == b){
+                lo |= 3 << (2 * k);
+            }
+        }
+        return lo;
+    }
+    if(colour != b){
+        return 0x00;
+    }
+    return depth == 16 && (i & 1) ? 0x03 : 0xff;
+}
+
+/* bytes [start, end) of the frame, start on a row boundary */
+static void shim_fill_bayer(struct shim_dev *dev, __u8 *vbuf, __u32 start, __u32 end)
+{
+    __u32 period = dev->fmt->depth == 8 ? 2 : (dev->fmt->depth == 16 ? 4 : 5);
+    __u32 bpl = (dev->width * dev->fmt->depth) >> 3;
+    __u32 step = dev->size / 3;
+    __u32 o, b, y, i, phase = 0;
+    __u8 tile[3][2][5];
+
+    for(b = 0; b < 3; b++){
+        for(y = 0; y < 2; y++){
+            for(i = 0; i < period; i++){
+                tile[b][y][i] = shim_bayer_byte(dev->fmt->depth, b, y, i);
+            }
+        }
+    }
+    for(o = start; o < end; o++){
+        if(o % bpl == 0){
+            phase = 0;
+        }
+        b = o - phase < step ? 0 : (o - phase < step * 2 ? 1 : 2);
+        vbuf[o] = tile[b][(o / bpl) & 1][phase];
+        if(++phase == period){
+            phase = 0;
+        }
+    }
+}
+
+/* same three colour bands as the driver's tick_timer_function, rows [first, last) */
+static void shim_fill(struct shim_dev *dev, __u8 *vbuf, __u32 first, __u32 last)
+{
+    __u32 bpl = (dev->width * dev->fmt->depth) >> 3;
+    __u32 size = last == dev->height ? dev->size : last * bpl;
+    __u32 step = dev->size / 3;
+    __u32 i = first * bpl;
+    __u8 band[3][4];
+
+    if(dev->fmt->bayer){
+        shim_fill_bayer(dev, vbuf, i, size);
+        return;
+    }
+    if(dev->fmt->fourcc == V4L2_PIX_FMT_RGB32){
+        memcpy(band[0], "\x00\x00\x00\xff", 4);
+        memcpy(band[1], "\x00\x00\xff\x00", 4);
+        memcpy(band[2], "\x00\xff\x00\x00", 4);
+    } else {
+        memcpy(band[0], "\xff\x00\x00\xff", 4);
+        memcpy(band[1], "\x00\xff\x00\xff", 4);
+        memcpy(band[2], "\x00\x00\xff\xff", 4);
+    }
+    for(; i < step && i < size; i += 4){
+        memcpy(vbuf + i, band[0], 4);
+    }
+    for(; i < step * 2 && i < size; i += 4){
+        memcpy(vbuf + i, band[1], 4);
+    }
+    for(; i < size; i += 4){
+        memcpy(vbuf + i, band[2], 4);
+    }
+}
+
+static __u8 *shim_buf_addr(struct shim_dev *dev, __u32 index)
+{
+    if(dev->memory == V4L2_MEMORY_USERPTR){
+        return (__u8 *)dev->buf[index].userptr;
+    }
+    return dev->map + (size_t)index * dev->buf_stride;
+}
+
+static __s64 shim_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void shim_set_ns(struct timespec *ts, __s64 ns)
+{
+    ts->tv_sec  = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+/* the clock starts over from now, on the group's grid when grouped */
+static void shim_clock_start(struct shim_dev *dev, struct timespec *next)
+{
+    __s64 period;
+
+    clock_gettime(CLOCK_MONOTONIC, next);
+    if(shim_group && dev->fps){
+        /* ticks of the group are epoch + n / fps, n is the sequence of the frame */
+        period = 1000000000LL / dev->fps;
+        dev->sequence = (shim_ns(next) - shim_ns(&shim_epoch)) / period + 1;
+        shim_set_ns(next, shim_ns(&shim_epoch) + (dev->sequence - 1) * period);
+    }
+}
+
+/* one frame period, or the share of it each slice gets */
+static void shim_tick(struct shim_dev *dev, struct timespec *next)
+{
+    next->tv_nsec += 1000000000L / dev->fps / (shim_slices > 1 ? shim_slices : 1);
+    if(next->tv_nsec >= 1000000000L){
+        next->tv_nsec -= 1000000000L;
+        next->tv_sec++;
+    }
+}
+
+/* like v4l2_event_queue, called with the lock held */
+static void shim_queue_event(struct shim_dev *dev, __u32 type, const void *data, size_t len)
+{
+    struct v4l2_event *ev;
+    struct timespec ts;
+    __u64 one = 1;
+
+    if(!(dev->events & SHIM_EVENT_BIT(type))){
+        return;
+    }
+    if(dev->e_len == SHIM_MAX_EVENTS){
+        dev->e_head = (dev->e_head + 1) % SHIM_MAX_EVENTS;
+        dev->e_len--;
+    } else if(write(dev->ev_fd, &one, sizeof(one)) != sizeof(one)){
+        perror("vvshim: eventfd write");
+    }
+    ev = &dev->evq[(dev->e_head + dev->e_len) % SHIM_MAX_EVENTS];
+    dev->e_len++;
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->sequence = dev->e_seq++;
+    memcpy(ev->u.data, data, len);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->timestamp = ts;
+    pthread_cond_broadcast(&dev->done_cond);
+}
+
+static int shim_dqevent(struct shim_dev *dev, struct v4l2_event *p)
+{
+    __u64 cnt;
+
+    pthread_mutex_lock(&dev->lock);
+    while(dev->e_len == 0){
+        if(dev->nonblock){
+            pthread_mutex_unlock(&dev->lock);
+            errno = ENOENT;
+            return -1;
+        }
+        pthread_cond_wait(&dev->done_cond, &dev->lock);
+    }
+    *p = dev->evq[dev->e_head];
+    dev->e_head = (dev->e_head + 1) % SHIM_MAX_EVENTS;
+    dev->e_len--;
+    p->pending = dev->e_len;
+    if(real_read(dev->ev_fd, &cnt, sizeof(cnt)) != sizeof(cnt)){
+        perror("vvshim: eventfd read");
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+static int shim_subscribe(struct shim_dev *dev, unsigned long request, const struct v4l2_event_subscription *sub)
+{
+    if(request == VIDIOC_UNSUBSCRIBE_EVENT){
+        pthread_mutex_lock(&dev->lock);
+        if(sub->type == V4L2_EVENT_ALL){
+            dev->events = 0;
+        } else if(sub->type == V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM || sub->type == V4L2_EVENT_VIRTUAL_VIDEO_SLICE){
+            dev->events &= ~SHIM_EVENT_BIT(sub->type);
+        }
+        pthread_mutex_unlock(&dev->lock);
+        return 0;
+    }
+    if(sub->type != V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM && sub->type != V4L2_EVENT_VIRTUAL_VIDEO_SLICE){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&dev->lock);
+    dev->events |= SHIM_EVENT_BIT(sub->type);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+static void *shim_producer(void *arg)
+{
+    struct shim_dev *dev = arg;
+    struct timespec next;
+    struct timespec ts;
+    struct timeval tv;
+    __u64 one = 1;
+    struct virtual_video_checksum_event sum;
+    struct virtual_video_slice_event slice;
+    __u32 index, n, first, rows;
+    __u8 *vbuf;
+
+    pthread_mutex_lock(&dev->lock);
+    shim_clock_start(dev, &next);
+    while(dev->streaming){
+        /* like the driver's parked frame clock, no ticks until the next QBUF */
+        if(dev->q_len == 0){
+            pthread_cond_wait(&dev->done_cond, &dev->lock);
+            if(dev->q_len){
+                shim_clock_start(dev, &next);
+            }
+            continue;
+        }
+        if(dev->fps){
+            shim_tick(dev, &next);
+            pthread_mutex_unlock(&dev->lock);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            pthread_mutex_lock(&dev->lock);
+            if(!dev->streaming){
+                break;
+            }
+        }
+
+        dev->sequence++;
+        if(dev->q_len == 0){
+            continue;
+        }
+        index = dev->queued[dev->q_head];
+        dev->q_head = (dev->q_head + 1) % SHIM_MAX_BUF;
+        dev->q_len--;
+        pthread_mutex_unlock(&dev->lock);
+
+        vbuf = shim_buf_addr(dev, index);
+        if(shim_slices <= 1){
+            shim_fill(dev, vbuf, 0, dev->height);
+        } else {
+            /* the driver's render_slice: one slice per tick, an event after each */
+            rows = (dev->height + shim_slices - 1) / shim_slices;
+            for(n = 0, first = 0; first < dev->height; n++, first += rows){
+                if(n && dev->fps){
+                    shim_tick(dev, &next);
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+                }
+                slice.index       = index;
+                slice.sequence    = dev->sequence - 1;
+                slice.lines_ready = first + rows < dev->height ? first + rows : dev->height;
+                slice.height      = dev->height;
+                shim_fill(dev, vbuf, first, slice.lines_ready);
+                pthread_mutex_lock(&dev->lock);
+                shim_queue_event(dev, V4L2_EVENT_VIRTUAL_VIDEO_SLICE, &slice, sizeof(slice));
+                pthread_mutex_unlock(&dev->lock);
+            }
+        }
+        if(dev->checksum){
+            sum.index     = index;
+            sum.sequence  = dev->sequence - 1;
+            sum.bytesused = dev->size;
+            sum.crc       = Crc32cFrame(dev->sequence - 1, vbuf, dev->size);
+            if(shim_corrupt && (dev->sequence - 1) % shim_corrupt == 0){
+                vbuf[0] ^= 0xff;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if(shim_group && dev->fps){
+            ts = next;      /* the tick, same for every node of the group */
+        }
+        tv.tv_sec  = ts.tv_sec;
+        tv.tv_usec = ts.tv_nsec / 1000;
+
+        pthread_mutex_lock(&dev->lock);
+        /* the driver queues it before marking the buffer done */
+        if(dev->checksum){
+            shim_queue_event(dev, V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM, &sum, sizeof(sum));
+        }
+        dev->buf[index].state     = BUF_DONE;
+        dev->buf[index].sequence  = dev->sequence - 1;
+        dev->buf[index].timestamp = tv;
+        dev->done[(dev->d_head + dev->d_len) % SHIM_MAX_BUF] = index;
+        dev->d_len++;
+        if(write(dev->fd, &one, sizeof(one)) != sizeof(one)){
+            perror("vvshim: eventfd write");
+        }
+        pthread_cond_broadcast(&dev->done_cond);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+static void shim_free_buffers(struct shim_dev *dev)
+{
+    if(dev->map){
+        munmap(dev->map, (size_t)dev->count * dev->buf_stride);
+        dev->map = NULL;
+    }
+    if(dev->memfd != -1){
+        real_close(dev->memfd);
+        dev->memfd = -1;
+    }
+    dev->count = 0;
+    dev->memory = V4L2_MEMORY_MMAP;
+}
+
+static void shim_streamoff(struct shim_dev *dev)
+{
+    __u64 cnt;
+    __u32 i;
+
+    pthread_mutex_lock(&dev->lock);
+    if(!dev->streaming){
+        pthread_mutex_unlock(&dev->lock);
+        return;
+    }
+    dev->streaming = 0;
+    dev->reading = 0;
+    dev->read_index = -1;
+    pthread_cond_broadcast(&dev->done_cond);
+    pthread_mutex_unlock(&dev->lock);
+    pthread_join(dev->producer, NULL);
+
+    /* all buffers go back to userspace, drain the eventfd count */
+    for(i = 0; i < dev->count; i++){
+        dev->buf[i].state = BUF_DEQUEUED;
+    }
+    dev->q_len = dev->d_len = 0;
+    dev->q_head = dev->d_head = 0;
+    fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_NONBLOCK);
+    while(real_read(dev->fd, &cnt, sizeof(cnt)) == sizeof(cnt));
+    fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+static int shim_reqbufs(struct shim_dev *dev, struct v4l2_requestbuffers *p)
+{
+    __u32 count = p->count;
+
+    if(p->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || (p->memory != V4L2_MEMORY_MMAP && p->memory != V4L2_MEMORY_USERPTR)){
+        errno = EINVAL;
+        return -1;
+    }
+    if(dev->streaming){
+        errno = EBUSY;
+        return -1;
+    }
+    shim_free_buffers(dev);
+    if(count == 0){
+        return 0;
+    }
+
+    /* same trimming as the driver's buffer_setup */
+    dev->size = dev->fmt->depth * dev->width * dev->height >> 3;
+    dev->buf_stride = (dev->size + 4095) & ~4095;
+    if(count < SHIM_MIN_BUF){
+        count = SHIM_MIN_BUF;
+    }
+    if(count > SHIM_MAX_BUF){
+        count = SHIM_MAX_BUF;
+    }
+    while(count && dev->size * count > SHIM_VID_LIMIT * 1024 * 1024){
+        count--;
+    }
+    if(count == 0){
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(dev->buf, 0, sizeof(dev->buf));
+    if(p->memory == V4L2_MEMORY_USERPTR){
+        dev->count = count;
+        dev->memory = V4L2_MEMORY_USERPTR;
+        p->count = count;
+        return 0;
+    }
+
+    dev->memfd = memfd_create("vvshim", MFD_CLOEXEC);
+    if(dev->memfd == -1 || ftruncate(dev->memfd, (off_t)count * dev->buf_stride) == -1){
+        shim_free_buffers(dev);
+        return -1;
+    }
+    dev->map = real_mmap(NULL, (size_t)count * dev->buf_stride, PROT_READ | PROT_WRITE, MAP_SHARED, dev->memfd, 0);
+    if(dev->map == MAP_FAILED){
+        dev->map = NULL;
+        shim_free_buffers(dev);
+        return -1;
+    }
+    dev->count = count;
+    p->count = count;
+    return 0;
+}
+
+static void shim_fill_v4l2_buffer(struct shim_dev *dev, __u32 index, struct v4l2_buffer *p)
+{
+    struct shim_buffer *b = &dev->buf[index];
+
+    p->index     = index;
+    p->type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    p->memory    = dev->memory;
+    if(dev->memory == V4L2_MEMORY_USERPTR){
+        p->m.userptr = b->userptr;
+        p->length    = b->length;
+    } else {
+        p->m.offset  = index * dev->buf_stride;
+        p->length    = dev->size;
+    }
+    p->bytesused = b->state == BUF_DONE || b->state == BUF_DEQUEUED ? dev->size : 0;
+    p->field     = dev->field;
+    p->sequence  = b->sequence;
+    p->timestamp = b->timestamp;
+    p->flags     = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if(dev->memory == V4L2_MEMORY_MMAP){
+        p->flags |= V4L2_BUF_FLAG_MAPPED;
+    }
+    if(b->state == BUF_QUEUED){
+        p->flags |= V4L2_BUF_FLAG_QUEUED;
+    } else if(b->state == BUF_DONE){
+        p->flags |= V4L2_BUF_FLAG_DONE;
+    }
+}
+
+/* next filled buffer, called with the lock held */
+static int shim_wait_done(struct shim_dev *dev)
+{
+    __u64 cnt;
+    __u32 index;
+
+    while(dev->d_len == 0){
+        if(dev->nonblock || !dev->streaming){
+            errno = dev->streaming ? EAGAIN : EINVAL;
+            return -1;
+        }
+        pthread_cond_wait(&dev->done_cond, &dev->lock);
+    }
+    index = dev->done[dev->d_head];
+    dev->d_head = (dev->d_head + 1) % SHIM_MAX_BUF;
+    dev->d_len--;
+    if(real_read(dev->fd, &cnt, sizeof(cnt)) != sizeof(cnt)){
+        perror("vvshim: eventfd read");
+    }
+    return index;
+}
+
+static void shim_queue(struct shim_dev *dev, __u32 index)
+{
+    dev->buf[index].state = BUF_QUEUED;
+    dev->queued[(dev->q_head + dev->q_len) % SHIM_MAX_BUF] = index;
+    dev->q_len++;
+    pthread_cond_broadcast(&dev->done_cond);
+}
+
+static int shim_dqbuf(struct shim_dev *dev, struct v4l2_buffer *p)
+{
+    int index;
+
+    pthread_mutex_lock(&dev->lock);
+    if(dev->reading){
+        pthread_mutex_unlock(&dev->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    index = shim_wait_done(dev);
+    if(index < 0){
+        pthread_mutex_unlock(&dev->lock);
+        return -1;
+    }
+    shim_fill_v4l2_buffer(dev, index, p);
+    dev->buf[index].state = BUF_DEQUEUED;
+    p->flags &= ~V4L2_BUF_FLAG_DONE;
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+static int shim_ioctl(struct shim_dev *dev, unsigned long request, void *arg)
+{
+    struct v4l2_capability *cap;
+    struct v4l2_fmtdesc *fmtdesc;
+    struct v4l2_format *f;
+    struct v4l2_buffer *b;
+    struct v4l2_control *ctrl;
+    const struct shim_fmt *fmt;
+    int retval = 0;
+
+    switch(request){
+    case VIDIOC_QUERYCAP:
+        cap = arg;
+        memset(cap, 0, sizeof(*cap));
+        cap->version = 0x0001;
+        strcpy((char *)cap->driver,   "virtual_video");
+        strcpy((char *)cap->card,     "virtual_video");
+        strcpy((char *)cap->bus_info, "virtual_video");
+        cap->device_caps  = V4L2_CAP_STREAMING | V4L2_CAP_READWRITE | V4L2_CAP_VIDEO_CAPTURE;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+
+    case VIDIOC_ENUM_FMT:
+        fmtdesc = arg;
+        if(fmtdesc->index >= sizeof(format) / sizeof(format[0])){
+            errno = EINVAL;
+            return -1;
+        }
+        strcpy((char *)fmtdesc->description, format[fmtdesc->index].name);
+        fmtdesc->pixelformat = format[fmtdesc->index].fourcc;
+        return 0;
+
+    case VIDIOC_G_FMT:
+        f = arg;
+        f->fmt.pix.width        = dev->width;
+        f->fmt.pix.height       = dev->height;
+        f->fmt.pix.field        = dev->field;
+        f->fmt.pix.pixelformat  = dev->fmt->fourcc;
+        f->fmt.pix.colorspace   = V4L2_COLORSPACE_SMPTE170M;
+        f->fmt.pix.bytesperline = (f->fmt.pix.width * dev->fmt->depth) >> 3;
+        f->fmt.pix.sizeimage    = f->fmt.pix.height * f->fmt.pix.bytesperline;
+        return 0;
+
+    case VIDIOC_TRY_FMT:
+        /* the driver keeps the current size on TRY_FMT */
+        f = arg;
+        fmt = shim_format_by_fourcc(f->fmt.pix.pixelformat);
+        if(!fmt){
+            errno = EINVAL;
+            return -1;
+        }
+        f->fmt.pix.width        = dev->width & ~0x01;
+        f->fmt.pix.height       = dev->height;
+        shim_align(fmt, &f->fmt.pix.width, &f->fmt.pix.height);
+        f->fmt.pix.field        = V4L2_FIELD_INTERLACED;
+        f->fmt.pix.bytesperline = (f->fmt.pix.width * fmt->depth) >> 3;
+        f->fmt.pix.sizeimage    = f->fmt.pix.height * f->fmt.pix.bytesperline;
+        f->fmt.pix.colorspace   = V4L2_COLORSPACE_SMPTE170M;
+        return 0;
+
+    case VIDIOC_S_FMT:
+        f = arg;
+        fmt = shim_format_by_fourcc(f->fmt.pix.pixelformat);
+        if(!fmt || f->fmt.pix.width == 0 || f->fmt.pix.height == 0){
+            errno = EINVAL;
+            return -1;
+        }
+        if(dev->count){
+            errno = EBUSY;
+            return -1;
+        }
+        shim_align(fmt, &f->fmt.pix.width, &f->fmt.pix.height);
+        f->fmt.pix.bytesperline = (f->fmt.pix.width * fmt->depth) >> 3;
+        f->fmt.pix.sizeimage    = f->fmt.pix.height * f->fmt.pix.bytesperline;
+        dev->fmt    = fmt;
+        dev->width  = f->fmt.pix.width;
+        dev->height = f->fmt.pix.height;
+        dev->field  = f->fmt.pix.field;
+        return 0;
+
+    case VIDIOC_REQBUFS:
+        if(dev->reading){
+            errno = EBUSY;
+            return -1;
+        }
+        return shim_reqbufs(dev, arg);
+
+    case VIDIOC_QUERYBUF:
+        b = arg;
+        if(b->index >= dev->count){
+            errno = EINVAL;
+            return -1;
+        }
+        shim_fill_v4l2_buffer(dev, b->index, b);
+        return 0;
+
+    case VIDIOC_QBUF:
+        b = arg;
+        pthread_mutex_lock(&dev->lock);
+        if(dev->reading){
+            errno = EBUSY;
+            retval = -1;
+        } else if(b->index >= dev->count || b->memory != dev->memory || dev->buf[b->index].state != BUF_DEQUEUED){
+            errno = EINVAL;
+            retval = -1;
+        } else if(b->memory == V4L2_MEMORY_USERPTR && (!b->m.userptr || b->length < dev->buf_stride)){
+            /* videobuf wants at least PAGE_ALIGN(sizeimage) */
+            errno = EINVAL;
+            retval = -1;
+        } else {
+            if(b->memory == V4L2_MEMORY_USERPTR){
+                dev->buf[b->index].userptr = b->m.userptr;
+                dev->buf[b->index].length  = b->length;
+            }
+            shim_queue(dev, b->index);
+        }
+        pthread_mutex_unlock(&dev->lock);
+        return retval;
+
+    case VIDIOC_DQBUF:
+        return shim_dqbuf(dev, arg);
+
+    case VIDIOC_STREAMON:
+        pthread_mutex_lock(&dev->lock);
+        if(dev->reading){
+            errno = EBUSY;
+            retval = -1;
+        } else if(!dev->streaming){
+            if(dev->count == 0){
+                errno = EINVAL;
+                retval = -1;
+            } else {
+                dev->streaming = 1;
+                retval = pthread_create(&dev->producer, NULL, shim_producer, dev);
+                if(retval != 0){
+                    dev->streaming = 0;
+                    errno = retval;
+                    retval = -1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+        return retval;
+
+    case VIDIOC_STREAMOFF:
+        if(dev->reading){
+            errno = EBUSY;
+            return -1;
+        }
+        shim_streamoff(dev);
+        return 0;
+
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL:
+        ctrl = arg;
+        if(ctrl->id != V4L2_CID_VIRTUAL_VIDEO_CHECKSUM){
+            errno = EINVAL;
+            return -1;
+        }
+        if(request == VIDIOC_S_CTRL){
+            dev->checksum = ctrl->value != 0;
+        }
+        ctrl->value = dev->checksum;
+        return 0;
+
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+        return shim_subscribe(dev, request, arg);
+
+    case VIDIOC_DQEVENT:
+        return shim_dqevent(dev, arg);
+
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+/* read() streams through SHIM_MIN_BUF internal buffers like videobuf_read_stream, frames may be read in pieces */
+static ssize_t shim_read(struct shim_dev *dev, void *data, size_t count)
+{
+    struct v4l2_requestbuffers req;
+    ssize_t retval = 0;
+    size_t n;
+    int index;
+    __u32 i;
+
+    pthread_mutex_lock(&dev->lock);
+    if(!dev->reading){
+        if(dev->streaming || dev->count){
+            pthread_mutex_unlock(&dev->lock);
+            errno = EBUSY;
+            return -1;
+        }
+        memset(&req, 0, sizeof(req));
+        req.count  = SHIM_MIN_BUF;
+        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = V4L2_MEMORY_MMAP;
+        if(shim_reqbufs(dev, &req) != 0){
+            pthread_mutex_unlock(&dev->lock);
+            return -1;
+        }
+        for(i = 0; i < dev->count; i++){
+            shim_queue(dev, i);
+        }
+        dev->reading = dev->streaming = 1;
+        dev->read_index = -1;
+        if((errno = pthread_create(&dev->producer, NULL, shim_producer, dev)) != 0){
+            dev->reading = dev->streaming = 0;
+            dev->q_len = dev->q_head = 0;
+            shim_free_buffers(dev);
+            pthread_mutex_unlock(&dev->lock);
+            return -1;
+        }
+    }
+
+    while(count > 0){
+        if(dev->read_index < 0){
+            index = shim_wait_done(dev);
+            if(index < 0){
+                break;
+            }
+            dev->read_index = index;
+            dev->read_off = 0;
+        }
+        n = dev->size - dev->read_off;
+        if(n > count){
+            n = count;
+        }
+        memcpy((__u8 *)data + retval, shim_buf_addr(dev, dev->read_index) + dev->read_off, n);
+        retval += n;
+        count -= n;
+        dev->read_off += n;
+        if(dev->read_off == dev->size){
+            shim_queue(dev, dev->read_index);
+            dev->read_index = -1;
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return retval || !count ? retval : -1;
+}
+
+static int shim_open(struct shim_dev *dev, const char *path, int flags)
+{
+    const char *fps = getenv("VV_SHIM_FPS");
+
+    pthread_mutex_lock(&dev->lock);
+    if(dev->fd != -1){
+        pthread_mutex_unlock(&dev->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    dev->fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    if(dev->fd == -1){
+        pthread_mutex_unlock(&dev->lock);
+        return -1;
+    }
+    dev->ev_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK);
+    if(dev->ev_fd == -1){
+        real_close(dev->fd);
+        dev->fd = -1;
+        pthread_mutex_unlock(&dev->lock);
+        return -1;
+    }
+    dev->events   = 0;
+    dev->e_head   = dev->e_len = dev->e_seq = 0;
+    dev->nonblock = (flags & O_NONBLOCK) != 0;
+    dev->width    = 800;
+    dev->height   = 480;
+    dev->fmt      = &format[0];
+    dev->field    = V4L2_FIELD_INTERLACED;
+    dev->sequence = 0;
+    dev->memory   = V4L2_MEMORY_MMAP;
+    dev->read_index = -1;
+    dev->fps      = fps ? strtoul(fps, NULL, 0) : 30;
+    pthread_mutex_unlock(&dev->lock);
+
+    if(shim_debug){
+        fprintf(stderr, "vvshim: open %s -> fd %d, %u fps%s\n", path, dev->fd, dev->fps, shim_group ? ", grouped" : "");
+    }
+    return dev->fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode = 0;
+    int index;
+
+    shim_resolve();
+    index = shim_is_dev(path);
+    if(index >= 0){
+        return shim_open(&shims[index], path, flags);
+    }
+    if(flags & (O_CREAT | O_TMPFILE)){
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode = 0;
+    int index;
+
+    shim_resolve();
+    index = shim_is_dev(path);
+    if(index >= 0){
+        return shim_open(&shims[index], path, flags);
+    }
+    if(flags & (O_CREAT | O_TMPFILE)){
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real_open64(path, flags, mode);
+}
+
+int close(int fd)
+{
+    struct shim_dev *dev;
+
+    shim_resolve();
+    dev = shim_by_fd(fd);
+    if(dev){
+        shim_streamoff(dev);
+        shim_free_buffers(dev);
+        real_close(dev->ev_fd);
+        dev->ev_fd = -1;
+        dev->fd = -1;
+    }
+    return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+    int retval;
+    struct shim_dev *dev;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    shim_resolve();
+    dev = shim_by_fd(fd);
+    if(!dev){
+        return real_ioctl(fd, request, arg);
+    }
+
+    retval = shim_ioctl(dev, request, arg);
+    if(shim_debug){
+        fprintf(stderr, "vvshim: ioctl %c %3lu -> %d%s%s\n", (int)((request >> 8) & 0xff), request & 0xff, retval,
+                retval ? " " : "", retval ? strerror(errno) : "");
+    }
+    return retval;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    struct shim_dev *dev;
+
+    shim_resolve();
+    dev = shim_by_fd(fd);
+    if(dev){
+        return shim_read(dev, buf, count);
+    }
+    return real_read(fd, buf, count);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    struct shim_dev *dev;
+
+    shim_resolve();
+    dev = shim_by_fd(fd);
+    if(dev){
+        if(dev->memfd == -1 || offset < 0 || (size_t)offset + length > (size_t)dev->count * dev->buf_stride){
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+        return real_mmap(addr, length, prot, flags, dev->memfd, offset);
+    }
+    return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+    shim_resolve();
+    if(shim_by_fd(fd)){
+        return mmap(addr, length, prot, flags, fd, offset);
+    }
+    return real_mmap64(addr, length, prot, flags, fd, offset);
+}
+
+/* POLLPRI for shim fds with events queued: their ev_fd is polled alongside for POLLIN */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct pollfd all[SHIM_MAX_POLL];
+    nfds_t owner[SHIM_MAX_POLL];
+    struct shim_dev *dev;
+    nfds_t i, n = nfds;
+    int retval;
+
+    shim_resolve();
+    if(nfds > SHIM_MAX_POLL){
+        return real_poll(fds, nfds, timeout);
+    }
+    memcpy(all, fds, nfds * sizeof(*fds));
+    for(i = 0; i < nfds; i++){
+        dev = shim_by_fd(fds[i].fd);
+        if(dev && (fds[i].events & POLLPRI) && n < SHIM_MAX_POLL){
+            owner[n] = i;
+            all[n].fd = dev->ev_fd;
+            all[n].events = POLLIN;
+            all[n].revents = 0;
+            n++;
+        }
+    }
+    if(n == nfds){
+        return real_poll(fds, nfds, timeout);
+    }
+
+    retval = real_poll(all, n, timeout);
+    if(retval < 0){
+        return retval;
+    }
+    for(i = 0; i < nfds; i++){
+        fds[i].revents = all[i].revents;
+    }
+    for(i = nfds; i < n; i++){
+        if(all[i].revents & POLLIN){
+            fds[owner[i]].revents |= POLLPRI;
+        }
+    }
+    for(i = 0, retval = 0; i < nfds; i++){
+        retval += fds[i].revents != 0;
+    }
+    return retval;
+}
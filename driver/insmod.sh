@@ -4,7 +4,11 @@ modprobe videodev
 modprobe v4l2-common
 modprobe videobuf-core #debug=3
 modprobe videobuf-vmalloc #debug=3
+modprobe libcrc32c
 insmod virtual_video.ko #debug=1
+modprobe v4l2-mem2mem
+modprobe videobuf2-vmalloc
+insmod virtual_m2m.ko #batch=4 threads=0
 
 
 
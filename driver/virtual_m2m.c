@@ -0,0 +1,657 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/platform_device.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-ctrls.h>
+#include <media/v4l2-fh.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-mem2mem.h>
+#include <media/videobuf2-vmalloc.h>
+#include <linux/videodev2.h>
+
+#include "virtual_m2m_fmt.h"
+
+/*
+ * Format and size converter next to the virtual_video capture nodes: frames
+ * queued on the OUTPUT side come back on the CAPTURE side in another of
+ * RGB32, BGR32, YUYV or NV12 and scaled (nearest neighbour). Each job takes
+ * up to batch= ready buffer pairs and converts them in horizontal stripes
+ * on an unbound workqueue, so one context keeps several CPUs busy.
+ *
+ * The queues are videobuf2 with vmalloc memory: a capture buffer mmapped
+ * from virtual_video goes in with USERPTR, converted frames can be handed
+ * on with VIDIOC_EXPBUF (DMABUF).
+ */
+
+#define ELMO_M2M_MIN_SIZE   16
+#define ELMO_M2M_MAX_SIZE   8192
+#define ELMO_M2M_DEF_WIDTH  800
+#define ELMO_M2M_DEF_HEIGHT 480
+
+/* buffer pairs per job and stripes per job */
+#define ELMO_M2M_MAX_BATCH   16
+#define ELMO_M2M_MAX_STRIPES 32
+
+#define DBG_ERR  (0x1<<0)
+#define DBG_WARN (0x1<<1)
+#define DBG_INFO (0x1<<2)
+
+static int debug=0;
+module_param(debug, int, 0644);
+
+#define debug_printk(level, fmt, arg...)    \
+    do {                                    \
+        if (debug & level)                  \
+            printk(fmt , ## arg);           \
+    }while(0)
+
+static unsigned int batch = 4;
+module_param(batch, uint, 0644);
+MODULE_PARM_DESC(batch, "most buffer pairs converted by one job (1-16)");
+
+static unsigned int threads;
+module_param(threads, uint, 0444);
+MODULE_PARM_DESC(threads, "stripes each job is split into (0=online CPUs, up to 32)");
+
+enum {
+    M2M_SRC,    /* OUTPUT queue */
+    M2M_DST,    /* CAPTURE queue */
+};
+
+struct virtual_m2m_ctx;
+
+/* rows [y0, y1) of every frame in the running job */
+struct virtual_m2m_stripe {
+    struct work_struct work;
+    struct virtual_m2m_ctx *ctx;
+    u32 y0, y1;
+    u8 *row;                /* one destination row, 3 bytes per pixel */
+    unsigned int done;      /* frames of the job this stripe converted */
+};
+
+struct virtual_m2m_ctx {
+    struct v4l2_fh fh;
+    struct mutex vb_mutex;  /* both vb2 queues */
+    struct virtual_m2m_q q[2];
+
+    /* set up on STREAMON for the current formats */
+    const int *coef;
+    u32 *xmap;              /* destination x to source x */
+    struct virtual_m2m_stripe *stripe;
+    unsigned int stripes;
+
+    /* the running job */
+    struct vb2_v4l2_buffer *src[ELMO_M2M_MAX_BATCH];
+    struct vb2_v4l2_buffer *dst[ELMO_M2M_MAX_BATCH];
+    u8 *src_vaddr[ELMO_M2M_MAX_BATCH];
+    u8 *dst_vaddr[ELMO_M2M_MAX_BATCH];
+    unsigned int count;
+    atomic_t pending;       /* stripes still running */
+    atomic_t aborting;      /* job_abort: stripes stop before their next frame */
+};
+
+struct virtual_m2m_dev {
+    struct platform_device *pdev;   /* parent for vb2 and dma-buf attachments */
+    struct v4l2_device v4l2_dev;
+    struct video_device vfd;
+    struct mutex lock;      /* ioctls */
+    struct v4l2_m2m_dev *m2m_dev;
+    struct workqueue_struct *wq;
+};
+
+static struct virtual_m2m_dev *m2m;
+
+static inline struct virtual_m2m_ctx *file_to_ctx(struct file *file)
+{
+    return container_of(file->private_data, struct virtual_m2m_ctx, fh);
+}
+
+static struct virtual_m2m_q *virtual_m2m_q(struct virtual_m2m_ctx *ctx, enum v4l2_buf_type type)
+{
+    return &ctx->q[V4L2_TYPE_IS_OUTPUT(type) ? M2M_SRC : M2M_DST];
+}
+
+static void virtual_m2m_convert(const struct virtual_m2m_ctx *ctx, const u8 *src, u8 *dst,
+                                const struct virtual_m2m_stripe *st)
+{
+    virtual_m2m_convert_rows(&ctx->q[M2M_SRC], &ctx->q[M2M_DST], ctx->coef, ctx->xmap, src, dst,
+                             st->y0, st->y1, st->row);
+}
+
+/* the last stripe of a job hands the buffers back and lets the next job run */
+static void virtual_m2m_job_done(struct virtual_m2m_ctx *ctx)
+{
+    struct vb2_v4l2_buffer *src, *dst;
+    enum vb2_buffer_state state;
+    unsigned int i, done = ctx->count;
+
+    /* after an abort only the frames every stripe got to are complete */
+    for (i = 0; i < ctx->stripes; i++)
+        done = min(done, ctx->stripe[i].done);
+    if (done < ctx->count)
+        debug_printk(DBG_INFO, "virtual_m2m: job aborted after %u of %u frames\n", done, ctx->count);
+
+    for (i = 0; i < ctx->count; i++) {
+        src = ctx->src[i];
+        dst = ctx->dst[i];
+        state = i < done && ctx->src_vaddr[i] && ctx->dst_vaddr[i] ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR;
+
+        dst->vb2_buf.timestamp = src->vb2_buf.timestamp;
+        dst->timecode = src->timecode;
+        dst->flags &= ~(V4L2_BUF_FLAG_TIMECODE | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+        dst->flags |= src->flags & (V4L2_BUF_FLAG_TIMECODE | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+        dst->field = V4L2_FIELD_NONE;
+        src->sequence = ctx->q[M2M_SRC].sequence++;
+        dst->sequence = ctx->q[M2M_DST].sequence++;
+        vb2_set_plane_payload(&dst->vb2_buf, 0, ctx->q[M2M_DST].sizeimage);
+
+        v4l2_m2m_buf_done(src, state);
+        v4l2_m2m_buf_done(dst, state);
+    }
+    ctx->count = 0;
+    v4l2_m2m_job_finish(m2m->m2m_dev, ctx->fh.m2m_ctx);
+}
+
+static void virtual_m2m_stripe_work(struct work_struct *work)
+{
+    struct virtual_m2m_stripe *st = container_of(work, struct virtual_m2m_stripe, work);
+    struct virtual_m2m_ctx *ctx = st->ctx;
+    unsigned int i;
+
+    for (i = 0; i < ctx->count; i++) {
+        if (atomic_read(&ctx->aborting))
+            break;
+        if (ctx->src_vaddr[i] && ctx->dst_vaddr[i])
+            virtual_m2m_convert(ctx, ctx->src_vaddr[i], ctx->dst_vaddr[i], st);
+        st->done = i + 1;
+    }
+    if (atomic_dec_and_test(&ctx->pending))
+        virtual_m2m_job_done(ctx);
+}
+
+/* take every ready pair up to batch= and spread the rows over the workqueue */
+static void virtual_m2m_device_run(void *priv)
+{
+    struct virtual_m2m_ctx *ctx = priv;
+    struct v4l2_m2m_ctx *m2m_ctx = ctx->fh.m2m_ctx;
+    unsigned int i, n = clamp(batch, 1U, (unsigned int)ELMO_M2M_MAX_BATCH);
+
+    ctx->count = 0;
+    while (ctx->count < n && v4l2_m2m_num_src_bufs_ready(m2m_ctx) && v4l2_m2m_num_dst_bufs_ready(m2m_ctx)) {
+        i = ctx->count++;
+        ctx->src[i] = v4l2_m2m_src_buf_remove(m2m_ctx);
+        ctx->dst[i] = v4l2_m2m_dst_buf_remove(m2m_ctx);
+        ctx->src_vaddr[i] = vb2_plane_vaddr(&ctx->src[i]->vb2_buf, 0);
+        ctx->dst_vaddr[i] = vb2_plane_vaddr(&ctx->dst[i]->vb2_buf, 0);
+        if (!ctx->src_vaddr[i] || !ctx->dst_vaddr[i])
+            debug_printk(DBG_ERR, "virtual_m2m: buffer %u/%u not mapped\n",
+                         ctx->src[i]->vb2_buf.index, ctx->dst[i]->vb2_buf.index);
+    }
+    debug_printk(DBG_INFO, "virtual_m2m: job of %u frames in %u stripes\n", ctx->count, ctx->stripes);
+
+    atomic_set(&ctx->aborting, 0);
+    atomic_set(&ctx->pending, ctx->stripes);
+    for (i = 0; i < ctx->stripes; i++) {
+        ctx->stripe[i].done = 0;
+        queue_work(m2m->wq, &ctx->stripe[i].work);
+    }
+}
+
+/*
+ * STREAMOFF or close with a job running: a batch of large frames can take
+ * a while, so the stripes drop the frames they have not started and the
+ * last one finishes the job, the dropped pairs come back with ERROR.
+ */
+static void virtual_m2m_job_abort(void *priv)
+{
+    struct virtual_m2m_ctx *ctx = priv;
+
+    atomic_set(&ctx->aborting, 1);
+}
+
+static const struct v4l2_m2m_ops virtual_m2m_ops = {
+    .device_run = virtual_m2m_device_run,
+    .job_abort  = virtual_m2m_job_abort,
+};
+
+static void virtual_m2m_free_stripes(struct virtual_m2m_ctx *ctx)
+{
+    unsigned int i;
+
+    for (i = 0; i < ctx->stripes; i++)
+        kvfree(ctx->stripe[i].row);
+    kfree(ctx->stripe);
+    kvfree(ctx->xmap);
+    ctx->stripe  = NULL;
+    ctx->xmap    = NULL;
+    ctx->stripes = 0;
+}
+
+/* scaling map, matrix and stripes for the formats set now; no job runs while this is called */
+static int virtual_m2m_setup(struct virtual_m2m_ctx *ctx)
+{
+    const struct virtual_m2m_q *in = &ctx->q[M2M_SRC], *out = &ctx->q[M2M_DST];
+    unsigned int i, n, rows;
+    u32 x;
+
+    virtual_m2m_free_stripes(ctx);
+
+    ctx->coef = in->colorspace == V4L2_COLORSPACE_REC709 ? coef_709 : coef_601;
+    ctx->xmap = kvmalloc_array(out->width, sizeof(*ctx->xmap), GFP_KERNEL);
+    if (!ctx->xmap)
+        return -ENOMEM;
+    for (x = 0; x < out->width; x++)
+        ctx->xmap[x] = x * in->width / out->width;
+
+    /* stripes start on even rows so NV12 chroma rows are never shared */
+    n = threads ? threads : num_online_cpus();
+    n = clamp(n, 1U, (unsigned int)ELMO_M2M_MAX_STRIPES);
+    rows = ALIGN(DIV_ROUND_UP(out->height, n), 2);
+    n = DIV_ROUND_UP(out->height, rows);
+
+    ctx->stripe = kcalloc(n, sizeof(*ctx->stripe), GFP_KERNEL);
+    if (!ctx->stripe)
+        goto err;
+    for (i = 0; i < n; i++) {
+        ctx->stripe[i].ctx = ctx;
+        ctx->stripe[i].y0  = i * rows;
+        ctx->stripe[i].y1  = min(out->height, (i + 1) * rows);
+        INIT_WORK(&ctx->stripe[i].work, virtual_m2m_stripe_work);
+        ctx->stripe[i].row = kvmalloc(out->width * 3, GFP_KERNEL);
+        ctx->stripes++;
+        if (!ctx->stripe[i].row)
+            goto err;
+    }
+    return 0;
+
+err:
+    virtual_m2m_free_stripes(ctx);
+    return -ENOMEM;
+}
+
+/* vb2 */
+
+static int virtual_m2m_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers, unsigned int *nplanes,
+                                   unsigned int sizes[], struct device *alloc_devs[])
+{
+    struct virtual_m2m_ctx *ctx = vb2_get_drv_priv(vq);
+    struct virtual_m2m_q *q = virtual_m2m_q(ctx, vq->type);
+
+    if (*nplanes)
+        return sizes[0] < q->sizeimage ? -EINVAL : 0;
+
+    *nplanes = 1;
+    sizes[0] = q->sizeimage;
+    debug_printk(DBG_INFO, "virtual_m2m: %s %u buffers of %u bytes\n",
+                 V4L2_TYPE_IS_OUTPUT(vq->type) ? "output" : "capture", *nbuffers, sizes[0]);
+    return 0;
+}
+
+static int virtual_m2m_buf_prepare(struct vb2_buffer *vb)
+{
+    struct virtual_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+    struct virtual_m2m_q *q = virtual_m2m_q(ctx, vb->vb2_queue->type);
+
+    if (vb2_plane_size(vb, 0) < q->sizeimage) {
+        debug_printk(DBG_ERR, "virtual_m2m: buffer of %lu bytes, need %u\n", vb2_plane_size(vb, 0), q->sizeimage);
+        return -EINVAL;
+    }
+    if (!V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type))
+        vb2_set_plane_payload(vb, 0, q->sizeimage);
+    return 0;
+}
+
+static void virtual_m2m_buf_queue(struct vb2_buffer *vb)
+{
+    struct virtual_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+
+    v4l2_m2m_buf_queue(ctx->fh.m2m_ctx, to_vb2_v4l2_buffer(vb));
+}
+
+static void virtual_m2m_return_bufs(struct vb2_queue *vq, enum vb2_buffer_state state)
+{
+    struct virtual_m2m_ctx *ctx = vb2_get_drv_priv(vq);
+    struct vb2_v4l2_buffer *vbuf;
+
+    for (;;) {
+        if (V4L2_TYPE_IS_OUTPUT(vq->type))
+            vbuf = v4l2_m2m_src_buf_remove(ctx->fh.m2m_ctx);
+        else
+            vbuf = v4l2_m2m_dst_buf_remove(ctx->fh.m2m_ctx);
+        if (!vbuf)
+            break;
+        v4l2_m2m_buf_done(vbuf, state);
+    }
+}
+
+static int virtual_m2m_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+    struct virtual_m2m_ctx *ctx = vb2_get_drv_priv(vq);
+    int retval;
+
+    virtual_m2m_q(ctx, vq->type)->sequence = 0;
+    /* the other queue may not stream yet, so no job can be running */
+    retval = virtual_m2m_setup(ctx);
+    if (retval < 0) {
+        debug_printk(DBG_ERR, "virtual_m2m: stripe setup failed: %d\n", retval);
+        virtual_m2m_return_bufs(vq, VB2_BUF_STATE_QUEUED);
+    }
+    return retval;
+}
+
+static void virtual_m2m_stop_streaming(struct vb2_queue *vq)
+{
+    /* v4l2-mem2mem waited for the running job before calling this */
+    virtual_m2m_return_bufs(vq, VB2_BUF_STATE_ERROR);
+}
+
+static const struct vb2_ops virtual_m2m_qops = {
+    .queue_setup     = virtual_m2m_queue_setup,
+    .buf_prepare     = virtual_m2m_buf_prepare,
+    .buf_queue       = virtual_m2m_buf_queue,
+    .start_streaming = virtual_m2m_start_streaming,
+    .stop_streaming  = virtual_m2m_stop_streaming,
+    .wait_prepare    = vb2_ops_wait_prepare,
+    .wait_finish     = vb2_ops_wait_finish,
+};
+
+static int virtual_m2m_queue_init(void *priv, struct vb2_queue *src_vq, struct vb2_queue *dst_vq)
+{
+    struct virtual_m2m_ctx *ctx = priv;
+    int retval;
+
+    src_vq->type            = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    src_vq->io_modes        = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+    src_vq->drv_priv        = ctx;
+    src_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+    src_vq->ops             = &virtual_m2m_qops;
+    src_vq->mem_ops         = &vb2_vmalloc_memops;
+    src_vq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    src_vq->lock            = &ctx->vb_mutex;
+    src_vq->dev             = &m2m->pdev->dev;
+    retval = vb2_queue_init(src_vq);
+    if (retval < 0)
+        return retval;
+
+    dst_vq->type            = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    dst_vq->io_modes        = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+    dst_vq->drv_priv        = ctx;
+    dst_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+    dst_vq->ops             = &virtual_m2m_qops;
+    dst_vq->mem_ops         = &vb2_vmalloc_memops;
+    dst_vq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    dst_vq->lock            = &ctx->vb_mutex;
+    dst_vq->dev             = &m2m->pdev->dev;
+    return vb2_queue_init(dst_vq);
+}
+
+/* ioctls */
+
+static int virtual_m2m_querycap(struct file *file, void *priv, struct v4l2_capability *cap)
+{
+    strlcpy(cap->driver,   "virtual_m2m", sizeof(cap->driver));
+    strlcpy(cap->card,     "virtual_m2m", sizeof(cap->card));
+    strlcpy(cap->bus_info, "platform:virtual_m2m", sizeof(cap->bus_info));
+
+    cap->device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+static int virtual_m2m_enum_fmt(struct file *file, void *priv, struct v4l2_fmtdesc *f)
+{
+    if (f->index >= ARRAY_SIZE(m2m_formats))
+        return -EINVAL;
+
+    strlcpy(f->description, m2m_formats[f->index].name, sizeof(f->description));
+    f->pixelformat = m2m_formats[f->index].fourcc;
+    return 0;
+}
+
+static int virtual_m2m_g_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+    struct virtual_m2m_ctx *ctx = file_to_ctx(file);
+    struct virtual_m2m_q *q = virtual_m2m_q(ctx, f->type);
+
+    f->fmt.pix.width        = q->width;
+    f->fmt.pix.height       = q->height;
+    f->fmt.pix.field        = V4L2_FIELD_NONE;
+    f->fmt.pix.pixelformat  = q->fmt->fourcc;
+    f->fmt.pix.bytesperline = q->bytesperline;
+    f->fmt.pix.sizeimage    = q->sizeimage;
+    f->fmt.pix.colorspace   = ctx->q[M2M_SRC].colorspace;
+    return 0;
+}
+
+/* unknown formats fall back to the first one, sizes are clamped and made even */
+static int virtual_m2m_try_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+    struct virtual_m2m_ctx *ctx = file_to_ctx(file);
+    const struct virtual_m2m_fmt *fmt;
+
+    fmt = virtual_m2m_find(f->fmt.pix.pixelformat);
+    if (!fmt)
+        fmt = &m2m_formats[0];
+
+    f->fmt.pix.pixelformat  = fmt->fourcc;
+    f->fmt.pix.width        = ALIGN(clamp(f->fmt.pix.width, (u32)ELMO_M2M_MIN_SIZE, (u32)ELMO_M2M_MAX_SIZE), 2);
+    f->fmt.pix.height       = ALIGN(clamp(f->fmt.pix.height, (u32)ELMO_M2M_MIN_SIZE, (u32)ELMO_M2M_MAX_SIZE), 2);
+    f->fmt.pix.field        = V4L2_FIELD_NONE;
+    f->fmt.pix.bytesperline = f->fmt.pix.width * fmt->bpp;
+    f->fmt.pix.sizeimage    = f->fmt.pix.width * f->fmt.pix.height * fmt->depth / 8;
+    /* the capture side keeps the colorspace of the frames going in */
+    if (!V4L2_TYPE_IS_OUTPUT(f->type))
+        f->fmt.pix.colorspace = ctx->q[M2M_SRC].colorspace;
+    else if (f->fmt.pix.colorspace != V4L2_COLORSPACE_REC709)
+        f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
+    return 0;
+}
+
+static int virtual_m2m_s_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+    struct virtual_m2m_ctx *ctx = file_to_ctx(file);
+    struct virtual_m2m_q *q = virtual_m2m_q(ctx, f->type);
+    struct vb2_queue *vq = v4l2_m2m_get_vq(ctx->fh.m2m_ctx, f->type);
+
+    if (vb2_is_busy(vq)) {
+        debug_printk(DBG_ERR, "virtual_m2m: %s queue busy\n", V4L2_TYPE_IS_OUTPUT(f->type) ? "output" : "capture");
+        return -EBUSY;
+    }
+
+    virtual_m2m_try_fmt(file, priv, f);
+    virtual_m2m_set_q(q, virtual_m2m_find(f->fmt.pix.pixelformat), f->fmt.pix.width, f->fmt.pix.height);
+    if (V4L2_TYPE_IS_OUTPUT(f->type))
+        q->colorspace = f->fmt.pix.colorspace;
+
+    debug_printk(DBG_INFO, "virtual_m2m: %s %ux%u %c%c%c%c\n", V4L2_TYPE_IS_OUTPUT(f->type) ? "output" : "capture",
+                 q->width, q->height, (q->fmt->fourcc >> 0) & 0xFF, (q->fmt->fourcc >> 8) & 0xFF,
+                 (q->fmt->fourcc >> 16) & 0xFF, (q->fmt->fourcc >> 24) & 0xFF);
+    return 0;
+}
+
+static const struct v4l2_ioctl_ops virtual_m2m_ioctl_ops = {
+    .vidioc_querycap         = virtual_m2m_querycap,
+
+    .vidioc_enum_fmt_vid_cap = virtual_m2m_enum_fmt,
+    .vidioc_g_fmt_vid_cap    = virtual_m2m_g_fmt,
+    .vidioc_try_fmt_vid_cap  = virtual_m2m_try_fmt,
+    .vidioc_s_fmt_vid_cap    = virtual_m2m_s_fmt,
+
+    .vidioc_enum_fmt_vid_out = virtual_m2m_enum_fmt,
+    .vidioc_g_fmt_vid_out    = virtual_m2m_g_fmt,
+    .vidioc_try_fmt_vid_out  = virtual_m2m_try_fmt,
+    .vidioc_s_fmt_vid_out    = virtual_m2m_s_fmt,
+
+    .vidioc_reqbufs          = v4l2_m2m_ioctl_reqbufs,
+    .vidioc_querybuf         = v4l2_m2m_ioctl_querybuf,
+    .vidioc_qbuf             = v4l2_m2m_ioctl_qbuf,
+    .vidioc_dqbuf            = v4l2_m2m_ioctl_dqbuf,
+    .vidioc_prepare_buf      = v4l2_m2m_ioctl_prepare_buf,
+    .vidioc_create_bufs      = v4l2_m2m_ioctl_create_bufs,
+    .vidioc_expbuf           = v4l2_m2m_ioctl_expbuf,
+
+    .vidioc_streamon         = v4l2_m2m_ioctl_streamon,
+    .vidioc_streamoff        = v4l2_m2m_ioctl_streamoff,
+
+    .vidioc_subscribe_event   = v4l2_ctrl_subscribe_event,
+    .vidioc_unsubscribe_event = v4l2_event_unsubscribe,
+};
+
+/* file operations, one conversion context per open */
+
+static int virtual_m2m_open(struct file *file)
+{
+    struct virtual_m2m_ctx *ctx;
+    int retval = 0;
+
+    if (mutex_lock_interruptible(&m2m->lock))
+        return -ERESTARTSYS;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx) {
+        retval = -ENOMEM;
+        goto unlock;
+    }
+    v4l2_fh_init(&ctx->fh, video_devdata(file));
+    file->private_data = &ctx->fh;
+    mutex_init(&ctx->vb_mutex);
+
+    virtual_m2m_set_q(&ctx->q[M2M_SRC], virtual_m2m_find(V4L2_PIX_FMT_BGR32), ELMO_M2M_DEF_WIDTH, ELMO_M2M_DEF_HEIGHT);
+    virtual_m2m_set_q(&ctx->q[M2M_DST], virtual_m2m_find(V4L2_PIX_FMT_NV12), ELMO_M2M_DEF_WIDTH, ELMO_M2M_DEF_HEIGHT);
+    ctx->q[M2M_SRC].colorspace = V4L2_COLORSPACE_SMPTE170M;
+
+    ctx->fh.m2m_ctx = v4l2_m2m_ctx_init(m2m->m2m_dev, ctx, virtual_m2m_queue_init);
+    if (IS_ERR(ctx->fh.m2m_ctx)) {
+        retval = PTR_ERR(ctx->fh.m2m_ctx);
+        debug_printk(DBG_ERR, "virtual_m2m: context init failed: %d\n", retval);
+        v4l2_fh_exit(&ctx->fh);
+        kfree(ctx);
+        goto unlock;
+    }
+    v4l2_fh_add(&ctx->fh);
+
+unlock:
+    mutex_unlock(&m2m->lock);
+    return retval;
+}
+
+static int virtual_m2m_release(struct file *file)
+{
+    struct virtual_m2m_ctx *ctx = file_to_ctx(file);
+
+    v4l2_fh_del(&ctx->fh);
+    v4l2_fh_exit(&ctx->fh);
+    mutex_lock(&m2m->lock);
+    /* waits for a running job */
+    v4l2_m2m_ctx_release(ctx->fh.m2m_ctx);
+    mutex_unlock(&m2m->lock);
+    virtual_m2m_free_stripes(ctx);
+    kfree(ctx);
+    return 0;
+}
+
+static const struct v4l2_file_operations virtual_m2m_fops = {
+    .owner          = THIS_MODULE,
+    .open           = virtual_m2m_open,
+    .release        = virtual_m2m_release,
+    .poll           = v4l2_m2m_fop_poll,
+    .unlocked_ioctl = video_ioctl2,
+    .mmap           = v4l2_m2m_fop_mmap,
+};
+
+static int virtual_m2m_init(void)
+{
+    int retval;
+
+    debug_printk(DBG_INFO, "virtual_m2m module init.\n");
+
+    m2m = kzalloc(sizeof(*m2m), GFP_KERNEL);
+    if (!m2m)
+        return -ENOMEM;
+    mutex_init(&m2m->lock);
+
+    /* stripes of one job run in parallel, wherever the scheduler finds idle CPUs */
+    m2m->wq = alloc_workqueue("virtual_m2m", WQ_UNBOUND | WQ_HIGHPRI, 0);
+    if (!m2m->wq) {
+        retval = -ENOMEM;
+        goto wq_err;
+    }
+
+    m2m->pdev = platform_device_register_simple("virtual_m2m", -1, NULL, 0);
+    if (IS_ERR(m2m->pdev)) {
+        retval = PTR_ERR(m2m->pdev);
+        debug_printk(DBG_ERR, "platform device registration failed: %d\n", retval);
+        goto pdev_err;
+    }
+
+    retval = v4l2_device_register(&m2m->pdev->dev, &m2m->v4l2_dev);
+    if (retval < 0) {
+        debug_printk(DBG_ERR, "v4l2_device_register failed: %d\n", retval);
+        goto v4l2_device_register_err;
+    }
+
+    m2m->m2m_dev = v4l2_m2m_init(&virtual_m2m_ops);
+    if (IS_ERR(m2m->m2m_dev)) {
+        retval = PTR_ERR(m2m->m2m_dev);
+        debug_printk(DBG_ERR, "v4l2_m2m_init failed: %d\n", retval);
+        goto m2m_init_err;
+    }
+
+    m2m->vfd.release   = video_device_release_empty;
+    m2m->vfd.fops      = &virtual_m2m_fops;
+    m2m->vfd.ioctl_ops = &virtual_m2m_ioctl_ops;
+    m2m->vfd.v4l2_dev  = &m2m->v4l2_dev;
+    m2m->vfd.lock      = &m2m->lock;
+    m2m->vfd.vfl_dir   = VFL_DIR_M2M;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+    m2m->vfd.device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING;
+#endif
+    strncpy(m2m->vfd.name, "virtual_m2m", sizeof(m2m->vfd.name));
+    retval = video_register_device(&m2m->vfd, VFL_TYPE_GRABBER, -1);
+    if (retval < 0) {
+        debug_printk(DBG_ERR, "video_register_device failed: %d\n", retval);
+        goto video_register_device_err;
+    }
+
+    debug_printk(DBG_INFO, "virtual_m2m: %s, batch %u, %u stripes\n", video_device_node_name(&m2m->vfd),
+                 batch, threads ? threads : num_online_cpus());
+    return 0;
+
+video_register_device_err:
+    v4l2_m2m_release(m2m->m2m_dev);
+m2m_init_err:
+    v4l2_device_unregister(&m2m->v4l2_dev);
+v4l2_device_register_err:
+    platform_device_unregister(m2m->pdev);
+pdev_err:
+    destroy_workqueue(m2m->wq);
+wq_err:
+    kfree(m2m);
+    return retval;
+}
+
+static void virtual_m2m_exit(void)
+{
+    /* no context can be open, every job has finished */
+    video_unregister_device(&m2m->vfd);
+    v4l2_m2m_release(m2m->m2m_dev);
+    v4l2_device_unregister(&m2m->v4l2_dev);
+    platform_device_unregister(m2m->pdev);
+    destroy_workqueue(m2m->wq);
+    kfree(m2m);
+    debug_printk(DBG_INFO, "virtual_m2m module exit\n");
+}
+
+module_init(virtual_m2m_init);
+module_exit(virtual_m2m_exit);
+
+MODULE_AUTHOR("Elmo.Yang");
+MODULE_DESCRIPTION("Elmo Virtual Video Format Converter");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
@@ -0,0 +1,247 @@
+/*
+ * Formats and pixel conversion of virtual_m2m. Kept apart from
+ * virtual_m2m.c so virtual_m2m_test.c can build them without the V4L2
+ * core; both include it, everything here is static.
+ */
+#ifndef __VIRTUAL_M2M_FMT_H
+#define __VIRTUAL_M2M_FMT_H
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+struct virtual_m2m_fmt {
+    const char *name;
+    u32 fourcc;
+    unsigned int depth;     /* bits per pixel, all planes */
+    unsigned int bpp;       /* bytes per pixel of the first plane */
+    bool yuv;
+};
+
+static const struct virtual_m2m_fmt m2m_formats[] = {
+    {
+        .name     = "ARGB8888, 32 bpp",
+        .fourcc   = V4L2_PIX_FMT_RGB32,  //byte0:a byte1:r byte2:g byte3:b
+        .depth    = 32,
+        .bpp      = 4,
+    }, {
+        .name     = "32 bpp RGB, be",
+        .fourcc   = V4L2_PIX_FMT_BGR32,  //byte0:b byte1:g byte2:r byte3:a
+        .depth    = 32,
+        .bpp      = 4,
+    }, {
+        .name     = "4:2:2, packed, YUYV",
+        .fourcc   = V4L2_PIX_FMT_YUYV,
+        .depth    = 16,
+        .bpp      = 2,
+        .yuv      = true,
+    }, {
+        .name     = "Y/CbCr 4:2:0",
+        .fourcc   = V4L2_PIX_FMT_NV12,   //Y plane, then interleaved CbCr at half height
+        .depth    = 12,
+        .bpp      = 1,
+        .yuv      = true,
+    },
+};
+
+/*
+ * limited range YCbCr, same integer matrices as app/convert.c:
+ * yr yg yb, ur ug ub, vr vg vb (RGB to YUV, >> 8) and cy rv gu gv bu (YUV to RGB, >> 8)
+ */
+static const int coef_601[14] = {66, 129, 25, -38, -74, 112, 112, -94, -18, 298, 409, -100, -208, 516};
+static const int coef_709[14] = {47, 157, 16, -26, -87, 112, 112, -102, -10, 298, 459, -55, -136, 541};
+
+struct virtual_m2m_q {
+    const struct virtual_m2m_fmt *fmt;
+    u32 width, height;
+    u32 bytesperline;       /* first plane */
+    u32 sizeimage;
+    u32 colorspace;
+    u32 sequence;
+};
+
+static const struct virtual_m2m_fmt *virtual_m2m_find(u32 fourcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(m2m_formats); i++) {
+        if (m2m_formats[i].fourcc == fourcc)
+            return &m2m_formats[i];
+    }
+    return NULL;
+}
+
+static void virtual_m2m_set_q(struct virtual_m2m_q *q, const struct virtual_m2m_fmt *fmt, u32 width, u32 height)
+{
+    q->fmt          = fmt;
+    q->width        = width;
+    q->height       = height;
+    q->bytesperline = width * fmt->bpp;
+    q->sizeimage    = width * height * fmt->depth / 8;
+}
+
+/* pixel conversion, one destination row at a time through a 3 byte per pixel row of RGB or YCbCr */
+
+static void virtual_m2m_unpack(const struct virtual_m2m_q *q, const u8 *src, u32 sy,
+                               const u32 *xmap, u32 width, u8 *row)
+{
+    const u8 *line = src + sy * q->bytesperline;
+    const u8 *uv, *p;
+    u32 x, sx;
+
+    switch (q->fmt->fourcc) {
+    case V4L2_PIX_FMT_RGB32:
+        for (x = 0; x < width; x++, row += 3) {
+            p = line + xmap[x] * 4;
+            row[0] = p[1];
+            row[1] = p[2];
+            row[2] = p[3];
+        }
+        break;
+    case V4L2_PIX_FMT_BGR32:
+        for (x = 0; x < width; x++, row += 3) {
+            p = line + xmap[x] * 4;
+            row[0] = p[2];
+            row[1] = p[1];
+            row[2] = p[0];
+        }
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        for (x = 0; x < width; x++, row += 3) {
+            sx = xmap[x];
+            p = line + (sx & ~1) * 2;
+            row[0] = line[sx * 2];
+            row[1] = p[1];
+            row[2] = p[3];
+        }
+        break;
+    case V4L2_PIX_FMT_NV12:
+        uv = src + q->bytesperline * q->height + (sy / 2) * q->bytesperline;
+        for (x = 0; x < width; x++, row += 3) {
+            sx = xmap[x];
+            p = uv + (sx & ~1);
+            row[0] = line[sx];
+            row[1] = p[0];
+            row[2] = p[1];
+        }
+        break;
+    }
+}
+
+static void virtual_m2m_pack(const struct virtual_m2m_q *q, u8 *dst, u32 y, const u8 *row)
+{
+    u8 *line = dst + y * q->bytesperline;
+    u8 *uv;
+    u32 x;
+
+    switch (q->fmt->fourcc) {
+    case V4L2_PIX_FMT_RGB32:
+        for (x = 0; x < q->width; x++, row += 3, line += 4) {
+            line[0] = 0xff;
+            line[1] = row[0];
+            line[2] = row[1];
+            line[3] = row[2];
+        }
+        break;
+    case V4L2_PIX_FMT_BGR32:
+        for (x = 0; x < q->width; x++, row += 3, line += 4) {
+            line[0] = row[2];
+            line[1] = row[1];
+            line[2] = row[0];
+            line[3] = 0xff;
+        }
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        /* chroma of a pixel pair is the average of the two */
+        for (x = 0; x < q->width; x += 2, row += 6, line += 4) {
+            line[0] = row[0];
+            line[1] = (row[1] + row[4] + 1) >> 1;
+            line[2] = row[3];
+            line[3] = (row[2] + row[5] + 1) >> 1;
+        }
+        break;
+    case V4L2_PIX_FMT_NV12:
+        for (x = 0; x < q->width; x++)
+            line[x] = row[x * 3];
+        /* even rows carry the chroma of each 2x2 block */
+        if (y & 1)
+            break;
+        uv = dst + q->bytesperline * q->height + (y / 2) * q->bytesperline;
+        for (x = 0; x < q->width; x += 2, row += 6) {
+            uv[x]     = (row[1] + row[4] + 1) >> 1;
+            uv[x + 1] = (row[2] + row[5] + 1) >> 1;
+        }
+        break;
+    }
+}
+
+static inline u8 clamp255(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void virtual_m2m_rgb_to_yuv(const int *k, u8 *row, u32 width)
+{
+    int r, g, b;
+    u32 x;
+
+    for (x = 0; x < width; x++, row += 3) {
+        r = row[0];
+        g = row[1];
+        b = row[2];
+        row[0] = ((k[0] * r + k[1] * g + k[2] * b + 128) >> 8) + 16;
+        row[1] = ((k[3] * r + k[4] * g + k[5] * b + 128) >> 8) + 128;
+        row[2] = ((k[6] * r + k[7] * g + k[8] * b + 128) >> 8) + 128;
+    }
+}
+
+static void virtual_m2m_yuv_to_rgb(const int *k, u8 *row, u32 width)
+{
+    int c, du, dv;
+    u32 x;
+
+    for (x = 0; x < width; x++, row += 3) {
+        c  = k[9] * (row[0] - 16) + 128;
+        du = row[1] - 128;
+        dv = row[2] - 128;
+        row[0] = clamp255((c + k[10] * dv) >> 8);
+        row[1] = clamp255((c + k[11] * du + k[12] * dv) >> 8);
+        row[2] = clamp255((c + k[13] * du) >> 8);
+    }
+}
+
+/* same format and size: rows are copied as they are */
+static void virtual_m2m_copy_rows(const struct virtual_m2m_q *q, const u8 *src, u8 *dst, u32 y0, u32 y1)
+{
+    u32 plane = q->bytesperline * q->height;
+
+    memcpy(dst + y0 * q->bytesperline, src + y0 * q->bytesperline, (y1 - y0) * q->bytesperline);
+    if (q->fmt->fourcc == V4L2_PIX_FMT_NV12)
+        memcpy(dst + plane + y0 / 2 * q->bytesperline, src + plane + y0 / 2 * q->bytesperline,
+               (y1 - y0) / 2 * q->bytesperline);
+}
+
+/* rows [y0, y1) of a frame in out from one in in; xmap maps x in out to x in in, row holds out->width pixels */
+static void virtual_m2m_convert_rows(const struct virtual_m2m_q *in, const struct virtual_m2m_q *out,
+                                     const int *coef, const u32 *xmap, const u8 *src, u8 *dst,
+                                     u32 y0, u32 y1, u8 *row)
+{
+    u32 y;
+
+    if (in->fmt == out->fmt && in->width == out->width && in->height == out->height) {
+        virtual_m2m_copy_rows(in, src, dst, y0, y1);
+        return;
+    }
+
+    for (y = y0; y < y1; y++) {
+        virtual_m2m_unpack(in, src, y * in->height / out->height, xmap, out->width, row);
+        if (in->fmt->yuv && !out->fmt->yuv)
+            virtual_m2m_yuv_to_rgb(coef, row, out->width);
+        else if (!in->fmt->yuv && out->fmt->yuv)
+            virtual_m2m_rgb_to_yuv(coef, row, out->width);
+        virtual_m2m_pack(out, dst, y, row);
+    }
+}
+
+#endif    /* __VIRTUAL_M2M_FMT_H */
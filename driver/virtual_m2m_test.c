@@ -0,0 +1,196 @@
+/*
+ * KUnit tests for the pixel conversion in virtual_m2m_fmt.h: RGB to YCbCr
+ * and back, RGB channel swaps, same format copies and stripes against a
+ * whole frame. They need no V4L2 core, so they run under UML: see
+ * .kunitconfig and the README.
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+
+#include "virtual_m2m_fmt.h"
+
+#define TEST_WIDTH  64
+#define TEST_HEIGHT 48
+
+/*
+ * limited range 8 bit YCbCr loses a little on the way back; flat 2x2
+ * blocks keep chroma subsampling out of it
+ */
+#define TEST_ROUND_TRIP_ERR 3
+
+static void virtual_m2m_test_set(struct virtual_m2m_q *q, u32 fourcc, u32 width, u32 height)
+{
+    virtual_m2m_set_q(q, virtual_m2m_find(fourcc), width, height);
+}
+
+/* BGR32 frame of 2x2 blocks, colours spread over the whole cube */
+static void virtual_m2m_test_pattern(const struct virtual_m2m_q *q, u8 *buf)
+{
+    u32 x, y, block;
+    u8 *p;
+
+    for (y = 0; y < q->height; y++) {
+        for (x = 0; x < q->width; x++) {
+            p = buf + y * q->bytesperline + x * 4;
+            block = (y / 2) * (q->width / 2) + x / 2;
+            p[0] = block * 37;
+            p[1] = block * 91 + 13;
+            p[2] = block * 53 + 200;
+            p[3] = 0xff;
+        }
+    }
+}
+
+/* whole frame in one call, like a job with a single stripe */
+static void virtual_m2m_test_convert(struct kunit *test, const struct virtual_m2m_q *in,
+                                     const struct virtual_m2m_q *out, const int *coef,
+                                     const u8 *src, u8 *dst, u32 y0, u32 y1)
+{
+    u32 *xmap = kunit_kzalloc(test, out->width * sizeof(*xmap), GFP_KERNEL);
+    u8 *row = kunit_kzalloc(test, out->width * 3, GFP_KERNEL);
+    u32 x;
+
+    KUNIT_ASSERT_TRUE(test, xmap && row);
+    for (x = 0; x < out->width; x++)
+        xmap[x] = x * in->width / out->width;
+    virtual_m2m_convert_rows(in, out, coef, xmap, src, dst, y0, y1, row);
+}
+
+/* largest difference of any colour byte, alpha is not compared */
+static unsigned int virtual_m2m_test_max_err(const struct virtual_m2m_q *q, const u8 *a, const u8 *b)
+{
+    unsigned int i, err = 0, d;
+
+    for (i = 0; i < q->sizeimage; i++) {
+        if ((i & 3) == 3)
+            continue;
+        d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        err = d > err ? d : err;
+    }
+    return err;
+}
+
+static void virtual_m2m_test_round_trip(struct kunit *test)
+{
+    static const u32 yuv[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12 };
+    static const int *coef[] = { coef_601, coef_709 };
+    struct virtual_m2m_q rgb, mid;
+    unsigned int f, c, err;
+    u8 *src, *tmp, *back;
+
+    virtual_m2m_test_set(&rgb, V4L2_PIX_FMT_BGR32, TEST_WIDTH, TEST_HEIGHT);
+    src  = kunit_kzalloc(test, rgb.sizeimage, GFP_KERNEL);
+    back = kunit_kzalloc(test, rgb.sizeimage, GFP_KERNEL);
+    KUNIT_ASSERT_TRUE(test, src && back);
+    virtual_m2m_test_pattern(&rgb, src);
+
+    for (f = 0; f < ARRAY_SIZE(yuv); f++) {
+        for (c = 0; c < ARRAY_SIZE(coef); c++) {
+            virtual_m2m_test_set(&mid, yuv[f], TEST_WIDTH, TEST_HEIGHT);
+            tmp = kunit_kzalloc(test, mid.sizeimage, GFP_KERNEL);
+            KUNIT_ASSERT_TRUE(test, tmp != NULL);
+
+            virtual_m2m_test_convert(test, &rgb, &mid, coef[c], src, tmp, 0, TEST_HEIGHT);
+            virtual_m2m_test_convert(test, &mid, &rgb, coef[c], tmp, back, 0, TEST_HEIGHT);
+            err = virtual_m2m_test_max_err(&rgb, src, back);
+            KUNIT_EXPECT_TRUE_MSG(test, err <= TEST_ROUND_TRIP_ERR, "%s %s: error %u",
+                                  mid.fmt->name, c ? "bt709" : "bt601", err);
+        }
+    }
+}
+
+/* RGB32 and BGR32 swap bytes only, there and back is exact */
+static void virtual_m2m_test_swap(struct kunit *test)
+{
+    struct virtual_m2m_q bgr, rgb;
+    u8 *src, *tmp, *back;
+
+    virtual_m2m_test_set(&bgr, V4L2_PIX_FMT_BGR32, TEST_WIDTH, TEST_HEIGHT);
+    virtual_m2m_test_set(&rgb, V4L2_PIX_FMT_RGB32, TEST_WIDTH, TEST_HEIGHT);
+    src  = kunit_kzalloc(test, bgr.sizeimage, GFP_KERNEL);
+    tmp  = kunit_kzalloc(test, rgb.sizeimage, GFP_KERNEL);
+    back = kunit_kzalloc(test, bgr.sizeimage, GFP_KERNEL);
+    KUNIT_ASSERT_TRUE(test, src && tmp && back);
+    virtual_m2m_test_pattern(&bgr, src);
+
+    virtual_m2m_test_convert(test, &bgr, &rgb, coef_601, src, tmp, 0, TEST_HEIGHT);
+    KUNIT_EXPECT_EQ(test, tmp[0], 0xff);
+    KUNIT_EXPECT_EQ(test, tmp[1], src[2]);
+    KUNIT_EXPECT_EQ(test, tmp[3], src[0]);
+    virtual_m2m_test_convert(test, &rgb, &bgr, coef_601, tmp, back, 0, TEST_HEIGHT);
+    KUNIT_EXPECT_EQ(test, memcmp(src, back, bgr.sizeimage), 0);
+}
+
+/* a job split into stripes writes the same frame as one pass, for every pair of formats */
+static void virtual_m2m_test_stripes(struct kunit *test)
+{
+    struct virtual_m2m_q rgb, in, out;
+    u8 *pattern, *src, *whole, *parts;
+    unsigned int i, o;
+    u32 y;
+
+    virtual_m2m_test_set(&rgb, V4L2_PIX_FMT_BGR32, TEST_WIDTH, TEST_HEIGHT);
+    pattern = kunit_kzalloc(test, rgb.sizeimage, GFP_KERNEL);
+    KUNIT_ASSERT_TRUE(test, pattern != NULL);
+    virtual_m2m_test_pattern(&rgb, pattern);
+
+    for (i = 0; i < ARRAY_SIZE(m2m_formats); i++) {
+        virtual_m2m_test_set(&in, m2m_formats[i].fourcc, TEST_WIDTH, TEST_HEIGHT);
+        src = kunit_kzalloc(test, in.sizeimage, GFP_KERNEL);
+        KUNIT_ASSERT_TRUE(test, src != NULL);
+        virtual_m2m_test_convert(test, &rgb, &in, coef_601, pattern, src, 0, TEST_HEIGHT);
+
+        for (o = 0; o < ARRAY_SIZE(m2m_formats); o++) {
+            /* scaled down, so the rows map back to uneven source rows */
+            virtual_m2m_test_set(&out, m2m_formats[o].fourcc, TEST_WIDTH / 2 + 2, TEST_HEIGHT / 2 + 2);
+            whole = kunit_kzalloc(test, out.sizeimage, GFP_KERNEL);
+            parts = kunit_kzalloc(test, out.sizeimage, GFP_KERNEL);
+            KUNIT_ASSERT_TRUE(test, whole && parts);
+
+            virtual_m2m_test_convert(test, &in, &out, coef_601, src, whole, 0, out.height);
+            /* stripes start on even rows, as virtual_m2m_setup makes them */
+            for (y = 0; y < out.height; y += 6)
+                virtual_m2m_test_convert(test, &in, &out, coef_601, src, parts, y, min(y + 6, out.height));
+            KUNIT_EXPECT_EQ_MSG(test, memcmp(whole, parts, out.sizeimage), 0, "%s to %s",
+                                in.fmt->name, out.fmt->name);
+        }
+    }
+}
+
+/* same format and size is a plain copy, stripes included */
+static void virtual_m2m_test_copy(struct kunit *test)
+{
+    struct virtual_m2m_q q;
+    unsigned int i, n;
+    u8 *src, *dst;
+    u32 y;
+
+    for (i = 0; i < ARRAY_SIZE(m2m_formats); i++) {
+        virtual_m2m_test_set(&q, m2m_formats[i].fourcc, TEST_WIDTH, TEST_HEIGHT);
+        src = kunit_kzalloc(test, q.sizeimage, GFP_KERNEL);
+        dst = kunit_kzalloc(test, q.sizeimage, GFP_KERNEL);
+        KUNIT_ASSERT_TRUE(test, src && dst);
+        for (n = 0; n < q.sizeimage; n++)
+            src[n] = n * 7 + n / 251;
+
+        for (y = 0; y < TEST_HEIGHT; y += 10)
+            virtual_m2m_test_convert(test, &q, &q, coef_601, src, dst, y, min(y + 10, (u32)TEST_HEIGHT));
+        KUNIT_EXPECT_EQ_MSG(test, memcmp(src, dst, q.sizeimage), 0, "%s", q.fmt->name);
+    }
+}
+
+static struct kunit_case virtual_m2m_test_cases[] = {
+    KUNIT_CASE(virtual_m2m_test_round_trip),
+    KUNIT_CASE(virtual_m2m_test_swap),
+    KUNIT_CASE(virtual_m2m_test_stripes),
+    KUNIT_CASE(virtual_m2m_test_copy),
+    {}
+};
+
+static struct kunit_suite virtual_m2m_test_suite = {
+    .name = "virtual_m2m",
+    .test_cases = virtual_m2m_test_cases,
+};
+kunit_test_suite(virtual_m2m_test_suite);
+
+MODULE_LICENSE("GPL");
@@ -1,6 +1,16 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/random.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/version.h>
+#include <linux/configfs.h>
+#include <linux/crc32c.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
 #include <media/videobuf2-v4l2.h>
@@ -11,9 +21,26 @@
 #include <media/v4l2-event.h>
 #include <media/videobuf-vmalloc.h>
 
-/* Limits minimum and default number of buffers */
-#define ELMO_VIDEO_MIN_BUF 4
-#define ELMO_VIDEO_DEF_BUF 8
+#include "virtual_video.h"
+#include "virtual_video_fmt.h"
+
+/* capture nodes sharing one frame clock, from streams= and configfs */
+#define ELMO_VIDEO_MAX_STREAMS 16
+
+/* rate of the frame clock, slower streams skip ticks */
+#define ELMO_VIDEO_FPS 30
+
+/* largest width or height a configfs device accepts */
+#define ELMO_VIDEO_MAX_SIZE 8192
+
+/* frames load shaping holds back per stream, and the longest burst */
+#define ELMO_VIDEO_SHAPE_QUEUE 32
+#define ELMO_VIDEO_MAX_BURST   16
+
+/* hugepages=1 backs pool buffers with PMD sized (2 MiB on x86) contiguous chunks */
+#define ELMO_VIDEO_CHUNK_SHIFT PMD_SHIFT
+#define ELMO_VIDEO_CHUNK_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#define ELMO_VIDEO_CHUNK_SIZE  (1UL << ELMO_VIDEO_CHUNK_SHIFT)
 
 #define DBG_ERR  (0x1<<0)
 #define DBG_WARN (0x1<<1)
@@ -30,10 +57,147 @@ module_param(debug, int, 0644);
 
 static unsigned int vid_limit = 16; /* Video memory limit, in Mb */
 
-struct virtual_video_fmt {
-    char *name;
-    u32 fourcc; /* v4l2 format id */
-    int depth;
+/*
+ * Every stream is its own video node with its own format and queue; one
+ * timer completes a frame on all of them so their sequences and
+ * timestamps line up. More are created and removed at runtime through
+ * configfs, see virtual_video_cfg_subsys.
+ */
+static unsigned int streams = 1;
+module_param(streams, uint, 0444);
+MODULE_PARM_DESC(streams, "capture nodes created at load, driven by one frame clock (0-16)");
+
+/* time every pattern generator at module load, see virtual_video_bench() */
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "time pattern generators per format and resolution at load");
+
+/*
+ * Frame buffers kept across open/close so reconnecting clients skip the
+ * vmalloc and page-fault cost; 0 keeps the stock videobuf-vmalloc path.
+ */
+static unsigned int pool_buffers;
+module_param(pool_buffers, uint, 0444);
+MODULE_PARM_DESC(pool_buffers, "number of frame buffers kept allocated across sessions (0=off)");
+
+static bool hugepages;
+module_param(hugepages, bool, 0444);
+MODULE_PARM_DESC(hugepages, "back pool buffers with 2 MiB contiguous chunks, vmalloc if unavailable");
+
+/* render each frame in this many slices, see V4L2_EVENT_VIRTUAL_VIDEO_SLICE */
+static unsigned int slices;
+module_param(slices, uint, 0444);
+MODULE_PARM_DESC(slices, "horizontal slices per frame with a progress event after each (0/1=whole frames)");
+
+/* side length of the box moved across the pattern with animate=1 */
+#define ELMO_VIDEO_BOX 64
+
+static bool animate;
+module_param(animate, bool, 0444);
+MODULE_PARM_DESC(animate, "move a box across the pattern so consecutive frames differ");
+
+/*
+ * nodes in the same clock group produce frames on the same ticks, with
+ * the same timestamp and the same v4l2_buffer.sequence; a node that had
+ * no buffer queued skips that sequence number
+ */
+static unsigned int group;
+module_param(group, uint, 0444);
+MODULE_PARM_DESC(group, "clock group of the nodes created at load (0=none, 1-16)");
+
+enum virtual_video_pattern {
+    VIRTUAL_VIDEO_PATTERN_BANDS,
+    VIRTUAL_VIDEO_PATTERN_BOX,      /* bands with a box moving across, see animate */
+};
+
+static const char * const virtual_video_patterns[] = { "bands", "box" };
+
+/* what a node starts with, from the module parameters or its configfs directory */
+struct virtual_video_config {
+    u32 fourcc;
+    u32 width, height;      /* format set on open */
+    unsigned int fps;       /* 1..ELMO_VIDEO_FPS */
+    unsigned int buffers;   /* most buffers REQBUFS grants, 0 for no limit but vid_limit */
+    unsigned int pattern;   /* enum virtual_video_pattern */
+    unsigned int group;     /* clock group, 0 for none */
+};
+
+/* when a frame was produced: the tick's timestamp and, in a clock group, its sequence */
+struct virtual_video_stamp {
+    struct timeval ts;
+    u32 sequence;
+};
+
+/* load shaping of one stream, see V4L2_CID_VIRTUAL_VIDEO_JITTER */
+struct virtual_video_shape {
+    /* controls */
+    unsigned int jitter, jitter_min, jitter_max;
+    unsigned int burst, stall_period, stall_time, cost;
+
+    /* the frame clock and timer both deliver frames, lock keeps them apart */
+    spinlock_t lock;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+    struct hrtimer timer;
+#else
+    struct tasklet_hrtimer timer;
+#endif
+    bool armed;
+    struct virtual_video_stamp stamp[ELMO_VIDEO_SHAPE_QUEUE];   /* held frames, oldest at head */
+    unsigned int head, count;
+    unsigned int burst_left;        /* frames of the current burst still to deliver */
+    unsigned int since_stall;
+    ktime_t hold;                   /* stalled until */
+    u32 dropped;
+};
+
+/*
+ * The shaping timer renders frames, so like the frame clock it runs in
+ * softirq context: a soft hrtimer, before 4.16 a tasklet_hrtimer.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define ELMO_VIDEO_SHAPE_HRTIMER timer
+
+static void virtual_video_shape_timer_init(struct virtual_video_shape *shape,
+                                           enum hrtimer_restart (*function)(struct hrtimer *))
+{
+    hrtimer_init(&shape->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    shape->timer.function = function;
+}
+
+static void virtual_video_shape_timer_start(struct virtual_video_shape *shape, ktime_t t, enum hrtimer_mode mode)
+{
+    hrtimer_start(&shape->timer, t, mode | HRTIMER_MODE_SOFT);
+}
+
+static void virtual_video_shape_timer_cancel(struct virtual_video_shape *shape)
+{
+    hrtimer_cancel(&shape->timer);
+}
+#else
+#define ELMO_VIDEO_SHAPE_HRTIMER timer.timer
+
+static void virtual_video_shape_timer_init(struct virtual_video_shape *shape,
+                                           enum hrtimer_restart (*function)(struct hrtimer *))
+{
+    tasklet_hrtimer_init(&shape->timer, function, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+}
+
+static void virtual_video_shape_timer_start(struct virtual_video_shape *shape, ktime_t t, enum hrtimer_mode mode)
+{
+    tasklet_hrtimer_start(&shape->timer, t, mode);
+}
+
+static void virtual_video_shape_timer_cancel(struct virtual_video_shape *shape)
+{
+    tasklet_hrtimer_cancel(&shape->timer);
+}
+#endif
+
+struct virtual_video_pool_buf {
+    void *vaddr;            /* kernel view of the whole frame, what videobuf sees */
+    struct page **chunks;   /* ELMO_VIDEO_CHUNK_SIZE pieces with hugepages, else NULL */
+    unsigned int nr_chunks;
+    atomic_t mapped;        /* user mappings of the chunks, which hold no page references */
 };
 
 struct virtual_video{
@@ -41,6 +205,10 @@ struct virtual_video{
     struct video_device video_dev;
     u32 io_usrs;
 
+    unsigned int index;             /* slot in virtual_devs */
+    struct virtual_video_config config;
+    unsigned int fps_acc;           /* clock ticks owed to this stream, times fps */
+
     struct mutex lock;
     spinlock_t slock;
     struct videobuf_queue vb_vidq;
@@ -49,8 +217,33 @@ struct virtual_video{
     unsigned int width, height;
     struct virtual_video_fmt *fmt;
 
-    struct timer_list tick_timer;
+    bool clocked;                   /* streaming or reading, the frame clock services this stream */
     struct list_head queued;
+
+    /* persistent buffers, see pool_buffers */
+    struct virtual_video_pool_buf pool[VIDEO_MAX_FRAME];
+    unsigned long pool_size;    /* bytes in every pool buffer, at least PAGE_ALIGN(sizeimage) */
+
+    ktime_t open_time;
+    bool first_frame;
+
+    u32 sequence;                   /* frames completed since open */
+    struct videobuf_buffer *slice_vb;   /* buffer being rendered in slice mode */
+    unsigned int slice;             /* next slice of slice_vb */
+
+    struct v4l2_ctrl_handler ctrl_handler;
+    bool overlay;                   /* V4L2_CID_VIRTUAL_VIDEO_OVERLAY */
+    bool checksum;                  /* V4L2_CID_VIRTUAL_VIDEO_CHECKSUM */
+    char overlay_text[48];          /* text of the frame being rendered */
+    unsigned int overlay_len;
+    ktime_t last_frame;
+    unsigned int fps_x10;           /* smoothed frame rate */
+
+    struct virtual_video_shape shape;
+
+    struct v4l2_rect last_box;      /* box of the previous frame */
+    struct v4l2_rect last_overlay;  /* overlay of the previous frame */
+    bool dirty_full;                /* next frame differs everywhere from the previous one */
 };
 
 /* buffer for one video frame */
@@ -58,6 +251,17 @@ struct virtual_video_buffer {
     /* common v4l buffer stuff -- must be first */
     struct videobuf_buffer vb;
     //struct virtual_video_fmt *fmt;
+
+    /* USERPTR memory pinned at QBUF and mapped for the frame clock, until the address changes */
+    struct page **pages;
+    unsigned int nr_pages;
+    void *kaddr;
+
+    /* what the memory holds since its last fill, buffers are recycled through queued */
+    bool filled;
+    u32 fourcc, width, height;
+    struct v4l2_rect box;
+    struct v4l2_rect overlay;
 };
 
 struct virtual_video_fh {
@@ -65,38 +269,430 @@ struct virtual_video_fh {
     struct virtual_video *dev;
 };
 
-struct virtual_video *virtual_dev;
+/* the frame clock reads the slots under no lock, they are cleared with the timer stopped */
+static struct virtual_video *virtual_devs[ELMO_VIDEO_MAX_STREAMS];
+static DEFINE_MUTEX(devs_lock);     /* slot allocation */
+
+static struct timer_list tick_timer;
+static DEFINE_MUTEX(clock_lock);
+static unsigned int clock_users;
+/* no tick pending: no clocked stream had a buffer queued, buffer_queue restarts the clock */
+static bool clock_parked = true;
+
+static void virtual_video_clock_wake(void);
+
+/*
+ * Overlay glyphs, 5x7 and drawn at twice the size. The atlas holds every
+ * glyph as a finished cell in each pixel format, so drawing a character
+ * is one memcpy per row.
+ */
+#define OVERLAY_SCALE   2
+#define OVERLAY_CELL_W  (6 * OVERLAY_SCALE)
+#define OVERLAY_CELL_H  (9 * OVERLAY_SCALE)
+#define OVERLAY_MARGIN  8
+#define OVERLAY_BPP     4   /* widest format is 32 bpp */
+#define OVERLAY_BLANK   12  /* ' ' in overlay_chars */
+
+static const char overlay_chars[] = "0123456789:. defpqsv";
+
+static const char overlay_font[][7][6] = {
+    { " ### ", "#   #", "#  ##", "# # #", "##  #", "#   #", " ### " },   /* 0 */
+    { "  #  ", " ##  ", "  #  ", "  #  ", "  #  ", "  #  ", " ### " },
+    { " ### ", "#   #", "    #", "   # ", "  #  ", " #   ", "#####" },
+    { "#####", "   # ", "  #  ", "   # ", "    #", "#   #", " ### " },
+    { "   # ", "  ## ", " # # ", "#  # ", "#####", "   # ", "   # " },
+    { "#####", "#    ", "#### ", "    #", "    #", "#   #", " ### " },
+    { "  ## ", " #   ", "#    ", "#### ", "#   #", "#   #", " ### " },
+    { "#####", "    #", "   # ", "  #  ", " #   ", " #   ", " #   " },
+    { " ### ", "#   #", "#   #", " ### ", "#   #", "#   #", " ### " },
+    { " ### ", "#   #", "#   #", " ####", "    #", "   # ", " ##  " },   /* 9 */
+    { "     ", " ##  ", " ##  ", "     ", " ##  ", " ##  ", "     " },   /* : */
+    { "     ", "     ", "     ", "     ", "     ", " ##  ", " ##  " },   /* . */
+    { "     ", "     ", "     ", "     ", "     ", "     ", "     " },   /*   */
+    { "    #", "    #", " ## #", "#  ##", "#   #", "#   #", " ####" },   /* d */
+    { "     ", "     ", " ### ", "#   #", "#####", "#    ", " ### " },   /* e */
+    { "  ## ", " #  #", " #   ", "###  ", " #   ", " #   ", " #   " },   /* f */
+    { "     ", "     ", "#### ", "#   #", "#### ", "#    ", "#    " },   /* p */
+    { "     ", "     ", " ## #", "#  ##", " ####", "    #", "    #" },   /* q */
+    { "     ", "     ", " ####", "#    ", " ### ", "    #", "#### " },   /* s */
+    { "     ", "     ", "#   #", "#   #", "#   #", " # # ", "  #  " },   /* v */
+};
 
-static struct virtual_video_fmt format[] = {
-    {
-        .name     = "ARGB8888, 32 bpp",
-        .fourcc   = V4L2_PIX_FMT_RGB32,  //byte0:a byte1:r byte2:g byte3:b
-        .depth      = 32,
-    }, {
-        .name     = "32 bpp RGB, be",
-        .fourcc   = V4L2_PIX_FMT_BGR32,  //byte0:b byte1:g byte2:r byte3:a
-        .depth    = 32,
-    },/* {
-        .name     = "4:2:2, packed, YVY2",
-        .fourcc   = V4L2_PIX_FMT_YUYV,
-        .depth    = 16,
-    }, {
-        .name     = "4:2:2, packed, UYVY",
-        .fourcc   = V4L2_PIX_FMT_UYVY,
-        .depth    = 16,
-    }*/
+static u8 overlay_atlas[ARRAY_SIZE(format)][ARRAY_SIZE(overlay_font)][OVERLAY_CELL_H][OVERLAY_CELL_W * OVERLAY_BPP];
+
+/* set pixel x of a row to white or black; on the colour filter that is every sample at full scale or zero */
+static void virtual_video_put_pixel(const struct virtual_video_fmt *fmt, u8 *row, unsigned int x, bool on)
+{
+    u8 *lo;
+
+    if (fmt->depth == 10) {
+        row += x / 4 * 5;
+        lo = row + 4;
+        row[x % 4] = on ? 0xff : 0x00;
+        if (on)
+            *lo |= 3 << (2 * (x % 4));
+        else
+            *lo &= ~(3 << (2 * (x % 4)));
+        return;
+    }
+    memcpy(row + virtual_video_pixel_bytes(fmt, x), on ? fmt->white : fmt->black, fmt->depth >> 3);
+}
+
+/* render every glyph cell once per format, glyph one scaled pixel in from the left and two from the top */
+static void virtual_video_build_atlas(void)
+{
+    unsigned int f, g, x, y;
+    bool on;
+
+    for (f = 0; f < ARRAY_SIZE(format); f++) {
+        for (g = 0; g < ARRAY_SIZE(overlay_font); g++) {
+            for (y = 0; y < OVERLAY_CELL_H; y++) {
+                for (x = 0; x < OVERLAY_CELL_W; x++) {
+                    on = x >= OVERLAY_SCALE && x < 6 * OVERLAY_SCALE &&
+                         y >= 2 * OVERLAY_SCALE && y < 9 * OVERLAY_SCALE &&
+                         overlay_font[g][y / OVERLAY_SCALE - 2][x / OVERLAY_SCALE - 1] == '#';
+                    virtual_video_put_pixel(&format[f], overlay_atlas[f][g][y], x, on);
+                }
+            }
+        }
+    }
+}
+
+static void virtual_video_pool_buf_free(struct virtual_video_pool_buf *pb)
+{
+    unsigned int i;
+
+    if (pb->chunks) {
+        if (pb->vaddr)
+            vunmap(pb->vaddr);
+        for (i = 0; i < pb->nr_chunks; i++) {
+            if (pb->chunks[i])
+                __free_pages(pb->chunks[i], ELMO_VIDEO_CHUNK_ORDER);
+        }
+        kfree(pb->chunks);
+    } else {
+        vfree(pb->vaddr);
+    }
+    pb->vaddr = NULL;
+    pb->chunks = NULL;
+    pb->nr_chunks = 0;
+}
+
+/*
+ * Frame made of physically contiguous, PMD aligned chunks. The kernel fills
+ * them through the linear map; user mappings are VM_PFNMAP and fault them
+ * in 4 KiB at a time.
+ */
+static int virtual_video_pool_buf_alloc_chunks(struct virtual_video_pool_buf *pb, unsigned long size)
+{
+    unsigned int nr = DIV_ROUND_UP(size, ELMO_VIDEO_CHUNK_SIZE);
+    unsigned int i, j;
+    struct page **pages;
+
+    pb->chunks = kcalloc(nr, sizeof(*pb->chunks), GFP_KERNEL);
+    if (!pb->chunks)
+        return -ENOMEM;
+    pb->nr_chunks = nr;
+
+    for (i = 0; i < nr; i++) {
+        pb->chunks[i] = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+                                    ELMO_VIDEO_CHUNK_ORDER);
+        if (!pb->chunks[i])
+            goto fail;
+    }
+
+    /* contiguous view for videobuf_to_vmalloc() users */
+    pages = kvmalloc_array(nr << ELMO_VIDEO_CHUNK_ORDER, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        goto fail;
+    for (i = 0; i < nr; i++) {
+        for (j = 0; j < (1U << ELMO_VIDEO_CHUNK_ORDER); j++)
+            pages[(i << ELMO_VIDEO_CHUNK_ORDER) + j] = pb->chunks[i] + j;
+    }
+    pb->vaddr = vmap(pages, nr << ELMO_VIDEO_CHUNK_ORDER, VM_MAP, PAGE_KERNEL);
+    kvfree(pages);
+    if (!pb->vaddr)
+        goto fail;
+    return 0;
+
+fail:
+    virtual_video_pool_buf_free(pb);
+    return -ENOMEM;
+}
+
+static int virtual_video_pool_buf_alloc(struct virtual_video_pool_buf *pb, unsigned long size, bool huge)
+{
+    if (huge) {
+        if (virtual_video_pool_buf_alloc_chunks(pb, size) == 0)
+            return 0;
+        debug_printk(DBG_WARN, "%s:no contiguous memory for %lu bytes, using vmalloc\n", __FUNCTION__, size);
+    }
+    pb->vaddr = vmalloc_user(size);
+    return pb->vaddr ? 0 : -ENOMEM;
+}
+
+/* pool memory is still referenced by user mappings, or videobuf buffers too if with_bufs */
+static bool virtual_video_pool_busy(struct virtual_video *dev, bool with_bufs)
+{
+    unsigned int i;
+
+    for (i = 0; i < VIDEO_MAX_FRAME; i++) {
+        if ((with_bufs && dev->vb_vidq.bufs[i]) || atomic_read(&dev->pool[i].mapped))
+            return true;
+    }
+    return false;
+}
+
+static void virtual_video_pool_free(struct virtual_video *dev)
+{
+    unsigned int i;
+
+    /* vmalloc pages still mapped by a client keep their own reference */
+    for (i = 0; i < VIDEO_MAX_FRAME; i++)
+        virtual_video_pool_buf_free(&dev->pool[i]);
+    dev->pool_size = 0;
+}
+
+/* pool_buffers, or fewer when the node has a smaller buffer budget */
+static unsigned int virtual_video_pool_count(const struct virtual_video *dev)
+{
+    unsigned int count = min_t(unsigned int, pool_buffers, VIDEO_MAX_FRAME);
+
+    if (dev->config.buffers)
+        count = min(count, dev->config.buffers);
+    return count;
+}
+
+/* (re)allocate the pool with buffers of size bytes unless the ones it has are large enough */
+static int virtual_video_pool_alloc(struct virtual_video *dev, unsigned long size)
+{
+    unsigned int i;
+
+    if (size <= dev->pool_size) {
+        debug_printk(DBG_INFO, "%s:reusing %u buffers of %lu bytes for %lu\n", __FUNCTION__,
+                     virtual_video_pool_count(dev), dev->pool_size, size);
+        return 0;
+    }
+    if (dev->pool_size && virtual_video_pool_busy(dev, false))
+        return -EBUSY;
+
+    virtual_video_pool_free(dev);
+    for (i = 0; i < virtual_video_pool_count(dev); i++) {
+        if (virtual_video_pool_buf_alloc(&dev->pool[i], size, hugepages) < 0) {
+            debug_printk(DBG_ERR, "%s:allocating %lu bytes failed\n", __FUNCTION__, size);
+            virtual_video_pool_free(dev);
+            return -ENOMEM;
+        }
+    }
+    dev->pool_size = size;
+    debug_printk(DBG_INFO, "%s:allocated %u buffers of %lu bytes\n", __FUNCTION__, i, size);
+    return 0;
+}
+
+static void virtual_video_chunk_vm_open(struct vm_area_struct *vma)
+{
+    struct virtual_video_pool_buf *pb = vma->vm_private_data;
+
+    atomic_inc(&pb->mapped);
+}
+
+static void virtual_video_chunk_vm_close(struct vm_area_struct *vma)
+{
+    struct virtual_video_pool_buf *pb = vma->vm_private_data;
+
+    atomic_dec(&pb->mapped);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+/* what 4.17 added to mm.h: fault handlers return VM_FAULT_* codes, vm_insert_pfn() an errno */
+typedef int vm_fault_t;
+
+static vm_fault_t vmf_insert_pfn(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn)
+{
+    int err = vm_insert_pfn(vma, addr, pfn);
+
+    if (err == -ENOMEM)
+        return VM_FAULT_OOM;
+    if (err < 0 && err != -EBUSY)
+        return VM_FAULT_SIGBUS;
+    return VM_FAULT_NOPAGE;
+}
+#endif
+
+static vm_fault_t virtual_video_chunk_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct virtual_video_pool_buf *pb = vma->vm_private_data;
+    unsigned long offset = vmf->address - vma->vm_start;
+    unsigned long chunk = offset >> ELMO_VIDEO_CHUNK_SHIFT;
+
+    if (chunk >= pb->nr_chunks)
+        return VM_FAULT_SIGBUS;
+    return vmf_insert_pfn(vma, vmf->address, page_to_pfn(pb->chunks[chunk]) +
+                          ((offset & (ELMO_VIDEO_CHUNK_SIZE - 1)) >> PAGE_SHIFT));
+}
+
+static const struct vm_operations_struct virtual_video_chunk_vm_ops = {
+    .open       = virtual_video_chunk_vm_open,
+    .close      = virtual_video_chunk_vm_close,
+    .fault      = virtual_video_chunk_fault,
 };
-static struct virtual_video_fmt *format_by_fourcc(unsigned int fourcc)
+
+/*
+ * Map a pool buffer in place of videobuf_mmap_mapper. videobuf only needs
+ * baddr set for QBUF and mem->vaddr for iolock; buf->map stays NULL so
+ * videobuf never frees the memory itself.
+ */
+static int virtual_video_pool_mmap(struct virtual_video *dev, struct vm_area_struct *vma)
 {
+    struct videobuf_queue *q = &dev->vb_vidq;
+    struct videobuf_buffer *buf = NULL;
+    struct videobuf_vmalloc_memory *mem;
+    struct virtual_video_pool_buf *pb;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
     unsigned int i;
-    for (i = 0; i < ARRAY_SIZE(format); i++){
-        if (format[i].fourcc == fourcc){
-            return format+i;
+    int retval;
+
+    if (!(vma->vm_flags & VM_WRITE) || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    mutex_lock(&dev->lock);
+    for (i = 0; i < VIDEO_MAX_FRAME && i < pool_buffers; i++) {
+        if (q->bufs[i] && q->bufs[i]->memory == V4L2_MEMORY_MMAP && q->bufs[i]->boff == offset) {
+            buf = q->bufs[i];
+            break;
+        }
+    }
+    if (!buf) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    retval = virtual_video_pool_alloc(dev, PAGE_ALIGN(buf->bsize));
+    if (retval < 0)
+        goto out;
+    if (vma->vm_end - vma->vm_start > dev->pool_size) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    pb = &dev->pool[i];
+    if (pb->chunks) {
+        vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+        vma->vm_ops = &virtual_video_chunk_vm_ops;
+        vma->vm_private_data = pb;
+        virtual_video_chunk_vm_open(vma);
+    } else {
+        retval = remap_vmalloc_range(vma, pb->vaddr, 0);
+        if (retval < 0) {
+            debug_printk(DBG_ERR, "%s:remap_vmalloc_range error:%d\n", __FUNCTION__, retval);
+            goto out;
         }
+        vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    }
+
+    mem = buf->priv;
+    mem->vaddr = pb->vaddr;
+    buf->baddr = vma->vm_start;
+out:
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/* fill bytes [offset, offset+len) of a frame; chunked pool buffers go through the linear map */
+static void virtual_video_fill_buf(const struct virtual_video_fmt *fmt, const struct virtual_video_pool_buf *pb,
+                                   char *vbuf, unsigned int offset, unsigned int len, unsigned int size,
+                                   unsigned int bpl)
+{
+    unsigned int end = offset + len, n;
+
+    if (!pb || !pb->chunks) {
+        fmt->fill(vbuf + offset, offset, len, size, bpl);
+        return;
     }
-    return NULL;
+    for (; offset < end; offset += n) {
+        n = min_t(unsigned long, end - offset, ELMO_VIDEO_CHUNK_SIZE - (offset & (ELMO_VIDEO_CHUNK_SIZE - 1)));
+        fmt->fill((char *)page_address(pb->chunks[offset >> ELMO_VIDEO_CHUNK_SHIFT]) + (offset & (ELMO_VIDEO_CHUNK_SIZE - 1)),
+                  offset, n, size, bpl);
+    }
+}
+
+/*
+ * videobuf-vmalloc only handles USERPTR without an address (read()); a real
+ * user buffer is pinned here and vmapped so the frame clock can fill it
+ * directly. The pages stay pinned while the buffer keeps its address.
+ */
+static int virtual_video_pin_user(struct virtual_video_buffer *buf)
+{
+    struct videobuf_vmalloc_memory *mem = buf->vb.priv;
+    unsigned long first = buf->vb.baddr & PAGE_MASK;
+    unsigned int n = DIV_ROUND_UP(offset_in_page(buf->vb.baddr) + buf->vb.size, PAGE_SIZE);
+    int pinned;
+
+    buf->pages = kvmalloc_array(n, sizeof(*buf->pages), GFP_KERNEL);
+    if (!buf->pages)
+        return -ENOMEM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    pinned = pin_user_pages_fast(first, n, FOLL_WRITE | FOLL_LONGTERM, buf->pages);
+#else
+    /* the last argument was "int write" before 5.2, FOLL_WRITE is 1 */
+    pinned = get_user_pages_fast(first, n, FOLL_WRITE, buf->pages);
+#endif
+    if (pinned != n) {
+        debug_printk(DBG_ERR, "%s:pinned %d of %u pages at 0x%lx\n", __FUNCTION__, pinned, n, buf->vb.baddr);
+        buf->nr_pages = max(pinned, 0);
+        goto fail;
+    }
+    buf->nr_pages = n;
+
+    buf->kaddr = vmap(buf->pages, n, VM_MAP, PAGE_KERNEL);
+    if (!buf->kaddr) {
+        debug_printk(DBG_ERR, "%s:vmap of %u pages failed\n", __FUNCTION__, n);
+        goto fail;
+    }
+    /* what videobuf_to_vmalloc() hands the frame clock */
+    mem->vaddr = buf->kaddr + offset_in_page(buf->vb.baddr);
+    buf->filled = false;
+    return 0;
+fail:
+    pinned = buf->nr_pages;
+    buf->nr_pages = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_pages(buf->pages, pinned);
+#else
+    while (pinned--)
+        put_page(buf->pages[pinned]);
+#endif
+    kvfree(buf->pages);
+    buf->pages = NULL;
+    return -EFAULT;
 }
 
+static void virtual_video_unpin_user(struct virtual_video_buffer *buf)
+{
+    struct videobuf_vmalloc_memory *mem = buf->vb.priv;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+    unsigned int i;
+#endif
+
+    if (!buf->pages)
+        return;
+    vunmap(buf->kaddr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_pages_dirty_lock(buf->pages, buf->nr_pages, true);
+#else
+    for (i = 0; i < buf->nr_pages; i++) {
+        set_page_dirty_lock(buf->pages[i]);
+        put_page(buf->pages[i]);
+    }
+#endif
+    kvfree(buf->pages);
+    buf->pages = NULL;
+    buf->nr_pages = 0;
+    buf->kaddr = NULL;
+    mem->vaddr = NULL;
+    buf->filled = false;
+}
 
 /*calculates the size of the video buffers and avoid they to waste more than some maximum limit of RAM;*/
 static int buffer_setup(struct videobuf_queue *vq, unsigned int *count, unsigned int *size)
@@ -106,17 +702,12 @@ static int buffer_setup(struct videobuf_queue *vq, unsigned int *count, unsigned
     debug_printk(DBG_INFO, "%s:count=%d\n", __FUNCTION__, *count);
     debug_printk(DBG_INFO, "%s:depth=%d, width=%d, height=%d\n", __FUNCTION__, dev->fmt->depth, dev->width, dev->height);
 
-    *size = dev->fmt->depth * dev->width * dev->height >> 3;
-
-    if (0 == *count)
-        *count = ELMO_VIDEO_DEF_BUF;
-
-    if (*count < ELMO_VIDEO_MIN_BUF)
-        *count = ELMO_VIDEO_MIN_BUF;
-
-    while (*size * *count > vid_limit * 1024 * 1024){
-        (*count)--;
-    }
+    *size = virtual_video_sizeimage(dev->fmt, dev->width, dev->height);
+    *count = virtual_video_trim_count(*count, *size, vid_limit);
+    if (pool_buffers && *count > pool_buffers)
+        *count = min_t(unsigned int, pool_buffers, VIDEO_MAX_FRAME);
+    if (dev->config.buffers && *count > dev->config.buffers)
+        *count = dev->config.buffers;
 
     debug_printk(DBG_INFO, "%s done:count=%d, size=%d\n", __FUNCTION__, *count, *size);
     return 0;
@@ -132,7 +723,7 @@ static int buffer_prepare(struct videobuf_queue *vq, struct videobuf_buffer *vb,
 
     /* FIXME: It assumes depth=2 */
     /* The only currently supported format is 16 bits/pixel */
-    buf->vb.size = dev->fmt->depth * dev->width * dev->height >> 3;
+    buf->vb.size = virtual_video_sizeimage(dev->fmt, dev->width, dev->height);
     if (buf->vb.baddr != 0 && buf->vb.bsize < buf->vb.size) {
         debug_printk(DBG_ERR, "invalid buffer prepare\n");
         return -EINVAL;
@@ -143,7 +734,11 @@ static int buffer_prepare(struct videobuf_queue *vq, struct videobuf_buffer *vb,
     buf->vb.height = dev->height;
     buf->vb.field  = field;
 
-    if (buf->vb.state == VIDEOBUF_NEEDS_INIT) {
+    if (buf->vb.state == VIDEOBUF_NEEDS_INIT && buf->vb.memory == V4L2_MEMORY_USERPTR && buf->vb.baddr) {
+        retval = virtual_video_pin_user(buf);
+        if (retval < 0)
+            goto fail;
+    } else if (buf->vb.state == VIDEOBUF_NEEDS_INIT) {
         debug_printk(DBG_INFO, "videobuf_iolock\n");
         retval = videobuf_iolock(vq, &buf->vb, NULL);
         if (retval < 0){
@@ -169,6 +764,7 @@ static void buffer_queue(struct videobuf_queue *vq, struct videobuf_buffer *vb)
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
     buf->vb.state = VIDEOBUF_QUEUED;
     list_add_tail(&buf->vb.queue, &dev->queued);
+    virtual_video_clock_wake();
 }
 /*frees any buffer that were allocated.*/
 static void buffer_release(struct videobuf_queue *vq, struct videobuf_buffer *vb)
@@ -176,6 +772,8 @@ static void buffer_release(struct videobuf_queue *vq, struct videobuf_buffer *vb
     struct virtual_video_buffer *buf = container_of(vb, struct virtual_video_buffer, vb);
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
 
+    /* also on QBUF with a new USERPTR address */
+    virtual_video_unpin_user(buf);
     videobuf_vmalloc_free(&buf->vb);
     buf->vb.state = VIDEOBUF_NEEDS_INIT;
 }
@@ -186,6 +784,90 @@ static struct videobuf_queue_ops virtual_video_qops = {
     .buf_release    = buffer_release,
 };
 
+static unsigned long virtual_video_period(void)
+{
+    /* slice mode spreads the same frame period over the slices */
+    return slices > 1 ? max(1UL, (unsigned long)HZ/ELMO_VIDEO_FPS/slices) : HZ/ELMO_VIDEO_FPS;
+}
+
+/* true if a clocked stream has a buffer to render into, the clock parks otherwise */
+static bool virtual_video_clock_busy(void)
+{
+    struct virtual_video *dev;
+    unsigned int i;
+
+    for (i = 0; i < ELMO_VIDEO_MAX_STREAMS; i++) {
+        dev = READ_ONCE(virtual_devs[i]);
+        if (dev && READ_ONCE(dev->clocked) && !list_empty(&dev->queued))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * restart a parked clock, from buffer_queue with slock held. Pairs with the
+ * barrier in tick_timer_function: either the timer sees the new buffer or
+ * we see clock_parked, and the xchg lets only one side arm the timer.
+ */
+static void virtual_video_clock_wake(void)
+{
+    smp_mb();
+    if (READ_ONCE(clock_parked) && xchg(&clock_parked, false))
+        mod_timer(&tick_timer, jiffies + virtual_video_period());
+}
+
+/* after del_timer_sync(): run again for the remaining streams, the first tick parks it if they are idle */
+static void virtual_video_clock_restart(void)
+{
+    WRITE_ONCE(clock_parked, !clock_users);
+    if (clock_users)
+        mod_timer(&tick_timer, jiffies + virtual_video_period());
+}
+
+/* the frame clock runs from STREAMON or the first read() until STREAMOFF or close, while buffers are queued */
+static void virtual_video_clock_get(struct virtual_video *dev)
+{
+    mutex_lock(&clock_lock);
+    spin_lock_irq(&dev->slock);
+    INIT_LIST_HEAD(&dev->queued);
+    dev->slice_vb = NULL;
+    dev->fps_acc = 0;
+    dev->shape.count = 0;
+    dev->shape.burst_left = 0;
+    dev->shape.since_stall = 0;
+    dev->shape.hold = 0;
+    dev->shape.dropped = 0;
+    dev->clocked = true;
+    spin_unlock_irq(&dev->slock);
+    /* the first buffer_queue starts the timer */
+    clock_users++;
+    mutex_unlock(&clock_lock);
+}
+
+static void virtual_video_clock_put(struct virtual_video *dev)
+{
+    mutex_lock(&clock_lock);
+    /* ticks after this skip the stream, other streams' buffer_queue can rearm the timer */
+    spin_lock_irq(&dev->slock);
+    dev->clocked = false;
+    spin_unlock_irq(&dev->slock);
+    /* the timer must not be rendering into this stream while it goes away */
+    del_timer_sync(&tick_timer);
+    virtual_video_shape_timer_cancel(&dev->shape);
+    dev->shape.armed = false;
+    if (dev->shape.dropped)
+        debug_printk(DBG_INFO, "stream %u: load shaping dropped %u frames\n", dev->index, dev->shape.dropped);
+    spin_lock_irq(&dev->slock);
+    /* videobuf_queue_cancel() unlinks these again */
+    while (!list_empty(&dev->queued))
+        list_del_init(dev->queued.next);
+    dev->slice_vb = NULL;
+    spin_unlock_irq(&dev->slock);
+    clock_users--;
+    virtual_video_clock_restart();
+    mutex_unlock(&clock_lock);
+}
+
 static int virtual_video_fops_open(struct file *file)
 {
     struct video_device *vdev = video_devdata(file);
@@ -211,10 +893,16 @@ static int virtual_video_fops_open(struct file *file)
     file->private_data = fh;
     fh->dev = dev;
 
-    dev->width = 800;
-    dev->height = 480;
-    dev->fourcc = format[0].fourcc;
+    dev->width = dev->config.width;
+    dev->height = dev->config.height;
+    dev->fourcc = dev->config.fourcc;
     dev->fmt = format_by_fourcc(dev->fourcc);
+    virtual_video_align(dev->fmt, &dev->width, &dev->height);
+    dev->open_time = ktime_get();
+    dev->first_frame = true;
+    dev->sequence = 0;
+    dev->slice_vb = NULL;
+    dev->dirty_full = true;
 
     videobuf_queue_vmalloc_init(&dev->vb_vidq, &virtual_video_qops,
                 NULL, &dev->slock,
@@ -224,9 +912,6 @@ static int virtual_video_fops_open(struct file *file)
 
     v4l2_fh_add(&fh->fh);
 
-    dev->tick_timer.expires = jiffies + HZ;
-    add_timer(&dev->tick_timer);
-
     return 0;
 }
 
@@ -239,8 +924,11 @@ static int virtual_video_fops_release(struct file *file)
 
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
     dev->io_usrs--;
+    if (dev->clocked)
+        virtual_video_clock_put(dev);
+    /* ends streaming or read(), so the buffers and any pinned USERPTR pages are freed */
+    videobuf_stop(&dev->vb_vidq);
     videobuf_mmap_free(&dev->vb_vidq);
-    del_timer(&dev->tick_timer);
     v4l2_fh_del(&fh->fh);
     v4l2_fh_exit(&fh->fh);
 
@@ -260,6 +948,25 @@ static long virtual_video_fops_unlocked_ioctl(struct file *file, unsigned int cm
     return retval;
 }
 
+/* read() capture, videobuf streams through its own buffers and copies out whole or partial frames */
+static ssize_t virtual_video_fops_read(struct file *file, char __user *data, size_t count, loff_t *ppos)
+{
+    struct virtual_video_fh *fh = (struct virtual_video_fh *)file->private_data;
+    struct virtual_video *dev = fh->dev;
+    ssize_t retval;
+
+    debug_printk(DBG_INFO, "%s:count=%zu\n", __FUNCTION__, count);
+    /* the queue's ext_lock, videobuf drops it while waiting for a frame */
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    /* the first read() queues the internal buffers */
+    if (!dev->clocked)
+        virtual_video_clock_get(dev);
+    retval = videobuf_read_stream(&dev->vb_vidq, data, count, ppos, 0, file->f_flags & O_NONBLOCK);
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
 static int virtual_video_fops_mmap(struct file *file, struct vm_area_struct *vma)
 {
     struct virtual_video_fh *fh = (struct virtual_video_fh *)file->private_data;
@@ -267,7 +974,10 @@ static int virtual_video_fops_mmap(struct file *file, struct vm_area_struct *vma
     int retval;
 
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
-    retval = videobuf_mmap_mapper(&dev->vb_vidq, vma);
+    if (pool_buffers)
+        retval = virtual_video_pool_mmap(dev, vma);
+    else
+        retval = videobuf_mmap_mapper(&dev->vb_vidq, vma);
     return retval;
 }
 
@@ -287,6 +997,13 @@ static unsigned int virtual_video_fops_poll(struct file *file, struct poll_table
     }
 
     if (req_events & (POLLIN | POLLRDNORM)) {
+        /* polling an idle queue starts read() capture like the first read() */
+        if (!READ_ONCE(dev->clocked) && !dev->vb_vidq.streaming) {
+            mutex_lock(&dev->lock);
+            if (!dev->clocked && !dev->vb_vidq.streaming)
+                virtual_video_clock_get(dev);
+            mutex_unlock(&dev->lock);
+        }
         return res | videobuf_poll_stream(file, &dev->vb_vidq, wait); /* read() capture */
     }
 
@@ -300,6 +1017,7 @@ static const struct v4l2_file_operations virtual_video_fops = {
     .open           = virtual_video_fops_open,
     .release        = virtual_video_fops_release,
     .unlocked_ioctl = virtual_video_fops_unlocked_ioctl,  //video_ioctl2,
+    .read           = virtual_video_fops_read,
     .mmap           = virtual_video_fops_mmap,
     .poll           = virtual_video_fops_poll             //vb2_fop_poll
 };
@@ -315,7 +1033,7 @@ static int virtual_video_iops_querycap(struct file *file, void  *priv, struct v4
     strlcpy(cap->card,     "virtual_video", sizeof(cap->card));
     strlcpy(cap->bus_info, "virtual_video", sizeof(cap->bus_info));
 
-    cap->device_caps = V4L2_CAP_STREAMING | V4L2_CAP_VIDEO_CAPTURE;
+    cap->device_caps = V4L2_CAP_STREAMING | V4L2_CAP_READWRITE | V4L2_CAP_VIDEO_CAPTURE;
     cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
 
     return 0;
@@ -343,8 +1061,7 @@ static int virtual_video_iops_g_fmt_vid_cap(struct file *file, void *priv, struc
     f->fmt.pix.field        = dev->vb_vidq.field;
     f->fmt.pix.pixelformat  = dev->fmt->fourcc;
     f->fmt.pix.colorspace   = V4L2_COLORSPACE_SMPTE170M;
-    f->fmt.pix.bytesperline = (f->fmt.pix.width * dev->fmt->depth) >> 3;
-    f->fmt.pix.sizeimage    = f->fmt.pix.height * f->fmt.pix.bytesperline;
+    virtual_video_pix_format(dev->fmt, &f->fmt.pix);
 
     return 0;
 }
@@ -366,11 +1083,9 @@ static int virtual_video_iops_try_fmt_vid_cap(struct file *file, void *priv, str
     f->fmt.pix.height = dev->height;
 
     f->fmt.pix.width &= ~0x01;
+    virtual_video_pix_format(fmt, &f->fmt.pix);
 
     f->fmt.pix.field = V4L2_FIELD_INTERLACED;
-
-    f->fmt.pix.bytesperline = (f->fmt.pix.width * fmt->depth) >> 3;
-    f->fmt.pix.sizeimage    = f->fmt.pix.height * f->fmt.pix.bytesperline;
     f->fmt.pix.colorspace   = V4L2_COLORSPACE_SMPTE170M;
 
     return 0;
@@ -379,13 +1094,36 @@ static int virtual_video_iops_s_fmt_vid_cap(struct file *file, void *priv, struc
 {
     struct virtual_video_fh *fh = (struct virtual_video_fh *)priv;
     struct virtual_video *dev = fh->dev;
+    struct virtual_video_fmt *fmt;
     int retval=0;
     
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
     debug_printk(DBG_INFO, "%s:width=%d,height=%d\n", __FUNCTION__, f->fmt.pix.width, f->fmt.pix.height);
     debug_printk(DBG_INFO, "%s:field=%d,type=%d\n", __FUNCTION__,f->fmt.pix.field, f->type);
 
-    dev->fmt           = format_by_fourcc(f->fmt.pix.pixelformat);
+    fmt = format_by_fourcc(f->fmt.pix.pixelformat);
+    if (NULL == fmt) {
+        debug_printk(DBG_INFO, "Fourcc format (0x%08x) invalid.\n", f->fmt.pix.pixelformat);
+        return -EINVAL;
+    }
+    virtual_video_pix_format(fmt, &f->fmt.pix);
+
+    /* smaller frames reuse the pool, only a larger one needs new buffers */
+    if (dev->pool_size && PAGE_ALIGN(f->fmt.pix.sizeimage) > dev->pool_size) {
+        mutex_lock(&dev->lock);
+        if (virtual_video_pool_busy(dev, true))
+            retval = -EBUSY;
+        else
+            virtual_video_pool_free(dev);
+        mutex_unlock(&dev->lock);
+        if (retval < 0) {
+            debug_printk(DBG_ERR, "%s:pool buffers still in use\n", __FUNCTION__);
+            return retval;
+        }
+    }
+
+    dev->dirty_full    = true;
+    dev->fmt           = fmt;
     dev->width         = f->fmt.pix.width;
     dev->height        = f->fmt.pix.height;
     dev->vb_vidq.field = f->fmt.pix.field;
@@ -462,30 +1200,196 @@ static int virtual_video_iops_streamon(struct file *file, void *priv, enum v4l2_
     int retval = 0;
     struct virtual_video_fh *fh = (struct virtual_video_fh *)priv;
     struct virtual_video *dev = fh->dev;
+    bool started = false;
 
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
 
+    /* before the queued buffers reach buffer_queue, which wakes the clock */
+    if (!dev->clocked) {
+        virtual_video_clock_get(dev);
+        started = true;
+    }
     retval = videobuf_streamon(&dev->vb_vidq);
     if(retval != 0){
         debug_printk(DBG_ERR, "%s:videobuf_streamon err,ret=%d\n", __FUNCTION__, retval);
+        if (started)
+            virtual_video_clock_put(dev);
     }
 
-//    dev->tick_timer.expires = jiffies + HZ/20;
-//    add_timer(&dev->tick_timer);
-
     return retval;
 }
 static int virtual_video_iops_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
 {
     int retval = 0;
-    //struct virtual_video *dev = (struct virtual_video *)fh;
+    struct virtual_video_fh *fh = (struct virtual_video_fh *)priv;
+    struct virtual_video *dev = fh->dev;
 
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
-    //del_timer(&dev->tick_timer);
-    
+    /* read() capture keeps the clock until close */
+    if (dev->clocked && dev->vb_vidq.streaming)
+        virtual_video_clock_put(dev);
+    /* hands every buffer back dequeued, and frees pinned USERPTR pages */
+    retval = videobuf_streamoff(&dev->vb_vidq);
+    if(retval != 0){
+        debug_printk(DBG_ERR, "%s:videobuf_streamoff err,ret=%d\n", __FUNCTION__, retval);
+    }
     return retval;
 }
 
+static int virtual_video_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct virtual_video *dev = container_of(ctrl->handler, struct virtual_video, ctrl_handler);
+
+    debug_printk(DBG_INFO, "%s:id=0x%x val=%d\n", __FUNCTION__, ctrl->id, ctrl->val);
+
+    switch (ctrl->id) {
+    case V4L2_CID_VIRTUAL_VIDEO_OVERLAY:
+        dev->overlay = ctrl->val;
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_CHECKSUM:
+        WRITE_ONCE(dev->checksum, ctrl->val);
+        return 0;
+    /* the frame clock picks these up on its next tick */
+    case V4L2_CID_VIRTUAL_VIDEO_JITTER:
+        WRITE_ONCE(dev->shape.jitter, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_JITTER_MIN:
+        WRITE_ONCE(dev->shape.jitter_min, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_JITTER_MAX:
+        WRITE_ONCE(dev->shape.jitter_max, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_BURST:
+        WRITE_ONCE(dev->shape.burst, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_STALL_PERIOD:
+        WRITE_ONCE(dev->shape.stall_period, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_STALL_TIME:
+        WRITE_ONCE(dev->shape.stall_time, ctrl->val);
+        return 0;
+    case V4L2_CID_VIRTUAL_VIDEO_RENDER_COST:
+        WRITE_ONCE(dev->shape.cost, ctrl->val);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static const struct v4l2_ctrl_ops virtual_video_ctrl_ops = {
+    .s_ctrl = virtual_video_s_ctrl,
+};
+
+static const struct v4l2_ctrl_config virtual_video_ctrl_overlay = {
+    .ops  = &virtual_video_ctrl_ops,
+    .id   = V4L2_CID_VIRTUAL_VIDEO_OVERLAY,
+    .name = "Timestamp Overlay",
+    .type = V4L2_CTRL_TYPE_BOOLEAN,
+    .min  = 0,
+    .max  = 1,
+    .step = 1,
+    .def  = 0,
+};
+
+static const struct v4l2_ctrl_config virtual_video_ctrl_checksum = {
+    .ops  = &virtual_video_ctrl_ops,
+    .id   = V4L2_CID_VIRTUAL_VIDEO_CHECKSUM,
+    .name = "Frame Checksum",
+    .type = V4L2_CTRL_TYPE_BOOLEAN,
+    .min  = 0,
+    .max  = 1,
+    .step = 1,
+    .def  = 0,
+};
+
+static const char * const virtual_video_jitter_menu[] = {
+    "None", "Uniform", "Normal", "Exponential", NULL,
+};
+
+static const struct v4l2_ctrl_config virtual_video_ctrl_shape[] = {
+    {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_JITTER,
+        .name = "Jitter Distribution",
+        .type = V4L2_CTRL_TYPE_MENU,
+        .max  = VIRTUAL_VIDEO_JITTER_EXPONENTIAL,
+        .def  = VIRTUAL_VIDEO_JITTER_NONE,
+        .qmenu = virtual_video_jitter_menu,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_JITTER_MIN,
+        .name = "Jitter Min (us)",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 0,
+        .max  = 1000000,
+        .step = 1,
+        .def  = 0,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_JITTER_MAX,
+        .name = "Jitter Max (us)",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 0,
+        .max  = 1000000,
+        .step = 1,
+        .def  = 0,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_BURST,
+        .name = "Burst Frames",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 1,
+        .max  = ELMO_VIDEO_MAX_BURST,
+        .step = 1,
+        .def  = 1,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_STALL_PERIOD,
+        .name = "Stall Period (frames)",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 0,
+        .max  = 1000000,
+        .step = 1,
+        .def  = 0,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_STALL_TIME,
+        .name = "Stall Time (ms)",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 0,
+        .max  = 10000,
+        .step = 1,
+        .def  = 0,
+    }, {
+        .ops  = &virtual_video_ctrl_ops,
+        .id   = V4L2_CID_VIRTUAL_VIDEO_RENDER_COST,
+        .name = "Render Cost (us)",
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .min  = 0,
+        .max  = 1000000,
+        .step = 1,
+        .def  = 0,
+    },
+};
+
+static int virtual_video_iops_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+    debug_printk(DBG_INFO, "%s:type=0x%x\n", __FUNCTION__, sub->type);
+
+    switch (sub->type) {
+    case V4L2_EVENT_VIRTUAL_VIDEO_SLICE:
+        /* room for a couple of frames worth of slices */
+        return v4l2_event_subscribe(fh, sub, 2 * VIDEO_MAX_FRAME, NULL);
+    case V4L2_EVENT_VIRTUAL_VIDEO_DIRTY:
+    case V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM:
+        return v4l2_event_subscribe(fh, sub, VIDEO_MAX_FRAME, NULL);
+    case V4L2_EVENT_CTRL:
+        return v4l2_ctrl_subscribe_event(fh, sub);
+    default:
+        return -EINVAL;
+    }
+}
+
 static const struct v4l2_ioctl_ops virtual_video_ioctl_ops =
 {
     /* 表示它是一个摄像头设备 */
@@ -506,6 +1410,10 @@ static const struct v4l2_ioctl_ops virtual_video_ioctl_ops =
     // 启动/停止
     .vidioc_streamon      = virtual_video_iops_streamon,
     .vidioc_streamoff     = virtual_video_iops_streamoff,   
+
+    // 事件
+    .vidioc_subscribe_event   = virtual_video_iops_subscribe_event,
+    .vidioc_unsubscribe_event = v4l2_event_unsubscribe,
 };
 
 static void virtual_video_device_release(struct video_device *vdev)
@@ -517,112 +1425,651 @@ static void virtual_video_device_release(struct video_device *vdev)
     //kfree(dev);
 }
 
+/* last reference gone: the node is unregistered and no file has it open */
 static void virtual_video_v4l2_device_release(struct v4l2_device *vdev)
 {
-    //struct virtual_video *dev = container_of(vdev, struct virtual_video, v4l2_dev);
+    struct virtual_video *dev = container_of(vdev, struct virtual_video, v4l2_dev);
     debug_printk(DBG_INFO, "%s\n", __FUNCTION__);
 
-    //video_device_release(dev->video_dev);
-    //kfree(dev);
+    v4l2_ctrl_handler_free(&dev->ctrl_handler);
+    virtual_video_pool_free(dev);
+    kfree(dev);
 }
 
-static void tick_timer_function(struct timer_list *t)
+/* where the animated box sits in frame sequence, empty without animate */
+static void virtual_video_box(const struct virtual_video *dev, u32 sequence, struct v4l2_rect *r)
 {
-    struct virtual_video *dev = from_timer(dev, t, tick_timer);
-    struct videobuf_buffer *vb;
-    char *vbuf;
-    int size;
-    int i,step;
+    unsigned int size = min3((unsigned int)ELMO_VIDEO_BOX, dev->width, dev->height);
 
-    if (list_empty(&dev->queued)) {
-        mod_timer(&dev->tick_timer, jiffies + HZ/30);
-        //debug_printk(DBG_INFO, "err%d\n",__LINE__);
+    /* packed pixels are only addressable in groups of 4 */
+    if (dev->fmt->depth == 10)
+        size = round_down(size, 4);
+    memset(r, 0, sizeof(*r));
+    if (dev->config.pattern != VIRTUAL_VIDEO_PATTERN_BOX || !size)
+        return;
+    r->width  = size;
+    r->height = size;
+    r->left   = (sequence * 8) % (dev->width - size + 1);
+    if (dev->fmt->depth == 10)
+        r->left = round_down(r->left, 4);
+    r->top    = (dev->height - size) / 2;
+}
+
+/* repaint the pattern under r, or the box itself, clipped to rows [first, last) */
+static void virtual_video_draw_rect(const struct virtual_video *dev, char *vbuf, const struct v4l2_rect *r,
+                                    bool box, unsigned int first, unsigned int last)
+{
+    unsigned int bpl = virtual_video_bytesperline(dev->fmt, dev->width);
+    unsigned int len = virtual_video_pixel_bytes(dev->fmt, r->width);
+    unsigned int size = virtual_video_sizeimage(dev->fmt, dev->width, dev->height);
+    unsigned int x, y, offset;
+    u8 white[ELMO_VIDEO_BOX * OVERLAY_BPP];
+
+    if (box) {
+        memset(white, 0, len);
+        for (x = 0; x < r->width; x++)
+            virtual_video_put_pixel(dev->fmt, white, x, true);
+    }
+    for (y = max_t(unsigned int, r->top, first); y < min(r->top + r->height, last); y++) {
+        offset = y * bpl + virtual_video_pixel_bytes(dev->fmt, r->left);
+        if (box)
+            memcpy(vbuf + offset, white, len);
+        else
+            dev->fmt->fill(vbuf + offset, offset, len, size, bpl);
+    }
+}
+
+/* compose the overlay text for the frame about to be rendered, and update the frame rate */
+static void virtual_video_overlay_text(struct virtual_video *dev)
+{
+    ktime_t now = ktime_get();
+    s64 delta = ktime_to_ns(ktime_sub(now, dev->last_frame));
+    struct timespec64 ts;
+    struct tm tm;
+
+    if (dev->sequence && delta > 0)
+        dev->fps_x10 = (dev->fps_x10 * 7 + div64_s64(10LL * NSEC_PER_SEC, delta)) / 8;
+    dev->last_frame = now;
+
+    if (!dev->overlay) {
+        dev->overlay_len = 0;
         return;
     }
+    ktime_get_real_ts64(&ts);
+    time64_to_tm(ts.tv_sec, 0, &tm);
+    dev->overlay_len = scnprintf(dev->overlay_text, sizeof(dev->overlay_text),
+                                 "dev%d seq %06u %02d:%02d:%02d.%03ld %3u.%u fps",
+                                 dev->video_dev.num, dev->sequence, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                                 ts.tv_nsec / NSEC_PER_MSEC, dev->fps_x10 / 10, dev->fps_x10 % 10);
+}
+
+/* whole cells that fit in the frame, empty when the overlay is off */
+static void virtual_video_overlay_rect(const struct virtual_video *dev, struct v4l2_rect *r)
+{
+    unsigned int cells = 0;
 
-    vb = list_entry(dev->queued.next, struct videobuf_buffer, queue);
+    if (dev->width > OVERLAY_MARGIN && dev->height >= OVERLAY_MARGIN + OVERLAY_CELL_H)
+        cells = min(dev->overlay_len, (dev->width - OVERLAY_MARGIN) / OVERLAY_CELL_W);
 
-    if (!waitqueue_active(&vb->done)){
-        mod_timer(&dev->tick_timer, jiffies + HZ/30);
-        //debug_printk(DBG_INFO, "err%d\n",__LINE__);
+    memset(r, 0, sizeof(*r));
+    if (!cells)
         return;
+    r->left   = OVERLAY_MARGIN;
+    r->top    = OVERLAY_MARGIN;
+    r->width  = cells * OVERLAY_CELL_W;
+    r->height = OVERLAY_CELL_H;
+}
+
+/* copy atlas cells into rows [first, last) of the overlay box, nothing else is touched */
+static void virtual_video_draw_overlay(const struct virtual_video *dev, char *vbuf, const struct v4l2_rect *r,
+                                       unsigned int first, unsigned int last)
+{
+    unsigned int bpl = virtual_video_bytesperline(dev->fmt, dev->width);
+    unsigned int f = dev->fmt - format;
+    unsigned int cells = r->width / OVERLAY_CELL_W;
+    unsigned int cell = virtual_video_pixel_bytes(dev->fmt, OVERLAY_CELL_W);
+    u8 glyph[sizeof(dev->overlay_text)];
+    unsigned int i, y;
+    char *dst;
+
+    /* characters missing from the font show as blanks */
+    for (i = 0; i < cells; i++) {
+        glyph[i] = strchrnul(overlay_chars, dev->overlay_text[i]) - overlay_chars;
+        if (glyph[i] >= ARRAY_SIZE(overlay_font))
+            glyph[i] = OVERLAY_BLANK;
     }
 
-    vbuf = (char*)videobuf_to_vmalloc(vb);
-    size = dev->fmt->depth * dev->width * dev->height >> 3;
-    step = size/3;
-    if(dev->fmt->fourcc == V4L2_PIX_FMT_RGB32){
-        for(i=0;i<step;i+=4){
-            vbuf[i]   = 0x00;  //a
-            vbuf[i+1] = 0x00;  //r
-            vbuf[i+2] = 0x00;  //g
-            vbuf[i+3] = 0xff;  //b
+    for (y = max_t(unsigned int, r->top, first); y < min(r->top + r->height, last); y++) {
+        dst = vbuf + y * bpl + virtual_video_pixel_bytes(dev->fmt, r->left);
+        for (i = 0; i < cells; i++) {
+            memcpy(dst, overlay_atlas[f][glyph[i]][y - r->top], cell);
+            dst += cell;
         }
-        for(;i<step*2;i+=4){
-            vbuf[i]   = 0x00;
-            vbuf[i+1] = 0x00;
-            vbuf[i+2] = 0xff;
-            vbuf[i+3] = 0x00;
-        }
-        for(;i<size;i+=4){
-            vbuf[i]   = 0x00;
-            vbuf[i+1] = 0xff;
-            vbuf[i+2] = 0x00;
-            vbuf[i+3] = 0x00;
+    }
+}
+
+static void virtual_video_buffer_filled(const struct virtual_video *dev, struct virtual_video_buffer *buf,
+                                        const struct v4l2_rect *box, const struct v4l2_rect *overlay)
+{
+    buf->filled  = true;
+    buf->fourcc  = dev->fourcc;
+    buf->width   = dev->width;
+    buf->height  = dev->height;
+    buf->box     = *box;
+    buf->overlay = *overlay;
+}
+
+/*
+ * Whole-frame mode: a buffer that already holds a frame of this geometry
+ * only gets the box moved and the overlay redrawn, everything else is
+ * still what it was. USERPTR memory belongs to the application, which may
+ * have reused it, so it is always filled completely.
+ */
+static void virtual_video_render_frame(struct virtual_video *dev, struct virtual_video_buffer *buf,
+                                       const struct virtual_video_pool_buf *pb, char *vbuf)
+{
+    unsigned int bpl = virtual_video_bytesperline(dev->fmt, dev->width);
+    unsigned int size = bpl * dev->height;
+    struct v4l2_rect box, overlay;
+    bool restored = false;
+
+    virtual_video_overlay_text(dev);
+    virtual_video_box(dev, dev->sequence, &box);
+    virtual_video_overlay_rect(dev, &overlay);
+
+    if (!buf->filled || buf->pages || buf->fourcc != dev->fourcc || buf->width != dev->width || buf->height != dev->height) {
+        virtual_video_fill_buf(dev->fmt, pb, vbuf, 0, size, size, bpl);
+        restored = true;
+    } else {
+        if (memcmp(&box, &buf->box, sizeof(box))) {
+            virtual_video_draw_rect(dev, vbuf, &buf->box, false, 0, dev->height);
+            restored = true;
         }
-    } else if(dev->fmt->fourcc == V4L2_PIX_FMT_BGR32){
-        for(i=0;i<step;i+=4){
-            vbuf[i]   = 0xff;  //b
-            vbuf[i+1] = 0x00;  //g
-            vbuf[i+2] = 0x00;  //r
-            vbuf[i+3] = 0xff;  //a
+        /* a shorter or disabled overlay leaves old text behind */
+        if (buf->overlay.width && memcmp(&overlay, &buf->overlay, sizeof(overlay))) {
+            virtual_video_draw_rect(dev, vbuf, &buf->overlay, false, 0, dev->height);
+            restored = true;
         }
-        for(;i<step*2;i+=4){
-            vbuf[i]   = 0x00;
-            vbuf[i+1] = 0xff;
-            vbuf[i+2] = 0x00;
-            vbuf[i+3] = 0xff;
+    }
+    if (restored)
+        virtual_video_draw_rect(dev, vbuf, &box, true, 0, dev->height);
+    virtual_video_draw_overlay(dev, vbuf, &overlay, 0, dev->height);
+    virtual_video_buffer_filled(dev, buf, &box, &overlay);
+}
+
+/* tell consumers which parts of the frame about to be delivered changed */
+static void virtual_video_queue_dirty(struct virtual_video *dev, struct videobuf_buffer *vb)
+{
+    struct v4l2_event ev;
+    struct virtual_video_dirty_event *dirty = (struct virtual_video_dirty_event *)ev.u.data;
+    struct v4l2_rect box, overlay;
+
+    virtual_video_box(dev, dev->sequence, &box);
+    virtual_video_overlay_rect(dev, &overlay);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = V4L2_EVENT_VIRTUAL_VIDEO_DIRTY;
+    dirty->index    = vb->i;
+    dirty->sequence = dev->sequence;
+    if (dev->dirty_full) {
+        dirty->rect[0].width  = dev->width;
+        dirty->rect[0].height = dev->height;
+        dirty->count = 1;
+    } else {
+        if (memcmp(&box, &dev->last_box, sizeof(box))) {
+            if (dev->last_box.width)
+                dirty->rect[dirty->count++] = dev->last_box;
+            if (box.width)
+                dirty->rect[dirty->count++] = box;
         }
-        for(;i<size;i+=4){
-            vbuf[i]   = 0x00;
-            vbuf[i+1] = 0x00;
-            vbuf[i+2] = 0xff;
-            vbuf[i+3] = 0xff;
+        /* the text changes every frame; old and new overlay share the origin */
+        if (overlay.width || dev->last_overlay.width) {
+            dirty->rect[dirty->count] = overlay.width ? overlay : dev->last_overlay;
+            dirty->rect[dirty->count].width = max(overlay.width, dev->last_overlay.width);
+            dirty->count++;
         }
     }
+    v4l2_event_queue(&dev->video_dev, &ev);
 
+    dev->last_box = box;
+    dev->last_overlay = overlay;
+    dev->dirty_full = false;
+}
 
-    vb->field_count++;
-    v4l2_get_timestamp(&vb->ts);
-    vb->state = VIDEOBUF_DONE;
+/* before vb is marked done, so the event is there by the time DQBUF returns it */
+static void virtual_video_queue_checksum(struct virtual_video *dev, struct videobuf_buffer *vb, const char *vbuf)
+{
+    struct v4l2_event ev;
+    struct virtual_video_checksum_event *sum = (struct virtual_video_checksum_event *)ev.u.data;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM;
+    sum->index     = vb->i;
+    sum->sequence  = dev->sequence;
+    sum->bytesused = vb->size;
+    sum->crc       = ~crc32c(~dev->sequence, vbuf, vb->size);
+    v4l2_event_queue(&dev->video_dev, &ev);
+}
 
+/* render the next slice of vb and tell subscribers how many rows are final, true once vb is complete */
+static bool virtual_video_render_slice(struct virtual_video *dev, struct videobuf_buffer *vb,
+                                       const struct virtual_video_pool_buf *pb, char *vbuf)
+{
+    struct v4l2_event ev;
+    struct virtual_video_slice_event *slice = (struct virtual_video_slice_event *)ev.u.data;
+    unsigned int bpl = virtual_video_bytesperline(dev->fmt, dev->width);
+    unsigned int rows = DIV_ROUND_UP(dev->height, slices);
+    unsigned int first, last;
+    struct v4l2_rect box, overlay;
+
+    if (dev->slice_vb != vb) {
+        dev->slice_vb = vb;
+        dev->slice = 0;
+        virtual_video_overlay_text(dev);
+    }
+    first = dev->slice++ * rows;
+    last = min(first + rows, dev->height);
+    virtual_video_fill_buf(dev->fmt, pb, vbuf, first * bpl, (last - first) * bpl,
+                           virtual_video_sizeimage(dev->fmt, dev->width, dev->height), bpl);
+    virtual_video_box(dev, dev->sequence, &box);
+    virtual_video_draw_rect(dev, vbuf, &box, true, first, last);
+    virtual_video_overlay_rect(dev, &overlay);
+    virtual_video_draw_overlay(dev, vbuf, &overlay, first, last);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = V4L2_EVENT_VIRTUAL_VIDEO_SLICE;
+    slice->index       = vb->i;
+    slice->sequence    = dev->sequence;
+    slice->lines_ready = last;
+    slice->height      = dev->height;
+    v4l2_event_queue(&dev->video_dev, &ev);
+
+    if (last < dev->height)
+        return false;
+    virtual_video_buffer_filled(dev, container_of(vb, struct virtual_video_buffer, vb), &box, &overlay);
+    dev->slice_vb = NULL;
+    return true;
+}
+
+/* one frame clock tick for one stream, held frames from load shaping complete even with nobody waiting */
+static void virtual_video_tick(struct virtual_video *dev, const struct virtual_video_stamp *stamp, bool held)
+{
+    struct videobuf_buffer *vb;
+    struct virtual_video_buffer *buf;
+    const struct virtual_video_pool_buf *pb;
+    char *vbuf;
+
+    spin_lock(&dev->slock);
+    vb = list_first_entry_or_null(&dev->queued, struct videobuf_buffer, queue);
+    spin_unlock(&dev->slock);
+    if (!vb) {
+        //debug_printk(DBG_INFO, "err%d\n",__LINE__);
+        return;
+    }
+
+    /* slice consumers work from events rather than sleeping in DQBUF */
+    if (slices <= 1 && !held && !waitqueue_active(&vb->done)){
+        //debug_printk(DBG_INFO, "err%d\n",__LINE__);
+        return;
+    }
+
+    /* the group's frame count, a slice frame keeps the one it started with */
+    if (dev->config.group && !dev->slice_vb)
+        dev->sequence = stamp->sequence;
+
+    buf = container_of(vb, struct virtual_video_buffer, vb);
+    vbuf = (char*)videobuf_to_vmalloc(vb);
+    pb = dev->pool[vb->i].vaddr == vbuf ? &dev->pool[vb->i] : NULL;
+    if (slices > 1) {
+        if (!virtual_video_render_slice(dev, vb, pb, vbuf))
+            return;
+    } else {
+        virtual_video_render_frame(dev, buf, pb, vbuf);
+    }
+    virtual_video_queue_dirty(dev, vb);
+    /* the application reads USERPTR pages through its own mapping */
+    if (buf->pages)
+        flush_kernel_vmap_range(vbuf, vb->size);
+
+    if (dev->first_frame) {
+        dev->first_frame = false;
+        debug_printk(DBG_INFO, "time to first frame: %lld us\n",
+                     ktime_us_delta(ktime_get(), dev->open_time));
+    }
+
+    /* stamped once complete, so a mismatch at the consumer means the memory changed after delivery */
+    if (READ_ONCE(dev->checksum))
+        virtual_video_queue_checksum(dev, vb, vbuf);
+
+    /* videobuf reports field_count / 2 as v4l2_buffer.sequence */
+    vb->field_count = dev->sequence++ << 1;
+    vb->ts = stamp->ts;
+
+    spin_lock(&dev->slock);
+    vb->state = VIDEOBUF_DONE;
     list_del(&vb->queue);
+    spin_unlock(&dev->slock);
     wake_up(&vb->done);
+}
 
-    mod_timer(&dev->tick_timer, jiffies + HZ/30);
+/* jitter in us for one frame, in [jitter_min, jitter_max] */
+static u32 virtual_video_jitter(const struct virtual_video_shape *shape)
+{
+    u32 lo = READ_ONCE(shape->jitter_min);
+    u32 range = max(READ_ONCE(shape->jitter_max), lo) - lo;
+    u32 r, l2;
+    u64 x;
+
+    switch (READ_ONCE(shape->jitter)) {
+    case VIRTUAL_VIDEO_JITTER_UNIFORM:
+        x = ((u64)get_random_u32() * (range + 1)) >> 32;
+        break;
+    case VIRTUAL_VIDEO_JITTER_NORMAL:
+        x = ((u64)get_random_u32() + get_random_u32() + get_random_u32() + get_random_u32()) * (range + 1) >> 34;
+        break;
+    case VIRTUAL_VIDEO_JITTER_EXPONENTIAL:
+        /* -ln(r / 2^32) in 16.16, log2 with a linear mantissa is close enough */
+        r = get_random_u32() | 1;
+        l2 = (ilog2(r) << 16) | (((r << (31 - ilog2(r))) & 0x7fffffff) >> 15);
+        x = ((u64)((32 << 16) - l2) * 45426) >> 16;     /* ln 2 = 45426 / 65536 */
+        x = min_t(u64, (x * range / 4) >> 16, range);
+        break;
+    default:
+        return 0;
+    }
+    return lo + x;
 }
 
-static int virtual_video_init(void)
+/* take the oldest held frame and complete it, under shape.lock */
+static void virtual_video_shape_deliver(struct virtual_video *dev)
+{
+    struct virtual_video_shape *shape = &dev->shape;
+    struct virtual_video_stamp stamp = shape->stamp[shape->head];
+
+    shape->head = (shape->head + 1) % ELMO_VIDEO_SHAPE_QUEUE;
+    shape->count--;
+    virtual_video_tick(dev, &stamp, true);
+}
+
+/* start the next burst once enough frames are held, under shape.lock */
+static void virtual_video_shape_schedule(struct virtual_video *dev)
+{
+    struct virtual_video_shape *shape = &dev->shape;
+    unsigned int burst = max(READ_ONCE(shape->burst), 1U);
+    ktime_t delay;
+
+    if (shape->armed || shape->burst_left || shape->count < burst)
+        return;
+
+    delay = ktime_sub(shape->hold, ktime_get());
+    if (ktime_to_ns(delay) < 0)
+        delay = 0;
+    delay = ktime_add_us(delay, virtual_video_jitter(shape) + READ_ONCE(shape->cost));
+    shape->burst_left = burst;
+    shape->armed = true;
+    virtual_video_shape_timer_start(shape, delay, HRTIMER_MODE_REL);
+}
+
+/* a burst goes out with only the render cost between its frames */
+static enum hrtimer_restart virtual_video_shape_timer(struct hrtimer *timer)
+{
+    struct virtual_video_shape *shape = container_of(timer, struct virtual_video_shape, ELMO_VIDEO_SHAPE_HRTIMER);
+    struct virtual_video *dev = container_of(shape, struct virtual_video, shape);
+    unsigned int cost;
+
+    spin_lock(&shape->lock);
+    shape->armed = false;
+    /* a stall that began since the burst was scheduled */
+    if (ktime_before(ktime_get(), shape->hold)) {
+        shape->armed = true;
+        virtual_video_shape_timer_start(shape, shape->hold, HRTIMER_MODE_ABS);
+        spin_unlock(&shape->lock);
+        return HRTIMER_NORESTART;
+    }
+
+    cost = READ_ONCE(shape->cost);
+    while (shape->burst_left && shape->count) {
+        virtual_video_shape_deliver(dev);
+        if (--shape->burst_left && shape->count && cost) {
+            shape->armed = true;
+            virtual_video_shape_timer_start(shape, ktime_set(0, cost * NSEC_PER_USEC), HRTIMER_MODE_REL);
+            break;
+        }
+    }
+    if (!shape->armed) {
+        shape->burst_left = 0;
+        virtual_video_shape_schedule(dev);
+    }
+    spin_unlock(&shape->lock);
+    return HRTIMER_NORESTART;
+}
+
+static bool virtual_video_shaping(const struct virtual_video_shape *shape)
+{
+    return (READ_ONCE(shape->jitter) != VIRTUAL_VIDEO_JITTER_NONE && READ_ONCE(shape->jitter_max)) ||
+           READ_ONCE(shape->burst) > 1 ||
+           (READ_ONCE(shape->stall_period) && READ_ONCE(shape->stall_time)) ||
+           READ_ONCE(shape->cost);
+}
+
+/* a frame is due on this stream: complete it now, or hold it for load shaping */
+static void virtual_video_shape_tick(struct virtual_video *dev, const struct virtual_video_stamp *stamp)
+{
+    struct virtual_video_shape *shape = &dev->shape;
+    unsigned int period;
+
+    spin_lock(&shape->lock);
+    /* slice mode already spreads the frame over the clock */
+    if (slices > 1 || (!shape->count && !shape->armed && !virtual_video_shaping(shape))) {
+        virtual_video_tick(dev, stamp, false);
+        spin_unlock(&shape->lock);
+        return;
+    }
+
+    if (shape->count == ELMO_VIDEO_SHAPE_QUEUE) {
+        shape->head = (shape->head + 1) % ELMO_VIDEO_SHAPE_QUEUE;
+        shape->count--;
+        shape->dropped++;
+    }
+    shape->stamp[(shape->head + shape->count++) % ELMO_VIDEO_SHAPE_QUEUE] = *stamp;
+
+    period = READ_ONCE(shape->stall_period);
+    if (period && ++shape->since_stall >= period) {
+        shape->since_stall = 0;
+        shape->hold = ktime_add_ms(ktime_get(), READ_ONCE(shape->stall_time));
+    }
+    virtual_video_shape_schedule(dev);
+    spin_unlock(&shape->lock);
+}
+
+/* frame schedule of a clock group, only the frame clock touches it */
+struct virtual_video_clock_group {
+    unsigned int fps_acc;
+    u32 sequence;           /* frames of the group since load */
+    bool stepped;           /* fps_acc advanced on this tick */
+    bool due;
+};
+
+static struct virtual_video_clock_group clock_groups[ELMO_VIDEO_MAX_STREAMS + 1];
+
+/* true if dev produces a frame on this tick, which is then stamped */
+static bool virtual_video_frame_due(struct virtual_video *dev, struct virtual_video_stamp *stamp)
+{
+    struct virtual_video_clock_group *grp;
+
+    /* a stream at fps takes fps out of every ELMO_VIDEO_FPS ticks */
+    if (!dev->config.group) {
+        dev->fps_acc += dev->config.fps;
+        if (dev->fps_acc < ELMO_VIDEO_FPS)
+            return false;
+        dev->fps_acc -= ELMO_VIDEO_FPS;
+        return true;
+    }
+
+    /* the first member seen on this tick advances the group for all of them */
+    grp = &clock_groups[dev->config.group];
+    if (!grp->stepped) {
+        grp->stepped = true;
+        grp->fps_acc += dev->config.fps;
+        grp->due = grp->fps_acc >= ELMO_VIDEO_FPS;
+        if (grp->due) {
+            grp->fps_acc -= ELMO_VIDEO_FPS;
+            grp->sequence++;
+        }
+    }
+    stamp->sequence = grp->sequence - 1;
+    return grp->due;
+}
+
+static void tick_timer_function(struct timer_list *t)
+{
+    struct virtual_video *dev;
+    struct virtual_video_stamp stamp;
+    unsigned int i;
+
+    /* every stream completing a frame on this tick gets the same timestamp */
+    v4l2_get_timestamp(&stamp.ts);
+    for (i = 0; i < ARRAY_SIZE(clock_groups); i++)
+        clock_groups[i].stepped = false;
+    for (i = 0; i < ELMO_VIDEO_MAX_STREAMS; i++) {
+        dev = READ_ONCE(virtual_devs[i]);
+        if (!dev || !dev->clocked)
+            continue;
+        if (virtual_video_frame_due(dev, &stamp))
+            virtual_video_shape_tick(dev, &stamp);
+    }
+
+    /* idle streams cost no wakeups: park until buffer_queue, see virtual_video_clock_wake */
+    if (!virtual_video_clock_busy()) {
+        WRITE_ONCE(clock_parked, true);
+        smp_mb();
+        if (!virtual_video_clock_busy() || !xchg(&clock_parked, false))
+            return;
+    }
+    mod_timer(&tick_timer, jiffies + virtual_video_period());
+}
+
+/* what a consumer does with a frame: touch every byte once */
+static u64 virtual_video_read_buf(const struct virtual_video_pool_buf *pb, unsigned int size)
+{
+    unsigned int offset, len, i;
+    const u64 *p;
+    u64 sum = 0;
+
+    for (offset = 0; offset < size; offset += len) {
+        if (pb->chunks) {
+            len = min_t(unsigned long, size - offset, ELMO_VIDEO_CHUNK_SIZE);
+            p = page_address(pb->chunks[offset >> ELMO_VIDEO_CHUNK_SHIFT]);
+        } else {
+            len = size;
+            p = pb->vaddr;
+        }
+        for (i = 0; i < len / 8; i++)
+            sum += p[i];
+    }
+    return sum;
+}
+
+/*
+ * fill and read cost of every pattern generator at common sizes, for vmalloc
+ * and chunked (hugepages=1) buffers, printed at load with bench=1
+ */
+static void virtual_video_bench(void)
+{
+    static const struct { u32 width, height; } res[] = {
+        { 640, 480 }, { 800, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 },
+    };
+    struct virtual_video_pool_buf pb;
+    unsigned int i, j, k, loops, size, bpl;
+    ktime_t start;
+    s64 fill_ns, read_ns;
+    u64 sum = 0;
+    int huge;
+
+    for (i = 0; i < ARRAY_SIZE(format); i++) {
+        for (j = 0; j < ARRAY_SIZE(res); j++) {
+            bpl = virtual_video_bytesperline(&format[i], res[j].width);
+            size = bpl * res[j].height;
+            for (huge = 0; huge < 2; huge++) {
+                memset(&pb, 0, sizeof(pb));
+                if (huge ? virtual_video_pool_buf_alloc_chunks(&pb, size) : virtual_video_pool_buf_alloc(&pb, size, false)) {
+                    printk(KERN_WARNING "virtual_video bench: no %s memory for %ux%u\n",
+                           huge ? "contiguous" : "vmalloc", res[j].width, res[j].height);
+                    continue;
+                }
+                /* first pass faults the pages in */
+                virtual_video_fill_buf(&format[i], &pb, pb.vaddr, 0, size, size, bpl);
+                loops = max(1U, (64U << 20) / size);
+
+                start = ktime_get();
+                for (k = 0; k < loops; k++)
+                    virtual_video_fill_buf(&format[i], &pb, pb.vaddr, 0, size, size, bpl);
+                fill_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+                start = ktime_get();
+                for (k = 0; k < loops; k++)
+                    sum += virtual_video_read_buf(&pb, size);
+                read_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+                printk(KERN_INFO "virtual_video bench: %-29s %4ux%-4u %-7s fill %9lld ns/frame %6lld MB/s"
+                       "  read %9lld ns/frame %6lld MB/s\n",
+                       format[i].name, res[j].width, res[j].height, huge ? "chunked" : "vmalloc",
+                       fill_ns / loops, fill_ns ? (s64)size * loops * 1000 / fill_ns : 0,
+                       read_ns / loops, read_ns ? (s64)size * loops * 1000 / read_ns : 0);
+                virtual_video_pool_buf_free(&pb);
+                cond_resched();
+            }
+        }
+    }
+    /* keep the read loops from being optimised away */
+    debug_printk(DBG_INFO, "virtual_video bench: checksum %llx\n", sum);
+}
+
+/* the node disappears now, dev once the last file holding it is closed */
+static void virtual_video_destroy(struct virtual_video *dev)
+{
+    video_unregister_device(&dev->video_dev);
+    v4l2_device_unregister(&dev->v4l2_dev);
+    v4l2_device_put(&dev->v4l2_dev);
+}
+
+static struct virtual_video *virtual_video_create(unsigned int index, const struct virtual_video_config *config)
 {
     int retval = 0;
     struct virtual_video *dev;
+    u32 width = config->width, height = config->height;
+    unsigned int i;
 
-    debug_printk(DBG_INFO, "virtual_video module init.\n");
-    
     dev = kzalloc(sizeof(struct virtual_video), GFP_KERNEL);
     if (!dev){
         debug_printk(DBG_ERR, "Unable to alloc virtual_video device\n");
-        return -ENOMEM;
+        return ERR_PTR(-ENOMEM);
     }
-    virtual_dev = dev;
 
     dev->io_usrs = 0;
+    dev->index = index;
+    dev->config = *config;
     spin_lock_init(&dev->slock);
     mutex_init(&dev->lock);
     INIT_LIST_HEAD(&dev->queued);
+    dev->shape.burst = 1;
+    spin_lock_init(&dev->shape.lock);
+    virtual_video_shape_timer_init(&dev->shape, virtual_video_shape_timer);
+
+    v4l2_ctrl_handler_init(&dev->ctrl_handler, 2 + ARRAY_SIZE(virtual_video_ctrl_shape));
+    v4l2_ctrl_new_custom(&dev->ctrl_handler, &virtual_video_ctrl_overlay, NULL);
+    v4l2_ctrl_new_custom(&dev->ctrl_handler, &virtual_video_ctrl_checksum, NULL);
+    for (i = 0; i < ARRAY_SIZE(virtual_video_ctrl_shape); i++)
+        v4l2_ctrl_new_custom(&dev->ctrl_handler, &virtual_video_ctrl_shape[i], NULL);
+    if (dev->ctrl_handler.error) {
+        retval = dev->ctrl_handler.error;
+        debug_printk(DBG_ERR, "control setup failed: %d\n", retval);
+        goto ctrl_handler_err;
+    }
+    dev->v4l2_dev.ctrl_handler = &dev->ctrl_handler;
 
     dev->v4l2_dev.release = virtual_video_v4l2_device_release;
-    strncpy(dev->v4l2_dev.name, "virtual_video", sizeof(dev->v4l2_dev.name));
+    snprintf(dev->v4l2_dev.name, sizeof(dev->v4l2_dev.name), "virtual_video-%u", index);
     retval = v4l2_device_register(NULL, &dev->v4l2_dev);//dev->dev
     if (retval < 0) {
         debug_printk(DBG_ERR, "v4l2_device_register failed: %d\n", retval);
@@ -634,30 +2081,389 @@ static int virtual_video_init(void)
     dev->video_dev.ioctl_ops = &virtual_video_ioctl_ops;
     dev->video_dev.v4l2_dev  = &dev->v4l2_dev;
     strncpy(dev->video_dev.name, "virtual_video", sizeof(dev->video_dev.name));
+    /* set before the node appears, open may follow right away */
+    video_set_drvdata(&dev->video_dev, dev);
     retval = video_register_device(&dev->video_dev, VFL_TYPE_GRABBER, -1);
     if (retval < 0) {
         debug_printk(DBG_ERR, "video_register_device failed: %d\n", retval);
         goto video_register_device_err;
     }
- 
-    video_set_drvdata(&dev->video_dev, dev);
 
-    timer_setup(&dev->tick_timer, tick_timer_function, 0);
+    /* preallocate for the geometry set on open */
+    virtual_video_align(format_by_fourcc(config->fourcc), &width, &height);
+    if (pool_buffers &&
+        virtual_video_pool_alloc(dev, PAGE_ALIGN(virtual_video_sizeimage(format_by_fourcc(config->fourcc), width, height))) < 0)
+        debug_printk(DBG_WARN, "buffer pool preallocation failed, allocating on first mmap\n");
 
-   debug_printk(DBG_INFO, "virtual_video module init ok,ret=%d\n",retval);
-    return retval;
+    debug_printk(DBG_INFO, "stream %u: %s\n", index, video_device_node_name(&dev->video_dev));
+    return dev;
 
 video_register_device_err:
     v4l2_device_unregister(&dev->v4l2_dev);
 v4l2_device_register_err:
+ctrl_handler_err:
+    v4l2_ctrl_handler_free(&dev->ctrl_handler);
     kfree(dev);
+    return ERR_PTR(retval);
+}
+
+/* create a node in the first free slot and put it on the frame clock */
+static struct virtual_video *virtual_video_add(const struct virtual_video_config *config)
+{
+    struct virtual_video *dev = ERR_PTR(-ENOSPC);
+    unsigned int i, slot = ELMO_VIDEO_MAX_STREAMS;
+
+    mutex_lock(&devs_lock);
+    for (i = 0; i < ELMO_VIDEO_MAX_STREAMS; i++) {
+        if (!virtual_devs[i]) {
+            if (slot == ELMO_VIDEO_MAX_STREAMS)
+                slot = i;
+            continue;
+        }
+        /* members of a clock group run on one schedule */
+        if (config->group && virtual_devs[i]->config.group == config->group &&
+            virtual_devs[i]->config.fps != config->fps) {
+            debug_printk(DBG_WARN, "clock group %u runs at %u fps\n", config->group, virtual_devs[i]->config.fps);
+            mutex_unlock(&devs_lock);
+            return ERR_PTR(-EINVAL);
+        }
+    }
+    if (slot < ELMO_VIDEO_MAX_STREAMS) {
+        dev = virtual_video_create(slot, config);
+        if (!IS_ERR(dev))
+            WRITE_ONCE(virtual_devs[slot], dev);
+    }
+    mutex_unlock(&devs_lock);
+    return dev;
+}
+
+/* take dev off the frame clock and unregister it, the other streams keep running */
+static void virtual_video_remove(struct virtual_video *dev)
+{
+    mutex_lock(&devs_lock);
+    mutex_lock(&clock_lock);
+    /* dev may be freed below, the timer must not be looking at it; buffer_queue can rearm it meanwhile */
+    WRITE_ONCE(virtual_devs[dev->index], NULL);
+    del_timer_sync(&tick_timer);
+    virtual_video_clock_restart();
+    mutex_unlock(&clock_lock);
+    mutex_unlock(&devs_lock);
+
+    virtual_video_destroy(dev);
+}
+
+/* settings of nodes created at load and the initial settings of configfs directories */
+static void virtual_video_default_config(struct virtual_video_config *config)
+{
+    config->fourcc  = format[0].fourcc;
+    config->width   = 800;
+    config->height  = 480;
+    config->fps     = ELMO_VIDEO_FPS;
+    config->buffers = 0;
+    config->pattern = animate ? VIRTUAL_VIDEO_PATTERN_BOX : VIRTUAL_VIDEO_PATTERN_BANDS;
+    config->group   = group;
+}
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+/*
+ * /sys/kernel/config/virtual_video/<name>/: mkdir makes a set of settings,
+ * writing 1 to enable creates the node (its name shows in node), 0 or
+ * rmdir removes it again. Settings only change while the node does not
+ * exist.
+ */
+struct virtual_video_cfg {
+    struct config_item item;
+    struct virtual_video_config config;
+    struct virtual_video *dev;      /* while enabled */
+};
+
+static DEFINE_MUTEX(cfg_lock);
+
+static inline struct virtual_video_cfg *to_virtual_video_cfg(struct config_item *item)
+{
+    return container_of(item, struct virtual_video_cfg, item);
+}
+
+static int virtual_video_cfg_set(struct config_item *item, unsigned int *field, unsigned int val)
+{
+    struct virtual_video_cfg *cfg = to_virtual_video_cfg(item);
+    int retval = 0;
+
+    mutex_lock(&cfg_lock);
+    if (cfg->dev)
+        retval = -EBUSY;
+    else
+        *field = val;
+    mutex_unlock(&cfg_lock);
+    return retval;
+}
+
+#define VIRTUAL_VIDEO_CFG_UINT(name, min, max)                                                      \
+static ssize_t virtual_video_cfg_##name##_show(struct config_item *item, char *page)                \
+{                                                                                                   \
+    return sprintf(page, "%u\n", to_virtual_video_cfg(item)->config.name);                         \
+}                                                                                                   \
+static ssize_t virtual_video_cfg_##name##_store(struct config_item *item, const char *page, size_t len) \
+{                                                                                                   \
+    unsigned int val;                                                                               \
+    int retval = kstrtouint(page, 0, &val);                                                         \
+                                                                                                    \
+    if (retval)                                                                                     \
+        return retval;                                                                              \
+    if (val < (min) || val > (max))                                                                 \
+        return -ERANGE;                                                                             \
+    retval = virtual_video_cfg_set(item, &to_virtual_video_cfg(item)->config.name, val);           \
+    return retval ? retval : len;                                                                   \
+}                                                                                                   \
+CONFIGFS_ATTR(virtual_video_cfg_, name)
+
+VIRTUAL_VIDEO_CFG_UINT(width, 2, ELMO_VIDEO_MAX_SIZE);
+VIRTUAL_VIDEO_CFG_UINT(height, 2, ELMO_VIDEO_MAX_SIZE);
+VIRTUAL_VIDEO_CFG_UINT(fps, 1, ELMO_VIDEO_FPS);
+VIRTUAL_VIDEO_CFG_UINT(buffers, 0, VIDEO_MAX_FRAME);
+VIRTUAL_VIDEO_CFG_UINT(group, 0, ELMO_VIDEO_MAX_STREAMS);
+
+/* fourcc as four characters, e.g. BGR4 or pRAA */
+static ssize_t virtual_video_cfg_format_show(struct config_item *item, char *page)
+{
+    u32 fourcc = to_virtual_video_cfg(item)->config.fourcc;
+
+    return sprintf(page, "%c%c%c%c\n", fourcc & 0xff, (fourcc >> 8) & 0xff, (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff);
+}
+
+static ssize_t virtual_video_cfg_format_store(struct config_item *item, const char *page, size_t len)
+{
+    u32 fourcc;
+    int retval;
+
+    if (len < 4)
+        return -EINVAL;
+    fourcc = v4l2_fourcc(page[0], page[1], page[2], page[3]);
+    if (!format_by_fourcc(fourcc))
+        return -EINVAL;
+    retval = virtual_video_cfg_set(item, &to_virtual_video_cfg(item)->config.fourcc, fourcc);
+    return retval ? retval : len;
+}
+CONFIGFS_ATTR(virtual_video_cfg_, format);
+
+static ssize_t virtual_video_cfg_pattern_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", virtual_video_patterns[to_virtual_video_cfg(item)->config.pattern]);
+}
+
+static ssize_t virtual_video_cfg_pattern_store(struct config_item *item, const char *page, size_t len)
+{
+    int pattern = sysfs_match_string(virtual_video_patterns, page);
+    int retval;
+
+    if (pattern < 0)
+        return pattern;
+    retval = virtual_video_cfg_set(item, &to_virtual_video_cfg(item)->config.pattern, pattern);
+    return retval ? retval : len;
+}
+CONFIGFS_ATTR(virtual_video_cfg_, pattern);
+
+static ssize_t virtual_video_cfg_enable_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", to_virtual_video_cfg(item)->dev != NULL);
+}
+
+static ssize_t virtual_video_cfg_enable_store(struct config_item *item, const char *page, size_t len)
+{
+    struct virtual_video_cfg *cfg = to_virtual_video_cfg(item);
+    struct virtual_video *dev;
+    bool enable;
+    int retval;
+
+    retval = kstrtobool(page, &enable);
+    if (retval)
+        return retval;
+
+    mutex_lock(&cfg_lock);
+    if (enable && !cfg->dev) {
+        dev = virtual_video_add(&cfg->config);
+        if (IS_ERR(dev))
+            retval = PTR_ERR(dev);
+        else
+            cfg->dev = dev;
+    } else if (!enable && cfg->dev) {
+        virtual_video_remove(cfg->dev);
+        cfg->dev = NULL;
+    }
+    mutex_unlock(&cfg_lock);
+    return retval ? retval : len;
+}
+CONFIGFS_ATTR(virtual_video_cfg_, enable);
+
+/* device node name while enabled, e.g. video3 */
+static ssize_t virtual_video_cfg_node_show(struct config_item *item, char *page)
+{
+    struct virtual_video_cfg *cfg = to_virtual_video_cfg(item);
+    ssize_t len;
+
+    mutex_lock(&cfg_lock);
+    len = sprintf(page, "%s\n", cfg->dev ? video_device_node_name(&cfg->dev->video_dev) : "");
+    mutex_unlock(&cfg_lock);
+    return len;
+}
+CONFIGFS_ATTR_RO(virtual_video_cfg_, node);
+
+static struct configfs_attribute *virtual_video_cfg_attrs[] = {
+    &virtual_video_cfg_attr_format,
+    &virtual_video_cfg_attr_width,
+    &virtual_video_cfg_attr_height,
+    &virtual_video_cfg_attr_fps,
+    &virtual_video_cfg_attr_pattern,
+    &virtual_video_cfg_attr_buffers,
+    &virtual_video_cfg_attr_group,
+    &virtual_video_cfg_attr_enable,
+    &virtual_video_cfg_attr_node,
+    NULL,
+};
+
+static void virtual_video_cfg_release(struct config_item *item)
+{
+    kfree(to_virtual_video_cfg(item));
+}
+
+static struct configfs_item_operations virtual_video_cfg_item_ops = {
+    .release = virtual_video_cfg_release,
+};
+
+static struct config_item_type virtual_video_cfg_type = {
+    .ct_item_ops = &virtual_video_cfg_item_ops,
+    .ct_attrs    = virtual_video_cfg_attrs,
+    .ct_owner    = THIS_MODULE,
+};
+
+static struct config_item *virtual_video_cfg_make_item(struct config_group *group, const char *name)
+{
+    struct virtual_video_cfg *cfg;
+
+    cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return ERR_PTR(-ENOMEM);
+    virtual_video_default_config(&cfg->config);
+    config_item_init_type_name(&cfg->item, name, &virtual_video_cfg_type);
+    return &cfg->item;
+}
+
+/* rmdir of an enabled directory removes its node first */
+static void virtual_video_cfg_drop_item(struct config_group *group, struct config_item *item)
+{
+    struct virtual_video_cfg *cfg = to_virtual_video_cfg(item);
+
+    mutex_lock(&cfg_lock);
+    if (cfg->dev) {
+        virtual_video_remove(cfg->dev);
+        cfg->dev = NULL;
+    }
+    mutex_unlock(&cfg_lock);
+    config_item_put(item);
+}
+
+static struct configfs_group_operations virtual_video_cfg_group_ops = {
+    .make_item = virtual_video_cfg_make_item,
+    .drop_item = virtual_video_cfg_drop_item,
+};
+
+static struct config_item_type virtual_video_cfg_root_type = {
+    .ct_group_ops = &virtual_video_cfg_group_ops,
+    .ct_owner     = THIS_MODULE,
+};
+
+static struct configfs_subsystem virtual_video_cfg_subsys = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = "virtual_video",
+            .ci_type    = &virtual_video_cfg_root_type,
+        },
+    },
+};
+
+static int virtual_video_cfg_init(void)
+{
+    config_group_init(&virtual_video_cfg_subsys.su_group);
+    mutex_init(&virtual_video_cfg_subsys.su_mutex);
+    return configfs_register_subsystem(&virtual_video_cfg_subsys);
+}
+
+/* directories hold a module reference, so none are left at unload */
+static void virtual_video_cfg_exit(void)
+{
+    configfs_unregister_subsystem(&virtual_video_cfg_subsys);
+}
+#else
+static int virtual_video_cfg_init(void)
+{
+    return 0;
+}
+
+static void virtual_video_cfg_exit(void)
+{
+}
+#endif
+
+static void virtual_video_remove_all(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ELMO_VIDEO_MAX_STREAMS; i++) {
+        if (virtual_devs[i])
+            virtual_video_remove(virtual_devs[i]);
+    }
+}
+
+static int virtual_video_init(void)
+{
+    int retval = 0;
+    struct virtual_video_config config;
+    struct virtual_video *dev;
+    unsigned int i;
+
+    debug_printk(DBG_INFO, "virtual_video module init.\n");
+
+    streams = min(streams, (unsigned int)ELMO_VIDEO_MAX_STREAMS);
+    group = min(group, (unsigned int)ELMO_VIDEO_MAX_STREAMS);
+    if (hugepages && !pool_buffers) {
+        debug_printk(DBG_WARN, "hugepages needs the buffer pool, using pool_buffers=%d\n", ELMO_VIDEO_DEF_BUF);
+        pool_buffers = ELMO_VIDEO_DEF_BUF;
+    }
+
+    if (bench)
+        virtual_video_bench();
+
+    virtual_video_build_atlas();
+    timer_setup(&tick_timer, tick_timer_function, 0);
+
+    virtual_video_default_config(&config);
+    for (i = 0; i < streams; i++) {
+        dev = virtual_video_add(&config);
+        if (IS_ERR(dev)) {
+            retval = PTR_ERR(dev);
+            goto err;
+        }
+    }
+
+    retval = virtual_video_cfg_init();
+    if (retval < 0) {
+        debug_printk(DBG_ERR, "configfs registration failed: %d\n", retval);
+        goto err;
+    }
+
+   debug_printk(DBG_INFO, "virtual_video module init ok,ret=%d\n",retval);
+    return retval;
+
+err:
+    virtual_video_remove_all();
     return retval;
 }
 
 static void virtual_video_exit(void)
 {
-    video_unregister_device(&virtual_dev->video_dev);
-    v4l2_device_unregister(&virtual_dev->v4l2_dev);
+    virtual_video_cfg_exit();
+    /* no stream can be open, so the clock is already stopped */
+    virtual_video_remove_all();
     debug_printk(DBG_INFO, "virtual_video module exit\n");
 }
 
@@ -0,0 +1,84 @@
+#ifndef _VIRTUAL_VIDEO_H_
+#define _VIRTUAL_VIDEO_H_
+
+/* interface between virtual_video.ko and the programs in app/ */
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/* burn "devN seq NNNNNN hh:mm:ss.mmm NN.N fps" into the top left corner (UTC) */
+#define V4L2_CID_VIRTUAL_VIDEO_OVERLAY (V4L2_CID_USER_BASE | 0x1f00)
+
+/*
+ * load shaping, per device and changeable while streaming: every frame
+ * the clock produces is delayed by a jitter sample in [JITTER_MIN,
+ * JITTER_MAX] us plus RENDER_COST us, frames are held until BURST of them
+ * can go out back to back, and after every STALL_PERIOD frames nothing is
+ * delivered for STALL_TIME ms. Held frames keep the timestamp of the tick
+ * that produced them; past 32 held frames the oldest are dropped.
+ */
+#define V4L2_CID_VIRTUAL_VIDEO_JITTER       (V4L2_CID_USER_BASE | 0x1f01)   /* enum virtual_video_jitter */
+#define V4L2_CID_VIRTUAL_VIDEO_JITTER_MIN   (V4L2_CID_USER_BASE | 0x1f02)   /* us */
+#define V4L2_CID_VIRTUAL_VIDEO_JITTER_MAX   (V4L2_CID_USER_BASE | 0x1f03)   /* us */
+#define V4L2_CID_VIRTUAL_VIDEO_BURST        (V4L2_CID_USER_BASE | 0x1f04)   /* frames, 1 = no bursts */
+#define V4L2_CID_VIRTUAL_VIDEO_STALL_PERIOD (V4L2_CID_USER_BASE | 0x1f05)   /* frames, 0 = no stalls */
+#define V4L2_CID_VIRTUAL_VIDEO_STALL_TIME   (V4L2_CID_USER_BASE | 0x1f06)   /* ms */
+#define V4L2_CID_VIRTUAL_VIDEO_RENDER_COST  (V4L2_CID_USER_BASE | 0x1f07)   /* us */
+
+/*
+ * stamp every completed frame with a V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM
+ * event, so a consumer can tell frames that changed after delivery.
+ * Costs a pass over every frame in the frame clock.
+ */
+#define V4L2_CID_VIRTUAL_VIDEO_CHECKSUM     (V4L2_CID_USER_BASE | 0x1f08)
+
+enum virtual_video_jitter {
+    VIRTUAL_VIDEO_JITTER_NONE,
+    VIRTUAL_VIDEO_JITTER_UNIFORM,
+    VIRTUAL_VIDEO_JITTER_NORMAL,        /* mean of 4 uniform samples, peaks mid range */
+    VIRTUAL_VIDEO_JITTER_EXPONENTIAL,   /* mean a quarter of the range, tail cut at JITTER_MAX */
+};
+
+/*
+ * slices=N: the frame is rendered in N horizontal slices and one event is
+ * queued after each, payload struct virtual_video_slice_event in u.data
+ */
+#define V4L2_EVENT_VIRTUAL_VIDEO_SLICE (V4L2_EVENT_PRIVATE_START + 1)
+
+struct virtual_video_slice_event {
+    __u32 index;        /* v4l2_buffer.index being filled */
+    __u32 sequence;     /* v4l2_buffer.sequence it will be dequeued with */
+    __u32 lines_ready;  /* rows [0, lines_ready) are final */
+    __u32 height;
+};
+
+/*
+ * queued with every completed buffer: the regions that differ from the
+ * previous frame, count == 0 when nothing changed
+ */
+#define V4L2_EVENT_VIRTUAL_VIDEO_DIRTY (V4L2_EVENT_PRIVATE_START + 2)
+
+#define VIRTUAL_VIDEO_MAX_DIRTY 3
+
+struct virtual_video_dirty_event {
+    __u32 index;
+    __u32 sequence;
+    __u32 count;
+    struct v4l2_rect rect[VIRTUAL_VIDEO_MAX_DIRTY];
+};
+
+/*
+ * queued with every completed buffer while V4L2_CID_VIRTUAL_VIDEO_CHECKSUM
+ * is on: the CRC32C of its bytesused bytes with ~sequence as the initial
+ * value, ~crc32c(~sequence, data, bytesused) with the kernel's crc32c()
+ */
+#define V4L2_EVENT_VIRTUAL_VIDEO_CHECKSUM (V4L2_EVENT_PRIVATE_START + 3)
+
+struct virtual_video_checksum_event {
+    __u32 index;
+    __u32 sequence;
+    __u32 bytesused;
+    __u32 crc;
+};
+
+#endif    /* _VIRTUAL_VIDEO_H_ */
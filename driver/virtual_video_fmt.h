@@ -0,0 +1,255 @@
+/*
+ * Pattern generators and format geometry of the capture nodes. Kept apart
+ * from virtual_video.c so virtual_video_test.c can build them without the
+ * V4L2 core; both include it, everything here is static.
+ */
+#ifndef __VIRTUAL_VIDEO_FMT_H
+#define __VIRTUAL_VIDEO_FMT_H
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/* Limits minimum and default number of buffers */
+#define ELMO_VIDEO_MIN_BUF 4
+#define ELMO_VIDEO_DEF_BUF 8
+
+struct virtual_video_fmt {
+    char *name;
+    u32 fourcc; /* v4l2 format id */
+    int depth;      /* bits per pixel, 10 is the packed format: 4 pixels in 5 bytes */
+    bool bayer;     /* RGGB colour filter, width and height even */
+    /* pattern generator, writes bytes [offset, offset+len) of a size byte frame to vbuf */
+    void (*fill)(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl);
+    u8 black[4];    /* overlay background and foreground pixels, unused when packed */
+    u8 white[4];
+};
+
+/* three horizontal bands of the given pixels, split by frame offset */
+static void fill_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, const u8 band[3][4])
+{
+    unsigned int step = size/3;
+    unsigned int limit[3] = { step, step*2, size };
+    unsigned int i = offset, end = offset + len, b;
+
+    for (b = 0; b < 3; b++) {
+        for (; i < end && i < limit[b]; i += 4)
+            memcpy(vbuf + i - offset, band[b], 4);
+    }
+}
+
+/* blue, green, red */
+static void fill_rgb32_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl)
+{
+    static const u8 band[3][4] = {
+        { 0x00, 0x00, 0x00, 0xff },  //a r g b
+        { 0x00, 0x00, 0xff, 0x00 },
+        { 0x00, 0xff, 0x00, 0x00 },
+    };
+
+    fill_bands(vbuf, offset, len, size, band);
+}
+
+static void fill_bgr32_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl)
+{
+    static const u8 band[3][4] = {
+        { 0xff, 0x00, 0x00, 0xff },  //b g r a
+        { 0x00, 0xff, 0x00, 0xff },
+        { 0x00, 0x00, 0xff, 0xff },
+    };
+
+    fill_bands(vbuf, offset, len, size, band);
+}
+
+/* RGGB: the filter colour at (x, y) as a band index, 0 blue, 1 green, 2 red */
+static inline unsigned int bayer_colour(unsigned int x, unsigned int y)
+{
+    if (y & 1)
+        return (x & 1) ? 0 : 1;
+    return (x & 1) ? 1 : 2;
+}
+
+/* byte i of a row of band b, rows repeat every 2 (8 bit), 4 (16 bit) or 5 (packed) bytes */
+static u8 bayer_band_byte(unsigned int depth, unsigned int b, unsigned int y, unsigned int i)
+{
+    unsigned int k;
+    u8 lo = 0;
+
+    switch (depth) {
+    case 8:
+        return bayer_colour(i, y) == b ? 0xff : 0x00;
+    case 16:
+        /* 10 bits, little endian */
+        return bayer_colour(i / 2, y) == b ? (i & 1 ? 0x03 : 0xff) : 0x00;
+    default:
+        /* high 8 bits of four pixels, then the low 2 bits of each */
+        if (i < 4)
+            return bayer_colour(i, y) == b ? 0xff : 0x00;
+        for (k = 0; k < 4; k++) {
+            if (bayer_colour(k, y) == b)
+                lo |= 3 << (2 * k);
+        }
+        return lo;
+    }
+}
+
+/*
+ * The same bands seen through the colour filter: full scale where the filter
+ * colour matches the band, zero elsewhere. Chunked pool buffers split the
+ * frame at arbitrary offsets, so any byte range works; the band is chosen
+ * per pixel group so a packed group is never split between two bands.
+ */
+static void fill_bayer_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size,
+                             unsigned int bpl, unsigned int depth)
+{
+    unsigned int period = depth == 8 ? 2 : (depth == 16 ? 4 : 5);
+    unsigned int step = size/3;
+    unsigned int end = offset + len, row_end, y, b, i, phase;
+    u8 tile[3][2][5];
+    u8 *p = (u8 *)vbuf;
+
+    for (b = 0; b < 3; b++) {
+        for (y = 0; y < 2; y++) {
+            for (i = 0; i < period; i++)
+                tile[b][y][i] = bayer_band_byte(depth, b, y, i);
+        }
+    }
+
+    while (offset < end) {
+        y = offset / bpl;
+        row_end = min(end, (y + 1) * bpl);
+        phase = (offset - y * bpl) % period;
+        for (; offset < row_end; offset++) {
+            b = offset - phase < step ? 0 : (offset - phase < step*2 ? 1 : 2);
+            *p++ = tile[b][y & 1][phase];
+            if (++phase == period)
+                phase = 0;
+        }
+    }
+}
+
+static void fill_srggb8_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl)
+{
+    fill_bayer_bands(vbuf, offset, len, size, bpl, 8);
+}
+
+static void fill_srggb10_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl)
+{
+    fill_bayer_bands(vbuf, offset, len, size, bpl, 16);
+}
+
+static void fill_srggb10p_bands(char *vbuf, unsigned int offset, unsigned int len, unsigned int size, unsigned int bpl)
+{
+    fill_bayer_bands(vbuf, offset, len, size, bpl, 10);
+}
+
+static struct virtual_video_fmt format[] = {
+    {
+        .name     = "ARGB8888, 32 bpp",
+        .fourcc   = V4L2_PIX_FMT_RGB32,  //byte0:a byte1:r byte2:g byte3:b
+        .depth      = 32,
+        .fill     = fill_rgb32_bands,
+        .black    = { 0x00, 0x00, 0x00, 0x00 },
+        .white    = { 0xff, 0xff, 0xff, 0xff },
+    }, {
+        .name     = "32 bpp RGB, be",
+        .fourcc   = V4L2_PIX_FMT_BGR32,  //byte0:b byte1:g byte2:r byte3:a
+        .depth    = 32,
+        .fill     = fill_bgr32_bands,
+        .black    = { 0x00, 0x00, 0x00, 0xff },
+        .white    = { 0xff, 0xff, 0xff, 0xff },
+    }, {
+        .name     = "8-bit Bayer RGRG/GBGB",
+        .fourcc   = V4L2_PIX_FMT_SRGGB8,
+        .depth    = 8,
+        .bayer    = true,
+        .fill     = fill_srggb8_bands,
+        .black    = { 0x00 },
+        .white    = { 0xff },
+    }, {
+        .name     = "10-bit Bayer RGRG/GBGB",
+        .fourcc   = V4L2_PIX_FMT_SRGGB10,  //10 bits in the low bits of a little endian u16
+        .depth    = 16,
+        .bayer    = true,
+        .fill     = fill_srggb10_bands,
+        .black    = { 0x00, 0x00 },
+        .white    = { 0xff, 0x03 },
+    }, {
+        .name     = "10-bit Bayer RGRG/GBGB Packed",
+        .fourcc   = V4L2_PIX_FMT_SRGGB10P,  //MIPI CSI-2 RAW10
+        .depth    = 10,
+        .bayer    = true,
+        .fill     = fill_srggb10p_bands,
+    },/* {
+        .name     = "4:2:2, packed, YVY2",
+        .fourcc   = V4L2_PIX_FMT_YUYV,
+        .depth    = 16,
+    }, {
+        .name     = "4:2:2, packed, UYVY",
+        .fourcc   = V4L2_PIX_FMT_UYVY,
+        .depth    = 16,
+    }*/
+};
+static struct virtual_video_fmt *format_by_fourcc(unsigned int fourcc)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(format); i++){
+        if (format[i].fourcc == fourcc){
+            return format+i;
+        }
+    }
+    return NULL;
+}
+
+/* bytes taken by n pixels, n a multiple of 4 for the packed format */
+static inline u32 virtual_video_pixel_bytes(const struct virtual_video_fmt *fmt, u32 n)
+{
+    return (n * fmt->depth) >> 3;
+}
+
+static inline u32 virtual_video_bytesperline(const struct virtual_video_fmt *fmt, u32 width)
+{
+    return virtual_video_pixel_bytes(fmt, width);
+}
+
+/* a colour filter needs whole 2x2 cells, the packed format whole groups of 4 */
+static void virtual_video_align(const struct virtual_video_fmt *fmt, u32 *width, u32 *height)
+{
+    unsigned int align = fmt->depth == 10 ? 4 : 2;
+
+    if (!fmt->bayer)
+        return;
+    *width  = max_t(u32, round_down(*width, align), align);
+    *height = max_t(u32, round_down(*height, 2), 2);
+}
+
+static inline u32 virtual_video_sizeimage(const struct virtual_video_fmt *fmt, u32 width, u32 height)
+{
+    return height * virtual_video_bytesperline(fmt, width);
+}
+
+/* the geometry TRY_FMT, S_FMT and G_FMT report for fmt at pix->width x pix->height */
+static inline void virtual_video_pix_format(const struct virtual_video_fmt *fmt, struct v4l2_pix_format *pix)
+{
+    virtual_video_align(fmt, &pix->width, &pix->height);
+    pix->bytesperline = virtual_video_bytesperline(fmt, pix->width);
+    pix->sizeimage    = virtual_video_sizeimage(fmt, pix->width, pix->height);
+}
+
+/* default/minimum buffer count, then drop buffers until they fit in limit MiB (vid_limit) */
+static unsigned int virtual_video_trim_count(unsigned int count, unsigned int size, unsigned int limit)
+{
+    if (0 == count)
+        count = ELMO_VIDEO_DEF_BUF;
+
+    if (count < ELMO_VIDEO_MIN_BUF)
+        count = ELMO_VIDEO_MIN_BUF;
+
+    while (count && size * count > limit * 1024 * 1024){
+        count--;
+    }
+    return count;
+}
+
+#endif
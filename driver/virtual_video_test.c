@@ -0,0 +1,248 @@
+/*
+ * KUnit tests for the pattern generators and the format and buffer math in
+ * virtual_video_fmt.h. They need no V4L2 core, so they run under UML:
+ * see .kunitconfig and the README.
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+
+#include "virtual_video_fmt.h"
+
+/* what a fill callback writes: a row pattern per band and row parity, repeating every period bytes */
+struct virtual_video_test_bands {
+    u32 fourcc;
+    unsigned int period;
+    u8 row[3][2][5];
+};
+
+static const struct virtual_video_test_bands test_bands[] = {
+    {
+        .fourcc = V4L2_PIX_FMT_RGB32,
+        .period = 4,
+        .row    = {
+            { { 0x00, 0x00, 0x00, 0xff }, { 0x00, 0x00, 0x00, 0xff } },
+            { { 0x00, 0x00, 0xff, 0x00 }, { 0x00, 0x00, 0xff, 0x00 } },
+            { { 0x00, 0xff, 0x00, 0x00 }, { 0x00, 0xff, 0x00, 0x00 } },
+        },
+    }, {
+        .fourcc = V4L2_PIX_FMT_BGR32,
+        .period = 4,
+        .row    = {
+            { { 0xff, 0x00, 0x00, 0xff }, { 0xff, 0x00, 0x00, 0xff } },
+            { { 0x00, 0xff, 0x00, 0xff }, { 0x00, 0xff, 0x00, 0xff } },
+            { { 0x00, 0x00, 0xff, 0xff }, { 0x00, 0x00, 0xff, 0xff } },
+        },
+    }, {
+        /* RG/GB rows, blue then green then red at full scale */
+        .fourcc = V4L2_PIX_FMT_SRGGB8,
+        .period = 2,
+        .row    = {
+            { { 0x00, 0x00 }, { 0x00, 0xff } },
+            { { 0x00, 0xff }, { 0xff, 0x00 } },
+            { { 0xff, 0x00 }, { 0x00, 0x00 } },
+        },
+    }, {
+        .fourcc = V4L2_PIX_FMT_SRGGB10,
+        .period = 4,
+        .row    = {
+            { { 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xff, 0x03 } },
+            { { 0x00, 0x00, 0xff, 0x03 }, { 0xff, 0x03, 0x00, 0x00 } },
+            { { 0xff, 0x03, 0x00, 0x00 }, { 0x00, 0x00, 0x00, 0x00 } },
+        },
+    }, {
+        /* four high bytes, then the low 2 bits of pixel k at bit 2k */
+        .fourcc = V4L2_PIX_FMT_SRGGB10P,
+        .period = 5,
+        .row    = {
+            { { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0xff, 0x00, 0xff, 0xcc } },
+            { { 0x00, 0xff, 0x00, 0xff, 0xcc }, { 0xff, 0x00, 0xff, 0x00, 0x33 } },
+            { { 0xff, 0x00, 0xff, 0x00, 0x33 }, { 0x00, 0x00, 0x00, 0x00, 0x00 } },
+        },
+    },
+};
+
+/* heights divisible by 3, so every band starts on a row */
+static const struct {
+    u32 width, height;
+} test_sizes[] = {
+    { 64, 48 },
+    { 320, 240 },
+};
+
+static const struct virtual_video_test_bands *test_bands_by_fourcc(u32 fourcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_bands); i++) {
+        if (test_bands[i].fourcc == fourcc)
+            return &test_bands[i];
+    }
+    return NULL;
+}
+
+static void virtual_video_test_format_by_fourcc(struct kunit *test)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(format); i++)
+        KUNIT_EXPECT_PTR_EQ(test, format_by_fourcc(format[i].fourcc), &format[i]);
+
+    KUNIT_EXPECT_TRUE(test, !format_by_fourcc(V4L2_PIX_FMT_YUYV));
+    KUNIT_EXPECT_TRUE(test, !format_by_fourcc(V4L2_PIX_FMT_NV12));
+    KUNIT_EXPECT_TRUE(test, !format_by_fourcc(0));
+}
+
+static void virtual_video_test_pix_format(struct kunit *test)
+{
+    /* requested size in, what TRY_FMT/S_FMT/G_FMT report out */
+    static const struct {
+        u32 fourcc;
+        u32 width, height;
+        u32 out_width, out_height, bytesperline, sizeimage;
+    } cases[] = {
+        { V4L2_PIX_FMT_RGB32,   640, 480, 640, 480, 2560, 1228800 },
+        { V4L2_PIX_FMT_RGB32,   641, 481, 641, 481, 2564, 1233284 },
+        { V4L2_PIX_FMT_BGR32,  1920,1080,1920,1080, 7680, 8294400 },
+        { V4L2_PIX_FMT_BGR32,     1,   1,   1,   1,    4,       4 },
+        { V4L2_PIX_FMT_SRGGB8,  640, 480, 640, 480,  640,  307200 },
+        { V4L2_PIX_FMT_SRGGB8,  641, 481, 640, 480,  640,  307200 },
+        { V4L2_PIX_FMT_SRGGB8,    1,   1,   2,   2,    2,       4 },
+        { V4L2_PIX_FMT_SRGGB10, 640, 480, 640, 480, 1280,  614400 },
+        { V4L2_PIX_FMT_SRGGB10, 643, 483, 642, 482, 1284,  618888 },
+        { V4L2_PIX_FMT_SRGGB10,   3,   3,   2,   2,    4,       8 },
+        { V4L2_PIX_FMT_SRGGB10P,640, 480, 640, 480,  800,  384000 },
+        { V4L2_PIX_FMT_SRGGB10P,642, 481, 640, 480,  800,  384000 },
+        { V4L2_PIX_FMT_SRGGB10P,  3,   1,   4,   2,    5,      10 },
+    };
+    const struct virtual_video_fmt *fmt;
+    struct v4l2_pix_format pix;
+    unsigned int i, f;
+    bool seen;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        fmt = format_by_fourcc(cases[i].fourcc);
+        KUNIT_ASSERT_TRUE(test, fmt != NULL);
+
+        memset(&pix, 0, sizeof(pix));
+        pix.width  = cases[i].width;
+        pix.height = cases[i].height;
+        virtual_video_pix_format(fmt, &pix);
+        KUNIT_EXPECT_EQ_MSG(test, pix.width, cases[i].out_width, "%s %ux%u", fmt->name, cases[i].width, cases[i].height);
+        KUNIT_EXPECT_EQ_MSG(test, pix.height, cases[i].out_height, "%s %ux%u", fmt->name, cases[i].width, cases[i].height);
+        KUNIT_EXPECT_EQ_MSG(test, pix.bytesperline, cases[i].bytesperline, "%s %ux%u", fmt->name, cases[i].width, cases[i].height);
+        KUNIT_EXPECT_EQ_MSG(test, pix.sizeimage, cases[i].sizeimage, "%s %ux%u", fmt->name, cases[i].width, cases[i].height);
+
+        /* G_FMT runs it again on what S_FMT stored, nothing may move */
+        virtual_video_pix_format(fmt, &pix);
+        KUNIT_EXPECT_EQ(test, pix.width, cases[i].out_width);
+        KUNIT_EXPECT_EQ(test, pix.height, cases[i].out_height);
+        KUNIT_EXPECT_EQ(test, pix.sizeimage, cases[i].sizeimage);
+    }
+
+    /* a format added without a case here fails */
+    for (f = 0; f < ARRAY_SIZE(format); f++) {
+        seen = false;
+        for (i = 0; i < ARRAY_SIZE(cases); i++)
+            seen |= cases[i].fourcc == format[f].fourcc;
+        KUNIT_EXPECT_TRUE_MSG(test, seen, "no geometry case for %s", format[f].name);
+    }
+}
+
+/* buffer_setup: sizeimage of the current format, then trimmed to vid_limit */
+static void virtual_video_test_trim_count(struct kunit *test)
+{
+    u32 vga = virtual_video_sizeimage(format_by_fourcc(V4L2_PIX_FMT_RGB32), 640, 480);
+    u32 hd = virtual_video_sizeimage(format_by_fourcc(V4L2_PIX_FMT_BGR32), 1920, 1080);
+    u32 raw = virtual_video_sizeimage(format_by_fourcc(V4L2_PIX_FMT_SRGGB10P), 640, 480);
+
+    /* 0 asks for the default, fewer than the minimum are raised */
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(0, vga, 16), (unsigned int)ELMO_VIDEO_DEF_BUF);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(1, vga, 16), (unsigned int)ELMO_VIDEO_MIN_BUF);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(6, vga, 16), 6U);
+
+    /* 16 MiB holds 13 VGA RGB32 frames, 2 at 1080p, 43 packed raw VGA */
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(32, vga, 16), 13U);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(0, hd, 16), 2U);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(32, raw, 16), 32U);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(32, raw, 1), 2U);
+
+    /* exactly at the limit still fits */
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(4, 4 * 1024 * 1024, 16), 4U);
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(5, 4 * 1024 * 1024, 16), 4U);
+
+    /* a frame larger than the limit gets no buffers at all */
+    KUNIT_EXPECT_EQ(test, virtual_video_trim_count(8, hd, 4), 0U);
+}
+
+/* offset of the first byte that differs from the band pattern, size if none */
+static unsigned int virtual_video_test_check_bands(const struct virtual_video_test_bands *bands, const u8 *buf,
+                                                   u32 height, u32 bpl)
+{
+    unsigned int size = height * bpl, off, y;
+
+    for (off = 0; off < size; off++) {
+        y = off / bpl;
+        if (buf[off] != bands->row[y * 3 / height][y & 1][(off - y * bpl) % bands->period])
+            return off;
+    }
+    return size;
+}
+
+static void virtual_video_test_fill(struct kunit *test)
+{
+    const struct virtual_video_test_bands *bands;
+    const struct virtual_video_fmt *fmt;
+    unsigned int f, s, size, split;
+    u32 width, height, bpl;
+    u8 *whole, *parts;
+
+    for (f = 0; f < ARRAY_SIZE(format); f++) {
+        fmt = &format[f];
+        bands = test_bands_by_fourcc(fmt->fourcc);
+        KUNIT_EXPECT_TRUE_MSG(test, bands != NULL, "no band pattern for %s", fmt->name);
+        if (!bands)
+            continue;
+
+        for (s = 0; s < ARRAY_SIZE(test_sizes); s++) {
+            width  = test_sizes[s].width;
+            height = test_sizes[s].height;
+            virtual_video_align(fmt, &width, &height);
+            bpl  = virtual_video_bytesperline(fmt, width);
+            size = virtual_video_sizeimage(fmt, width, height);
+
+            whole = kunit_kzalloc(test, size, GFP_KERNEL);
+            parts = kunit_kzalloc(test, size, GFP_KERNEL);
+            KUNIT_ASSERT_TRUE(test, whole && parts);
+
+            fmt->fill((char *)whole, 0, size, size, bpl);
+            KUNIT_EXPECT_EQ_MSG(test, virtual_video_test_check_bands(bands, whole, height, bpl), size,
+                                "%s %ux%u", fmt->name, width, height);
+
+            /*
+             * Chunked pool buffers fill a frame piece by piece; the colour
+             * filter formats take any split, the others whole pixels.
+             */
+            split = fmt->bayer ? size / 2 + 1 : round_down(size / 2, 4);
+            fmt->fill((char *)parts, 0, split, size, bpl);
+            fmt->fill((char *)parts + split, split, size - split, size, bpl);
+            KUNIT_EXPECT_EQ_MSG(test, memcmp(whole, parts, size), 0,
+                                "%s %ux%u split at %u", fmt->name, width, height, split);
+        }
+    }
+}
+
+static struct kunit_case virtual_video_test_cases[] = {
+    KUNIT_CASE(virtual_video_test_format_by_fourcc),
+    KUNIT_CASE(virtual_video_test_pix_format),
+    KUNIT_CASE(virtual_video_test_trim_count),
+    KUNIT_CASE(virtual_video_test_fill),
+    {}
+};
+
+static struct kunit_suite virtual_video_test_suite = {
+    .name = "virtual_video",
+    .test_cases = virtual_video_test_cases,
+};
+kunit_test_suite(virtual_video_test_suite);
+
+MODULE_LICENSE("GPL");